@@ -0,0 +1,19 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <stdarg.h>
+
+// The audit log named on the command line. Lines are formatted into a
+// buffer under a lock and written out by a thread of their own every
+// AUDIT_FLUSH_MS, sooner once AUDIT_BUFFER bytes wait, and at exit; so no
+// reader, reactor or job thread waits on the file. Past AUDIT_MAX_BUFFER
+// bytes waiting, lines are dropped and counted.
+#define AUDIT_BUFFER (1 << 20)
+#define AUDIT_MAX_BUFFER (64 << 20)
+#define AUDIT_FLUSH_MS 100
+
+void auditInit(const char *path);
+// One line, printf style; it is appended to the file as formatted.
+void auditWrite(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "server.h"
+
+// Room messages for a user who asked for PETR_OPT_BATCH. Instead of an
+// RMRECV frame per message, the user gets RMRECVB frames holding what came
+// in for it over a short window. A message after a quiet spell, a window
+// or more since the last one, goes straight out; one that follows closer
+// is held and opens a window if none is open, and the batch goes out when
+// the window closes or once it has count messages. So sparse traffic is
+// not delayed, and nothing waits longer than a window. One held message
+// goes out as the frame it was. Any other frame for the user sends what
+// is held first, so order is kept.
+//
+// Windows are closed by a thread of their own, in the order they opened.
+// It never waits on a client: what the socket or ring won't take at once
+// stays held for another window, and a job thread writing to the user
+// sends it first.
+#define BATCH_WINDOW_MS 2.0
+#define BATCH_COUNT 64
+#define BATCH_MAX_BYTES MAX_MSG_LEN  // body of an RMRECVB, as the client caps a frame
+
+// Apply "MS[/COUNT]", as given to -w. Returns -1 if spec is malformed.
+int batchParse(const char *spec);
+void batchInit(void);
+
+userBatch *batchNew(void);
+// Once nothing can write to the batch's user; what is held is dropped.
+void batchFree(userBatch *b);
+
+// userWriteFrame for a user with a batch: frame[0] starts with the wire
+// header.
+void batchWrite(user *u, struct iovec *frame, int iovcnt);
+// For a thread that must not wait on the client: frame goes after what is
+// held, now if the client takes it at once, else with the next window.
+// -1, and nothing is kept, if another thread is writing to the user or a
+// window's worth is already waiting on it.
+int batchTryWrite(user *u, struct iovec *frame, int iovcnt);
+
+// Stop (held = 1) or restart the flushing thread. Holding sends every
+// open batch now, so nothing is left waiting on a window.
+void batchHold(int held);
+
+#endif
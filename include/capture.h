@@ -0,0 +1,34 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Capture of what clients sent a server, written by petr_server -c FILE
+// and read by petr_replay. The file is a header, then records in the
+// order the server took them in. A record is a fixed part followed by the
+// frame exactly as it came off the wire, header and body; a record with
+// no frame says the connection closed. All fields are little-endian.
+//
+// conn is the connection's descriptor on the capturing server. Numbers
+// are reused, but a connection's first record is always its LOGIN and its
+// last its close, so each LOGIN on a number starts a new connection.
+#define PETR_CAPTURE_MAGIC 0x50415250  // "PRAP"
+#define PETR_CAPTURE_VERSION 1
+#define PETR_CAPTURE_HEADER_SIZE 8   // magic, version
+#define PETR_CAPTURE_RECORD_SIZE 16  // time, conn, len
+
+typedef struct {
+    uint64_t time;  // ns since the capture started
+    uint32_t conn;
+    uint32_t len;   // bytes of frame that follow, 0 for a close
+} petr_capture_record;
+
+void petr_capture_header_pack(uint8_t *out);
+// -1 unless in starts a capture this build can read.
+int petr_capture_header_check(const uint8_t *in);
+
+void petr_capture_record_pack(const petr_capture_record *r, uint8_t *out);
+void petr_capture_record_unpack(const uint8_t *in, petr_capture_record *r);
+
+#endif
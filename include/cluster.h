@@ -0,0 +1,61 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "server.h"
+
+// Rooms are sharded across the server processes of a cluster by consistent
+// hashing on their name. Each node listens for its peers on a Unix socket;
+// a job for a room another node owns is shipped there whole and run
+// against a proxy of the sending user. Users are replicated to every node
+// instead, and so are room listings; see presence.h.
+#define CLUSTER_MAX_NODES 64
+#define CLUSTER_VNODES 64  // points per node on the hash ring
+
+// Peer frames reuse the PETR header; msg_type is one of these.
+enum peer_msg_types {
+    PEER_JOB = 1,     // u64 id, u32 node, u32 features, name\0, client frame
+    PEER_DELIVER,     // name\0, frame to write to that local user
+    PEER_PRESENCE,    // batch of login/logout events, see presence.h
+    PEER_SYNC,        // u32 node: the sender (re)started, wants a snapshot
+    PEER_ROOMS,       // listings of rooms that changed, see presence.h
+};
+
+// paths lists one peer socket per node, comma separated, in node order.
+// Without paths the server runs standalone as node 0.
+int clusterInit(int self, char *paths);
+int clusterEnabled(void);
+int clusterSelf(void);
+// Whether node is one of the other nodes. Node numbers read off the wire
+// are checked with this before anything is indexed by them.
+int clusterPeer(uint64_t node);
+int clusterOwner(const char *name);
+
+// Hand a job to the node owning it. The reply reaches the client through
+// PEER_DELIVER frames sent by that node.
+void clusterForwardJob(int node, user *client, char *msg);
+void clusterBroadcastJob(user *client, char *msg);
+
+// Raw peer frames. A node that cannot be reached is skipped.
+int clusterSend(int node, uint8_t type, struct iovec *body, int iovcnt);
+void clusterSendAll(uint8_t type, struct iovec *body, int iovcnt);
+
+// Write a frame to u wherever it is connected. There is nothing for the
+// sender to handle when that fails: a local client that cannot be written
+// to is shut down, and its reader logs it out; frames for users on a node
+// that cannot be reached are dropped.
+void userWrite(user *u, petr_header *h, char *msgbuf);
+void userWritev(user *u, petr_header *h, const struct iovec *body, int iovcnt);
+// userWrite for the reactor, which must not wait on any one client; local
+// users only. A frame the client has no room for is dropped and counted,
+// and -1 returned. One cut short shuts the client down.
+int userTryWrite(user *u, petr_header *h, char *msgbuf);
+// Write an already encoded frame, header and body, to a local user: onto
+// its ring if it has one, else its socket. A user with a batch gets it
+// through that, see batch.h; Direct skips the batch.
+void userWriteFrame(user *u, struct iovec *frame, int iovcnt);
+void userWriteDirect(user *u, struct iovec *frame, int iovcnt);
+// userWriteDirect without waiting on the client: the bytes that went, 0 if
+// none could yet, -1 if u is gone. A ring takes all of them or none.
+ssize_t userTryWriteDirect(user *u, struct iovec *frame, int iovcnt);
+
+#endif
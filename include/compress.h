@@ -0,0 +1,23 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Bodies shorter than this are always sent as-is.
+#define PETR_COMPRESS_MIN 512
+
+// LZ4 block format, no frame header. compress returns the block size, or -1
+// if it would not fit in dstCap; decompress returns the decoded size, or -1
+// if src is malformed or does not decode to exactly dstLen bytes.
+size_t petr_compress_bound(size_t srcLen);
+int petr_compress(const char *src, size_t srcLen, char *dst, size_t dstCap);
+int petr_decompress(const char *src, size_t srcLen, char *dst, size_t dstLen);
+
+// Compressed RMRECVZ/USRRECVZ body: little-endian uint32 original length
+// followed by the block. Returns a malloc'd body, or NULL if compressing the
+// gathered pieces would not make them smaller.
+char *petr_compress_msg(const struct iovec *body, int iovcnt, size_t *outLen);
+char *petr_decompress_msg(const char *body, size_t len, size_t *outLen);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdio.h>
+
+// Epoch-based reclamation for the user and room registries. Readers look
+// things up between epochEnter and epochExit without taking a lock.
+// Writers still serialize on the registry's mutex, publish a new version
+// with one atomic store, and retire what they unlinked instead of freeing
+// it. A thread of its own frees retired memory once every reader that
+// might still see it has left its section.
+//
+// Sections may nest. A long one, like a send blocked on a slow client,
+// holds back reclamation but never a writer.
+#define EPOCH_RECLAIM_MS 10
+
+void epochInit(void);
+
+void epochEnter(void);
+void epochExit(void);
+
+// Call fn(p) once no reader can see p any more.
+void epochRetire(void (*fn)(void *), void *p);
+
+void epochDump(FILE *out);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "server.h"
+
+// Members are handed to the fan-out threads in chunks of this many; rooms
+// no bigger than one chunk are sent to inline by the job thread.
+#define FANOUT_CHUNK 256
+
+typedef struct outMsg outMsg;
+
+// One RMRECV/USRRECV body. It is compressed at most once, however many
+// recipients negotiated compression.
+struct outMsg {
+    struct iovec *pieces;
+    int count;
+    uint32_t len;
+    char *packed;
+    size_t packedLen;
+    int packTried;
+};
+
+void outMsgInit(outMsg *out, struct iovec *pieces, int count);
+void outMsgFree(outMsg *out);
+void sendOutMsg(user *to, uint8_t msg_type, uint8_t packed_type, outMsg *out);
+
+void fanoutInit(int numThreads);
+
+// Send out to every member but skip, splitting large rooms across the
+// fan-out threads. Returns once all sends finished; members must stay
+// valid until then.
+void fanoutSend(const memberEntry *members, size_t count, unsigned long skip, uint8_t msg_type, uint8_t packed_type,
+               outMsg *out);
+
+#endif
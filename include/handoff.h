@@ -0,0 +1,45 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "io.h"
+
+// Zero-downtime restart. A server started with -H PATH first connects to
+// PATH: if an older server listens there, it hands over its listening
+// sockets, every client connection and the state behind them, then exits.
+// Clients keep their sockets (and shared-memory rings) and never log in
+// again. Either way the new server then listens on PATH itself, for the
+// next upgrade.
+//
+// The old server stops accepting and reading, stops every other writer
+// (frames from peers are dropped, timers held) and lets the job queue run
+// dry. It then sends a length-prefixed state record: its listeners, each
+// user with its connection and any frame half read from it, connections
+// not logged in yet, rooms and their members, the next user id. The
+// descriptors follow, HANDOFF_FDS_PER_MSG per SCM_RIGHTS message. It exits
+// once the successor acknowledges, and serves on if it never does.
+//
+// Needs an event-loop backend on both sides: the thread backend's readers
+// cannot be stopped between frames.
+#define HANDOFF_MAGIC 0x48544550  // "PETH"
+#define HANDOFF_VERSION 1
+#define HANDOFF_FDS_PER_MSG 64
+
+// Take over from a server at path. Returns how many listening sockets came
+// with it, into listenFds (TCP first, then Unix with its *unixPath), or 0
+// if nothing answers at path.
+int handoffTakeOver(const char *path, int *listenFds, char **unixPath);
+// Listen on path for a successor.
+void handoffListen(const char *path);
+// Readable once a successor is waiting; -1 without -H.
+int handoffWakeFd(void);
+// Called by the backend's loop once the wake fd is readable and it has
+// stopped reading; conns is indexed by fd. Returns only if the successor
+// went away before taking over, and the backend then carries on.
+void handoffRun(conn **conns, size_t maxConns);
+// Writes to clients are off while a handoff is under way.
+int handoffFrozen(void);
+// The connections taken over, for the backend to watch: an array of
+// *count, which the caller frees. NULL if there are none.
+conn **handoffAdopted(size_t *count);
+
+#endif
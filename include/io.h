@@ -0,0 +1,45 @@
+#ifndef IO_H
+#define IO_H
+
+#include "server.h"
+
+typedef struct conn conn;
+
+// Connection driven by an event loop rather than its own thread. Bytes are
+// fed in as they arrive and frames are assembled across reads.
+struct conn {
+    int fd;
+    unsigned int gen;  // bumped on reuse so stale completions can be told apart
+    user *client;      // NULL until LOGIN is accepted
+    char *msg;         // frame being assembled, laid out like readJobMsg's
+    uint64_t started;  // when its header arrived, for tracing
+    conn *nextPaused;
+    // the small fields last, packed: one per idle connection adds up
+    uint32_t have;     // header and body bytes received for it so far
+    uint8_t wireHeader[PETR_HEADER_SIZE];
+    uint8_t paused;    // not being read until its queued jobs drain
+    uint8_t armed;     // io_uring: a multishot receive is outstanding
+};
+
+int ioParseBackend(const char *name, ioBackend *backend);
+size_t ioMaxConns(void);
+
+void connInit(conn *c, int fd);
+// Returns -1 once the connection should be closed.
+int connFeed(conn *c, const char *data, size_t len);
+void connClose(conn *c);
+// Copy out the frame bytes received but not yet dispatched, wire header
+// first; out needs room for a whole frame. Returns how many.
+size_t connPartial(const conn *c, char *out);
+// Whether reading should pause after a feed, counted in the queue stats.
+int connShouldPause(conn *c);
+
+#define IO_RESUME_MS 10  // how often paused connections are looked at
+
+// Each runs the accept/receive loop on the calling thread, over every
+// listening socket. runUring returns -1 straight away if the kernel does
+// not support what it needs.
+void runEpoll(const int *listenFds, int numListen);
+int runUring(const int *listenFds, int numListen);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include "server.h"
+
+void listCacheInit(listCache *cache);
+void listCacheInvalidate(listCache *cache);
+
+// The cached frame if it is up to date, else NULL. Call inside an epoch
+// section; the frame stays valid until it ends.
+listFrame *listCacheFrame(listCache *cache);
+
+// Rebuild the cached frame if membership changed since the last build,
+// holding the registry's mutex. Returns -1 if the frame could not be
+// allocated.
+int listCacheRooms(listCache *cache, room *head, room *replicas);
+int listCacheUsers(listCache *cache, user *head);
+
+// A room's members as RMLIST lists them, "member,member" newest first, in
+// a malloc'd string; NULL if it could not be allocated. Holding the
+// registry's mutex.
+char *listMemberNames(const room *r);
+
+// Send a cached frame to a local user. The USRLIST variant leaves out
+// self's own entry by sending the slices around it instead of re-encoding
+// the list.
+void listCacheSendRooms(user *to, listFrame *frame);
+void listCacheSendUsers(user *self, listFrame *frame);
+
+#define LIST_PAGE_MAX 256
+
+typedef struct {
+    char *cursor;   // last name of the previous page, "" for the first page
+    char *prefix;   // only names starting with this, "" for all
+    size_t limit;
+} listPageQuery;
+
+// Insert and remove hold the registry's mutex. Find and the page
+// encoders run inside an epoch section, or with the mutex held.
+void nameIndexInit(nameIndex *index);
+int nameIndexInsert(nameIndex *index, const char *name, void *item);
+void nameIndexRemove(nameIndex *index, const char *name);
+void *nameIndexFind(nameIndex *index, const char *name);
+
+// Parse a RMLISTPAGE/USRLISTPAGE body in place. Returns -1 if malformed.
+int listPageParse(char *body, listPageQuery *query);
+
+// Encode one page into a malloc'd body; *len is 0 for an empty page.
+char *listPageRooms(nameIndex *index, listPageQuery *query, size_t *len);
+char *listPageUsers(nameIndex *index, listPageQuery *query, user *self, size_t *len);
+
+#endif
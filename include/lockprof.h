@@ -0,0 +1,49 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+// Lock contention profiling, built with `make LOCK_PROFILE=1`. Every
+// pthread_mutex_lock, unlock, cond_wait and cond_timedwait in a file that
+// includes this header goes through a wrapper that records, per mutex and
+// per call site, how often it was taken, how often it was already held, a
+// log2 histogram of the time spent waiting for it and how long it was held.
+// A mutex is counted under the place it was initialized, so every user's
+// batch lock adds up to one line, and a mutex at a reused address is
+// charged to whatever was last initialized there. Mutexes set up with
+// PTHREAD_MUTEX_INITIALIZER are statics and are counted by address. The
+// counters are printed with the SIGUSR1 stats. Without the flag this
+// header only pulls in pthread.h.
+#ifdef LOCK_PROFILE
+
+#define LOCK_PROF_LOCKS 256
+#define LOCK_PROF_SITES 1024
+#define LOCK_PROF_MUTEXES (1 << 16)  // live mutexes whose init site is known
+#define LOCK_PROF_BUCKETS 40         // log2 nanoseconds
+#define LOCK_PROF_TOP 20             // call sites shown in a dump, by total wait
+
+void lockProfInit(void);
+
+int lockProfMutexInit(pthread_mutex_t *m, const pthread_mutexattr_t *attr, const char *name, const char *file,
+                      int line);
+int lockProfMutexDestroy(pthread_mutex_t *m);
+int lockProfLock(pthread_mutex_t *m, const char *name, const char *file, int line);
+int lockProfUnlock(pthread_mutex_t *m);
+int lockProfCondWait(pthread_cond_t *c, pthread_mutex_t *m, const char *name, const char *file, int line);
+int lockProfCondTimedWait(pthread_cond_t *c, pthread_mutex_t *m, const struct timespec *abstime);
+
+void lockProfDump(FILE *out);
+
+#ifndef LOCKPROF_IMPL
+#define pthread_mutex_init(m, attr) lockProfMutexInit((m), (attr), #m, __FILE__, __LINE__)
+#define pthread_mutex_destroy(m) lockProfMutexDestroy(m)
+#define pthread_mutex_lock(m) lockProfLock((m), #m, __FILE__, __LINE__)
+#define pthread_mutex_unlock(m) lockProfUnlock(m)
+#define pthread_cond_wait(c, m) lockProfCondWait((c), (m), #m, __FILE__, __LINE__)
+#define pthread_cond_timedwait(c, m, t) lockProfCondTimedWait((c), (m), (t))
+#endif
+
+#endif
+
+#endif
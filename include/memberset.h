@@ -0,0 +1,49 @@
+#ifndef MEMBERSET_H
+#define MEMBERSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct user;
+
+// A member and its id, kept side by side so a lookup never touches the user.
+typedef struct {
+    unsigned long id;
+    struct user *member;
+} memberEntry;
+
+#define MEMBER_INLINE 4
+
+typedef struct memberSet memberSet;
+
+// A room's members, packed for fan-out: entries[0..size) is dense, so a
+// send walks one array. Up to MEMBER_INLINE members live inline and are
+// searched; past that they move to the heap behind an open-addressed index
+// (linear probing) from id to position. Join, leave and lookup are O(1); a
+// leave moves the last entry into the hole, so order is not kept.
+//
+// The entries may point into the struct itself, so a set is never copied
+// by assignment, only with memberSetCopy.
+struct memberSet {
+    memberEntry *entries;  // small until the set outgrows it
+    size_t size;
+    size_t cap;
+    uint32_t *slots;  // position + 1, 0 marks an empty slot; NULL while inline
+    size_t slotCap;
+    memberEntry small[MEMBER_INLINE];
+};
+
+void memberSetInit(memberSet *set);
+void memberSetFree(memberSet *set);
+
+// Add a member whose id is not in the set yet. Returns -1 if out of memory.
+int memberSetAdd(memberSet *set, unsigned long id, struct user *member);
+// Take a member out. Returns it, or NULL if it was not there.
+struct user *memberSetRemove(memberSet *set, unsigned long id);
+struct user *memberSetFind(const memberSet *set, unsigned long id);
+int memberSetContains(const memberSet *set, unsigned long id);
+
+// dst gets a set of its own with the same members, for publishing to readers.
+int memberSetCopy(memberSet *dst, const memberSet *src);
+
+#endif
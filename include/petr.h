@@ -0,0 +1,87 @@
+#ifndef PETR_H
+#define PETR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+// libpetr: PETR client sessions multiplexed on one single-threaded epoll
+// loop, so a bot or service can run thousands of them in one process.
+// Only petrConnect's name lookup blocks. Nothing is thread safe: call
+// everything from the thread running the loop, callbacks included.
+//
+// Commands are pipelined. A command call queues its frame and returns at
+// once; its callback gets the reply later. The server answers a session's
+// frames in the order they were sent, so replies are matched first in,
+// first out. Frames queued during one loop iteration leave in a single
+// write per session.
+
+typedef struct petrLoop petrLoop;
+typedef struct petrSession petrSession;
+
+typedef enum {
+    PETR_LOGGED_IN,  // LOGIN accepted
+    PETR_REJECTED,   // LOGIN refused, error is the server's reply type
+    PETR_CLOSED,     // connection gone; the session is freed after the callback
+} petrState;
+
+// A frame the server sent unasked. Compressed bodies arrive decoded, and
+// the messages of an RMRECVB one at a time.
+typedef struct {
+    uint8_t type;      // RMRECV, USRRECV or RMCLOSED
+    const char *room;  // RMRECV and RMCLOSED, NULL for USRRECV
+    const char *from;  // RMRECV and USRRECV, NULL for RMCLOSED
+    const char *text;  // NULL for RMCLOSED
+} petrMessage;
+
+typedef struct {
+    void (*onState)(petrSession *s, petrState state, uint8_t error, void *arg);
+    void (*onMessage)(petrSession *s, const petrMessage *m, void *arg);
+} petrHandlers;
+
+// The reply to one command: OK, an error type, or RMLIST/USRLIST and the
+// listing. body is only valid during the call.
+typedef void (*petrReplyFn)(petrSession *s, uint8_t type, const char *body, uint32_t len, void *arg);
+
+#define PETR_MAX_FRAME (64 * 1024)  // bigger frames from the server close the session
+
+petrLoop *petrLoopNew(void);
+// Closes every session still open, without calling back.
+void petrLoopFree(petrLoop *loop);
+// One iteration: send what was queued, wait up to timeoutMs (-1 for no
+// limit) and dispatch what arrived. Returns the number of sessions still
+// open, or -1 if epoll failed.
+int petrLoopRun(petrLoop *loop, int timeoutMs);
+
+// Connect and log in as username. options is NULL or a NULL-terminated
+// list of LOGIN options, such as PETR_OPT_COMPRESS. handlers and arg are
+// kept for the session's lifetime. Returns NULL if host:port cannot be
+// resolved or the socket cannot be made.
+petrSession *petrConnect(petrLoop *loop, const char *host, int port, const char *username,
+                         const char **options, const petrHandlers *handlers, void *arg);
+// The same over the Unix-domain socket of a server started with -u. With
+// PETR_OPT_SHM among the options, the server's frames come through a
+// shared-memory ring instead of the socket; a server that will not grant
+// one answers with a plain OK and the session reads its socket as usual.
+petrSession *petrConnectUnix(petrLoop *loop, const char *path, const char *username, const char **options,
+                             const petrHandlers *handlers, void *arg);
+// Drop the connection now, without a LOGOUT. PETR_CLOSED is still called
+// back, and replies still outstanding are not.
+void petrClose(petrSession *s);
+const char *petrUsername(const petrSession *s);
+
+// Queue a raw frame. done may be NULL. Returns -1 once the session is closed.
+int petrCommand(petrSession *s, uint8_t type, const char *body, uint32_t len, petrReplyFn done, void *arg);
+
+int petrRoomCreate(petrSession *s, const char *room, petrReplyFn done, void *arg);
+int petrRoomDelete(petrSession *s, const char *room, petrReplyFn done, void *arg);
+int petrRoomJoin(petrSession *s, const char *room, petrReplyFn done, void *arg);
+int petrRoomLeave(petrSession *s, const char *room, petrReplyFn done, void *arg);
+int petrRoomSend(petrSession *s, const char *room, const char *text, petrReplyFn done, void *arg);
+int petrRoomList(petrSession *s, petrReplyFn done, void *arg);
+int petrUserSend(petrSession *s, const char *to, const char *text, petrReplyFn done, void *arg);
+int petrUserList(petrSession *s, petrReplyFn done, void *arg);
+// The session closes once the reply is in.
+int petrLogout(petrSession *s, petrReplyFn done, void *arg);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "server.h"
+
+// Login/logout events published to every other cluster node, so each node
+// keeps every remote user in its own registry and answers USRLIST, USRSEND
+// and the duplicate-name check at LOGIN locally. Rooms go the same way:
+// every node keeps a replica of each other node's rooms for RMLIST and
+// RMLISTPAGE, and nothing else.
+//
+// Events are held for PRESENCE_WINDOW_US and sent as one PEER_PRESENCE
+// frame of varints: the publishing node, the event count, then per event
+// (sorted by name) op, bytes shared with the previous name, the rest of
+// the name, the zigzag id delta from the previous event and, for a login,
+// the user's features.
+#define PRESENCE_WINDOW_US 2000
+#define PRESENCE_BATCH_MAX 1024
+
+// A room that changed is sent as it is when the window ends, so a burst of
+// joins costs one listing. PEER_ROOMS frames are varints: the publishing
+// node, then per room up to the end of the frame: op, name length, name
+// and, unless the room is gone, the member count (ROOM_LISTED only) and a
+// piece of "member,member" as RMLIST shows it. A listing too long for one
+// frame goes on in ROOM_MORE entries of the next.
+#define ROOMS_FRAME_MAX MAX_MSG_LEN
+
+enum presence_room_ops { ROOM_GONE, ROOM_LISTED, ROOM_MORE };
+
+void presenceInit(void);
+
+// Queue a local login (online = 1) or logout for the other nodes.
+void presencePublish(const user *u, int online);
+
+// Queue a local room that was created, closed, joined or left.
+void presencePublishRoom(const char *name);
+
+// Apply a PEER_PRESENCE or PEER_ROOMS frame from a peer.
+void presenceReceive(const char *body, size_t len);
+void presenceReceiveRooms(const char *body, size_t len);
+
+// node (re)started: forget its users and rooms, and send it ours.
+void presenceSync(int node);
+
+#endif
@@ -1,11 +1,14 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 // These are the message types for the PETR protocol
 enum msg_types {
     OK,
+    HEARTBEAT,    // server to client, empty; sent to quiet clients with -k heartbeat=N
     LOGIN = 0x10,
     LOGOUT,
     EUSREXISTS = 0x1a,
@@ -17,14 +20,21 @@ enum msg_types {
     RMLEAVE,
     RMSEND,
     RMRECV,
+    RMLISTPAGE,   // body "cursor\r\nprefix\r\nlimit", replies "room: count\n" per room
+    RMRECVZ,      // RMRECV with a compressed body, see compress.h
     ERMEXISTS = 0x2a,
     ERMFULL,
     ERMNOTFOUND,
     ERMDENIED,
+    RMRECVB,      // RMRECV/RMRECVZ frames back to back, headers and all; see PETR_OPT_BATCH
     USRSEND = 0x30,
     USRRECV,
     USRLIST,
+    USRLISTPAGE,  // body "cursor\r\nprefix\r\nlimit", replies "user\n" per user
+    USRRECVZ,     // USRRECV with a compressed body, see compress.h
     EUSRNOTFOUND = 0x3a,
+    ESERVBUSY = 0xfd,   // frame dropped, the server's job queue is full
+    ETHROTTLED = 0xfe,  // frame dropped, over the sender's rate limit
     ESERV = 0xff
 };
 
@@ -34,7 +44,52 @@ typedef struct {
     uint8_t msg_type;
 } petr_header;
 
+// A LOGIN body may carry options after the username's terminator,
+// "name\0option\0option\0". Clients that send only the name get none.
+#define PETR_OPT_COMPRESS "compress"  // accept RMRECVZ/USRRECVZ
+#define PETR_OPT_SHM "shm"            // take frames from a shared-memory ring, see ring.h
+#define PETR_OPT_BATCH "batch"        // take room messages a few at a time in RMRECVB
+
+// On the wire a header is always 8 bytes: msg_len as little-endian uint32,
+// msg_type, then 3 zero bytes of padding.
+#define PETR_HEADER_SIZE 8
+
+void petr_header_pack(const petr_header *h, uint8_t *out);
+void petr_header_unpack(const uint8_t *in, petr_header *h);
+
+// Buffered reader for one connection. Reads pull as much as the socket has
+// ready so a burst of small frames costs one recv instead of two per frame.
+#define PETR_READER_SIZE 4096
+
+typedef struct {
+    int fd;
+    size_t start;
+    size_t end;
+    uint8_t buf[PETR_READER_SIZE];
+} petr_reader;
+
+void petr_reader_init(petr_reader *r, int socket_fd);
+int rd_msgheader_buffered(petr_reader *r, petr_header *h);
+int rd_msgbody(petr_reader *r, char *msgbuf, size_t len);
+
 int rd_msgheader(int socket_fd, petr_header *h);
 int wr_msg(int socket_fd, petr_header *h, char *msgbuf);
 
+// Header plus a body gathered from iovcnt pieces, sent with one syscall.
+// h->msg_len must equal the total length of the pieces.
+int wr_msgv(int socket_fd, petr_header *h, const struct iovec *body, int iovcnt);
+
+// count frames sent back to back with as few syscalls as IOV_MAX allows.
+int wr_msgbatch(int socket_fd, petr_header *hs, char **msgbufs, int count);
+
+// Write every byte described by iov, retrying short writes.
+int wr_iov(int socket_fd, struct iovec *iov, int iovcnt);
+
+// One write of what iov describes that does not wait for room: the bytes
+// taken, 0 if the socket would block, -1 on an error.
+ssize_t wr_iov_try(int socket_fd, const struct iovec *iov, int iovcnt);
+// wr_msg for a thread that must not wait on the peer: 0 only if the whole
+// frame went at once.
+int wr_msg_try(int socket_fd, petr_header *h, char *msgbuf);
+
 #endif
\ No newline at end of file
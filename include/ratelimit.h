@@ -0,0 +1,41 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Token buckets checked before a frame is queued as a job. Each user has
+// one bucket for everything it sends plus one per class of message; a
+// frame has to get past both, and takes a token from each only if it
+// does. Buckets are kept as GCRA "theoretical arrival times". Only the
+// user's own receive path takes tokens, one frame at a time, so checking
+// both and then storing them cannot race.
+typedef enum {
+    RATE_ALL,   // every frame on the connection
+    RATE_SEND,  // RMSEND, USRSEND
+    RATE_ROOM,  // RMCREATE, RMDELETE, RMJOIN, RMLEAVE
+    RATE_LIST,  // RMLIST, USRLIST and the paged listings
+    RATE_CLASSES
+} rateClass;
+
+typedef struct rateBuckets rateBuckets;
+
+struct rateBuckets {
+    uint64_t tat[RATE_CLASSES];  // ns on CLOCK_MONOTONIC, 0 for a full bucket
+    unsigned long throttled;
+};
+
+// Apply "class=rate/burst" (frames per second, rate 0 for no limit), as
+// given to -r. Returns -1 if spec is malformed.
+int rateLimitParse(const char *spec);
+void rateLimitInit(void);
+
+void rateBucketsInit(rateBuckets *buckets);
+
+// Take a token for a frame of msg_type. Returns -1, and counts the frame,
+// if it is over its user's limits.
+int rateAdmit(rateBuckets *buckets, uint8_t msg_type);
+
+void rateLimitDump(FILE *out);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "capture.h"
+
+// Capture of every frame clients send, on with -c FILE; see capture.h for
+// the format and petr_replay to play one back. Records are buffered and
+// written out by a thread of their own every RECORDER_FLUSH_MS, sooner if
+// the buffer fills, so a server killed by a signal loses only the last
+// moments.
+#define RECORDER_BUFFER (1 << 20)
+#define RECORDER_FLUSH_MS 200
+
+// path NULL leaves capture off, and the other calls do nothing.
+void recorderInit(const char *path);
+// msg is a frame as the readers build it, see serverLogin.
+void recorderFrame(int fd, const char *msg);
+// Call before fd is closed, so a new connection on it comes after.
+void recorderClosed(int fd);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Shared-memory byte ring the server writes frames into for a client on
+// the same host, instead of its socket. Granted at LOGIN over a Unix-domain
+// connection (PETR_OPT_SHM): the OK carries the ring's memfd and an eventfd
+// doorbell as SCM_RIGHTS. From then on every frame for the client goes
+// through the ring, bytes exactly as on the wire; the socket stays open for
+// the client's own frames, heartbeats and hangups.
+//
+// head and tail count bytes ever written and read. The server only moves
+// head and the client only tail, so neither side takes a lock. A client
+// about to wait sets sleeping and looks at head once more; the server rings
+// the doorbell after moving head only if it finds sleeping set, so a busy
+// client drains many frames per wakeup.
+#define PETR_RING_MAGIC 0x52544550  // "PETR"
+#define PETR_RING_DATA 192          // data starts after three cache lines
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;  // data bytes, a power of two
+    uint8_t pad0[56];
+    uint64_t head;
+    uint8_t pad1[56];
+    uint64_t tail;
+    uint32_t sleeping;
+    uint8_t pad2[52];
+} petr_ring;
+
+// One side's handle on a mapped ring, with its own copy of what the other
+// side could scribble over: the size and its position, head for the
+// server and tail for the client.
+typedef struct {
+    petr_ring *shared;
+    char *data;
+    uint32_t size;
+    uint64_t pos;
+} petr_ring_end;
+
+// Lay out a fresh ring over a mapping of PETR_RING_DATA + size bytes.
+void petr_ring_init(petr_ring *r, uint32_t size);
+// Check a mapping of mapLen bytes holds a ring and take a handle on it.
+// Returns -1 if it does not.
+int petr_ring_attach(petr_ring_end *end, petr_ring *r, size_t mapLen);
+
+// Server side. Write one whole frame gathered from iov: 0 if written, 1 if
+// there is no room for it yet, -1 if it can never fit or the client has
+// corrupted tail.
+int petr_ring_write(petr_ring_end *end, const struct iovec *iov, int iovcnt);
+// After a write: 1 if the client is waiting on the doorbell.
+int petr_ring_wake(petr_ring_end *end);
+
+// Client side. Copy out up to cap bytes; -1 if the server's head is corrupt.
+ssize_t petr_ring_read(petr_ring_end *end, char *buf, size_t cap);
+// Call once the ring reads empty. 0 if the client may now wait on the
+// doorbell, 1 if bytes came in meanwhile and it should read again.
+int petr_ring_sleep(petr_ring_end *end);
+
+#endif
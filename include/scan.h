@@ -0,0 +1,27 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdint.h>
+
+// One field of a frame body, pointing into the body itself.
+typedef struct {
+    char *ptr;
+    uint32_t len;
+} petr_span;
+
+// Check a body of msg_len bytes and split it at "\r\n" into at most max
+// fields, the last taking the rest of the body. The body must end in its
+// '\0' at len - 1, with no other '\0' and only well-formed UTF-8 before
+// it. Separators and the terminator are left in place; a field can be
+// made a string by writing '\0' at ptr[len].
+//
+// One pass, 32 or 16 bytes at a time where AVX2 or SSE2 is available.
+// Returns the number of fields, or -1 if the body is malformed.
+int petr_scan_fields(char *body, uint32_t len, petr_span *fields, int max);
+
+// The same check with SSE2 alone, even where AVX2 is available, and done
+// a byte at a time; for comparison, see src/test/scan.c.
+int petr_scan_fields_sse2(char *body, uint32_t len, petr_span *fields, int max);
+int petr_scan_fields_scalar(char *body, uint32_t len, petr_span *fields, int max);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "server.h"
+
+// Jobs wait in one FIFO lane per class. Job threads take from the lanes
+// by weighted round robin (JOB_WEIGHTS dequeues per round, control first).
+// A lane whose head has waited JOB_STARVE_NS and that has not been served
+// for as long goes next regardless.
+//
+// A client's jobs still run one at a time and in the order it sent them:
+// a job queues behind the client's earlier jobs in a lower lane. Each
+// client keeps its own list of jobs, and a lane holds the clients whose
+// next job is in it and who have no job running, so a job thread takes
+// the first of them without looking past anyone else's work.
+#define JOB_WEIGHTS { 8, 4, 1 }
+#define JOB_STARVE_NS (50 * 1000 * 1000ULL)
+
+#define LATENCY_BUCKETS 32  // log2 microseconds, enqueue to done
+
+// Waiting jobs may hold at most the budget (set with -q) in frames. Past
+// it new frames are shed with ESERVBUSY. Readers of a connection stop
+// taking frames while it holds more than 1/JOB_CONN_SHARE of the budget,
+// or more than an even share once the queue is 3/4 full.
+#define JOB_BUDGET_DEFAULT (64 * 1024 * 1024)
+#define JOB_CONN_SHARE 8
+
+void jobQueueInit(jobQueue *queue, size_t budget);
+
+// Returns -1, without taking msg, if the queue is over its budget, and -2
+// if client's jobs were dropped for its LOGOUT.
+int jobQueuePush(jobQueue *queue, user *client, char *msg, unsigned int trace);
+// Blocks until a job can run. The job's client is marked running.
+job *jobQueuePop(jobQueue *queue);
+// Record the job's latency, let its client's next job run and free it.
+void jobQueueDone(jobQueue *queue, job *j);
+// Free every job client still has waiting and refuse any more, before
+// client is freed.
+void jobQueueDrop(jobQueue *queue, user *client);
+
+// Whether reading from client should pause for now, for the event-loop
+// backends. The thread backend blocks in jobQueueWaitShare instead.
+int jobQueueShouldPause(jobQueue *queue, user *client);
+void jobQueueWaitShare(jobQueue *queue, user *client);
+void jobQueueNotePause(jobQueue *queue);
+// Block until no job is waiting or running. Only meaningful once nothing
+// pushes any more, as for a handoff.
+void jobQueueWaitIdle(jobQueue *queue);
+
+void jobQueueDump(FILE *out);
+
+#endif
@@ -11,54 +11,218 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "lockprof.h"
+#include "memberset.h"
+#include "protocol.h"
+#include "ratelimit.h"
 
 #define BUFFER_SIZE 1024
+#define MAX_MSG_LEN (64 * 1024)
+
+// user->features, negotiated through LOGIN options
+#define USER_COMPRESS 0x1
+#define USER_SHM 0x2  // frames go through a shared-memory ring, see shmring.h
+#define USER_BATCH 0x4  // room messages go out in RMRECVB frames, see batch.h
 #define SA struct sockaddr
 
 typedef struct user user;
 typedef struct room room;
 typedef struct job job;
 typedef struct jobQueue jobQueue;
+typedef struct jobLane jobLane;
+typedef struct jobOrder jobOrder;
 typedef struct roomList roomList;
-typedef struct auditLog auditLog;
+typedef struct listCache listCache;
+typedef struct listFrame listFrame;
+typedef struct nameIndex nameIndex;
+typedef struct nameTable nameTable;
+typedef struct nameLeaf nameLeaf;
+typedef struct nameEntry nameEntry;
+typedef struct roomView roomView;
+typedef struct shmRing shmRing;
+typedef struct userBatch userBatch;
+
+typedef enum { IO_THREADS, IO_EPOLL, IO_URING } ioBackend;
+
+// Scheduler lanes, highest priority first. See scheduler.h.
+typedef enum { JOB_CONTROL, JOB_QUERY, JOB_BULK, JOB_CLASSES } jobClass;
+
+// Keeps one client's jobs in order across lanes and job threads.
+struct jobOrder {
+    job *head, *tail;     // its waiting jobs, oldest first; their lanes never go down
+    jobOrder *nextReady;  // in the ready list of head's lane
+    size_t bytes;         // memory they hold, counted against the budget
+    int running;          // a job thread is on one of them
+    int closed;           // dropped at LOGOUT, nothing more is queued
+};
+
+void run_server(int server_port, const char *unix_path, const char *handoff_path, ioBackend backend);
+void serverSendAudit(int msg_type, user *u);
+
+// Hooks for the I/O backends. msg is a whole frame as built by the reader:
+// the decoded header, the body and a terminator. Both take ownership of it.
+user *serverLogin(int client_fd, char *loginMsg);
+void serverEnqueue(user *client, char *msg);
+// For a connection closed before it logged in.
+void serverDisconnect(int client_fd);
+// For a logged-in connection that is gone, hung up or timed out: the user
+// is logged out, and client and its fd are let go once no job needs them.
+void serverHangup(user *client);
+// Whether to stop reading from client while its queued jobs drain, and
+// whether a paused client may be read from again.
+int serverPauseReads(user *client);
+int serverCanResume(user *client);
+// Write a frame relayed by a peer node to the named local user.
+void serverDeliver(const char *name, struct iovec *frame, int iovcnt);
+
+// Hooks for presence replication. Apply takes ownership of proxy.
+void serverPresenceApply(user *proxy, int online);
+void serverPresenceReset(int node);
+void serverLocalUsers(void (*fn)(const user *u, void *arg), void *arg);
 
-void run_server(int server_port);
+// Hooks for room replication. Snapshot gives a local room's member count
+// and malloc'd member names, or returns -1 if there is no such room. Apply
+// takes ownership of name and memberNames: NULL names for a room that is
+// gone, more for names that go on from the last ones.
+int serverRoomSnapshot(const char *name, size_t *memberCount, char **memberNames);
+void serverRoomApply(int node, char *name, size_t memberCount, char *memberNames, int more);
+void serverRoomReset(int node);
+
+// Hooks for a handoff, see handoff.h. Listeners returns how many listening
+// sockets there are, TCP first. WaitIdle returns once no job is queued or
+// running. The adopt hooks rebuild what a predecessor had: AdoptUser takes
+// name and ring, AdoptRoom takes name and copies what it needs of members,
+// whose local ones must have been adopted already.
+int serverListeners(int *fds, const char **unix_path);
+void serverWaitIdle(void);
+unsigned long serverNextId(void);
+void serverAdoptNextId(unsigned long nextId);
+void serverRooms(void (*fn)(const room *r, void *arg), void *arg);
+user *serverAdoptUser(char *name, unsigned long id, int fd, unsigned int features, shmRing *ring);
+void serverAdoptRoom(char *name, user *members, size_t count);
+
+// Keep a local user, fd and all, past its logout until released; see
+// batch.h.
+void serverUserHold(user *u);
+void serverUserRelease(user *u);
 
 struct user {
     char *username;
-    int fd;
+    unsigned long id;  // never reused, 0 is not a valid id; unique across the cluster
+    int fd;            // -1 for a proxy of a user on another node
+    int node;          // cluster node the user is connected to
+    unsigned int features;
+    rateBuckets rate;
+    jobOrder order;
+    petr_reader *reader;
+    shmRing *ring;              // frames for the user are written here, NULL for its socket
+    userBatch *batch;           // room messages held for the user, NULL unless it asked
+    int refs;                   // held by its connection, the user list and an open batch
+    size_t listOffset;          // where this user starts in the cached USRLIST body
+    unsigned long listVersion;  // cache version listOffset was taken from, 0 while it changes
     user *next;
 };
 
+// The registries are read without their locks, see epoch.h. Writers
+// change rooms, lists and indexes under the registry's mutex and publish
+// what readers use as immutable versions.
 struct room {
     char *roomName;
     user* creator;
-    user* userList;
+    memberSet members;   // local users themselves, copies of remote ones
+    roomView *view;      // published by the first RMSEND after a change
+    int viewStale;       // members changed since view was taken
+    size_t memberCount;  // members.size, for readers without the mutex
+    int node;            // owner; the other nodes keep a replica, see presence.h
+    char *memberNames;   // a replica's members as RMLIST shows them; it has no member set
     room *next;
 };
 
+// A room's members as RMSEND sees them: a copy of the member set, whose
+// entries it fans out to. Joins and leaves only mark it stale, so a burst
+// of them costs one copy, not one each.
+struct roomView {
+    memberSet members;
+};
+
+// Encoded RMLIST/USRLIST frame (header + body). A reader sends current as
+// long as its version is the cache's; otherwise the frame is rebuilt
+// under the registry's mutex and replaces it.
+struct listFrame {
+    size_t len;
+    unsigned long version;
+    char data[];
+};
+
+struct listCache {
+    listFrame *current;
+    unsigned long version;  // bumped by every change to the registry
+};
+
+// Registry entries kept sorted by name so paged listings can seek to a
+// cursor or prefix with a binary search. They are split into leaves of at
+// most NAME_LEAF_MAX, in order, under a table of leaves; a change copies
+// the leaf it touches and the table, not every entry.
+#define NAME_LEAF_MAX 512
+
+struct nameEntry {
+    const char *name;
+    void *item;
+};
+
+struct nameLeaf {
+    size_t size;
+    nameEntry entries[];
+};
+
+struct nameTable {
+    size_t size;       // entries, over every leaf
+    size_t numLeaves;  // none of them empty
+    nameLeaf *leaves[];
+};
+
+struct nameIndex {
+    nameTable *table;
+};
+
 struct roomList {
     room *head;
+    room *replicas;  // other nodes' rooms, listed and nothing else
+    listCache cache;
+    nameIndex index;
     pthread_mutex_t roomListMutex;
 };
 
 struct job {
     char *msg;
     user *client;
+    jobOrder *order;
+    jobClass class;     // by message type, for the latency histograms
+    jobClass lane;      // where it queued, class or lower to stay in order
+    uint64_t enqueued;  // ns on CLOCK_MONOTONIC
+    size_t bytes;
+    unsigned int trace; // sampled frame id, 0 if not traced
     job *next;
-    job *prev;
+};
+
+// Clients whose next job waits in the lane, and who have none running,
+// in the order they got there.
+struct jobLane {
+    jobOrder *head, *tail;
+    size_t size;          // jobs waiting in the lane
+    int credits;          // dequeues left this round
+    uint64_t lastServed;  // ns on CLOCK_MONOTONIC
 };
 
 struct jobQueue {
-    job *head, *tail;
+    jobLane lanes[JOB_CLASSES];
     size_t size;
+    size_t bytes;    // frames and job records waiting
+    size_t senders;  // clients with jobs waiting
+    size_t running;  // jobs taken by a job thread and not done yet
     pthread_mutex_t jobQueueMutex;
     pthread_cond_t notEmpty;
-};
-
- struct auditLog {
-    char *fileName;
-    pthread_mutex_t auditLogMutex;
+    pthread_cond_t drained;  // bytes went down, for paused readers
 };
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include "ring.h"
+#include "server.h"
+
+// The server's end of a client's shared-memory ring, see ring.h. Any
+// thread may send: a frame goes in whole under the ring's lock, and a
+// sender finding the ring full waits for the client to read, as it would
+// block on a full socket.
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_RING_WAIT_US 100  // how often a full ring is looked at again
+
+void shmRingInit(void);
+
+// A fresh ring and doorbell, or NULL if they cannot be had.
+shmRing *shmRingNew(void);
+// Send the LOGIN OK on fd with the ring's memory and doorbell attached.
+int shmRingGrant(shmRing *ring, int fd);
+// Write one whole wire frame. -1 once the ring is closed or the client has
+// broken it.
+int shmRingSend(shmRing *ring, struct iovec *frame, int iovcnt);
+// As shmRingSend without waiting: 1 if the ring is full or another sender
+// is waiting on it, and nothing was written.
+int shmRingTrySend(shmRing *ring, struct iovec *frame, int iovcnt);
+// Nothing more is written; senders waiting for room give up.
+void shmRingClose(shmRing *ring);
+void shmRingFree(shmRing *ring);
+
+// For a handoff: what a successor needs to write on where this process
+// stopped, and a ring rebuilt from it. Adopt takes the descriptors.
+void shmRingState(shmRing *ring, int *memfd, int *doorbell, uint64_t *head);
+shmRing *shmRingAdopt(int memfd, int doorbell, uint64_t head);
+
+#endif
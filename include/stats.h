@@ -0,0 +1,19 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+// Counters are dumped to stdout when the server gets SIGUSR1. Each module
+// registers a function that prints its own.
+#define STATS_MAX_SOURCES 16
+
+typedef void (*statsDumpFn)(FILE *out);
+
+// Call before any thread is started: SIGUSR1 is blocked everywhere and
+// taken by a thread of its own, so dumps run outside signal context.
+// SIGINT and SIGTERM are taken there too and exit the server normally, so
+// buffered output (the audit log, a capture) is written out first.
+void statsInit(void);
+void statsRegister(statsDumpFn dump);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef TIMECACHE_H
+#define TIMECACHE_H
+
+// The wall time formatted like ctime(), newline included, for audit
+// lines. It reads CLOCK_REALTIME_COARSE through the vDSO, so there is no
+// system call, and the text is kept per thread and only formatted again
+// when the second changes. It stays valid until this thread's next call.
+const char *auditTime(void);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Per-connection deadlines on a hierarchical timer wheel driven by one
+// thread, whatever the I/O backend:
+//
+//   login      seconds from accept to a LOGIN, default 10
+//   idle       seconds without a frame from a logged-in client, 0 = never
+//   heartbeat  seconds of silence before the server sends a HEARTBEAT
+//              frame, so a dead peer turns into a write error, 0 = never
+//
+// A connection past its deadline is shut down, and its backend then
+// closes it as if the client had hung up.
+//
+// Connections are keyed by fd. Arming and cancelling are O(1) list
+// operations, and traffic only stamps the connection: its deadline is
+// pushed back lazily when the timer fires.
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_ROOT_BITS 8   // 256 ticks on the first level
+#define TIMER_LEVEL_BITS 6  // 64 slots on each level above
+
+// Apply "name=seconds", as given to -k. Returns -1 if spec is malformed.
+int timersParse(const char *spec);
+void timersInit(void);
+
+void timersAccepted(int fd);
+void timersLoggedIn(int fd);
+void timersActivity(int fd);
+// Must be called before fd is closed, so a firing timer never shuts down
+// a reused descriptor.
+void timersClosed(int fd);
+// Stop (held = 1) or restart the wheel. While held nothing fires, so the
+// timer thread writes to no socket; deadlines slide by the time held.
+void timersHold(int held);
+
+#endif
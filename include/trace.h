@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Sampled per-frame tracing, on with -t N (one frame in N). A sampled
+// frame gets an id, and each thread that works on it records a span:
+// receiving it, enqueueing it, waiting in the job queue, running its
+// handler and every frame sent on its behalf, fan-out threads included.
+// Spans go into a fixed ring, oldest overwritten, and the ring is written
+// out as Chrome trace-event JSON (AUDIT_FILENAME.trace.json) with each
+// SIGUSR1 stats dump, ready for chrome://tracing or Perfetto.
+#define TRACE_RING 65536
+#define TRACE_DETAIL 24  // bytes of user or room name kept per span
+
+typedef enum {
+    SPAN_RECEIVE,  // first header byte in to last body byte in
+    SPAN_ENQUEUE,  // rate check, audit and push
+    SPAN_QUEUED,   // pushed to popped by a job thread
+    SPAN_HANDLER,
+    SPAN_SEND,
+    SPAN_FANOUT,   // one chunk of a broadcast on a fan-out thread
+    SPAN_KINDS
+} spanKind;
+
+void traceInit(unsigned int every, const char *auditFile);
+
+// CLOCK_MONOTONIC ns, or 0 when tracing is off so callers can skip work.
+uint64_t traceNow(void);
+
+// Readers call traceReceived with the time the frame's header started
+// arriving just before handing it to serverEnqueue, which calls
+// traceFrame on the same thread. Returns the frame's id, 0 if it is not
+// sampled.
+void traceReceived(uint64_t start);
+unsigned int traceFrame(uint8_t msg_type, const char *from);
+
+void traceSpan(unsigned int frame, spanKind kind, uint8_t msg_type, uint64_t start, const char *detail);
+
+// Frames sent by this thread between enter and leave are charged to frame.
+void traceEnter(unsigned int frame, uint8_t msg_type);
+void traceLeave(spanKind kind, const char *detail);
+unsigned int traceCurrent(void);
+uint64_t traceSendBegin(void);
+void traceSendEnd(uint64_t start, uint8_t msg_type, const char *to);
+
+void traceDump(FILE *out);
+
+#endif
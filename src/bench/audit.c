@@ -0,0 +1,54 @@
+// Cost of stamping an audit line, as the server did it before
+// auditTime() and as it does now. The old way is time() into a global,
+// then ctime(), which formats the date again for every line; the new one
+// reads the coarse clock and formats only when the second changes. Each
+// is timed alone, then in a "Client sent" line formatted the way
+// auditWrite() formats it.
+//
+// usage: bench_audit [LINES]
+#include "timecache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static time_t t;  // the global the old audit lines shared
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *oldTime(void) {
+    time(&t);
+    return ctime(&t);
+}
+
+// ns per call, summing a byte of each stamp so none is optimized away.
+static double stamp(const char *(*how)(void), size_t lines, unsigned long *sum) {
+    double start = nowNs();
+    for (size_t i = 0; i < lines; i++)
+        *sum += how()[i % 24];
+    return (nowNs() - start) / lines;
+}
+
+static double line(const char *(*how)(void), size_t lines, unsigned long *sum) {
+    char buf[256];
+    double start = nowNs();
+    for (size_t i = 0; i < lines; i++) {
+        int len = snprintf(buf, sizeof(buf), "Client sent: %x, %d %s at %s\n", 0x26, 12, "room\r\nhello", how());
+        *sum += buf[len - 2];
+    }
+    return (nowNs() - start) / lines;
+}
+
+int main(int argc, char *argv[]) {
+    size_t lines = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000000;
+    unsigned long sum = 0;
+
+    printf("%zu lines, ns per line\n\n", lines);
+    printf("%22s %10s %10s\n", "", "stamp", "line");
+    printf("%22s %10.0f %10.0f\n", "time() + ctime()", stamp(oldTime, lines, &sum), line(oldTime, lines, &sum));
+    printf("%22s %10.0f %10.0f\n", "auditTime()", stamp(auditTime, lines, &sum), line(auditTime, lines, &sum));
+    return sum == 0;
+}
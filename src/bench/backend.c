@@ -0,0 +1,284 @@
+// Latency and server syscalls per message for one receive backend, on a
+// server started with -i threads, epoll or uring. Logs in MEMBERS clients
+// and puts them in one room, then has them take turns sending MESSAGES
+// RMSENDs, one at a time: each is timed from its write until every other
+// member has read it. The run is then repeated with the server's threads
+// traced (ptrace, from a child process), counting the syscalls it makes;
+// tracing slows the server down, so the timed run is the untraced one.
+//
+// usage: bench_backend [-n MEMBERS][-m MESSAGES] SERVER_PID PORT
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROOM "bench"
+#define BODY_MAX (64 * 1024)  // the server's MAX_MSG_LEN
+#define NR_MAX 512
+#define TOP 8  // syscalls listed by count, those made once in 100 messages or more
+
+#define NAME(nr) [__NR_##nr] = #nr
+static const char *names[NR_MAX] = {
+    NAME(read), NAME(write), NAME(readv), NAME(writev), NAME(sendmsg), NAME(recvmsg), NAME(sendto), NAME(recvfrom),
+    NAME(select), NAME(pselect6), NAME(poll), NAME(ppoll), NAME(epoll_wait), NAME(epoll_pwait), NAME(epoll_ctl),
+    NAME(futex), NAME(io_uring_enter), NAME(accept4), NAME(close), NAME(shutdown), NAME(mmap), NAME(munmap),
+    NAME(madvise), NAME(brk), NAME(openat), NAME(lseek), NAME(rt_sigprocmask), NAME(sched_yield), NAME(nanosleep),
+    NAME(clock_nanosleep), NAME(getrandom), NAME(fcntl), NAME(ioctl), NAME(setsockopt), NAME(getsockopt),
+    NAME(rt_sigtimedwait), NAME(restart_syscall),
+};
+
+static double nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sendFrame(int fd, uint8_t type, const char *body, size_t len) {
+    petr_header h = { len, type };
+    if (wr_msg(fd, &h, (char *)body) < 0) {
+        printf("Write error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void expect(int fd, uint8_t want) {
+    static char body[BODY_MAX];
+    petr_header h;
+    if (rd_msgheader(fd, &h) < 0 || h.msg_len > sizeof(body)) {
+        printf("Server went away\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t n = 0; n < h.msg_len;) {
+        ssize_t got = read(fd, body + n, h.msg_len - n);
+        if (got <= 0) {
+            printf("Server went away\n");
+            exit(EXIT_FAILURE);
+        }
+        n += got;
+    }
+    if (h.msg_type != want) {
+        printf("Got %x waiting for %x\n", h.msg_type, want);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int login(int port, int i) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    char name[32];
+    int len = snprintf(name, sizeof(name), "backend%d", i);
+    sendFrame(fd, LOGIN, name, len + 1);
+    expect(fd, OK);
+    return fd;
+}
+
+// One RMSEND per message, the senders taking turns. Fills us with the
+// time of each until the last member read it.
+static void sendAll(int *fds, int members, int messages, double *us) {
+    for (int i = 0; i < messages; i++) {
+        int from = i % members;
+        double start = nowUs();
+        sendFrame(fds[from], RMSEND, ROOM "\r\nhello room", sizeof(ROOM "\r\nhello room"));
+        for (int j = 0; j < members; j++)
+            if (j != from)
+                expect(fds[j], RMRECV);
+        if (us != NULL)
+            us[i] = nowUs() - start;
+        expect(fds[from], OK);
+    }
+}
+
+static volatile sig_atomic_t stopTracing;
+
+static void onStop(int sig) {
+    stopTracing = 1;
+}
+
+static unsigned long counts[NR_MAX];
+
+static int byCount(const void *a, const void *b) {
+    unsigned long x = counts[*(const int *)a], y = counts[*(const int *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Count the syscalls every thread of pid makes until SIGTERM, then print
+// them per message. Writes a byte to ready once all threads are traced.
+static void traceServer(pid_t pid, int ready, int messages) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onStop;
+    sigaction(SIGTERM, &sa, NULL);  // no SA_RESTART, so waitpid sees it
+
+    pid_t tids[256];
+    int numTids = 0, tracees = 0;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        _exit(EXIT_FAILURE);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && numTids < 256) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0 || ptrace(PTRACE_SEIZE, tid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE) < 0)
+            continue;
+        ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+        tids[numTids++] = tid;
+        tracees++;
+    }
+    closedir(dir);
+    if (tracees == 0) {
+        perror("ptrace");
+        _exit(EXIT_FAILURE);
+    }
+    if (write(ready, "", 1) != 1)
+        _exit(EXIT_FAILURE);
+
+    int interrupted = 0;
+    while (tracees > 0) {
+        if (stopTracing && !interrupted) {
+            for (int i = 0; i < numTids; i++)
+                ptrace(PTRACE_INTERRUPT, tids[i], 0, 0);
+            interrupted = 1;
+        }
+        int status;
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            tracees--;
+            continue;
+        }
+
+        int sig = WSTOPSIG(status), event = status >> 16;
+        if (sig == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr < NR_MAX)
+                counts[info.entry.nr]++;
+            sig = 0;
+        } else if (event != 0) {
+            unsigned long child;
+            if (event == PTRACE_EVENT_CLONE && ptrace(PTRACE_GETEVENTMSG, tid, 0, &child) == 0) {
+                tracees++;
+                if (numTids < 256)
+                    tids[numTids++] = child;
+            }
+            sig = 0;
+        }
+        if (stopTracing) {
+            if (ptrace(PTRACE_DETACH, tid, 0, sig) == 0)
+                tracees--;
+        } else {
+            ptrace(PTRACE_SYSCALL, tid, 0, sig);
+        }
+    }
+
+    unsigned long total = 0;
+    int order[NR_MAX];
+    for (int i = 0; i < NR_MAX; i++) {
+        total += counts[i];
+        order[i] = i;
+    }
+    qsort(order, NR_MAX, sizeof(int), byCount);
+    printf("server syscalls: %lu, %.2f per message over %d threads\n", total, (double)total / messages, numTids);
+    for (int i = 0; i < TOP && counts[order[i]] * 100 >= (unsigned long)messages; i++) {
+        if (names[order[i]] != NULL)
+            printf("  %-16s %8.2f\n", names[order[i]], (double)counts[order[i]] / messages);
+        else
+            printf("  syscall %-8d %8.2f\n", order[i], (double)counts[order[i]] / messages);
+    }
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+static int byUs(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int members = 10, messages = 2000, opt;
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        if (opt == 'n')
+            members = atoi(optarg);
+        else if (opt == 'm')
+            messages = atoi(optarg);
+        else
+            break;
+    }
+    if (optind != argc - 2 || members < 2 || messages < 1) {
+        fprintf(stderr, "usage: %s [-n MEMBERS][-m MESSAGES] SERVER_PID PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    pid_t server = atoi(argv[optind]);
+    int port = atoi(argv[optind + 1]);
+
+    int *fds = malloc(members * sizeof(int));
+    for (int i = 0; i < members; i++)
+        fds[i] = login(port, i);
+    sendFrame(fds[0], RMCREATE, ROOM, sizeof(ROOM));
+    expect(fds[0], OK);
+    for (int i = 1; i < members; i++) {
+        sendFrame(fds[i], RMJOIN, ROOM, sizeof(ROOM));
+        expect(fds[i], OK);
+    }
+
+    // warm up, then the timed run
+    sendAll(fds, members, messages / 10 + 1, NULL);
+    double *us = malloc(messages * sizeof(double));
+    sendAll(fds, members, messages, us);
+    qsort(us, messages, sizeof(double), byUs);
+    printf("%d members, %d messages: delivered p50 %.0fus p99 %.0fus max %.0fus\n", members, messages,
+           us[messages / 2], us[messages * 99 / 100], us[messages - 1]);
+    fflush(stdout);
+
+    int ready[2];
+    if (pipe(ready) < 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    pid_t tracer = fork();
+    if (tracer == 0)
+        traceServer(server, ready[1], messages);
+    char byte;
+    if (read(ready[0], &byte, 1) != 1) {
+        waitpid(tracer, NULL, 0);
+        return EXIT_FAILURE;
+    }
+    sendAll(fds, members, messages, NULL);
+    kill(tracer, SIGTERM);
+    waitpid(tracer, NULL, 0);
+
+    for (int i = 0; i < members; i++)
+        close(fds[i]);
+    free(fds);
+    free(us);
+    return 0;
+}
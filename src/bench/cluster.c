@@ -0,0 +1,188 @@
+// Aggregate RMSEND throughput of a cluster as it grows. For each count in
+// NODES, starts that many petr_server processes on ports PORT and up,
+// peered over Unix sockets in /tmp (a single node runs without -P), then
+// one petr_bot per node at the same time, each in a room of its own. The
+// hash ring puts each room on whichever node it likes, so most sends cross
+// a peer link. Prints the messages received per second summed over the
+// bots, and that against the first row. Run from the top of the tree, it
+// starts bin/petr_server and bin/petr_bot; see `make clusterbench`.
+//
+// usage: bench_cluster [-i BACKEND][-n SESSIONS][-m MESSAGES][-p PORT] NODES...
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_NODES 16
+#define SOCKET_PATH "/tmp/petr_cluster%d.sock"
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int listening(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int up = fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (fd >= 0)
+        close(fd);
+    return up;
+}
+
+static pid_t startNode(int node, int nodes, int port, const char *backend) {
+    char peers[MAX_NODES * 64] = "", path[64], nodeArg[16], portArg[16];
+    for (int i = 0; i < nodes; i++) {
+        snprintf(path, sizeof(path), SOCKET_PATH, i);
+        if (i > 0)
+            strcat(peers, ",");
+        strcat(peers, path);
+    }
+    snprintf(nodeArg, sizeof(nodeArg), "%d", node);
+    snprintf(portArg, sizeof(portArg), "%d", port + node);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (freopen("/dev/null", "w", stdout) == NULL || freopen("/dev/null", "w", stderr) == NULL)
+            _exit(EXIT_FAILURE);
+        if (nodes == 1)
+            execl("bin/petr_server", "petr_server", "-i", backend, portArg, "/dev/null", (char *)NULL);
+        else
+            execl("bin/petr_server", "petr_server", "-i", backend, "-n", nodeArg, "-P", peers, portArg, "/dev/null",
+                  (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// A bot for node, its output on the returned descriptor.
+static pid_t startBot(int node, int port, const char *sessions, const char *messages, int *out) {
+    char room[32], portArg[16];
+    snprintf(room, sizeof(room), "cluster%d", node);
+    snprintf(portArg, sizeof(portArg), "%d", port + node);
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        execl("bin/petr_bot", "petr_bot", "-n", sessions, "-m", messages, "-r", room, "127.0.0.1", portArg,
+              (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+    *out = fds[0];
+    return pid;
+}
+
+// Messages received per second over every bot, or -1 if one failed.
+static double run(int nodes, int port, const char *backend, const char *sessions, const char *messages,
+                  unsigned long *received) {
+    pid_t servers[MAX_NODES], bots[MAX_NODES];
+    int outs[MAX_NODES];
+    for (int i = 0; i < nodes; i++)
+        servers[i] = startNode(i, nodes, port, backend);
+    for (int i = 0; i < nodes; i++)
+        for (int tries = 0; !listening(port + i); tries++) {
+            if (tries == 500) {
+                printf("Node %d did not come up on port %d\n", i, port + i);
+                exit(EXIT_FAILURE);
+            }
+            usleep(10000);
+        }
+    // the peer links and presence sync settle before the bots log in
+    usleep(200000);
+
+    double start = nowSeconds();
+    for (int i = 0; i < nodes; i++)
+        bots[i] = startBot(i, port, sessions, messages, &outs[i]);
+    int failed = 0;
+    for (int i = 0; i < nodes; i++) {
+        int status;
+        waitpid(bots[i], &status, 0);
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    }
+    double elapsed = nowSeconds() - start;
+
+    *received = 0;
+    for (int i = 0; i < nodes; i++) {
+        char line[256];
+        ssize_t n = read(outs[i], line, sizeof(line) - 1);
+        unsigned long got = 0;
+        line[n > 0 ? n : 0] = '\0';
+        if (sscanf(line, "%*d sessions, %*u sent, %lu received", &got) != 1)
+            failed = 1;
+        *received += got;
+        close(outs[i]);
+    }
+
+    for (int i = 0; i < nodes; i++) {
+        kill(servers[i], SIGTERM);
+        waitpid(servers[i], NULL, 0);
+        char path[64];
+        snprintf(path, sizeof(path), SOCKET_PATH, i);
+        unlink(path);
+    }
+    return failed ? -1 : *received / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *backend = "epoll", *sessions = "20", *messages = "500";
+    int port = 9700, opt;
+    while ((opt = getopt(argc, argv, "i:n:m:p:")) != -1) {
+        if (opt == 'i')
+            backend = optarg;
+        else if (opt == 'n')
+            sessions = optarg;
+        else if (opt == 'm')
+            messages = optarg;
+        else if (opt == 'p')
+            port = atoi(optarg);
+        else
+            break;
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-i BACKEND][-n SESSIONS][-m MESSAGES][-p PORT] NODES...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("one bot per node, %s sessions sending %s each, -i %s, %ld CPUs\n\n", sessions, messages, backend,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%6s %12s %14s %8s\n", "nodes", "received", "received/s", "scaling");
+    fflush(stdout);  // before the forks, so no child writes it again
+    double first = 0;
+    for (int i = optind; i < argc; i++) {
+        int nodes = atoi(argv[i]);
+        if (nodes < 1 || nodes > MAX_NODES) {
+            fprintf(stderr, "Between 1 and %d nodes\n", MAX_NODES);
+            return EXIT_FAILURE;
+        }
+        unsigned long received;
+        double rate = run(nodes, port, backend, sessions, messages, &received);
+        if (rate < 0) {
+            printf("%6d a bot failed\n", nodes);
+            return EXIT_FAILURE;
+        }
+        if (first == 0)
+            first = rate;
+        printf("%6d %12lu %14.0f %7.2fx\n", nodes, received, rate, rate / first);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+// Time per RMSEND broadcast to 1k, 10k and 100k members, through
+// fanoutSend over a member set against what RMSEND used to do: walk the
+// room's list of user copies comparing names to find the sender, then
+// send to each member in turn on the job thread. The sender is the room's
+// creator, last in the old list. Members write to SINKS socket pairs that
+// sink threads drain, so every send is a sendmsg of its own as it is to a
+// client; neither side writes an audit line.
+//
+// usage: bench_fanout [-f THREADS][-n MAX_MEMBERS]
+#include "compress.h"
+#include "fanout.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SINKS 16
+#define ROOM "bench"
+#define BODY "hello room"
+
+// What fanout.c needs from the rest of the server: a plain local client's
+// write, and no audit, trace or compression.
+void userWritev(user *u, petr_header *h, const struct iovec *body, int iovcnt) {
+    if (wr_msgv(u->fd, h, body, iovcnt) < 0) {
+        printf("Write error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void userWrite(user *u, petr_header *h, char *msgbuf) {
+    struct iovec body = { msgbuf, h->msg_len };
+    userWritev(u, h, &body, msgbuf == NULL ? 0 : 1);
+}
+
+void serverSendAudit(int msg_type, user *u) {
+}
+
+char *petr_compress_msg(const struct iovec *body, int iovcnt, size_t *outLen) {
+    return NULL;
+}
+
+unsigned int traceCurrent(void) {
+    return 0;
+}
+
+void traceEnter(unsigned int frame, uint8_t msg_type) {
+}
+
+void traceLeave(spanKind kind, const char *detail) {
+}
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *sink(void *arg) {
+    static char buf[1 << 16];
+    int fd = (int)(intptr_t)arg;
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    return NULL;
+}
+
+static int sinkFds[SINKS];
+
+static void startSinks(void) {
+    for (int i = 0; i < SINKS; i++) {
+        int fds[2];
+        pthread_t tid;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        sinkFds[i] = fds[1];
+        pthread_create(&tid, NULL, sink, (void *)(intptr_t)fds[0]);
+    }
+}
+
+static user *members(size_t n) {
+    user *users = calloc(n, sizeof(user));
+    if (users == NULL) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "member%zu", i);
+        users[i].username = strdup(name);
+        users[i].id = i + 1;
+        users[i].fd = sinkFds[i % SINKS];
+    }
+    return users;
+}
+
+// The old room: a copy of each member, the newest joiner first.
+static user *oldList(user *users, size_t n) {
+    user *head = NULL;
+    for (size_t i = 0; i < n; i++) {
+        user *copy = malloc(sizeof(user));
+        *copy = users[i];
+        copy->next = head;
+        head = copy;
+    }
+    return head;
+}
+
+static void oldSend(user *list, user *sender) {
+    for (user *from = list; from != NULL; from = from->next) {
+        if (strcmp(from->username, sender->username) != 0)
+            continue;
+        struct iovec message[5] = {
+            { ROOM, strlen(ROOM) },
+            { "\r\n", 2 },
+            { sender->username, strlen(sender->username) },
+            { "\r\n", 2 },
+            { BODY, sizeof(BODY) },
+        };
+        outMsg out;
+        outMsgInit(&out, message, 5);
+        for (user *to = list; to != NULL; to = to->next)
+            if (to != from)
+                sendOutMsg(to, RMRECV, RMRECVZ, &out);
+        outMsgFree(&out);
+        return;
+    }
+}
+
+static void newSend(const memberSet *set, user *sender) {
+    if (!memberSetContains(set, sender->id))
+        return;
+    struct iovec message[5] = {
+        { ROOM, strlen(ROOM) },
+        { "\r\n", 2 },
+        { sender->username, strlen(sender->username) },
+        { "\r\n", 2 },
+        { BODY, sizeof(BODY) },
+    };
+    outMsg out;
+    outMsgInit(&out, message, 5);
+    fanoutSend(set->entries, set->size, sender->id, RMRECV, RMRECVZ, &out);
+    outMsgFree(&out);
+}
+
+static void run(size_t n) {
+    user *users = members(n);
+    user *list = oldList(users, n);
+    memberSet *set = malloc(sizeof(memberSet));
+    memberSetInit(set);
+    for (size_t i = 0; i < n; i++)
+        if (memberSetAdd(set, users[i].id, &users[i]) < 0) {
+            printf("Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+    size_t reps = 500000 / n < 3 ? 3 : 500000 / n;
+    double start = nowNs();
+    for (size_t i = 0; i < reps; i++)
+        oldSend(list, &users[0]);
+    double oldNs = (nowNs() - start) / reps;
+
+    start = nowNs();
+    for (size_t i = 0; i < reps; i++)
+        newSend(set, &users[0]);
+    double newNs = (nowNs() - start) / reps;
+
+    printf("%9zu %6zu %10.0f %10.0f %8.0f %8.0f\n", n, reps, oldNs / 1000, newNs / 1000, oldNs / (n - 1),
+           newNs / (n - 1));
+
+    while (list != NULL) {
+        user *next = list->next;
+        free(list);
+        list = next;
+    }
+    for (size_t i = 0; i < n; i++)
+        free(users[i].username);
+    free(users);
+    memberSetFree(set);
+    free(set);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 2, opt;
+    size_t max = 100000;
+    while ((opt = getopt(argc, argv, "f:n:")) != -1) {
+        if (opt == 'f')
+            threads = atoi(optarg);
+        else if (opt == 'n')
+            max = strtoul(optarg, NULL, 10);
+        else
+            break;
+    }
+    if (optind != argc || threads < 0) {
+        fprintf(stderr, "usage: %s [-f THREADS][-n MAX_MEMBERS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    startSinks();
+    fanoutInit(threads);
+    printf("%d fan-out threads, chunks of %d members, %d sinks, %ld CPUs\n\n", threads, FANOUT_CHUNK, SINKS,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%9s %6s %10s %10s %8s %8s\n", "members", "sends", "old us", "fanout us", "old ns/m", "new ns/m");
+    for (size_t n = 1000; n <= max; n *= 10)
+        run(n);
+    return 0;
+}
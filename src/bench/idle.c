@@ -0,0 +1,169 @@
+// Resident bytes per idle connection on a running server: opens CONNS
+// loopback connections, logs each in under a name of its own, and reads
+// the server's VmRSS before and after. The connections are spread over
+// WORKERS processes, and over source addresses 127.0.0.2 and up so the
+// ephemeral port range does not run out, which takes it to a million.
+// The server and each worker need a descriptor limit to match; see
+// `make idlebench`.
+//
+// usage: bench_idle [-n CONNS][-w WORKERS] SERVER_PID PORT
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONNS_PER_SOURCE 10000  // of 28232 ports by default; connect slows as they fill
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// kB, or 0 if pid is gone.
+static size_t residentKb(pid_t pid) {
+    char path[64], line[256];
+    size_t kb = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "VmRSS: %zu kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+static int connectOne(size_t n, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + n / CONNS_PER_SOURCE);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char name[32];
+    petr_header h = { snprintf(name, sizeof(name), "idle%zu", n) + 1, LOGIN };
+    if (wr_msg(fd, &h, name) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Open count connections starting at first, wait for every LOGIN's reply,
+// report how many were let in and hold them until killed. A worker that
+// cannot open them all stops there, and still reports.
+static void worker(size_t first, size_t count, int port, int report) {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < count + 64)
+        printf("Worker needs %zu descriptors, the limit is %lu\n", count + 64, (unsigned long)limit.rlim_max);
+    else
+        limit.rlim_cur = count + 64;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    int *fds = malloc(count * sizeof(int));
+    size_t opened = 0;
+    while (fds != NULL && opened < count && (fds[opened] = connectOne(first + opened, port)) >= 0)
+        opened++;
+    if (opened < count)
+        perror("connect");
+
+    size_t in = 0;
+    for (size_t i = 0; i < opened; i++) {
+        petr_header h;
+        if (rd_msgheader(fds[i], &h) == 0 && h.msg_type == OK && h.msg_len == 0)
+            in++;
+    }
+    if (write(report, &in, sizeof(in)) != sizeof(in))
+        exit(EXIT_FAILURE);
+    pause();
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]) {
+    size_t conns = 1000000;
+    int workers = 8;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hn:w:")) != -1) {
+        switch (opt) {
+        case 'n':
+            conns = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "./bin/bench_idle [-h][-n CONNS][-w WORKERS] SERVER_PID PORT\n");
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind + 2 != argc || conns == 0 || workers < 1) {
+        fprintf(stderr, "./bin/bench_idle [-h][-n CONNS][-w WORKERS] SERVER_PID PORT\n");
+        exit(EXIT_FAILURE);
+    }
+    pid_t server = atoi(argv[optind]);
+    int port = atoi(argv[optind + 1]);
+
+    size_t before = residentKb(server);
+    if (before == 0) {
+        printf("No process %d\n", (int)server);
+        exit(EXIT_FAILURE);
+    }
+
+    int report[2];
+    if (pipe(report) < 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    double start = nowSeconds();
+    for (int w = 0; w < workers; w++) {
+        size_t first = conns * w / workers, last = conns * (w + 1) / workers;
+        if ((pids[w] = fork()) == 0)
+            worker(first, last - first, port, report[1]);
+    }
+
+    size_t in = 0;
+    for (int w = 0; w < workers; w++) {
+        size_t n;
+        if (read(report[0], &n, sizeof(n)) != sizeof(n))
+            break;
+        in += n;
+    }
+    double elapsed = nowSeconds() - start;
+    size_t after = residentKb(server);
+
+    printf("%zu connections, %zu logged in, in %.1fs: server RSS %zu kB -> %zu kB, %.0f bytes per idle connection\n",
+           conns, in, elapsed, before, after, in ? ((double)after - before) * 1024 / in : 0);
+
+    for (int w = 0; w < workers; w++) {
+        kill(pids[w], SIGTERM);
+        waitpid(pids[w], NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+// RMJOIN and RMSEND through a running server as a room grows: logs in
+// MEMBERS connections, has one create a room, and the rest join it a block
+// of STEP at a time, every join of a block sent before any OK is read.
+// Prints the time per join for each block, and after it the time of one
+// RMSEND to the room, whose first send after the joins takes the new
+// member list. Each connection needs a descriptor; see `make joinbench`.
+//
+// usage: bench_join [-n MEMBERS][-s STEP] PORT
+#include "protocol.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROOM "bench"
+#define BODY_MAX (64 * 1024)  // the server's MAX_MSG_LEN
+
+static double nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sendFrame(int fd, uint8_t type, const char *body, size_t len) {
+    petr_header h = { len, type };
+    if (wr_msg(fd, &h, (char *)body) < 0) {
+        printf("Write error\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Read frames until one of type want; RMRECVs for fd on the way are skipped.
+static void expect(int fd, uint8_t want) {
+    static char body[BODY_MAX];
+    for (;;) {
+        petr_header h;
+        if (rd_msgheader(fd, &h) < 0 || h.msg_len > sizeof(body)) {
+            printf("Server went away\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t n = 0; n < h.msg_len;) {
+            ssize_t got = read(fd, body + n, h.msg_len - n);
+            if (got <= 0) {
+                printf("Server went away\n");
+                exit(EXIT_FAILURE);
+            }
+            n += got;
+        }
+        if (h.msg_type == want)
+            return;
+        if (h.msg_type != RMRECV && h.msg_type != RMRECVZ) {
+            printf("Got %x waiting for %x\n", h.msg_type, want);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static int login(int port, int i) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    char name[32];
+    int len = snprintf(name, sizeof(name), "join%d", i);
+    sendFrame(fd, LOGIN, name, len + 1);
+    expect(fd, OK);
+    return fd;
+}
+
+// One RMSEND from the creator; every member gets it, the creator an OK.
+static double roomSend(int *fds, int members) {
+    double start = nowUs();
+    sendFrame(fds[0], RMSEND, ROOM "\r\nhi", sizeof(ROOM "\r\nhi"));
+    expect(fds[0], OK);
+    double us = nowUs() - start;
+    for (int i = 1; i < members; i++)
+        expect(fds[i], RMRECV);
+    return us;
+}
+
+int main(int argc, char *argv[]) {
+    int members = 10000, step = 1000, opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        if (opt == 'n')
+            members = atoi(optarg);
+        else if (opt == 's')
+            step = atoi(optarg);
+        else
+            break;
+    }
+    if (optind != argc - 1 || members < 2 || step < 1) {
+        fprintf(stderr, "usage: %s [-n MEMBERS][-s STEP] PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[optind]);
+
+    int *fds = malloc(members * sizeof(int));
+    for (int i = 0; i < members; i++)
+        fds[i] = login(port, i);
+    sendFrame(fds[0], RMCREATE, ROOM, sizeof(ROOM));
+    expect(fds[0], OK);
+
+    printf("%9s %12s %12s\n", "members", "us per join", "RMSEND us");
+    for (int at = 1; at < members;) {
+        int end = at + step < members ? at + step : members;
+        double start = nowUs();
+        for (int i = at; i < end; i++)
+            sendFrame(fds[i], RMJOIN, ROOM, sizeof(ROOM));
+        for (int i = at; i < end; i++)
+            expect(fds[i], OK);
+        double perJoin = (nowUs() - start) / (end - at);
+        at = end;
+        printf("%9d %12.1f %12.0f\n", at, perJoin, roomSend(fds, at));
+    }
+
+    for (int i = 0; i < members; i++)
+        close(fds[i]);
+    free(fds);
+    return 0;
+}
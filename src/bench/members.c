@@ -0,0 +1,124 @@
+// Heap bytes per room member and the cost of join, lookup and leave, for
+// the member set against what rooms used to keep: a malloc'd copy of the
+// user per member plus a table of ids.
+//
+// usage: bench_members [MAX_MEMBERS]
+#include "server.h"
+#include <malloc.h>
+#include <time.h>
+
+static size_t heapUsed(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Ids the way the server hands them out, visited in a scrambled order.
+static unsigned long *shuffledIds(size_t n) {
+    unsigned long *ids = malloc(n * sizeof(unsigned long));
+    if (ids == NULL) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i++)
+        ids[i] = i + 1;
+    for (size_t i = n; i > 1; i--) {
+        size_t j = rand() % i;
+        unsigned long t = ids[i - 1];
+        ids[i - 1] = ids[j];
+        ids[j] = t;
+    }
+    return ids;
+}
+
+// The old layout: one user copy per member and an id table at load 3/4.
+static size_t oldBytes(size_t n) {
+    size_t cap = 8;
+    while (n * 4 > cap * 3)
+        cap *= 2;
+
+    size_t before = heapUsed();
+    user **copies = malloc(n * sizeof(user *));
+    unsigned long *table = calloc(cap, sizeof(unsigned long));
+    for (size_t i = 0; i < n; i++)
+        copies[i] = calloc(1, sizeof(user));
+    // the copies array only stands in for the list links
+    size_t bytes = heapUsed() - before - malloc_usable_size(copies);
+
+    for (size_t i = 0; i < n; i++)
+        free(copies[i]);
+    free(copies);
+    free(table);
+    return bytes;
+}
+
+static void run(size_t n) {
+    user dummy;
+    unsigned long *ids = shuffledIds(n);
+    unsigned long *order = shuffledIds(n);
+    memberSet *set = malloc(sizeof(memberSet));
+    memberSet *view = malloc(sizeof(memberSet));
+
+    // count the struct itself, as a room carries it inline
+    size_t before = heapUsed();
+    memberSetInit(set);
+    double start = nowNs();
+    for (size_t i = 0; i < n; i++)
+        if (memberSetAdd(set, ids[i], &dummy) < 0) {
+            printf("Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    double joinNs = (nowNs() - start) / n;
+    size_t setBytes = heapUsed() - before + sizeof(memberSet);
+
+    before = heapUsed();
+    if (memberSetCopy(view, set) < 0) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t viewBytes = heapUsed() - before + sizeof(memberSet);
+
+    size_t found = 0;
+    start = nowNs();
+    for (size_t i = 0; i < n; i++)
+        found += memberSetContains(set, order[i]);
+    double lookupNs = (nowNs() - start) / n;
+
+    start = nowNs();
+    for (size_t i = 0; i < n; i++)
+        memberSetRemove(set, order[i]);
+    double leaveNs = (nowNs() - start) / n;
+
+    if (found != n || set->size != 0) {
+        printf("member set lost members at %zu\n", n);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%9zu %10.1f %10.1f %10.1f %8.1f %8.1f %8.1f\n", n, (double)setBytes / n, (double)(setBytes + viewBytes) / n,
+           (double)oldBytes(n) / n, joinNs, lookupNs, leaveNs);
+
+    memberSetFree(set);
+    memberSetFree(view);
+    free(set);
+    free(view);
+    free(ids);
+    free(order);
+}
+
+int main(int argc, char *argv[]) {
+    size_t max = argc > 1 ? strtoul(argv[1], NULL, 10) : 1 << 20;
+
+    srand(1);
+    printf("memberSet is %zu bytes, inline up to %d members; a user copy is %zu bytes\n\n", sizeof(memberSet),
+           MEMBER_INLINE, sizeof(user));
+    printf("%9s %10s %10s %10s %8s %8s %8s\n", "members", "set B/mb", "+view", "old B/mb", "join ns", "find ns",
+           "leave ns");
+    for (size_t n = 1; n <= max; n *= 4)
+        run(n);
+    return 0;
+}
@@ -0,0 +1,148 @@
+// Time per frame through the in-tree protocol against the prebuilt
+// object it replaced (lib/protocol.o, its symbols renamed old_* by `make
+// bench`), over a Unix socket pair with a second process at the other end.
+// The old wr_msg copies header and body into a malloc'd buffer for one
+// send; the old rd_msgheader is a recv of its own ahead of the body's.
+//
+// usage: bench_protocol [FRAMES]
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int old_rd_msgheader(int socket_fd, petr_header *h);
+int old_wr_msg(int socket_fd, petr_header *h, char *msgbuf);
+
+#define BATCH 64
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void pair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void sink(int fd) {
+    static char buf[1 << 16];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    _exit(EXIT_SUCCESS);
+}
+
+typedef enum { OLD_WRITE, NEW_WRITE, NEW_BATCH } writer;
+
+// ns per frame written, with a child process reading them.
+static double writeFrames(writer how, size_t frames, size_t len) {
+    int fds[2];
+    pair(fds);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[1]);
+        sink(fds[0]);
+    }
+    close(fds[0]);
+
+    char *body = malloc(len + 1);
+    memset(body, 'x', len);
+    petr_header hs[BATCH];
+    char *bodies[BATCH];
+    for (int i = 0; i < BATCH; i++) {
+        hs[i] = (petr_header){ len, RMRECV };
+        bodies[i] = body;
+    }
+
+    double start = nowNs();
+    for (size_t i = 0; i < frames;) {
+        int ret;
+        if (how == NEW_BATCH) {
+            int n = frames - i < BATCH ? frames - i : BATCH;
+            ret = wr_msgbatch(fds[1], hs, bodies, n);
+            i += n;
+        } else {
+            petr_header h = { len, RMRECV };
+            ret = how == OLD_WRITE ? old_wr_msg(fds[1], &h, body) : wr_msg(fds[1], &h, body);
+            i++;
+        }
+        if (ret < 0)
+            exit(EXIT_FAILURE);
+    }
+    close(fds[1]);
+    waitpid(pid, NULL, 0);
+    double ns = (nowNs() - start) / frames;
+    free(body);
+    return ns;
+}
+
+// ns per frame read, with a child process writing them in batches.
+static double readFrames(int old, size_t frames, size_t len) {
+    int fds[2];
+    pair(fds);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        char *body = calloc(1, len + 1);
+        petr_header hs[BATCH];
+        char *bodies[BATCH];
+        for (int i = 0; i < BATCH; i++) {
+            hs[i] = (petr_header){ len, RMRECV };
+            bodies[i] = body;
+        }
+        for (size_t i = 0; i < frames; i += BATCH)
+            if (wr_msgbatch(fds[1], hs, bodies, frames - i < BATCH ? frames - i : BATCH) < 0)
+                _exit(EXIT_FAILURE);
+        _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+
+    char *body = malloc(len + 1);
+    petr_reader *reader = malloc(sizeof(petr_reader));
+    petr_reader_init(reader, fds[0]);
+    double start = nowNs();
+    for (size_t i = 0; i < frames; i++) {
+        petr_header h;
+        if (old) {
+            // as the server read before: the header, then the body with read()
+            if (old_rd_msgheader(fds[0], &h) < 0)
+                exit(EXIT_FAILURE);
+            for (size_t n = 0; n < h.msg_len;) {
+                ssize_t got = read(fds[0], body + n, h.msg_len - n);
+                if (got <= 0)
+                    exit(EXIT_FAILURE);
+                n += got;
+            }
+        } else if (rd_msgheader_buffered(reader, &h) < 0 || rd_msgbody(reader, body, h.msg_len) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    double ns = (nowNs() - start) / frames;
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    free(reader);
+    free(body);
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    size_t frames = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    size_t sizes[] = { 16, 256, 4096 };
+
+    printf("%zu frames per run, ns per frame\n\n", frames);
+    printf("%7s %10s %10s %10s %10s %10s\n", "body", "old write", "wr_msg", "batch 64", "old read", "reader");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t len = sizes[i];
+        printf("%7zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", len, writeFrames(OLD_WRITE, frames, len),
+               writeFrames(NEW_WRITE, frames, len), writeFrames(NEW_BATCH, frames, len), readFrames(1, frames, len),
+               readFrames(0, frames, len));
+    }
+    return 0;
+}
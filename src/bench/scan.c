@@ -0,0 +1,87 @@
+// Time per RMSEND body, "room\r\n" and a message of ASCII or of é's, split
+// the way the handlers used to (copy, strtok_r at "\r\n", strlen of the
+// message, no checks at all) and through each path of petr_scan_fields:
+// scalar, SSE2 and AVX2, the last where the CPU has it.
+//
+// usage: bench_scan [BYTES]
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef int (*scanFn)(char *body, uint32_t len, petr_span *fields, int max);
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int oldSplit(char *body, uint32_t len, petr_span *fields, int max) {
+    char *copy = malloc(len), *save;
+    memcpy(copy, body, len);
+    char *room = strtok_r(copy, "\r\n", &save);
+    char *msg = strtok_r(NULL, "\r\n", &save);
+    int n = room != NULL && msg != NULL ? (int)strlen(msg) : -1;
+    free(copy);
+    return n;
+}
+
+// A body of len bytes, its terminator included.
+static char *body(uint32_t len, int utf8) {
+    char *b = malloc(len);
+    if (b == NULL) {
+        printf("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(b, "room\r\n", 6);
+    for (uint32_t i = 6; i + 1 < len; i++)
+        b[i] = utf8 ? "\xc3\xa9"[i % 2] : 'a' + i % 26;
+    if (utf8 && len % 2 == 0)
+        b[len - 2] = 'a';  // no é cut in half by the terminator
+    b[len - 1] = '\0';
+    return b;
+}
+
+static double time1(scanFn fn, char *b, uint32_t len, long *sum) {
+    petr_span fields[2];
+    size_t reps = 200000000 / (len + 100);
+    double start = nowNs();
+    for (size_t i = 0; i < reps; i++)
+        *sum += fn(b, len, fields, 2);
+    return (nowNs() - start) / reps;
+}
+
+static void run(uint32_t len, int utf8, long *sum) {
+    char *b = body(len, utf8);
+    petr_span fields[2];
+    if (petr_scan_fields_scalar(b, len, fields, 2) != 2) {
+        printf("Body did not scan\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("%6s %7u %8.0f %8.0f %8.0f %8.0f\n", utf8 ? "utf8" : "ascii", len, time1(oldSplit, b, len, sum),
+           time1(petr_scan_fields_scalar, b, len, sum), time1(petr_scan_fields_sse2, b, len, sum),
+           time1(petr_scan_fields, b, len, sum));
+    free(b);
+}
+
+int main(int argc, char *argv[]) {
+    long sum = 0;
+    printf("ns per body%s\n\n", __builtin_cpu_supports("avx2") ? "" : ", no AVX2 here: the avx2 column is SSE2");
+    printf("%6s %7s %8s %8s %8s %8s\n", "body", "bytes", "old", "scalar", "sse2", "avx2");
+    if (argc > 1) {
+        uint32_t len = strtoul(argv[1], NULL, 10);
+        if (len < 8) {
+            fprintf(stderr, "usage: %s [BYTES], 8 or more\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        run(len, 0, &sum);
+        run(len, 1, &sum);
+        return sum == 0;
+    }
+    for (int utf8 = 0; utf8 < 2; utf8++)
+        for (uint32_t len = 32; len <= 65536; len *= 8)
+            run(len, utf8, &sum);
+    return sum == 0;
+}
@@ -0,0 +1,212 @@
+#include "petr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// petr_bot: N sessions on one libpetr loop. The first creates the room,
+// the rest join it once it exists, then each sends its messages without
+// waiting for replies. Direct messages saying "ping" get "pong" back.
+// With -u the sessions connect over the server's Unix-domain socket, and
+// with -s as well they take their frames from shared memory.
+
+typedef struct {
+    petrSession *session;
+    char name[32];
+    int sent;
+    int acked;
+    int joined;
+    int done;
+} bot;
+
+static struct {
+    const char *room;
+    int sessions;
+    int messages;
+    bot *bots;
+    int loggedIn;
+    int joined;
+    int finished;
+    int failed;
+    unsigned long received;
+} run;
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The room closes when its creator logs out, so nobody leaves before
+// every bot has had all its messages answered.
+static void finish(bot *b) {
+    b->done = 1;
+    if (++run.finished < run.sessions)
+        return;
+    for (int i = 0; i < run.sessions; i++)
+        if (run.bots[i].session != NULL)
+            petrLogout(run.bots[i].session, NULL, NULL);
+}
+
+static void sent(petrSession *s, uint8_t type, const char *body, uint32_t len, void *arg) {
+    bot *b = arg;
+    if (type != OK) {
+        if (run.failed++ == 0)
+            fprintf(stderr, "%s: send refused (0x%x)\n", b->name, type);
+    }
+    if (++b->acked == run.messages)
+        finish(b);
+}
+
+static void sendAll(bot *b) {
+    char text[64];
+    for (; b->sent < run.messages; b->sent++) {
+        snprintf(text, sizeof(text), "%s says %d", b->name, b->sent);
+        petrRoomSend(b->session, run.room, text, sent, b);
+    }
+    if (run.messages == 0)
+        finish(b);
+}
+
+static void joined(petrSession *s, uint8_t type, const char *body, uint32_t len, void *arg) {
+    bot *b = arg;
+    if (type != OK && type != ERMEXISTS) {
+        fprintf(stderr, "%s: cannot join %s (0x%x)\n", b->name, run.room, type);
+        petrClose(s);
+        return;
+    }
+    b->joined = 1;
+    // everyone sends once everyone is in, so every message reaches all
+    if (++run.joined < run.sessions)
+        return;
+    for (int i = 0; i < run.sessions; i++)
+        if (run.bots[i].session != NULL)
+            sendAll(&run.bots[i]);
+}
+
+static void created(petrSession *s, uint8_t type, const char *body, uint32_t len, void *arg) {
+    joined(s, type, body, len, arg);
+    if (type != OK && type != ERMEXISTS)
+        return;
+    for (int i = 1; i < run.sessions; i++)
+        if (run.bots[i].session != NULL)
+            petrRoomJoin(run.bots[i].session, run.room, joined, &run.bots[i]);
+}
+
+static void onState(petrSession *s, petrState state, uint8_t error, void *arg) {
+    bot *b = arg;
+    switch (state) {
+    case PETR_LOGGED_IN:
+        // the room is created once every session is in
+        if (++run.loggedIn == run.sessions)
+            petrRoomCreate(run.bots[0].session, run.room, created, &run.bots[0]);
+        break;
+    case PETR_REJECTED:
+        fprintf(stderr, "%s: login refused (0x%x)\n", b->name, error);
+        break;
+    case PETR_CLOSED:
+        b->session = NULL;
+        if (!b->done) {
+            fprintf(stderr, "%s: connection closed\n", b->name);
+            finish(b);
+        }
+        break;
+    }
+}
+
+static void onMessage(petrSession *s, const petrMessage *m, void *arg) {
+    if (m->type == RMRECV) {
+        run.received++;
+        return;
+    }
+    if (m->type == USRRECV && strcmp(m->text, "ping") == 0)
+        petrUserSend(s, m->from, "pong", NULL, NULL);
+}
+
+static const petrHandlers handlers = { onState, onMessage };
+
+int main(int argc, char *argv[]) {
+    int opt;
+    run.room = "bots";
+    run.sessions = 10;
+    run.messages = 100;
+    const char *unixPath = NULL;
+    int shm = 0, batch = 0;
+
+    while ((opt = getopt(argc, argv, "hn:r:m:u:sb")) != -1) {
+        switch (opt) {
+        case 'n':
+            run.sessions = atoi(optarg);
+            break;
+        case 'r':
+            run.room = optarg;
+            break;
+        case 'm':
+            run.messages = atoi(optarg);
+            break;
+        case 'u':
+            unixPath = optarg;
+            break;
+        case 's':
+            shm = 1;
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr, "./bin/petr_bot [-h][-n SESSIONS][-r ROOM][-m MESSAGES][-b] HOST PORT | -u SOCKET_PATH [-s]\n");
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind + (unixPath == NULL ? 2 : 0) != argc || run.sessions < 1 || run.messages < 0 ||
+        (shm && unixPath == NULL)) {
+        fprintf(stderr, "./bin/petr_bot [-h][-n SESSIONS][-r ROOM][-m MESSAGES][-b] HOST PORT | -u SOCKET_PATH [-s]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *options[3] = { NULL };
+    int numOptions = 0;
+    if (shm)
+        options[numOptions++] = PETR_OPT_SHM;
+    if (batch)
+        options[numOptions++] = PETR_OPT_BATCH;
+
+    petrLoop *loop = petrLoopNew();
+    if (loop == NULL) {
+        perror("epoll");
+        exit(EXIT_FAILURE);
+    }
+    run.bots = calloc(run.sessions, sizeof(bot));
+    pid_t pid = getpid();
+    for (int i = 0; i < run.sessions; i++) {
+        bot *b = &run.bots[i];
+        snprintf(b->name, sizeof(b->name), "bot%d-%d", (int)pid, i);
+        if (unixPath != NULL)
+            b->session = petrConnectUnix(loop, unixPath, b->name, options, &handlers, b);
+        else
+            b->session = petrConnect(loop, argv[optind], atoi(argv[optind + 1]), b->name, options, &handlers, b);
+        if (b->session == NULL) {
+            if (unixPath != NULL)
+                fprintf(stderr, "Cannot connect to %s\n", unixPath);
+            else
+                fprintf(stderr, "Cannot connect to %s:%s\n", argv[optind], argv[optind + 1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double start = nowSeconds();
+    while (petrLoopRun(loop, 1000) > 0)
+        ;
+    double elapsed = nowSeconds() - start;
+
+    unsigned long sentTotal = (unsigned long)run.sessions * run.messages;
+    printf("%d sessions, %lu sent, %lu received, %d failed in %.3fs: %.0f sent/s, %.0f received/s\n",
+           run.sessions, sentTotal, run.received, run.failed, elapsed, sentTotal / elapsed,
+           run.received / elapsed);
+
+    petrLoopFree(loop);
+    free(run.bots);
+    return run.finished == run.sessions && run.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,10 +1,11 @@
-#include "chat.h"
 #include "debug.h"
 #include "protocol.h"
+#include <errno.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -13,16 +14,127 @@
 #define YELLOW "\x1B[1;33m"
 #define BLUE "\x1B[1;34m"
 
+#define RECV_CHUNK 65536  // read from the socket at a time, at least
+
+// Incoming records are "user\r\n" then the message up to and including its
+// '\0'. They are parsed where they were read; the buffer only grows for a
+// record bigger than it.
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t start;  // first byte not parsed yet
+    size_t end;    // one past the last byte read
+} chat_reader;
+
+// Everything rendered in one poll wakeup, written to stdout in one go.
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} chat_output;
+
+static void out_append(chat_output *out, const char *s, size_t len) {
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : RECV_CHUNK;
+        while (out->len + len > cap)
+            cap *= 2;
+        out->buf = realloc(out->buf, cap);
+        if (out->buf == NULL) {
+            fatal("Out of memory\n");
+        }
+        out->cap = cap;
+    }
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+static void out_flush(chat_output *out) {
+    size_t done = 0;
+    while (done < out->len) {
+        ssize_t n = write(STDOUT_FILENO, out->buf + done, out->len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write error");
+            break;
+        }
+        done += n;
+    }
+    out->len = 0;
+}
+
 // you can customize this print here!
-void print_username(char *name) {
-    printf(YELLOW "%s" KNRM, name);
-    fflush(stdout);
+void print_username(chat_output *out, const char *name, size_t len) {
+    out_append(out, YELLOW, strlen(YELLOW));
+    out_append(out, name, len);
+    out_append(out, KNRM, strlen(KNRM));
 }
 
 // you can customize this print here!
-void print_msg(char *msg) {
-    printf(BLUE "%s" KNRM, msg);
-    fflush(stdout);
+void print_msg(chat_output *out, const char *msg, size_t len) {
+    out_append(out, BLUE, strlen(BLUE));
+    out_append(out, msg, len);
+    out_append(out, KNRM, strlen(KNRM));
+}
+
+// Read whatever the socket has, up to the free space left (making at least
+// a quarter chunk of room first). Returns what read() does.
+static ssize_t reader_fill(chat_reader *r, int fd) {
+    if (r->cap - r->end < RECV_CHUNK / 4) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        if (r->cap - r->end < RECV_CHUNK / 4) {
+            size_t cap = r->cap ? r->cap * 2 : RECV_CHUNK;
+            r->buf = realloc(r->buf, cap);
+            if (r->buf == NULL) {
+                fatal("Out of memory\n");
+            }
+            r->cap = cap;
+        }
+    }
+
+    ssize_t n;
+    do {
+        n = read(fd, r->buf + r->end, r->cap - r->end);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        r->end += n;
+    return n;
+}
+
+// Render every complete record in the buffer; a partial one waits for more.
+static void reader_render(chat_reader *r, chat_output *out) {
+    while (r->start < r->end) {
+        char *record = r->buf + r->start;
+        size_t avail = r->end - r->start;
+
+        char *newline = memchr(record, '\n', avail);
+        if (newline == NULL)
+            break;
+        char *msg = newline + 1;
+        char *nul = memchr(msg, '\0', record + avail - msg);
+        if (nul == NULL)
+            break;
+
+        // the name keeps its \r\n, as the protocol sends it
+        print_username(out, record, msg - record);
+        print_msg(out, msg, nul - msg);
+        r->start += nul + 1 - record;
+    }
+    if (r->start == r->end)
+        r->start = r->end = 0;
+}
+
+// close everything but stay open, the parent decides when we go
+static void hang_up(int sockfd) {
+    close(STDIN_FILENO);
+    close(sockfd);
+    // go to sleep forever
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigsuspend(&mask);
+    exit(1);
 }
 
 int main(int argc, char *argv[]) {
@@ -39,6 +151,9 @@ int main(int argc, char *argv[]) {
     fds[1].fd = sockfd;
     fds[1].events = POLLIN;    
 
+    chat_reader reader = { NULL, 0, 0, 0 };
+    chat_output out = { NULL, 0, 0 };
+
     while (1) {
         // poll on the two descriptors we care about until some event occurs (no timing out)
         int ret = poll(fds, 2, -1);
@@ -49,15 +164,8 @@ int main(int argc, char *argv[]) {
         // we have to loop over all the descriptors to find which one had the event
         for (int i = 0; i < 2; i++) {
             // if the file descriptor encountered an error or a hangup, close everything but stay open
-            if (fds[i].revents & POLLERR || fds[i].revents & POLLHUP) {
-                close(STDIN_FILENO);
-                close(sockfd);
-                // go to sleep forever
-                sigset_t mask;
-                sigemptyset(&mask);
-                sigsuspend(&mask);
-                exit(1);
-            }
+            if (fds[i].revents & POLLERR || fds[i].revents & POLLHUP)
+                hang_up(sockfd);
             if (fds[i].revents & POLLIN && fds[i].fd == STDIN_FILENO) {
                 char *buf = NULL;
                 size_t n = 0;
@@ -74,31 +182,19 @@ int main(int argc, char *argv[]) {
                 free(buf);
             }
             if (fds[i].revents & POLLIN && fds[i].fd == sockfd) {
-                // first get the user
-                char *from_user = NULL;
-                size_t n = 0;
-                ssize_t len = getdelimfd(&from_user, &n, '\n', sockfd);
-                if (len < 0) {
-                    perror("getdelimfd error");
-                    fatal("Unexpected getdelimfd failure.\n");
-                }
-                // the from_user string will have \r\n in it if the protocol
-                // is implemented correctly
-                print_username(from_user);
-                free(from_user);
-                // then get the rest of message
-                char *msg = NULL;
-                len = getdelimfd(&msg, &n, '\0', sockfd);
+                // take everything the socket has in one read and parse it in place
+                ssize_t len = reader_fill(&reader, sockfd);
                 if (len < 0) {
-                    perror("getdelimfd error");
-                    fatal("Unexpected getdelimfd failure.\n");
+                    perror("read error");
+                    fatal("Unexpected read failure.\n");
                 }
-                // the msg string will have a null terminator if the protocol
-                // is implemented correctly
-                print_msg(msg);
-                free(msg);
+                if (len == 0)
+                    hang_up(sockfd);
+                reader_render(&reader, &out);
             }
         }
+        // one write for everything that arrived this wakeup
+        out_flush(&out);
     }
     return EXIT_SUCCESS;
 }
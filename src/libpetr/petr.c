@@ -0,0 +1,722 @@
+#include "petr.h"
+#include "compress.h"
+#include "ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define RECV_CHUNK 65536
+#define EPOLL_BATCH 256
+
+typedef enum { SESSION_CONNECTING, SESSION_LOGGING_IN, SESSION_READY, SESSION_CLOSED } sessionState;
+
+// A command waiting for its reply.
+typedef struct {
+    petrReplyFn done;
+    void *arg;
+    uint8_t type;
+} pendingReply;
+
+typedef struct {
+    char *buf;
+    size_t start;  // first byte not consumed (read) or not written (write)
+    size_t end;
+    size_t cap;
+} byteBuffer;
+
+// What an epoll event is for: a session's socket or its ring's doorbell.
+typedef struct {
+    petrSession *session;
+    int doorbell;
+} watchTag;
+
+struct petrSession {
+    petrLoop *loop;
+    int fd;
+    watchTag sockTag;
+    sessionState state;
+    char *username;
+    const petrHandlers *handlers;
+    void *arg;
+
+    byteBuffer in;
+    byteBuffer out;
+    int wantWrite;  // EPOLLOUT is registered
+
+    // Frames from a ring granted at LOGIN, see ring.h. They are parsed
+    // apart from the socket's, so heartbeats cannot split one.
+    int wantRing;      // PETR_OPT_SHM was asked for
+    size_t ringLen;    // bytes mapped, 0 without a ring
+    petr_ring_end ring;
+    int doorbell;
+    watchTag bellTag;
+    byteBuffer ringIn;
+
+    pendingReply *pending;  // ring, first in first out
+    size_t pendingHead;
+    size_t pendingCount;
+    size_t pendingCap;
+
+    petrSession *nextDirty;  // has frames queued since the last flush
+    int dirty;
+    petrSession *nextClosed;
+    petrSession *prev, *next;  // every session of the loop, open or closed
+};
+
+struct petrLoop {
+    int epfd;
+    int open;
+    petrSession *sessions;
+    petrSession *dirty;
+    petrSession *closed;  // freed at the end of the iteration that closed them
+};
+
+static int reserve(byteBuffer *b, size_t len) {
+    if (b->cap - b->end >= len)
+        return 0;
+
+    // slide what is left to the front before growing
+    if (b->start > 0) {
+        memmove(b->buf, b->buf + b->start, b->end - b->start);
+        b->end -= b->start;
+        b->start = 0;
+        if (b->cap - b->end >= len)
+            return 0;
+    }
+
+    size_t cap = b->cap ? b->cap : RECV_CHUNK;
+    while (cap - b->end < len)
+        cap *= 2;
+    char *buf = realloc(b->buf, cap);
+    if (buf == NULL)
+        return -1;
+    b->buf = buf;
+    b->cap = cap;
+    return 0;
+}
+
+petrLoop *petrLoopNew(void) {
+    petrLoop *loop = calloc(1, sizeof(petrLoop));
+    if (loop == NULL)
+        return NULL;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+static void sessionFree(petrSession *s) {
+    petrLoop *loop = s->loop;
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        loop->sessions = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+
+    free(s->username);
+    free(s->in.buf);
+    free(s->ringIn.buf);
+    free(s->out.buf);
+    free(s->pending);
+    free(s);
+}
+
+static void sessionShut(petrSession *s) {
+    if (s->state == SESSION_CLOSED)
+        return;
+
+    epoll_ctl(s->loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    if (s->ringLen > 0) {
+        epoll_ctl(s->loop->epfd, EPOLL_CTL_DEL, s->doorbell, NULL);
+        close(s->doorbell);
+        munmap(s->ring.shared, s->ringLen);
+        s->ringLen = 0;
+    }
+    s->state = SESSION_CLOSED;
+    s->loop->open--;
+}
+
+void petrLoopFree(petrLoop *loop) {
+    while (loop->sessions != NULL) {
+        sessionShut(loop->sessions);
+        sessionFree(loop->sessions);
+    }
+    close(loop->epfd);
+    free(loop);
+}
+
+// Close for good and tell the owner; the memory goes at the end of the
+// loop iteration, since the caller may still be inside a callback for it.
+static void sessionClose(petrSession *s) {
+    if (s->state == SESSION_CLOSED)
+        return;
+
+    sessionShut(s);
+    if (s->handlers->onState != NULL)
+        s->handlers->onState(s, PETR_CLOSED, 0, s->arg);
+    s->nextClosed = s->loop->closed;
+    s->loop->closed = s;
+}
+
+void petrClose(petrSession *s) {
+    sessionClose(s);
+}
+
+const char *petrUsername(const petrSession *s) {
+    return s->username;
+}
+
+static void watch(petrSession *s, int write) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (write ? EPOLLOUT : 0);
+    ev.data.ptr = &s->sockTag;
+    epoll_ctl(s->loop->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    s->wantWrite = write;
+}
+
+static void markDirty(petrSession *s) {
+    if (s->dirty)
+        return;
+    s->dirty = 1;
+    s->nextDirty = s->loop->dirty;
+    s->loop->dirty = s;
+}
+
+// Write as much of the queued frames as the socket takes; EPOLLOUT is
+// only asked for while some are left.
+static void flush(petrSession *s) {
+    while (s->out.start < s->out.end) {
+        ssize_t n = send(s->fd, s->out.buf + s->out.start, s->out.end - s->out.start, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            sessionClose(s);
+            return;
+        }
+        s->out.start += n;
+    }
+
+    if (s->out.start == s->out.end)
+        s->out.start = s->out.end = 0;
+    int write = s->out.end > 0;
+    if (write != s->wantWrite)
+        watch(s, write);
+}
+
+static int queueFrame(petrSession *s, uint8_t type, const struct iovec *body, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += body[i].iov_len;
+    if (reserve(&s->out, PETR_HEADER_SIZE + len) < 0)
+        return -1;
+
+    petr_header header = { len, type };
+    petr_header_pack(&header, (uint8_t *)s->out.buf + s->out.end);
+    s->out.end += PETR_HEADER_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(s->out.buf + s->out.end, body[i].iov_base, body[i].iov_len);
+        s->out.end += body[i].iov_len;
+    }
+
+    if (s->state != SESSION_CONNECTING)
+        markDirty(s);
+    return 0;
+}
+
+static int pushPending(petrSession *s, uint8_t type, petrReplyFn done, void *arg) {
+    if (s->pendingCount == s->pendingCap) {
+        size_t cap = s->pendingCap ? s->pendingCap * 2 : 16;
+        pendingReply *ring = malloc(cap * sizeof(pendingReply));
+        if (ring == NULL)
+            return -1;
+        for (size_t i = 0; i < s->pendingCount; i++)
+            ring[i] = s->pending[(s->pendingHead + i) % s->pendingCap];
+        free(s->pending);
+        s->pending = ring;
+        s->pendingHead = 0;
+        s->pendingCap = cap;
+    }
+    s->pending[(s->pendingHead + s->pendingCount) % s->pendingCap] = (pendingReply){ done, arg, type };
+    s->pendingCount++;
+    return 0;
+}
+
+static int commandv(petrSession *s, uint8_t type, const struct iovec *body, int iovcnt, petrReplyFn done,
+                    void *arg) {
+    if (s->state == SESSION_CLOSED)
+        return -1;
+    if (pushPending(s, type, done, arg) < 0)
+        return -1;
+    if (queueFrame(s, type, body, iovcnt) < 0) {
+        s->pendingCount--;
+        return -1;
+    }
+    return 0;
+}
+
+int petrCommand(petrSession *s, uint8_t type, const char *body, uint32_t len, petrReplyFn done, void *arg) {
+    struct iovec piece = { (void *)body, len };
+    return commandv(s, type, &piece, body == NULL ? 0 : 1, done, arg);
+}
+
+static int nameCommand(petrSession *s, uint8_t type, const char *name, petrReplyFn done, void *arg) {
+    return petrCommand(s, type, name, strlen(name) + 1, done, arg);
+}
+
+// "target\r\ntext\0", as RMSEND and USRSEND take it.
+static int sendCommand(petrSession *s, uint8_t type, const char *target, const char *text, petrReplyFn done,
+                       void *arg) {
+    struct iovec pieces[3] = {
+        { (void *)target, strlen(target) },
+        { "\r\n", 2 },
+        { (void *)text, strlen(text) + 1 },
+    };
+    return commandv(s, type, pieces, 3, done, arg);
+}
+
+int petrRoomCreate(petrSession *s, const char *room, petrReplyFn done, void *arg) {
+    return nameCommand(s, RMCREATE, room, done, arg);
+}
+
+int petrRoomDelete(petrSession *s, const char *room, petrReplyFn done, void *arg) {
+    return nameCommand(s, RMDELETE, room, done, arg);
+}
+
+int petrRoomJoin(petrSession *s, const char *room, petrReplyFn done, void *arg) {
+    return nameCommand(s, RMJOIN, room, done, arg);
+}
+
+int petrRoomLeave(petrSession *s, const char *room, petrReplyFn done, void *arg) {
+    return nameCommand(s, RMLEAVE, room, done, arg);
+}
+
+int petrRoomSend(petrSession *s, const char *room, const char *text, petrReplyFn done, void *arg) {
+    return sendCommand(s, RMSEND, room, text, done, arg);
+}
+
+int petrRoomList(petrSession *s, petrReplyFn done, void *arg) {
+    return petrCommand(s, RMLIST, NULL, 0, done, arg);
+}
+
+int petrUserSend(petrSession *s, const char *to, const char *text, petrReplyFn done, void *arg) {
+    return sendCommand(s, USRSEND, to, text, done, arg);
+}
+
+int petrUserList(petrSession *s, petrReplyFn done, void *arg) {
+    return petrCommand(s, USRLIST, NULL, 0, done, arg);
+}
+
+int petrLogout(petrSession *s, petrReplyFn done, void *arg) {
+    return petrCommand(s, LOGOUT, NULL, 0, done, arg);
+}
+
+// Log in over a connected (or connecting) socket fd, which is the
+// session's from here on even if this fails.
+static petrSession *sessionStart(petrLoop *loop, int fd, const char *username, const char **options,
+                                 const petrHandlers *handlers, void *arg) {
+    petrSession *s = calloc(1, sizeof(petrSession));
+    if (s == NULL || (s->username = strdup(username)) == NULL) {
+        free(s);
+        close(fd);
+        return NULL;
+    }
+    s->loop = loop;
+    s->fd = fd;
+    s->state = SESSION_CONNECTING;
+    s->handlers = handlers;
+    s->arg = arg;
+    s->sockTag = (watchTag){ s, 0 };
+    s->bellTag = (watchTag){ s, 1 };
+    s->doorbell = -1;
+
+    // LOGIN goes first in the output, whatever is queued behind it
+    struct iovec login[16];
+    int count = 0;
+    login[count++] = (struct iovec){ (void *)username, strlen(username) + 1 };
+    for (int i = 0; options != NULL && options[i] != NULL && count < 16; i++) {
+        login[count++] = (struct iovec){ (void *)options[i], strlen(options[i]) + 1 };
+        s->wantRing |= strcmp(options[i], PETR_OPT_SHM) == 0;
+    }
+    if (queueFrame(s, LOGIN, login, count) < 0) {
+        free(s->username);
+        free(s);
+        close(fd);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+    ev.data.ptr = &s->sockTag;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+    s->wantWrite = 1;
+
+    s->next = loop->sessions;
+    if (loop->sessions != NULL)
+        loop->sessions->prev = s;
+    loop->sessions = s;
+    loop->open++;
+    return s;
+}
+
+petrSession *petrConnect(petrLoop *loop, const char *host, int port, const char *username,
+                         const char **options, const petrHandlers *handlers, void *arg) {
+    char service[16];
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &addrs) != 0)
+        return NULL;
+
+    int fd = socket(addrs->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        freeaddrinfo(addrs);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int ret = connect(fd, addrs->ai_addr, addrs->ai_addrlen);
+    freeaddrinfo(addrs);
+    if (ret < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+    return sessionStart(loop, fd, username, options, handlers, arg);
+}
+
+petrSession *petrConnectUnix(petrLoop *loop, const char *path, const char *username, const char **options,
+                             const petrHandlers *handlers, void *arg) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    // a Unix-domain connect never waits: it is made or refused
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    return sessionStart(loop, fd, username, options, handlers, arg);
+}
+
+// Split an unasked frame into its fields, in place. body ends in its '\0'.
+static void deliver(petrSession *s, uint8_t type, char *body, size_t len) {
+    petrMessage m = { type, NULL, NULL, NULL };
+    char *save;
+
+    if (len == 0 || body[len - 1] != '\0' || s->handlers->onMessage == NULL)
+        return;
+
+    switch (type) {
+    case RMRECV:
+        m.room = strtok_r(body, "\r\n", &save);
+        m.from = strtok_r(NULL, "\r\n", &save);
+        m.text = save + 1;
+        break;
+    case USRRECV:
+        m.from = strtok_r(body, "\r\n", &save);
+        m.text = save + 1;
+        break;
+    case RMCLOSED:
+        m.room = body;
+        break;
+    default:
+        return;
+    }
+    if ((type != USRRECV && m.room == NULL) || (type != RMCLOSED && m.from == NULL))
+        return;
+    if (m.text != NULL && m.text > body + len - 1)
+        m.text = body + len - 1;
+    s->handlers->onMessage(s, &m, s->arg);
+}
+
+static void dispatch(petrSession *s, uint8_t type, char *body, uint32_t len) {
+    switch (type) {
+    case HEARTBEAT:
+        return;
+    case RMRECV:
+    case USRRECV:
+    case RMCLOSED:
+        deliver(s, type, body, len);
+        return;
+    case RMRECVZ:
+    case USRRECVZ: {
+        size_t plainLen;
+        char *plain = petr_decompress_msg(body, len, &plainLen);
+        if (plain == NULL) {
+            sessionClose(s);
+            return;
+        }
+        deliver(s, type == RMRECVZ ? RMRECV : USRRECV, plain, plainLen);
+        free(plain);
+        return;
+    }
+    case RMRECVB:
+        // the room messages of a batch, each a whole frame of its own
+        for (uint32_t at = 0; at < len && s->state != SESSION_CLOSED;) {
+            petr_header inner;
+            if (len - at < PETR_HEADER_SIZE) {
+                sessionClose(s);
+                return;
+            }
+            petr_header_unpack((uint8_t *)body + at, &inner);
+            at += PETR_HEADER_SIZE;
+            if ((inner.msg_type != RMRECV && inner.msg_type != RMRECVZ) || inner.msg_len > len - at) {
+                sessionClose(s);
+                return;
+            }
+            dispatch(s, inner.msg_type, body + at, inner.msg_len);
+            at += inner.msg_len;
+        }
+        return;
+    default:
+        break;
+    }
+
+    if (s->state == SESSION_LOGGING_IN) {
+        if (type != OK) {
+            if (s->handlers->onState != NULL)
+                s->handlers->onState(s, PETR_REJECTED, type, s->arg);
+            sessionClose(s);
+            return;
+        }
+        s->state = SESSION_READY;
+        if (s->handlers->onState != NULL)
+            s->handlers->onState(s, PETR_LOGGED_IN, OK, s->arg);
+        return;
+    }
+
+    if (s->pendingCount == 0)
+        return;
+    pendingReply reply = s->pending[s->pendingHead];
+    s->pendingHead = (s->pendingHead + 1) % s->pendingCap;
+    s->pendingCount--;
+    if (reply.done != NULL)
+        reply.done(s, type, body, len, reply.arg);
+    // the server waits for the client to hang up after a LOGOUT
+    if (reply.type == LOGOUT)
+        sessionClose(s);
+}
+
+// Dispatch every whole frame in b, leaving room for the rest of a part one.
+static void consume(petrSession *s, byteBuffer *b) {
+    while (s->state != SESSION_CLOSED && b->end - b->start >= PETR_HEADER_SIZE) {
+        petr_header header;
+        petr_header_unpack((uint8_t *)b->buf + b->start, &header);
+        if (header.msg_len > PETR_MAX_FRAME) {
+            sessionClose(s);
+            return;
+        }
+        if (b->end - b->start < PETR_HEADER_SIZE + header.msg_len) {
+            // make sure the rest of the frame fits on the next read
+            if (reserve(b, PETR_HEADER_SIZE + header.msg_len) < 0)
+                sessionClose(s);
+            return;
+        }
+        char *body = b->buf + b->start + PETR_HEADER_SIZE;
+        b->start += PETR_HEADER_SIZE + header.msg_len;
+        dispatch(s, header.msg_type, body, header.msg_len);
+    }
+    if (b->start == b->end)
+        b->start = b->end = 0;
+}
+
+// Read everything in the ring, then arm the doorbell. Frames are written
+// whole, so this never stops partway through one.
+static void drainRing(petrSession *s) {
+    uint64_t rings;
+    if (read(s->doorbell, &rings, sizeof(rings)) < 0 && errno != EAGAIN) {
+        sessionClose(s);
+        return;
+    }
+
+    while (s->state != SESSION_CLOSED && s->ringLen > 0) {
+        if (reserve(&s->ringIn, RECV_CHUNK / 4) < 0) {
+            sessionClose(s);
+            return;
+        }
+        ssize_t n = petr_ring_read(&s->ring, s->ringIn.buf + s->ringIn.end, s->ringIn.cap - s->ringIn.end);
+        if (n < 0) {
+            sessionClose(s);
+            return;
+        }
+        if (n == 0) {
+            if (petr_ring_sleep(&s->ring) == 0)
+                return;
+            continue;
+        }
+        s->ringIn.end += n;
+        consume(s, &s->ringIn);
+    }
+}
+
+// Map the ring the server granted with its OK and watch its doorbell.
+static int attachRing(petrSession *s, int memfd, int doorbell) {
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(memfd, &st) == 0 && st.st_size >= PETR_RING_DATA)
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (map == MAP_FAILED || petr_ring_attach(&s->ring, map, st.st_size) < 0) {
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        close(doorbell);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &s->bellTag;
+    if (epoll_ctl(s->loop->epfd, EPOLL_CTL_ADD, doorbell, &ev) < 0) {
+        munmap(map, st.st_size);
+        close(doorbell);
+        return -1;
+    }
+    s->ringLen = st.st_size;
+    s->doorbell = doorbell;
+    return 0;
+}
+
+// recv, taking the descriptors a ring grant carries.
+static ssize_t recvGrant(petrSession *s, char *buf, size_t len) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(s->fd, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        return n;
+
+    int fds[2];
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), (count < 2 ? count : 2) * sizeof(int));
+    if (count != 2 || s->ringLen > 0 || attachRing(s, fds[0], fds[1]) < 0) {
+        for (size_t i = 0; i < count && i < 2; i++)
+            close(fds[i]);
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
+// Read what the socket has and dispatch every whole frame in it.
+static void receive(petrSession *s) {
+    while (s->state != SESSION_CLOSED) {
+        if (reserve(&s->in, RECV_CHUNK / 4) < 0) {
+            sessionClose(s);
+            return;
+        }
+        char *buf = s->in.buf + s->in.end;
+        size_t len = s->in.cap - s->in.end;
+        int granting = s->wantRing && s->ringLen == 0;
+        ssize_t n = granting ? recvGrant(s, buf, len) : recv(s->fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            sessionClose(s);
+            return;
+        }
+        s->in.end += n;
+        consume(s, &s->in);
+
+        // replies to commands pipelined behind LOGIN may already be waiting
+        if (granting && s->ringLen > 0)
+            drainRing(s);
+    }
+}
+
+static void connected(petrSession *s) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        sessionClose(s);
+        return;
+    }
+    s->state = SESSION_LOGGING_IN;
+    flush(s);
+}
+
+// Everything a session queued since its last flush goes out in one write.
+static void flushDirty(petrLoop *loop) {
+    while (loop->dirty != NULL) {
+        petrSession *s = loop->dirty;
+        loop->dirty = s->nextDirty;
+        s->dirty = 0;
+        if (s->state != SESSION_CLOSED && s->state != SESSION_CONNECTING)
+            flush(s);
+    }
+}
+
+int petrLoopRun(petrLoop *loop, int timeoutMs) {
+    struct epoll_event events[EPOLL_BATCH];
+
+    // frames queued between iterations, outside any callback
+    flushDirty(loop);
+
+    int n = epoll_wait(loop->epfd, events, EPOLL_BATCH, loop->open > 0 ? timeoutMs : 0);
+    if (n < 0 && errno != EINTR)
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        watchTag *tag = events[i].data.ptr;
+        petrSession *s = tag->session;
+        if (s->state == SESSION_CLOSED)
+            continue;
+        if (tag->doorbell) {
+            drainRing(s);
+            continue;
+        }
+        if (s->state == SESSION_CONNECTING) {
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                connected(s);
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            receive(s);
+        if (s->state != SESSION_CLOSED && (events[i].events & EPOLLOUT))
+            flush(s);
+    }
+
+    // replies the callbacks queued leave before the next wait
+    flushDirty(loop);
+    while (loop->closed != NULL) {
+        petrSession *s = loop->closed;
+        loop->closed = s->nextClosed;
+        sessionFree(s);
+    }
+    return loop->open;
+}
@@ -0,0 +1,32 @@
+#include "capture.h"
+
+static void put32(uint8_t *out, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        out[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint32_t get32(const uint8_t *in) {
+    return (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+void petr_capture_header_pack(uint8_t *out) {
+    put32(out, PETR_CAPTURE_MAGIC);
+    put32(out + 4, PETR_CAPTURE_VERSION);
+}
+
+int petr_capture_header_check(const uint8_t *in) {
+    return get32(in) == PETR_CAPTURE_MAGIC && get32(in + 4) == PETR_CAPTURE_VERSION ? 0 : -1;
+}
+
+void petr_capture_record_pack(const petr_capture_record *r, uint8_t *out) {
+    put32(out, r->time & 0xffffffff);
+    put32(out + 4, r->time >> 32);
+    put32(out + 8, r->conn);
+    put32(out + 12, r->len);
+}
+
+void petr_capture_record_unpack(const uint8_t *in, petr_capture_record *r) {
+    r->time = (uint64_t)get32(in) | (uint64_t)get32(in + 4) << 32;
+    r->conn = get32(in + 8);
+    r->len = get32(in + 12);
+}
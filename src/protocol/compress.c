@@ -0,0 +1,214 @@
+#include "compress.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // the block must end in at least this many literals
+#define MF_LIMIT 12      // and no match may start closer than this to the end
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Write a 4-bit length field's overflow as a run of 255s and a final byte.
+static char *writeLength(char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = (char)255;
+        len -= 255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+size_t petr_compress_bound(size_t srcLen) {
+    return srcLen + srcLen / 255 + 16;
+}
+
+static char *emitSequence(char *op, char *dstEnd, const char *literals, size_t litLen, size_t offset, size_t matchLen) {
+    if (op + 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1 > dstEnd)
+        return NULL;
+
+    char *token = op++;
+    if (litLen >= 15) {
+        *token = (char)(15 << 4);
+        op = writeLength(op, litLen - 15);
+    } else {
+        *token = (char)(litLen << 4);
+    }
+    memcpy(op, literals, litLen);
+    op += litLen;
+
+    // the final sequence carries literals only
+    if (matchLen == 0)
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = (offset >> 8) & 0xff;
+
+    matchLen -= MIN_MATCH;
+    if (matchLen >= 15) {
+        *token |= 15;
+        op = writeLength(op, matchLen - 15);
+    } else {
+        *token |= matchLen;
+    }
+    return op;
+}
+
+int petr_compress(const char *src, size_t srcLen, char *dst, size_t dstCap) {
+    uint32_t table[1 << HASH_LOG];
+    char *op = dst;
+    char *dstEnd = dst + dstCap;
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (srcLen > MF_LIMIT) {
+        while (ip < srcLen - MF_LIMIT) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            // table holds position + 1 so that 0 means empty
+            size_t ref = table[h];
+            table[h] = ip + 1;
+
+            if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+
+            size_t matchLen = MIN_MATCH;
+            while (ip + matchLen < srcLen - LAST_LITERALS && src[ref + matchLen] == src[ip + matchLen])
+                matchLen++;
+
+            op = emitSequence(op, dstEnd, src + anchor, ip - anchor, ip - ref, matchLen);
+            if (op == NULL)
+                return -1;
+
+            ip += matchLen;
+            anchor = ip;
+        }
+    }
+
+    op = emitSequence(op, dstEnd, src + anchor, srcLen - anchor, 0, 0);
+    if (op == NULL)
+        return -1;
+    return op - dst;
+}
+
+// Read a 4-bit length field's overflow bytes. Returns -1 past the end of src.
+static int readLength(const char *src, size_t srcLen, size_t *ip, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= srcLen)
+            return -1;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int petr_decompress(const char *src, size_t srcLen, char *dst, size_t dstLen) {
+    size_t ip = 0, op = 0;
+
+    while (ip < srcLen) {
+        unsigned char token = src[ip++];
+
+        size_t litLen = token >> 4;
+        if (litLen == 15 && readLength(src, srcLen, &ip, &litLen) < 0)
+            return -1;
+        if (litLen > srcLen - ip || litLen > dstLen - op)
+            return -1;
+        memcpy(dst + op, src + ip, litLen);
+        ip += litLen;
+        op += litLen;
+
+        if (ip == srcLen)
+            break;
+
+        if (srcLen - ip < 2)
+            return -1;
+        size_t offset = (unsigned char)src[ip] | (unsigned char)src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return -1;
+
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && readLength(src, srcLen, &ip, &matchLen) < 0)
+            return -1;
+        matchLen += MIN_MATCH;
+        if (matchLen > dstLen - op)
+            return -1;
+
+        // byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < matchLen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+
+    return op == dstLen ? (int)op : -1;
+}
+
+char *petr_compress_msg(const struct iovec *body, int iovcnt, size_t *outLen) {
+    size_t srcLen = 0;
+    for (int i = 0; i < iovcnt; i++)
+        srcLen += body[i].iov_len;
+    if (srcLen <= 8)
+        return NULL;
+
+    char *src = malloc(srcLen);
+    // only worth it if the result comes out smaller than the plain body
+    char *packed = malloc(4 + srcLen);
+    if (src == NULL || packed == NULL) {
+        free(src);
+        free(packed);
+        return NULL;
+    }
+
+    size_t offset = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(src + offset, body[i].iov_base, body[i].iov_len);
+        offset += body[i].iov_len;
+    }
+
+    int blockLen = petr_compress(src, srcLen, packed + 4, srcLen - 4);
+    free(src);
+    if (blockLen < 0) {
+        free(packed);
+        return NULL;
+    }
+
+    packed[0] = srcLen & 0xff;
+    packed[1] = (srcLen >> 8) & 0xff;
+    packed[2] = (srcLen >> 16) & 0xff;
+    packed[3] = (srcLen >> 24) & 0xff;
+    *outLen = 4 + blockLen;
+    return packed;
+}
+
+char *petr_decompress_msg(const char *body, size_t len, size_t *outLen) {
+    if (len < 4)
+        return NULL;
+
+    const unsigned char *p = (const unsigned char *)body;
+    size_t plainLen = (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24;
+
+    char *plain = malloc(plainLen ? plainLen : 1);
+    if (plain == NULL)
+        return NULL;
+
+    if (petr_decompress(body + 4, len - 4, plain, plainLen) < 0) {
+        free(plain);
+        return NULL;
+    }
+    *outLen = plainLen;
+    return plain;
+}
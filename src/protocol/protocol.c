@@ -0,0 +1,231 @@
+#include "protocol.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+void petr_header_pack(const petr_header *h, uint8_t *out) {
+    out[0] = h->msg_len & 0xff;
+    out[1] = (h->msg_len >> 8) & 0xff;
+    out[2] = (h->msg_len >> 16) & 0xff;
+    out[3] = (h->msg_len >> 24) & 0xff;
+    out[4] = h->msg_type;
+    out[5] = out[6] = out[7] = 0;
+}
+
+void petr_header_unpack(const uint8_t *in, petr_header *h) {
+    memset(h, 0, sizeof(*h));
+    h->msg_len = (uint32_t)in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+    h->msg_type = in[4];
+}
+
+void petr_reader_init(petr_reader *r, int socket_fd) {
+    r->fd = socket_fd;
+    r->start = r->end = 0;
+}
+
+// Make at least want bytes available in the buffer. Returns -1 on error or EOF.
+static int fill(petr_reader *r, size_t want) {
+    if (r->end - r->start >= want)
+        return 0;
+
+    if (r->start + want > PETR_READER_SIZE) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+
+    while (r->end - r->start < want) {
+        ssize_t received = recv(r->fd, r->buf + r->end, PETR_READER_SIZE - r->end, 0);
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            return -1;
+        }
+        if (received == 0)
+            return -1;
+        r->end += received;
+    }
+    return 0;
+}
+
+int rd_msgheader_buffered(petr_reader *r, petr_header *h) {
+    if (h == NULL || fill(r, PETR_HEADER_SIZE) < 0)
+        return -1;
+
+    petr_header_unpack(r->buf + r->start, h);
+    r->start += PETR_HEADER_SIZE;
+    return 0;
+}
+
+int rd_msgbody(petr_reader *r, char *msgbuf, size_t len) {
+    // drain what is already buffered, then read large bodies straight into msgbuf
+    size_t buffered = r->end - r->start;
+    size_t n = buffered < len ? buffered : len;
+    memcpy(msgbuf, r->buf + r->start, n);
+    r->start += n;
+
+    while (n < len) {
+        if (len - n < PETR_READER_SIZE / 2) {
+            if (fill(r, len - n) < 0)
+                return -1;
+            memcpy(msgbuf + n, r->buf + r->start, len - n);
+            r->start += len - n;
+            return 0;
+        }
+
+        ssize_t received = recv(r->fd, msgbuf + n, len - n, 0);
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            return -1;
+        }
+        if (received == 0)
+            return -1;
+        n += received;
+    }
+    return 0;
+}
+
+int rd_msgheader(int socket_fd, petr_header *h) {
+    if (h == NULL)
+        return -1;
+
+    uint8_t wire[PETR_HEADER_SIZE];
+    size_t n = 0;
+    while (n < PETR_HEADER_SIZE) {
+        ssize_t received = recv(socket_fd, wire + n, PETR_HEADER_SIZE - n, 0);
+        if (received < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            return -1;
+        }
+        if (received == 0)
+            return -1;
+        n += received;
+    }
+
+    petr_header_unpack(wire, h);
+    return 0;
+}
+
+int wr_iov(int socket_fd, struct iovec *iov, int iovcnt) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+
+    while (iovcnt > 0) {
+        message.msg_iov = iov;
+        message.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        ssize_t written = sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("sendmsg");
+            return -1;
+        }
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+ssize_t wr_iov_try(int socket_fd, const struct iovec *iov, int iovcnt) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = (struct iovec *)iov;
+    message.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+    for (;;) {
+        ssize_t written = sendmsg(socket_fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written >= 0)
+            return written;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINTR) {
+            perror("sendmsg");
+            return -1;
+        }
+    }
+}
+
+int wr_msg_try(int socket_fd, petr_header *h, char *msgbuf) {
+    uint8_t wire[PETR_HEADER_SIZE];
+    petr_header_pack(h, wire);
+    struct iovec iov[2] = { { wire, PETR_HEADER_SIZE }, { msgbuf, h->msg_len } };
+    ssize_t written = wr_iov_try(socket_fd, iov, msgbuf == NULL ? 1 : 2);
+    return written == (ssize_t)(PETR_HEADER_SIZE + (msgbuf == NULL ? 0 : h->msg_len)) ? 0 : -1;
+}
+
+int wr_msg(int socket_fd, petr_header *h, char *msgbuf) {
+    struct iovec body = { msgbuf, h->msg_len };
+    return wr_msgv(socket_fd, h, &body, msgbuf == NULL ? 0 : 1);
+}
+
+int wr_msgv(int socket_fd, petr_header *h, const struct iovec *body, int iovcnt) {
+    uint8_t wire[PETR_HEADER_SIZE];
+    struct iovec stackIov[8];
+    struct iovec *iov = stackIov;
+
+    if (iovcnt + 1 > 8) {
+        iov = malloc((iovcnt + 1) * sizeof(struct iovec));
+        if (iov == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    petr_header_pack(h, wire);
+    iov[0].iov_base = wire;
+    iov[0].iov_len = PETR_HEADER_SIZE;
+    memcpy(iov + 1, body, iovcnt * sizeof(struct iovec));
+
+    int ret = wr_iov(socket_fd, iov, iovcnt + 1);
+    if (iov != stackIov)
+        free(iov);
+    return ret;
+}
+
+int wr_msgbatch(int socket_fd, petr_header *hs, char **msgbufs, int count) {
+    uint8_t *wire = malloc(count * PETR_HEADER_SIZE);
+    struct iovec *iov = malloc(count * 2 * sizeof(struct iovec));
+    if (wire == NULL || iov == NULL) {
+        perror("malloc");
+        free(wire);
+        free(iov);
+        return -1;
+    }
+
+    int iovcnt = 0;
+    for (int i = 0; i < count; i++) {
+        petr_header_pack(&hs[i], wire + i * PETR_HEADER_SIZE);
+        iov[iovcnt].iov_base = wire + i * PETR_HEADER_SIZE;
+        iov[iovcnt++].iov_len = PETR_HEADER_SIZE;
+        if (msgbufs[i] != NULL && hs[i].msg_len > 0) {
+            iov[iovcnt].iov_base = msgbufs[i];
+            iov[iovcnt++].iov_len = hs[i].msg_len;
+        }
+    }
+
+    int ret = wr_iov(socket_fd, iov, iovcnt);
+    free(wire);
+    free(iov);
+    return ret;
+}
@@ -0,0 +1,86 @@
+#include "ring.h"
+#include <string.h>
+
+void petr_ring_init(petr_ring *r, uint32_t size) {
+    memset(r, 0, sizeof(*r));
+    r->magic = PETR_RING_MAGIC;
+    r->size = size;
+}
+
+int petr_ring_attach(petr_ring_end *end, petr_ring *r, size_t mapLen) {
+    if (mapLen < PETR_RING_DATA || r->magic != PETR_RING_MAGIC)
+        return -1;
+    uint32_t size = r->size;
+    if (size == 0 || (size & (size - 1)) != 0 || size > mapLen - PETR_RING_DATA)
+        return -1;
+
+    end->shared = r;
+    end->data = (char *)r + PETR_RING_DATA;
+    end->size = size;
+    // a ring is attached to fresh; the server may have written before the
+    // client attaches, but nothing has been read (a server taking one over
+    // sets its position itself)
+    end->pos = 0;
+    return 0;
+}
+
+int petr_ring_write(petr_ring_end *end, const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    uint64_t head = end->pos;
+    uint64_t used = head - __atomic_load_n(&end->shared->tail, __ATOMIC_ACQUIRE);
+    if (used > end->size || len > end->size)
+        return -1;
+    if (end->size - used < len)
+        return 1;
+
+    uint32_t mask = end->size - 1;
+    for (int i = 0; i < iovcnt; i++) {
+        const char *piece = iov[i].iov_base;
+        size_t at = head & mask;
+        size_t first = iov[i].iov_len < end->size - at ? iov[i].iov_len : end->size - at;
+        memcpy(end->data + at, piece, first);
+        memcpy(end->data, piece + first, iov[i].iov_len - first);
+        head += iov[i].iov_len;
+    }
+
+    end->pos = head;
+    // sequentially consistent so petr_ring_wake sees sleeping as the
+    // client set it before it looked at head
+    __atomic_store_n(&end->shared->head, head, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+int petr_ring_wake(petr_ring_end *end) {
+    if (__atomic_load_n(&end->shared->sleeping, __ATOMIC_SEQ_CST) == 0)
+        return 0;
+    return __atomic_exchange_n(&end->shared->sleeping, 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+ssize_t petr_ring_read(petr_ring_end *end, char *buf, size_t cap) {
+    uint64_t tail = end->pos;
+    uint64_t avail = __atomic_load_n(&end->shared->head, __ATOMIC_ACQUIRE) - tail;
+    if (avail > end->size)
+        return -1;
+    if (avail < cap)
+        cap = avail;
+
+    size_t at = tail & (end->size - 1);
+    size_t first = cap < end->size - at ? cap : end->size - at;
+    memcpy(buf, end->data + at, first);
+    memcpy(buf + first, end->data, cap - first);
+
+    end->pos = tail + cap;
+    __atomic_store_n(&end->shared->tail, end->pos, __ATOMIC_RELEASE);
+    return cap;
+}
+
+int petr_ring_sleep(petr_ring_end *end) {
+    __atomic_store_n(&end->shared->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&end->shared->head, __ATOMIC_SEQ_CST) == end->pos)
+        return 0;
+    __atomic_store_n(&end->shared->sleeping, 0, __ATOMIC_RELAXED);
+    return 1;
+}
@@ -0,0 +1,263 @@
+#include "scan.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+// How far up scan() may go; it takes the best the CPU has up to that.
+typedef enum { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 } scanPath;
+
+typedef struct {
+    char *body;
+    uint32_t end;  // where the terminator is
+    petr_span *fields;
+    int max;
+    int count;
+    uint32_t start;  // of the field being scanned
+} scanState;
+
+// A '\r' at at; it ends a field if a '\n' follows and fields are left.
+// at is before the terminator, so at + 1 is still in the body.
+static void separator(scanState *s, uint32_t at) {
+    if (s->count + 1 >= s->max || s->body[at + 1] != '\n')
+        return;
+    s->fields[s->count].ptr = s->body + s->start;
+    s->fields[s->count].len = at - s->start;
+    s->count++;
+    s->start = at + 2;
+}
+
+static void separators(scanState *s, uint32_t base, uint32_t mask) {
+    while (mask != 0 && s->count + 1 < s->max) {
+        separator(s, base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+}
+
+// Length of the well-formed multibyte UTF-8 sequence at p, or 0. Overlong
+// forms, surrogates and code points past U+10FFFF are malformed.
+static uint32_t utf8Length(const uint8_t *p, uint32_t avail) {
+    uint32_t n;
+    if (p[0] < 0xc2)
+        return 0;
+    else if (p[0] < 0xe0)
+        n = 2;
+    else if (p[0] < 0xf0)
+        n = 3;
+    else if (p[0] < 0xf5)
+        n = 4;
+    else
+        return 0;
+
+    if (avail < n)
+        return 0;
+    for (uint32_t i = 1; i < n; i++)
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+    if ((p[0] == 0xe0 && p[1] < 0xa0) || (p[0] == 0xed && p[1] >= 0xa0))
+        return 0;
+    if ((p[0] == 0xf0 && p[1] < 0x90) || (p[0] == 0xf4 && p[1] >= 0x90))
+        return 0;
+    return n;
+}
+
+// Byte at a time from *pos until at least stop. A multibyte sequence may
+// carry *pos a little past stop, never past the terminator.
+static int scalarRun(scanState *s, uint32_t *pos, uint32_t stop) {
+    const uint8_t *p = (const uint8_t *)s->body;
+    uint32_t i = *pos;
+
+    while (i < stop) {
+        if (p[i] < 0x80) {
+            if (p[i] == '\0')
+                return -1;
+            if (p[i] == '\r')
+                separator(s, i);
+            i++;
+            continue;
+        }
+        uint32_t n = utf8Length(p + i, s->end - i);
+        if (n == 0)
+            return -1;
+        i += n;
+    }
+    *pos = i;
+    return 0;
+}
+
+#ifdef SCAN_X86
+// UTF-8 is checked 32 bytes at a time by classifying each byte pair with
+// three 16-entry tables: the high and low nibble of the first byte and
+// the high nibble of the second. A pair is wrong when all three agree on
+// an error bit. Third and fourth bytes of a sequence are checked by
+// looking back two and three bytes.
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS (1 << 7)
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2"))) static __m256i highNibble(__m256i v) {
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+}
+
+// The 32 bytes before v's, n bytes back, spanning the previous block.
+#define BEFORE(v, prev, n) _mm256_alignr_epi8(v, _mm256_permute2x128_si256(prev, v, 0x21), 16 - (n))
+
+__attribute__((target("avx2"))) static __m256i utf8Errors(__m256i v, __m256i prev) {
+    const __m256i byte1High = TABLE(TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                                    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, TOO_SHORT | OVERLONG_2, TOO_SHORT,
+                                    TOO_SHORT | OVERLONG_3 | SURROGATE,
+                                    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte1Low = TABLE(CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+                                   CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                                   CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                                   CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                                   CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+                                   CARRY | TOO_LARGE | TOO_LARGE_1000,
+                                   CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+                                   CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte2High = TABLE(TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+                                    TOO_SHORT,
+                                    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+                                    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+                                    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                                    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT,
+                                    TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+    __m256i prev1 = BEFORE(v, prev, 1);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(_mm256_shuffle_epi8(byte1High, highNibble(prev1)),
+                         _mm256_shuffle_epi8(byte1Low, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)))),
+        _mm256_shuffle_epi8(byte2High, highNibble(v)));
+
+    // a byte two after a 3 or 4 byte lead, or three after a 4 byte lead,
+    // must be a continuation; that is the one pair error a table can't see
+    __m256i third = _mm256_subs_epu8(BEFORE(v, prev, 2), _mm256_set1_epi8(0xe0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(BEFORE(v, prev, 3), _mm256_set1_epi8(0xf0 - 0x80));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, special);
+}
+
+// '\0' and '\r' in a block: -1 for a '\0', else the separators are taken.
+__attribute__((target("avx2"))) static int specials(scanState *s, uint32_t at, __m256i v) {
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())) != 0)
+        return -1;
+    separators(s, at, (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    return 0;
+}
+
+// Two blocks at a time, with one branch when both are plain ASCII free of
+// '\0' and '\r'; the UTF-8 tables only run on blocks that need them.
+__attribute__((target("avx2"))) static int scanAvx2(scanState *s, uint32_t *pos) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i zero = _mm256_setzero_si256();
+    const uint32_t end = s->end;
+    __m256i prev = zero;
+    __m256i errors = zero;
+    uint32_t i = *pos;
+
+    for (; i + 64 <= end; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(s->body + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(s->body + i + 32));
+        __m256i found = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v0, cr), _mm256_cmpeq_epi8(v0, zero)),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(v1, cr), _mm256_cmpeq_epi8(v1, zero)));
+        if (_mm256_movemask_epi8(found) != 0 && (specials(s, i, v0) < 0 || specials(s, i + 32, v1) < 0))
+            return -1;
+        // an ASCII block after a non-ASCII one still has to close off
+        // any sequence the last one started
+        if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(v0, v1), prev)) != 0)
+            errors = _mm256_or_si256(errors, _mm256_or_si256(utf8Errors(v0, prev), utf8Errors(v1, v0)));
+        prev = v1;
+    }
+    for (; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s->body + i));
+        if (specials(s, i, v) < 0)
+            return -1;
+        if (_mm256_movemask_epi8(_mm256_or_si256(v, prev)) != 0)
+            errors = _mm256_or_si256(errors, utf8Errors(v, prev));
+        prev = v;
+    }
+    if (!_mm256_testz_si256(errors, errors))
+        return -1;
+
+    // a sequence cut off at the end of the last block is checked again,
+    // whole, by whoever scans on from here
+    for (uint32_t back = 1; back <= 3 && back <= i - *pos; back++) {
+        uint8_t c = (uint8_t)s->body[i - back];
+        if (c < 0x80)
+            break;
+        if (c >= 0xc0) {
+            if (back < (c >= 0xf0 ? 4u : c >= 0xe0 ? 3u : 2u))
+                i -= back;
+            break;
+        }
+    }
+    *pos = i;
+    return 0;
+}
+
+// Without pshufb there are no tables to classify with: blocks with a byte
+// over 0x7f go through scalarRun.
+static int scanSse2(scanState *s, uint32_t *pos) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = *pos;
+
+    while (i + 16 <= s->end) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s->body + i));
+        if (_mm_movemask_epi8(v) != 0) {
+            if (scalarRun(s, &i, i + 16) < 0)
+                return -1;
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0)
+            return -1;
+        separators(s, i, (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cr)));
+        i += 16;
+    }
+    *pos = i;
+    return 0;
+}
+#endif
+
+static int scan(char *body, uint32_t len, petr_span *fields, int max, scanPath path) {
+    if (len == 0 || max < 1 || body[len - 1] != '\0')
+        return -1;
+
+    scanState s = { body, len - 1, fields, max, 0, 0 };
+    uint32_t i = 0;
+#ifdef SCAN_X86
+    if (path >= SCAN_AVX2 && __builtin_cpu_supports("avx2") && scanAvx2(&s, &i) < 0)
+        return -1;
+    if (path >= SCAN_SSE2 && scanSse2(&s, &i) < 0)
+        return -1;
+#endif
+    if (scalarRun(&s, &i, s.end) < 0)
+        return -1;
+
+    fields[s.count].ptr = body + s.start;
+    fields[s.count].len = s.end - s.start;
+    return s.count + 1;
+}
+
+int petr_scan_fields(char *body, uint32_t len, petr_span *fields, int max) {
+    return scan(body, len, fields, max, SCAN_AVX2);
+}
+
+int petr_scan_fields_sse2(char *body, uint32_t len, petr_span *fields, int max) {
+    return scan(body, len, fields, max, SCAN_SSE2);
+}
+
+int petr_scan_fields_scalar(char *body, uint32_t len, petr_span *fields, int max) {
+    return scan(body, len, fields, max, SCAN_SCALAR);
+}
@@ -0,0 +1,519 @@
+#include "capture.h"
+#include "protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// petr_replay: play a capture (petr_server -c FILE) back against a server.
+// Every connection in the capture gets one of its own, opened at its LOGIN
+// and closed where the capture closed it once its replies are in.
+//
+// Frames go out no sooner than their captured times, scaled by -x SPEED,
+// or as soon as they may with -x max. A connection's frames go out back to
+// back, but before the next connection's the replies to all sent are
+// awaited: the server takes frames in the captured order, a JOIN never
+// overtakes its room's CREATE, and a run answers the same every time.
+//
+// With -o frames go out at their times whatever is owed, as the clients
+// sent them: the load keeps the capture's concurrency, but a server slower
+// or faster than the captured one may take frames of different
+// connections in another order, and the refusal count shows when that
+// changed its answers.
+//
+// The server answers every frame, in order per connection, so replies are
+// matched to frames first in, first out; latency runs from a frame's last
+// byte going out to its reply's header coming in.
+
+#define REPLAY_IDLE_MS 5000  // give up once a reply is this late
+#define EPOLL_BATCH 256
+#define RECV_CHUNK 65536
+#define WRITE_BATCH 64  // frames per sendmsg
+
+typedef struct {
+    void *items;
+    size_t size;  // of one item
+    size_t head;
+    size_t count;
+    size_t cap;
+} fifo;
+
+typedef struct {
+    const uint8_t *frame;
+    uint32_t len;
+} frameRef;
+
+typedef struct {
+    int fd;
+    uint32_t conn;
+    fifo pending;  // frameRefs not written out yet
+    size_t sent;   // bytes of the first pending frame already written
+    fifo waiting;  // when each frame still owed a reply went out
+    uint8_t header[PETR_HEADER_SIZE];
+    size_t have;
+    uint32_t skip;  // body bytes of the current reply still to come
+    int closing;    // the capture closed it; close once nothing is owed
+    int watchingOut;
+} peer;
+
+static struct {
+    double speed;  // 0 for as fast as possible
+    const char *speedName;
+    int open;      // -o: do not wait for replies across connections
+    const char *host;
+    const char *port;
+    const char *unixPath;
+    int epfd;
+    peer **peers;  // by captured conn
+    size_t pending;
+    size_t waiting;
+
+    unsigned long connections;
+    unsigned long frames;
+    unsigned long replies;
+    unsigned long errors;
+    unsigned long pushes;
+    unsigned long lost;
+    unsigned long skipped;
+    uint64_t *latencies;
+} run;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *fifoAt(fifo *f, size_t i) {
+    return (char *)f->items + ((f->head + i) % f->cap) * f->size;
+}
+
+static void fifoPush(fifo *f, const void *item) {
+    if (f->count == f->cap) {
+        size_t cap = f->cap ? f->cap * 2 : 16;
+        char *items = malloc(cap * f->size);
+        if (items == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < f->count; i++)
+            memcpy(items + i * f->size, fifoAt(f, i), f->size);
+        free(f->items);
+        f->items = items;
+        f->head = 0;
+        f->cap = cap;
+    }
+    f->count++;
+    memcpy(fifoAt(f, f->count - 1), item, f->size);
+}
+
+static void fifoPop(fifo *f, void *item) {
+    memcpy(item, fifoAt(f, 0), f->size);
+    f->head = (f->head + 1) % f->cap;
+    f->count--;
+}
+
+// Frames a connection is sent unasked, which answer none of its own.
+static int pushed(uint8_t type) {
+    switch (type) {
+    case HEARTBEAT:
+    case RMCLOSED:
+    case RMRECV:
+    case RMRECVB:
+    case RMRECVZ:
+    case USRRECV:
+    case USRRECVZ:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int refused(uint8_t type) {
+    switch (type) {
+    case EUSREXISTS:
+    case ERMEXISTS:
+    case ERMFULL:
+    case ERMNOTFOUND:
+    case ERMDENIED:
+    case EUSRNOTFOUND:
+    case ESERVBUSY:
+    case ETHROTTLED:
+    case ESERV:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void watch(peer *p, int out) {
+    struct epoll_event ev = { .events = EPOLLIN | (out ? EPOLLOUT : 0), .data.ptr = p };
+    epoll_ctl(run.epfd, EPOLL_CTL_MOD, p->fd, &ev);
+    p->watchingOut = out;
+}
+
+static void closePeer(peer *p) {
+    run.lost += p->pending.count + p->waiting.count;
+    run.pending -= p->pending.count;
+    run.waiting -= p->waiting.count;
+    close(p->fd);
+    if (run.peers[p->conn] == p)
+        run.peers[p->conn] = NULL;
+    free(p->pending.items);
+    free(p->waiting.items);
+    free(p);
+}
+
+static void maybeClose(peer *p) {
+    if (p->closing && p->pending.count == 0 && p->waiting.count == 0)
+        closePeer(p);
+}
+
+static int connectServer(void) {
+    int fd;
+    if (run.unixPath != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, run.unixPath, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        struct addrinfo hints, *addrs;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(run.host, run.port, &hints, &addrs) != 0)
+            return -1;
+        fd = socket(addrs->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        // connected blocking, which a local server answers at once
+        if (fd >= 0 && (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0 ||
+                        connect(fd, addrs->ai_addr, addrs->ai_addrlen) < 0)) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addrs);
+    }
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static peer *openPeer(uint32_t conn) {
+    peer *p = calloc(1, sizeof(peer));
+    p->fd = connectServer();
+    if (p->fd < 0) {
+        if (run.unixPath != NULL)
+            fprintf(stderr, "Cannot connect to %s\n", run.unixPath);
+        else
+            fprintf(stderr, "Cannot connect to %s:%s\n", run.host, run.port);
+        exit(EXIT_FAILURE);
+    }
+    p->conn = conn;
+    p->pending.size = sizeof(frameRef);
+    p->waiting.size = sizeof(uint64_t);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = p };
+    epoll_ctl(run.epfd, EPOLL_CTL_ADD, p->fd, &ev);
+    run.connections++;
+    return p;
+}
+
+// Write out what the socket takes; what it does not waits for EPOLLOUT.
+// Returns -1 if the connection broke, and p is gone.
+static int writePeer(peer *p) {
+    while (p->pending.count > 0) {
+        struct iovec iov[WRITE_BATCH];
+        int iovcnt = 0;
+        for (; iovcnt < WRITE_BATCH && (size_t)iovcnt < p->pending.count; iovcnt++) {
+            frameRef *f = fifoAt(&p->pending, iovcnt);
+            size_t skip = iovcnt == 0 ? p->sent : 0;
+            iov[iovcnt].iov_base = (void *)(f->frame + skip);
+            iov[iovcnt].iov_len = f->len - skip;
+        }
+        struct msghdr msg = { 0 };
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(p->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!p->watchingOut)
+                watch(p, 1);
+            return 0;
+        }
+        if (n < 0) {
+            closePeer(p);
+            return -1;
+        }
+
+        uint64_t now = nowNs();
+        size_t left = n;
+        while (p->pending.count > 0) {
+            frameRef *f = fifoAt(&p->pending, 0);
+            if (left < f->len - p->sent) {
+                p->sent += left;
+                break;
+            }
+            left -= f->len - p->sent;
+            p->sent = 0;
+            frameRef done;
+            fifoPop(&p->pending, &done);
+            fifoPush(&p->waiting, &now);
+            run.pending--;
+            run.waiting++;
+            run.frames++;
+        }
+    }
+    if (p->watchingOut)
+        watch(p, 0);
+    return 0;
+}
+
+static void readPeer(peer *p) {
+    static uint8_t buf[RECV_CHUNK];
+    ssize_t n = recv(p->fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        closePeer(p);
+        return;
+    }
+
+    uint64_t now = nowNs();
+    for (ssize_t at = 0; at < n;) {
+        if (p->skip > 0) {
+            size_t take = (size_t)(n - at) < p->skip ? (size_t)(n - at) : p->skip;
+            p->skip -= take;
+            at += take;
+            continue;
+        }
+        p->header[p->have++] = buf[at++];
+        if (p->have < PETR_HEADER_SIZE)
+            continue;
+        p->have = 0;
+
+        petr_header h;
+        petr_header_unpack(p->header, &h);
+        p->skip = h.msg_len;
+        if (pushed(h.msg_type)) {
+            run.pushes++;
+        } else if (p->waiting.count > 0) {
+            uint64_t sentAt;
+            fifoPop(&p->waiting, &sentAt);
+            run.waiting--;
+            run.latencies[run.replies++] = now - sentAt;
+            run.errors += refused(h.msg_type);
+        }
+    }
+    maybeClose(p);
+}
+
+static void issue(const petr_capture_record *r, const uint8_t *frame) {
+    peer *p = run.peers[r->conn];
+    if (r->len == 0) {
+        if (p != NULL) {
+            p->closing = 1;
+            maybeClose(p);
+        }
+        return;
+    }
+
+    if (frame[4] == LOGIN) {
+        // a close that was not captured
+        if (p != NULL)
+            p->closing = 1;
+        p = run.peers[r->conn] = openPeer(r->conn);
+    } else if (p == NULL || p->closing) {
+        // its connection was open before the capture started
+        run.skipped++;
+        return;
+    }
+
+    frameRef f = { frame, r->len };
+    fifoPush(&p->pending, &f);
+    run.pending++;
+    writePeer(p);
+}
+
+static int byValue(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentileUs(double q) {
+    if (run.replies == 0)
+        return 0;
+    size_t i = (size_t)(q * (run.replies - 1));
+    return run.latencies[i] / 1000.0;
+}
+
+static uint8_t *load(const char *path, size_t *len, uint32_t *maxConn, size_t *frames) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t *data = malloc(st.st_size ? st.st_size : 1);
+    size_t have = 0;
+    while (data != NULL && have < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + have, st.st_size - have);
+        if (n <= 0) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        have += n;
+    }
+    close(fd);
+    if (data == NULL || have < PETR_CAPTURE_HEADER_SIZE || petr_capture_header_check(data) < 0) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // a capture cut short by a killed server ends at its last whole record
+    size_t at = PETR_CAPTURE_HEADER_SIZE;
+    *maxConn = 0;
+    *frames = 0;
+    while (have - at >= PETR_CAPTURE_RECORD_SIZE) {
+        petr_capture_record r;
+        petr_capture_record_unpack(data + at, &r);
+        if (r.len != 0 && r.len < PETR_HEADER_SIZE) {
+            fprintf(stderr, "%s: bad record at byte %zu\n", path, at);
+            exit(EXIT_FAILURE);
+        }
+        if (r.len > have - at - PETR_CAPTURE_RECORD_SIZE)
+            break;
+        if (r.conn > *maxConn)
+            *maxConn = r.conn;
+        *frames += r.len != 0;
+        at += PETR_CAPTURE_RECORD_SIZE + r.len;
+    }
+    *len = at;
+    return data;
+}
+
+static void usage(int status) {
+    fprintf(stderr, "./bin/petr_replay [-h][-x SPEED|max][-o] CAPTURE_FILE HOST PORT | -u SOCKET_PATH CAPTURE_FILE\n");
+    exit(status);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    run.speed = 1;
+    run.speedName = "1";
+
+    while ((opt = getopt(argc, argv, "hx:ou:")) != -1) {
+        switch (opt) {
+        case 'x':
+            run.speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+            if (run.speed <= 0 && strcmp(optarg, "max") != 0)
+                usage(EXIT_FAILURE);
+            run.speedName = optarg;
+            break;
+        case 'o':
+            run.open = 1;
+            break;
+        case 'u':
+            run.unixPath = optarg;
+            break;
+        case 'h':
+        default:
+            usage(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind + (run.unixPath == NULL ? 3 : 1) != argc)
+        usage(EXIT_FAILURE);
+    if (run.unixPath == NULL) {
+        run.host = argv[optind + 1];
+        run.port = argv[optind + 2];
+    }
+
+    size_t len, frames;
+    uint32_t maxConn;
+    uint8_t *data = load(argv[optind], &len, &maxConn, &frames);
+    run.peers = calloc((size_t)maxConn + 1, sizeof(peer *));
+    run.latencies = malloc((frames ? frames : 1) * sizeof(uint64_t));
+    run.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (run.peers == NULL || run.latencies == NULL || run.epfd < 0) {
+        perror("setup");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event events[EPOLL_BATCH];
+    size_t at = PETR_CAPTURE_HEADER_SIZE;
+    uint64_t start = nowNs();
+    uint64_t lastHeard = start;
+    uint32_t lastConn = 0;
+    while (at < len || run.pending > 0 || run.waiting > 0) {
+        uint64_t elapsed = nowNs() - start;
+        int timeout = REPLAY_IDLE_MS;
+        while (at < len) {
+            petr_capture_record r;
+            petr_capture_record_unpack(data + at, &r);
+            if (run.speed > 0) {
+                uint64_t due = r.time / run.speed;
+                if (due > elapsed) {
+                    timeout = (due - elapsed + 999999) / 1000000;
+                    break;
+                }
+            }
+            if (!run.open && r.conn != lastConn && run.pending + run.waiting > 0)
+                break;
+            issue(&r, data + at + PETR_CAPTURE_RECORD_SIZE);
+            lastConn = r.conn;
+            lastHeard = nowNs();
+            at += PETR_CAPTURE_RECORD_SIZE + r.len;
+        }
+        if (at == len && run.pending == 0 && run.waiting == 0)
+            break;
+
+        int n = epoll_wait(run.epfd, events, EPOLL_BATCH, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0)
+            lastHeard = nowNs();
+        else if (run.pending + run.waiting > 0 && nowNs() - lastHeard >= REPLAY_IDLE_MS * 1000000ULL) {
+            fprintf(stderr, "No reply for %dms, giving up\n", REPLAY_IDLE_MS);
+            break;
+        }
+        // a peer is only ever closed handling its own event, and each
+        // appears once per batch
+        for (int i = 0; i < n; i++) {
+            peer *p = events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && writePeer(p) < 0)
+                continue;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                readPeer(p);
+        }
+    }
+    double elapsed = (nowNs() - start) / 1e9;
+    run.lost += run.pending + run.waiting;
+
+    qsort(run.latencies, run.replies, sizeof(uint64_t), byValue);
+    printf("%lu frames on %lu connections in %.3fs (speed %s%s): %.0f frames/s\n", run.frames, run.connections,
+           elapsed, run.speedName, run.open ? ", open" : "", run.frames / elapsed);
+    printf("%lu replies, %lu refusals, %lu pushed, %lu unanswered, %lu skipped\n", run.replies, run.errors,
+           run.pushes, run.lost, run.skipped);
+    printf("latency: p50 %.0fus, p90 %.0fus, p99 %.0fus, max %.0fus\n", percentileUs(0.5), percentileUs(0.9),
+           percentileUs(0.99), percentileUs(1));
+
+    free(data);
+    return run.lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,146 @@
+#include "audit.h"
+#include "lockprof.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct {
+    int fd;
+    char *buf;  // lines not yet taken by the writer
+    size_t len, cap;
+    unsigned long lines;
+    unsigned long dropped;
+    unsigned long written;  // bytes that made it to the file
+    pthread_mutex_t lock;
+    pthread_cond_t full;       // AUDIT_BUFFER bytes wait
+    pthread_mutex_t fileLock;  // held by whoever is writing to the file
+} audit = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fileLock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Take what is buffered and write it out. The writer's buffer is handed
+// back for reuse, so a steady log allocates nothing.
+static void flush(void) {
+    static char *spare;
+    static size_t spareCap;
+
+    pthread_mutex_lock(&audit.fileLock);
+    pthread_mutex_lock(&audit.lock);
+    char *buf = audit.buf;
+    size_t len = audit.len;
+    size_t cap = audit.cap;
+    audit.buf = spare;
+    audit.cap = spareCap;
+    audit.len = 0;
+    pthread_mutex_unlock(&audit.lock);
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(audit.fd, buf + done, len - done);
+        if (n < 0) {
+            perror("audit write");
+            break;
+        }
+        done += n;
+    }
+    __atomic_fetch_add(&audit.written, done, __ATOMIC_RELAXED);
+    spare = buf;
+    spareCap = cap;
+    pthread_mutex_unlock(&audit.fileLock);
+}
+
+static void *process_audit(void *arg) {
+    pthread_mutex_lock(&audit.lock);
+    for (;;) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += AUDIT_FLUSH_MS % 1000 * 1000000L;
+        ts.tv_sec += AUDIT_FLUSH_MS / 1000 + ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        while (audit.len < AUDIT_BUFFER)
+            if (pthread_cond_timedwait(&audit.full, &audit.lock, &ts) != 0)
+                break;
+        pthread_mutex_unlock(&audit.lock);
+        flush();
+        pthread_mutex_lock(&audit.lock);
+    }
+    return NULL;
+}
+
+static void auditDump(FILE *out) {
+    fprintf(out, "audit: %lu lines, %lu bytes written, %lu dropped\n", __atomic_load_n(&audit.lines, __ATOMIC_RELAXED),
+            __atomic_load_n(&audit.written, __ATOMIC_RELAXED), __atomic_load_n(&audit.dropped, __ATOMIC_RELAXED));
+}
+
+void auditInit(const char *path) {
+    audit.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (audit.fd < 0) {
+        printf("Cannot open audit log %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&audit.full, &attr);
+    pthread_condattr_destroy(&attr);
+    statsRegister(auditDump);
+    atexit(flush);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, process_audit, NULL);
+}
+
+void auditWrite(const char *fmt, ...) {
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    // a long line (a client's message body) is formatted a second time
+    char *text = line;
+    if ((size_t)n >= sizeof(line)) {
+        text = malloc(n + 1);
+        if (text == NULL) {
+            __atomic_fetch_add(&audit.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        va_start(ap, fmt);
+        vsnprintf(text, n + 1, fmt, ap);
+        va_end(ap);
+    }
+
+    pthread_mutex_lock(&audit.lock);
+    if (audit.len + n > audit.cap) {
+        size_t cap = audit.cap ? audit.cap : AUDIT_BUFFER;
+        while (cap < audit.len + n)
+            cap *= 2;
+        char *buf = cap <= AUDIT_MAX_BUFFER ? realloc(audit.buf, cap) : NULL;
+        if (buf == NULL) {
+            pthread_mutex_unlock(&audit.lock);
+            __atomic_fetch_add(&audit.dropped, 1, __ATOMIC_RELAXED);
+            if (text != line)
+                free(text);
+            return;
+        }
+        audit.buf = buf;
+        audit.cap = cap;
+    }
+    memcpy(audit.buf + audit.len, text, n);
+    audit.len += n;
+    if (audit.len >= AUDIT_BUFFER && audit.len - n < AUDIT_BUFFER)
+        pthread_cond_signal(&audit.full);
+    pthread_mutex_unlock(&audit.lock);
+    __atomic_fetch_add(&audit.lines, 1, __ATOMIC_RELAXED);
+    if (text != line)
+        free(text);
+}
@@ -0,0 +1,424 @@
+#include "batch.h"
+#include "cluster.h"
+#include "stats.h"
+#include <pthread.h>
+#include <time.h>
+
+#define BATCH_INITIAL_BYTES 4096
+
+struct userBatch {
+    pthread_mutex_t lock;
+    pthread_cond_t sent;  // writing went back to 0
+    // the held frames, headers and all, after room for an RMRECVB header;
+    // freed when a window closes
+    char *buf;
+    size_t len, cap;
+    unsigned int count;
+    // bytes taken to be sent, from outOff to outLen. Only the thread that set
+    // writing touches them without the lock. Any left over once that is done
+    // are what the client would not take yet, and go before anything else.
+    char *out;
+    size_t outOff, outLen, outCap;
+    int writing;
+    int queued;  // its window is open, and it holds a reference to owner
+    user *owner;
+    uint64_t deadline;  // ns on CLOCK_MONOTONIC
+    uint64_t last;      // when the last room message came in
+    userBatch *next;
+};
+
+static struct {
+    uint64_t window;  // ns
+    unsigned int count;
+    userBatch *head, *tail;  // open windows, oldest first
+    int held;
+    int busy;  // the thread is flushing one it took off the queue
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    unsigned long batches;   // RMRECVB frames sent
+    unsigned long frames;    // messages in them
+    unsigned long full;      // batches sent on count or size
+    unsigned long expired;   // batches sent when their window closed
+    unsigned long direct;    // messages sent on their own
+    unsigned long deferred;  // windows kept open as the client was not reading
+} batch = {
+    .window = BATCH_WINDOW_MS * 1000000,
+    .count = BATCH_COUNT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void count(unsigned long *counter, unsigned long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+int batchParse(const char *spec) {
+    char *end;
+    double ms = strtod(spec, &end);
+    if (end == spec || ms <= 0 || ms > 1000)
+        return -1;
+    unsigned long n = batch.count;
+    if (*end == '/') {
+        const char *digits = end + 1;
+        n = strtoul(digits, &end, 10);
+        if (end == digits || n == 0 || n > 65536)
+            return -1;
+    }
+    if (*end != '\0')
+        return -1;
+    batch.window = ms * 1000000;
+    batch.count = n;
+    return 0;
+}
+
+userBatch *batchNew(void) {
+    userBatch *b = calloc(1, sizeof(userBatch));
+    if (b == NULL) {
+        printf("Out of memory allocating a batch\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->sent, NULL);
+    return b;
+}
+
+void batchFree(userBatch *b) {
+    if (b == NULL)
+        return;
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->sent);
+    free(b->buf);
+    free(b->out);
+    free(b);
+}
+
+static int reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap)
+        return 0;
+    size_t size = *cap ? *cap : BATCH_INITIAL_BYTES;
+    while (size < need)
+        size *= 2;
+    char *grown = realloc(*buf, size);
+    if (grown == NULL)
+        return -1;
+    *buf = grown;
+    *cap = size;
+    return 0;
+}
+
+// Called with b's lock held and nothing writing. Move what is held to the
+// bytes to be sent; one message goes out as it came.
+static void takeLocked(userBatch *b) {
+    if (b->count == 0)
+        return;
+
+    char *frames = b->buf + PETR_HEADER_SIZE;
+    size_t len = b->len;
+    if (b->count == 1) {
+        count(&batch.direct, 1);
+    } else {
+        petr_header h = { b->len, RMRECVB };
+        petr_header_pack(&h, (uint8_t *)b->buf);
+        frames = b->buf;
+        len += PETR_HEADER_SIZE;
+        count(&batch.batches, 1);
+        count(&batch.frames, b->count);
+    }
+
+    if (b->outOff == b->outLen) {
+        // the buffers trade places, so a busy user allocates nothing
+        char *spare = b->out;
+        size_t spareCap = b->outCap;
+        b->out = b->buf;
+        b->outCap = b->cap;
+        b->outOff = frames - b->buf;
+        b->outLen = b->outOff + len;
+        b->buf = spare;
+        b->cap = spareCap;
+    } else {
+        if (reserve(&b->out, &b->outCap, b->outLen + len) < 0) {
+            printf("Out of memory batching room messages\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(b->out + b->outLen, frames, len);
+        b->outLen += len;
+    }
+    b->len = 0;
+    b->count = 0;
+}
+
+// Send what is held, then frame, waiting on the client as any job thread
+// writing to it does. Called with b's lock held, which is let go for the
+// write; other writers to u wait their turn on sent.
+static void sendLocked(user *u, userBatch *b, struct iovec *frame, int iovcnt) {
+    while (b->writing)
+        pthread_cond_wait(&b->sent, &b->lock);
+    takeLocked(b);
+    if (b->outOff == b->outLen && iovcnt == 0)
+        return;
+
+    struct iovec out = { b->out + b->outOff, b->outLen - b->outOff };
+    b->outOff = b->outLen;
+    b->writing = 1;
+    pthread_mutex_unlock(&b->lock);
+    if (out.iov_len > 0)
+        userWriteDirect(u, &out, 1);
+    if (iovcnt > 0)
+        userWriteDirect(u, frame, iovcnt);
+    pthread_mutex_lock(&b->lock);
+    b->writing = 0;
+    pthread_cond_broadcast(&b->sent);
+}
+
+// Put b on the queue of open windows, to close at deadline.
+static void queue(userBatch *b, uint64_t deadline) {
+    pthread_mutex_lock(&batch.lock);
+    b->deadline = deadline;
+    b->next = NULL;
+    if (batch.tail == NULL) {
+        batch.head = batch.tail = b;
+        pthread_cond_signal(&batch.wake);
+    } else {
+        batch.tail->next = b;
+        batch.tail = b;
+    }
+    pthread_mutex_unlock(&batch.lock);
+}
+
+// Open b's window. The caller is writing to owner, so it is alive to be held.
+static void enqueue(userBatch *b, user *owner, uint64_t start) {
+    b->queued = 1;
+    b->owner = owner;
+    serverUserHold(owner);
+    queue(b, start + batch.window);
+}
+
+// Called with b's lock held, once nothing is left to send.
+static user *closeLocked(userBatch *b) {
+    user *owner = b->owner;
+    free(b->buf);
+    free(b->out);
+    b->buf = b->out = NULL;
+    b->cap = b->outCap = 0;
+    b->outOff = b->outLen = 0;
+    b->queued = 0;
+    b->owner = NULL;
+    return owner;
+}
+
+// Close a window taken off the queue and let its owner go. The thread
+// closing windows for everyone only sends what the client takes at once.
+// The rest, or a window whose user is being written to by another thread,
+// stays open for another window, so a client that is not reading holds up
+// no one but itself.
+static void expire(userBatch *b) {
+    pthread_mutex_lock(&b->lock);
+    if (!b->writing) {
+        if (b->count > 1)
+            count(&batch.expired, 1);
+        takeLocked(b);
+        if (b->outOff < b->outLen) {
+            struct iovec out = { b->out + b->outOff, b->outLen - b->outOff };
+            b->writing = 1;
+            pthread_mutex_unlock(&b->lock);
+            ssize_t n = userTryWriteDirect(b->owner, &out, 1);
+            pthread_mutex_lock(&b->lock);
+            b->writing = 0;
+            pthread_cond_broadcast(&b->sent);
+            // a client that is gone is shut down, and what it had is dropped
+            b->outOff = n < 0 ? b->outLen : b->outOff + n;
+        }
+    }
+    if (b->writing || b->outOff < b->outLen || b->count > 0) {
+        count(&batch.deferred, 1);
+        queue(b, now() + batch.window);
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+    user *owner = closeLocked(b);
+    pthread_mutex_unlock(&b->lock);
+    serverUserRelease(owner);
+}
+
+// As expire, for batchHold: everything goes, however long that takes.
+static void expireAll(userBatch *b) {
+    pthread_mutex_lock(&b->lock);
+    if (b->count > 1)
+        count(&batch.expired, 1);
+    sendLocked(b->owner, b, NULL, 0);
+    user *owner = closeLocked(b);
+    pthread_mutex_unlock(&b->lock);
+    serverUserRelease(owner);
+}
+
+void batchWrite(user *u, struct iovec *frame, int iovcnt) {
+    userBatch *b = u->batch;
+    uint8_t type = ((uint8_t *)frame[0].iov_base)[4];
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += frame[i].iov_len;
+
+    pthread_mutex_lock(&b->lock);
+    while (b->count > 0 && b->len + len > BATCH_MAX_BYTES) {
+        if (b->count > 1)
+            count(&batch.full, 1);
+        sendLocked(u, b, NULL, 0);
+    }
+    if ((type != RMRECV && type != RMRECVZ) || len > BATCH_MAX_BYTES ||
+        reserve(&b->buf, &b->cap, PETR_HEADER_SIZE + b->len + len) < 0) {
+        sendLocked(u, b, frame, iovcnt);
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+
+    uint64_t t = now();
+    uint64_t last = b->last;
+    b->last = t;
+    if (!b->queued && t - last >= batch.window) {
+        count(&batch.direct, 1);
+        sendLocked(u, b, frame, iovcnt);
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+
+    char *at = b->buf + PETR_HEADER_SIZE + b->len;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(at, frame[i].iov_base, frame[i].iov_len);
+        at += frame[i].iov_len;
+    }
+    b->len += len;
+    if (++b->count >= batch.count) {
+        if (b->count > 1)
+            count(&batch.full, 1);
+        sendLocked(u, b, NULL, 0);
+    } else if (!b->queued) {
+        enqueue(b, u, t);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+int batchTryWrite(user *u, struct iovec *frame, int iovcnt) {
+    userBatch *b = u->batch;
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += frame[i].iov_len;
+
+    pthread_mutex_lock(&b->lock);
+    // the bytes another thread is writing can't be added to, and a client
+    // that has not taken a window's worth is not sent more
+    if (b->writing || b->outLen - b->outOff + b->len + len > BATCH_MAX_BYTES) {
+        pthread_mutex_unlock(&b->lock);
+        return -1;
+    }
+    takeLocked(b);
+    size_t skip = 0;
+    if (b->outOff == b->outLen) {
+        b->writing = 1;
+        pthread_mutex_unlock(&b->lock);
+        ssize_t n = userTryWriteDirect(u, frame, iovcnt);
+        pthread_mutex_lock(&b->lock);
+        b->writing = 0;
+        pthread_cond_broadcast(&b->sent);
+        if (n < 0 || (size_t)n == len) {
+            pthread_mutex_unlock(&b->lock);
+            return 0;
+        }
+        skip = n;
+    }
+
+    // the rest goes first thing, with the next window or writer
+    if (reserve(&b->out, &b->outCap, b->outLen + len - skip) < 0) {
+        printf("Out of memory batching room messages\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        size_t drop = skip < frame[i].iov_len ? skip : frame[i].iov_len;
+        memcpy(b->out + b->outLen, (char *)frame[i].iov_base + drop, frame[i].iov_len - drop);
+        b->outLen += frame[i].iov_len - drop;
+        skip -= drop;
+    }
+    if (!b->queued)
+        enqueue(b, u, now());
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+static void *process_batches(void *arg) {
+    pthread_mutex_lock(&batch.lock);
+    for (;;) {
+        if (batch.held || batch.head == NULL) {
+            pthread_cond_wait(&batch.wake, &batch.lock);
+            continue;
+        }
+        // windows about to close go with the one that has, which saves a
+        // wakeup each without any message waiting longer
+        uint64_t deadline = batch.head->deadline;
+        if (deadline > now() + batch.window / 4) {
+            struct timespec ts = { deadline / 1000000000ULL, deadline % 1000000000ULL };
+            pthread_cond_timedwait(&batch.wake, &batch.lock, &ts);
+            continue;
+        }
+
+        userBatch *b = batch.head;
+        batch.head = b->next;
+        if (batch.head == NULL)
+            batch.tail = NULL;
+        batch.busy = 1;
+        pthread_mutex_unlock(&batch.lock);
+        expire(b);
+        pthread_mutex_lock(&batch.lock);
+        batch.busy = 0;
+        pthread_cond_broadcast(&batch.idle);
+    }
+    return NULL;
+}
+
+void batchHold(int held) {
+    pthread_mutex_lock(&batch.lock);
+    batch.held = held;
+    if (!held) {
+        pthread_cond_signal(&batch.wake);
+        pthread_mutex_unlock(&batch.lock);
+        return;
+    }
+    while (batch.busy)
+        pthread_cond_wait(&batch.idle, &batch.lock);
+    userBatch *b = batch.head;
+    batch.head = batch.tail = NULL;
+    pthread_mutex_unlock(&batch.lock);
+
+    while (b != NULL) {
+        userBatch *next = b->next;
+        expireAll(b);
+        b = next;
+    }
+}
+
+static void batchDump(FILE *out) {
+    fprintf(out,
+            "batch: %.1fms/%u, %lu batches of %lu messages, %lu full, %lu on window, %lu sent alone, "
+            "%lu windows kept open\n",
+            batch.window / 1e6, batch.count, __atomic_load_n(&batch.batches, __ATOMIC_RELAXED),
+            __atomic_load_n(&batch.frames, __ATOMIC_RELAXED), __atomic_load_n(&batch.full, __ATOMIC_RELAXED),
+            __atomic_load_n(&batch.expired, __ATOMIC_RELAXED), __atomic_load_n(&batch.direct, __ATOMIC_RELAXED),
+            __atomic_load_n(&batch.deferred, __ATOMIC_RELAXED));
+}
+
+void batchInit(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&batch.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    statsRegister(batchDump);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, process_batches, NULL);
+}
@@ -0,0 +1,464 @@
+#include "cluster.h"
+#include "batch.h"
+#include "presence.h"
+#include "shmring.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/un.h>
+
+#define PEER_MAX_FRAME (MAX_MSG_LEN + 512)
+
+typedef struct {
+    uint64_t point;
+    int node;
+} ringPoint;
+
+typedef struct {
+    char *path;
+    int fd;  // outbound link, -1 until first used
+    pthread_mutex_t lock;
+} peer;
+
+static struct {
+    int self;
+    int numNodes;
+    peer nodes[CLUSTER_MAX_NODES];
+    ringPoint *ring;
+    size_t ringSize;
+    unsigned long replyDrops;  // userTryWrite frames the client had no room for
+    unsigned long replyCuts;   // and clients shut down on half a frame
+} cluster;
+
+static uint64_t hashName(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    for (; *name != '\0'; name++) {
+        h ^= (unsigned char)*name;
+        h *= 0x100000001b3ULL;
+    }
+    // FNV alone clusters short similar names, finish with a mix
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int comparePoints(const void *a, const void *b) {
+    const ringPoint *x = a, *y = b;
+    if (x->point != y->point)
+        return x->point < y->point ? -1 : 1;
+    return x->node - y->node;
+}
+
+static void buildRing(void) {
+    char label[32];
+
+    cluster.ringSize = (size_t)cluster.numNodes * CLUSTER_VNODES;
+    cluster.ring = malloc(cluster.ringSize * sizeof(ringPoint));
+    for (int node = 0; node < cluster.numNodes; node++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            snprintf(label, sizeof(label), "node-%d#%d", node, v);
+            ringPoint *p = &cluster.ring[node * CLUSTER_VNODES + v];
+            p->point = hashName(label);
+            p->node = node;
+        }
+    }
+    qsort(cluster.ring, cluster.ringSize, sizeof(ringPoint), comparePoints);
+}
+
+int clusterOwner(const char *name) {
+    if (cluster.numNodes <= 1)
+        return cluster.self;
+
+    // first point clockwise from the name's hash
+    uint64_t h = hashName(name);
+    size_t lo = 0, hi = cluster.ringSize;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cluster.ring[mid].point < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return cluster.ring[lo == cluster.ringSize ? 0 : lo].node;
+}
+
+int clusterEnabled(void) {
+    return cluster.numNodes > 1;
+}
+
+int clusterSelf(void) {
+    return cluster.self;
+}
+
+int clusterPeer(uint64_t node) {
+    return node < (uint64_t)cluster.numNodes && node != (uint64_t)cluster.self;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// id, node and features of a user, as carried by PEER_JOB
+#define USER_WIRE_SIZE 16
+
+static void packUser(const user *u, uint8_t *p) {
+    put32(p, (uint32_t)u->id);
+    put32(p + 4, (uint32_t)((uint64_t)u->id >> 32));
+    put32(p + 8, u->node);
+    put32(p + 12, u->features);
+}
+
+// Returns a proxy for the user described at p, or NULL if malformed or
+// not on a peer node.
+static user *unpackUser(const char *p, size_t len, size_t *used) {
+    if (len <= USER_WIRE_SIZE || !clusterPeer(get32((const uint8_t *)p + 8)))
+        return NULL;
+    const char *name = p + USER_WIRE_SIZE;
+    size_t nameLen = strnlen(name, len - USER_WIRE_SIZE);
+    if (nameLen == len - USER_WIRE_SIZE)
+        return NULL;
+
+    const uint8_t *wire = (const uint8_t *)p;
+    user *proxy = calloc(1, sizeof(user));
+    proxy->username = strdup(name);
+    proxy->id = (unsigned long)((uint64_t)get32(wire + 4) << 32 | get32(wire));
+    proxy->node = get32(wire + 8);
+    proxy->features = get32(wire + 12);
+    proxy->fd = -1;
+    *used = USER_WIRE_SIZE + nameLen + 1;
+    return proxy;
+}
+
+static int peerConnect(peer *p) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, p->path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send one peer frame. The link is (re)opened on demand, and a frame for a
+// node that is down is dropped.
+int clusterSend(int node, uint8_t type, struct iovec *body, int iovcnt) {
+    peer *p = &cluster.nodes[node];
+    petr_header h;
+    memset(&h, 0, sizeof(h));
+    h.msg_type = type;
+    for (int i = 0; i < iovcnt; i++)
+        h.msg_len += body[i].iov_len;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->fd < 0)
+        p->fd = peerConnect(p);
+    if (p->fd < 0 || wr_msgv(p->fd, &h, body, iovcnt) < 0) {
+        printf("Peer node %d unreachable, dropped frame %x\n", node, type);
+        if (p->fd >= 0)
+            close(p->fd);
+        p->fd = -1;
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static void sendJob(int node, user *client, char *msg) {
+    petr_header *header = (petr_header *)msg;
+    uint8_t who[USER_WIRE_SIZE];
+    uint8_t wire[PETR_HEADER_SIZE];
+
+    packUser(client, who);
+    petr_header_pack(header, wire);
+    struct iovec body[4] = {
+        { who, sizeof(who) },
+        { client->username, strlen(client->username) + 1 },
+        { wire, sizeof(wire) },
+        { msg + sizeof(petr_header), header->msg_len },
+    };
+    clusterSend(node, PEER_JOB, body, 4);
+}
+
+void clusterSendAll(uint8_t type, struct iovec *body, int iovcnt) {
+    for (int node = 0; node < cluster.numNodes; node++)
+        if (node != cluster.self)
+            clusterSend(node, type, body, iovcnt);
+}
+
+void clusterForwardJob(int node, user *client, char *msg) {
+    sendJob(node, client, msg);
+}
+
+void clusterBroadcastJob(user *client, char *msg) {
+    for (int node = 0; node < cluster.numNodes; node++)
+        if (node != cluster.self)
+            sendJob(node, client, msg);
+}
+
+static void freeProxy(user *proxy) {
+    free(proxy->username);
+    free(proxy);
+}
+
+void userWriteDirect(user *u, struct iovec *frame, int iovcnt) {
+    int ret = u->ring != NULL ? shmRingSend(u->ring, frame, iovcnt) : wr_iov(u->fd, frame, iovcnt);
+    // a client that is gone is not the sender's problem: its reader sees
+    // the shutdown and logs it out
+    if (ret < 0)
+        shutdown(u->fd, SHUT_RDWR);
+}
+
+ssize_t userTryWriteDirect(user *u, struct iovec *frame, int iovcnt) {
+    ssize_t ret;
+    if (u->ring != NULL) {
+        ret = shmRingTrySend(u->ring, frame, iovcnt);
+        if (ret == 0)
+            for (int i = 0; i < iovcnt; i++)
+                ret += frame[i].iov_len;
+        else if (ret == 1)
+            ret = 0;
+    } else {
+        ret = wr_iov_try(u->fd, frame, iovcnt);
+    }
+    if (ret < 0)
+        shutdown(u->fd, SHUT_RDWR);
+    return ret;
+}
+
+int userTryWrite(user *u, petr_header *h, char *msgbuf) {
+    uint64_t start = traceSendBegin();
+    uint8_t wire[PETR_HEADER_SIZE];
+    petr_header_pack(h, wire);
+    struct iovec frame[2] = { { wire, sizeof(wire) }, { msgbuf, h->msg_len } };
+    int iovcnt = msgbuf == NULL ? 1 : 2;
+    size_t len = sizeof(wire) + (msgbuf == NULL ? 0 : h->msg_len);
+
+    int ret = 0;
+    if (u->batch != NULL) {
+        if ((ret = batchTryWrite(u, frame, iovcnt)) < 0)
+            __atomic_fetch_add(&cluster.replyDrops, 1, __ATOMIC_RELAXED);
+    } else {
+        ssize_t n = userTryWriteDirect(u, frame, iovcnt);
+        if (n == 0) {
+            __atomic_fetch_add(&cluster.replyDrops, 1, __ATOMIC_RELAXED);
+        } else if (n > 0 && (size_t)n < len) {
+            // nothing can follow half a frame
+            shutdown(u->fd, SHUT_RDWR);
+            __atomic_fetch_add(&cluster.replyCuts, 1, __ATOMIC_RELAXED);
+        }
+        ret = (size_t)n == len ? 0 : -1;
+    }
+    traceSendEnd(start, h->msg_type, u->username);
+    return ret;
+}
+
+void userWriteFrame(user *u, struct iovec *frame, int iovcnt) {
+    if (u->batch != NULL)
+        batchWrite(u, frame, iovcnt);
+    else
+        userWriteDirect(u, frame, iovcnt);
+}
+
+static void sendTo(user *u, petr_header *h, const struct iovec *body, int iovcnt) {
+    int local = u->node == cluster.self;
+    if (local && u->ring == NULL && u->batch == NULL) {
+        if (wr_msgv(u->fd, h, body, iovcnt) < 0)
+            shutdown(u->fd, SHUT_RDWR);
+        return;
+    }
+
+    // a peer gets the name then the frame; a ring or batch only the frame
+    uint8_t wire[PETR_HEADER_SIZE];
+    struct iovec stackIov[8];
+    struct iovec *iov = stackIov;
+    if (iovcnt + 2 > 8) {
+        iov = malloc((iovcnt + 2) * sizeof(struct iovec));
+        if (iov == NULL) {
+            printf("Out of memory writing to %s\n", u->username);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    petr_header_pack(h, wire);
+    iov[0].iov_base = u->username;
+    iov[0].iov_len = strlen(u->username) + 1;
+    iov[1].iov_base = wire;
+    iov[1].iov_len = sizeof(wire);
+    memcpy(iov + 2, body, iovcnt * sizeof(struct iovec));
+
+    if (local)
+        userWriteFrame(u, iov + 1, iovcnt + 1);
+    else
+        clusterSend(u->node, PEER_DELIVER, iov, iovcnt + 2);
+    if (iov != stackIov)
+        free(iov);
+}
+
+void userWritev(user *u, petr_header *h, const struct iovec *body, int iovcnt) {
+    uint64_t start = traceSendBegin();
+    sendTo(u, h, body, iovcnt);
+    traceSendEnd(start, h->msg_type, u->username);
+}
+
+void userWrite(user *u, petr_header *h, char *msgbuf) {
+    struct iovec body = { msgbuf, h->msg_len };
+    userWritev(u, h, &body, msgbuf == NULL ? 0 : 1);
+}
+
+static void handleJob(char *body, size_t len) {
+    size_t used;
+    user *proxy = unpackUser(body, len, &used);
+    if (proxy == NULL)
+        return;
+
+    petr_header header;
+    if (len - used < PETR_HEADER_SIZE) {
+        freeProxy(proxy);
+        return;
+    }
+    petr_header_unpack((uint8_t *)body + used, &header);
+    used += PETR_HEADER_SIZE;
+    if (header.msg_len != len - used) {
+        freeProxy(proxy);
+        return;
+    }
+
+    // laid out like a job read off a client socket; the job thread frees
+    // the proxy once the job is done
+    char *msg = malloc(sizeof(petr_header) + header.msg_len + 1);
+    memcpy(msg, &header, sizeof(petr_header));
+    memcpy(msg + sizeof(petr_header), body + used, header.msg_len);
+    msg[sizeof(petr_header) + header.msg_len] = '\0';
+    serverEnqueue(proxy, msg);
+}
+
+static void handleDeliver(char *body, size_t len) {
+    size_t nameLen = strnlen(body, len);
+    if (nameLen == len)
+        return;
+
+    struct iovec frame = { body + nameLen + 1, len - nameLen - 1 };
+    serverDeliver(body, &frame, 1);
+}
+
+static void *process_peer(void *arg) {
+    int fd = (int)(long)arg;
+    petr_reader reader;
+    petr_reader_init(&reader, fd);
+
+    while (1) {
+        petr_header h;
+        if (rd_msgheader_buffered(&reader, &h) < 0 || h.msg_len > PEER_MAX_FRAME)
+            break;
+
+        char *body = malloc(h.msg_len + 1);
+        if (rd_msgbody(&reader, body, h.msg_len) < 0) {
+            free(body);
+            break;
+        }
+        body[h.msg_len] = '\0';
+
+        switch (h.msg_type) {
+        case PEER_JOB:
+            handleJob(body, h.msg_len);
+            break;
+        case PEER_DELIVER:
+            handleDeliver(body, h.msg_len);
+            break;
+        case PEER_PRESENCE:
+            presenceReceive(body, h.msg_len);
+            break;
+        case PEER_ROOMS:
+            presenceReceiveRooms(body, h.msg_len);
+            break;
+        case PEER_SYNC:
+            if (h.msg_len == 4 && clusterPeer(get32((uint8_t *)body)))
+                presenceSync(get32((uint8_t *)body));
+            break;
+        default:
+            break;
+        }
+        free(body);
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void *process_peer_listener(void *arg) {
+    int listen_fd = (int)(long)arg;
+    pthread_t tid;
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("peer accept");
+            exit(EXIT_FAILURE);
+        }
+        pthread_create(&tid, NULL, process_peer, (void *)(long)fd);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+static void clusterDump(FILE *out) {
+    fprintf(out, "replies: %lu dropped as the client was not reading, %lu clients cut off mid-frame\n",
+            __atomic_load_n(&cluster.replyDrops, __ATOMIC_RELAXED), __atomic_load_n(&cluster.replyCuts, __ATOMIC_RELAXED));
+}
+
+int clusterInit(int self, char *paths) {
+    cluster.self = self;
+    cluster.numNodes = 0;
+    statsRegister(clusterDump);
+
+    if (paths == NULL)
+        return self == 0 ? 0 : -1;
+
+    char *save_ptr;
+    for (char *path = strtok_r(paths, ",", &save_ptr); path != NULL; path = strtok_r(NULL, ",", &save_ptr)) {
+        if (cluster.numNodes == CLUSTER_MAX_NODES)
+            return -1;
+        peer *p = &cluster.nodes[cluster.numNodes++];
+        p->path = path;
+        p->fd = -1;
+        pthread_mutex_init(&p->lock, NULL);
+    }
+    if (self < 0 || self >= cluster.numNodes)
+        return -1;
+    buildRing();
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, cluster.nodes[self].path, sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (SA *)&addr, sizeof(addr)) < 0 || listen(listen_fd, CLUSTER_MAX_NODES) < 0) {
+        perror("peer socket");
+        return -1;
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, process_peer_listener, (void *)(long)listen_fd);
+    printf("Cluster node %d of %d listening on %s\n", self, cluster.numNodes, cluster.nodes[self].path);
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "epoch.h"
+#include "lockprof.h"
+#include "stats.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+// A reader's state is 0 outside a section, else the epoch it entered in,
+// shifted left, with the low bit set.
+typedef struct epochThread epochThread;
+struct epochThread {
+    uint64_t state;
+    int nesting;
+    int inUse;  // records of threads that exited are reused
+    epochThread *next;
+};
+
+typedef struct retired retired;
+struct retired {
+    void (*fn)(void *);
+    void *p;
+    uint64_t epoch;
+    retired *next;
+};
+
+static struct {
+    uint64_t global;
+    epochThread *threads;
+    retired *limbo;  // newest first
+    size_t pending;
+    unsigned long advanced;
+    unsigned long reclaimed;
+    pthread_mutex_t lock;
+    pthread_cond_t retiredCond;
+    pthread_key_t key;
+} epochs = { .global = 1 };
+
+static __thread epochThread *self;
+
+static void threadExit(void *arg) {
+    epochThread *t = arg;
+    __atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&epochs.lock);
+    t->inUse = 0;
+    pthread_mutex_unlock(&epochs.lock);
+}
+
+static void threadRegister(void) {
+    pthread_mutex_lock(&epochs.lock);
+    epochThread *t = epochs.threads;
+    while (t != NULL && t->inUse)
+        t = t->next;
+    if (t == NULL) {
+        t = calloc(1, sizeof(epochThread));
+        if (t == NULL) {
+            printf("Out of memory registering epoch reader\n");
+            exit(EXIT_FAILURE);
+        }
+        t->next = epochs.threads;
+        epochs.threads = t;
+    }
+    t->inUse = 1;
+    t->nesting = 0;
+    pthread_mutex_unlock(&epochs.lock);
+
+    pthread_setspecific(epochs.key, t);
+    self = t;
+}
+
+void epochEnter(void) {
+    if (self == NULL)
+        threadRegister();
+    if (self->nesting++ > 0)
+        return;
+
+    uint64_t e = __atomic_load_n(&epochs.global, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->state, e << 1 | 1, __ATOMIC_RELAXED);
+    // the state must be visible before any registry pointer is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epochExit(void) {
+    if (--self->nesting > 0)
+        return;
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+void epochRetire(void (*fn)(void *), void *p) {
+    retired *r = malloc(sizeof(retired));
+    if (r == NULL) {
+        printf("Out of memory retiring registry entry\n");
+        exit(EXIT_FAILURE);
+    }
+    r->fn = fn;
+    r->p = p;
+
+    pthread_mutex_lock(&epochs.lock);
+    // unlinked before this read of the epoch, so readers that entered two
+    // epochs later cannot have seen it
+    r->epoch = __atomic_load_n(&epochs.global, __ATOMIC_SEQ_CST);
+    r->next = epochs.limbo;
+    epochs.limbo = r;
+    if (epochs.pending++ == 0)
+        pthread_cond_signal(&epochs.retiredCond);
+    pthread_mutex_unlock(&epochs.lock);
+}
+
+// Move the epoch on if every reader in a section entered in this one.
+// Called with the lock held.
+static void tryAdvance(void) {
+    uint64_t e = __atomic_load_n(&epochs.global, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (epochThread *t = epochs.threads; t != NULL; t = t->next) {
+        uint64_t state = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && state >> 1 != e)
+            return;
+    }
+    __atomic_store_n(&epochs.global, e + 1, __ATOMIC_SEQ_CST);
+    epochs.advanced++;
+}
+
+// Detach everything retired two or more epochs ago. Called with the lock held.
+static retired *takeReclaimable(void) {
+    uint64_t e = __atomic_load_n(&epochs.global, __ATOMIC_RELAXED);
+    retired **link = &epochs.limbo;
+    while (*link != NULL && (*link)->epoch + 2 > e)
+        link = &(*link)->next;
+
+    retired *ready = *link;
+    *link = NULL;
+    for (retired *r = ready; r != NULL; r = r->next)
+        epochs.pending--;
+    return ready;
+}
+
+static void *process_reclaim(void *arg) {
+    struct timespec wait = { 0, EPOCH_RECLAIM_MS * 1000000L };
+
+    while (1) {
+        pthread_mutex_lock(&epochs.lock);
+        while (epochs.pending == 0)
+            pthread_cond_wait(&epochs.retiredCond, &epochs.lock);
+        tryAdvance();
+        retired *ready = takeReclaimable();
+        pthread_mutex_unlock(&epochs.lock);
+
+        // callbacks may take registry locks, so run them unlocked
+        unsigned long count = 0;
+        while (ready != NULL) {
+            retired *next = ready->next;
+            ready->fn(ready->p);
+            free(ready);
+            ready = next;
+            count++;
+        }
+
+        pthread_mutex_lock(&epochs.lock);
+        epochs.reclaimed += count;
+        int more = epochs.pending > 0;
+        pthread_mutex_unlock(&epochs.lock);
+        // give readers a moment to move on before looking again
+        if (more)
+            nanosleep(&wait, NULL);
+    }
+    return NULL;
+}
+
+void epochInit(void) {
+    pthread_t tid;
+
+    pthread_mutex_init(&epochs.lock, NULL);
+    pthread_cond_init(&epochs.retiredCond, NULL);
+    pthread_key_create(&epochs.key, threadExit);
+    pthread_create(&tid, NULL, process_reclaim, NULL);
+    statsRegister(epochDump);
+}
+
+void epochDump(FILE *out) {
+    size_t readers = 0;
+
+    pthread_mutex_lock(&epochs.lock);
+    for (epochThread *t = epochs.threads; t != NULL; t = t->next)
+        readers += t->inUse;
+    fprintf(out, "epoch %lu: %zu readers, advanced %lu, retired pending %zu, reclaimed %lu\n",
+            (unsigned long)__atomic_load_n(&epochs.global, __ATOMIC_RELAXED), readers, epochs.advanced,
+            epochs.pending, epochs.reclaimed);
+    pthread_mutex_unlock(&epochs.lock);
+}
@@ -0,0 +1,187 @@
+#include "fanout.h"
+#include "cluster.h"
+#include "compress.h"
+#include "trace.h"
+#include <pthread.h>
+
+typedef struct fanoutBatch fanoutBatch;
+typedef struct fanoutTask fanoutTask;
+
+// Chunks of one broadcast still being sent.
+struct fanoutBatch {
+    size_t pending;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+struct fanoutTask {
+    const memberEntry *members;
+    size_t count;
+    unsigned long skip;
+    uint8_t msg_type;
+    uint8_t packed_type;
+    outMsg *out;
+    fanoutBatch *batch;
+    unsigned int trace;
+    fanoutTask *next;
+};
+
+static struct {
+    fanoutTask *head, *tail;
+    int numThreads;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+} tasks;
+
+void outMsgInit(outMsg *out, struct iovec *pieces, int count) {
+    out->pieces = pieces;
+    out->count = count;
+    out->len = 0;
+    for (int i = 0; i < count; i++)
+        out->len += pieces[i].iov_len;
+    out->packed = NULL;
+    out->packedLen = 0;
+    out->packTried = 0;
+}
+
+void outMsgFree(outMsg *out) {
+    free(out->packed);
+}
+
+static void outMsgPack(outMsg *out) {
+    if (!out->packTried) {
+        out->packed = petr_compress_msg(out->pieces, out->count, &out->packedLen);
+        out->packTried = 1;
+    }
+}
+
+void sendOutMsg(user *to, uint8_t msg_type, uint8_t packed_type, outMsg *out) {
+    petr_header response;
+    memset(&response, 0, sizeof(response));
+
+    if ((to->features & USER_COMPRESS) && out->len >= PETR_COMPRESS_MIN) {
+        outMsgPack(out);
+        if (out->packed != NULL) {
+            response.msg_type = packed_type;
+            response.msg_len = out->packedLen;
+            userWrite(to, &response, out->packed);
+            serverSendAudit(response.msg_type, to);
+            return;
+        }
+    }
+
+    response.msg_type = msg_type;
+    response.msg_len = out->len;
+    userWritev(to, &response, out->pieces, out->count);
+    serverSendAudit(response.msg_type, to);
+}
+
+static void sendChunk(fanoutTask *task) {
+    for (size_t i = 0; i < task->count; i++)
+        if (task->members[i].id != task->skip)
+            sendOutMsg(task->members[i].member, task->msg_type, task->packed_type, task->out);
+}
+
+static void *process_fanout(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&tasks.lock);
+        while (tasks.head == NULL)
+            pthread_cond_wait(&tasks.notEmpty, &tasks.lock);
+
+        fanoutTask *task = tasks.head;
+        tasks.head = task->next;
+        if (tasks.head == NULL)
+            tasks.tail = NULL;
+        pthread_mutex_unlock(&tasks.lock);
+
+        traceEnter(task->trace, task->msg_type);
+        sendChunk(task);
+        traceLeave(SPAN_FANOUT, NULL);
+
+        fanoutBatch *batch = task->batch;
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->pending == 0)
+            pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+void fanoutInit(int numThreads) {
+    pthread_t tid;
+
+    tasks.head = tasks.tail = NULL;
+    tasks.numThreads = numThreads;
+    pthread_mutex_init(&tasks.lock, NULL);
+    pthread_cond_init(&tasks.notEmpty, NULL);
+
+    for (int i = 0; i < numThreads; i++)
+        pthread_create(&tid, NULL, process_fanout, NULL);
+}
+
+void fanoutSend(const memberEntry *members, size_t count, unsigned long skip, uint8_t msg_type, uint8_t packed_type,
+                outMsg *out) {
+    fanoutTask first = { members, count, skip, msg_type, packed_type, out, NULL, traceCurrent(), NULL };
+
+    if (count <= FANOUT_CHUNK || tasks.numThreads == 0) {
+        sendChunk(&first);
+        return;
+    }
+
+    // chunks read out concurrently, so compress up front if anyone needs it
+    for (size_t i = 0; i < count; i++) {
+        if (members[i].member->features & USER_COMPRESS) {
+            if (out->len >= PETR_COMPRESS_MIN)
+                outMsgPack(out);
+            break;
+        }
+    }
+
+    size_t numChunks = (count + FANOUT_CHUNK - 1) / FANOUT_CHUNK;
+    fanoutTask *chunks = malloc((numChunks - 1) * sizeof(fanoutTask));
+    if (chunks == NULL) {
+        sendChunk(&first);
+        return;
+    }
+
+    fanoutBatch batch;
+    batch.pending = numChunks - 1;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+
+    // the calling thread keeps the first chunk for itself
+    first.count = FANOUT_CHUNK;
+
+    pthread_mutex_lock(&tasks.lock);
+    for (size_t i = 1; i < numChunks; i++) {
+        fanoutTask *task = &chunks[i - 1];
+        task->members = members + i * FANOUT_CHUNK;
+        task->count = i == numChunks - 1 ? count - i * FANOUT_CHUNK : FANOUT_CHUNK;
+        task->skip = skip;
+        task->msg_type = msg_type;
+        task->packed_type = packed_type;
+        task->out = out;
+        task->batch = &batch;
+        task->trace = first.trace;
+        task->next = NULL;
+
+        if (tasks.tail == NULL)
+            tasks.head = task;
+        else
+            tasks.tail->next = task;
+        tasks.tail = task;
+    }
+    pthread_cond_broadcast(&tasks.notEmpty);
+    pthread_mutex_unlock(&tasks.lock);
+
+    sendChunk(&first);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending > 0)
+        pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+    free(chunks);
+}
@@ -0,0 +1,623 @@
+#include "handoff.h"
+#include "cluster.h"
+#include "batch.h"
+#include "shmring.h"
+#include "timer.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+static struct {
+    int wakeFd;
+    int successor;  // connection from a new server, -1 while none waits
+    int frozen;
+    conn **adopted;
+    size_t numAdopted;
+    pthread_mutex_t lock;
+} handoff = { .wakeFd = -1, .successor = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// The state record, in host byte order: both ends are the same machine.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} record;
+
+typedef struct {
+    int *fds;
+    size_t count;
+    size_t cap;
+} fdList;
+
+// Reading side; a cursor that ran past the end stays bad.
+typedef struct {
+    const char *p;
+    size_t left;
+    int bad;
+} cursor;
+
+static void put(record *r, const void *p, size_t n) {
+    if (r->len + n > r->cap) {
+        size_t cap = r->cap ? r->cap : 4096;
+        while (cap < r->len + n)
+            cap *= 2;
+        char *data = realloc(r->data, cap);
+        if (data == NULL) {
+            printf("Out of memory writing handoff state\n");
+            exit(EXIT_FAILURE);
+        }
+        r->data = data;
+        r->cap = cap;
+    }
+    memcpy(r->data + r->len, p, n);
+    r->len += n;
+}
+
+static void put32(record *r, uint32_t v) {
+    put(r, &v, sizeof(v));
+}
+
+static void put64(record *r, uint64_t v) {
+    put(r, &v, sizeof(v));
+}
+
+static void putString(record *r, const char *s) {
+    uint32_t len = strlen(s);
+    put32(r, len);
+    put(r, s, len);
+}
+
+static uint32_t addFd(fdList *l, int fd) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        int *fds = realloc(l->fds, cap * sizeof(int));
+        if (fds == NULL) {
+            printf("Out of memory writing handoff state\n");
+            exit(EXIT_FAILURE);
+        }
+        l->fds = fds;
+        l->cap = cap;
+    }
+    l->fds[l->count] = fd;
+    return l->count++;
+}
+
+static void get(cursor *c, void *out, size_t n) {
+    if (c->bad || n > c->left) {
+        c->bad = 1;
+        memset(out, 0, n);
+        return;
+    }
+    memcpy(out, c->p, n);
+    c->p += n;
+    c->left -= n;
+}
+
+static uint32_t get32(cursor *c) {
+    uint32_t v;
+    get(c, &v, sizeof(v));
+    return v;
+}
+
+static uint64_t get64(cursor *c) {
+    uint64_t v;
+    get(c, &v, sizeof(v));
+    return v;
+}
+
+static char *getString(cursor *c) {
+    uint32_t len = get32(c);
+    if (c->bad || len > c->left) {
+        c->bad = 1;
+        return NULL;
+    }
+    char *s = malloc(len + 1);
+    if (s == NULL) {
+        printf("Out of memory reading handoff state\n");
+        exit(EXIT_FAILURE);
+    }
+    get(c, s, len);
+    s[len] = '\0';
+    return s;
+}
+
+// A descriptor sent along; an index past what came is a broken record.
+static int getFd(cursor *c, const int *fds, size_t numFds) {
+    uint32_t index = get32(c);
+    if (index >= numFds) {
+        c->bad = 1;
+        return -1;
+    }
+    return fds[index];
+}
+
+static int readFull(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One byte per message, so the receiver gets exactly one batch per read.
+static int sendFds(int sock, const int *fds, size_t count) {
+    for (size_t at = 0; at < count; at += HANDOFF_FDS_PER_MSG) {
+        size_t n = count - at < HANDOFF_FDS_PER_MSG ? count - at : HANDOFF_FDS_PER_MSG;
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        } control;
+        memset(&control, 0, sizeof(control));
+        char mark = 'F';
+        struct iovec iov = { &mark, 1 };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds + at, n * sizeof(int));
+
+        ssize_t sent;
+        do
+            sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        while (sent < 0 && errno == EINTR);
+        if (sent != 1)
+            return -1;
+    }
+    return 0;
+}
+
+static int recvFds(int sock, int *fds, size_t count) {
+    for (size_t at = 0; at < count;) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+        } control;
+        char mark;
+        struct iovec iov = { &mark, 1 };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+            continue;
+        struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+            (msg.msg_flags & MSG_CTRUNC))
+            return -1;
+        size_t got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (got > count - at)
+            return -1;
+        memcpy(fds + at, CMSG_DATA(cmsg), got * sizeof(int));
+        at += got;
+    }
+    return 0;
+}
+
+typedef struct {
+    record *state;
+    fdList *fds;
+    conn **conns;
+    size_t maxConns;
+    uint32_t count;
+    char *partial;  // a frame's worth of scratch for connPartial
+} snapshot;
+
+static void putConn(snapshot *s, conn *c) {
+    put32(s->state, addFd(s->fds, c->fd));
+    uint32_t len = connPartial(c, s->partial);
+    put32(s->state, len);
+    put(s->state, s->partial, len);
+}
+
+static void snapshotUser(const user *u, void *arg) {
+    snapshot *s = arg;
+    conn *c = (size_t)u->fd < s->maxConns ? s->conns[u->fd] : NULL;
+    if (c == NULL || c->client != u)
+        return;
+
+    putConn(s, c);
+    putString(s->state, u->username);
+    put64(s->state, u->id);
+    put32(s->state, u->features);
+    put32(s->state, u->ring != NULL);
+    if (u->ring != NULL) {
+        int memfd, doorbell;
+        uint64_t head;
+        shmRingState(u->ring, &memfd, &doorbell, &head);
+        put32(s->state, addFd(s->fds, memfd));
+        put32(s->state, addFd(s->fds, doorbell));
+        put64(s->state, head);
+    }
+    s->count++;
+}
+
+static void snapshotRoom(const room *r, void *arg) {
+    snapshot *s = arg;
+    putString(s->state, r->roomName);
+    put32(s->state, r->members.size);
+    // in set order, which keeps the creator first
+    for (size_t i = 0; i < r->members.size; i++) {
+        const user *member = r->members.entries[i].member;
+        put64(s->state, member->id);
+        put32(s->state, member->node);
+        put32(s->state, member->features);
+        putString(s->state, member->username);
+    }
+    s->count++;
+}
+
+// Write a count not known until its items are: reserve it, then fill it in.
+static size_t putCountLater(record *r) {
+    put32(r, 0);
+    return r->len - sizeof(uint32_t);
+}
+
+static void fillCount(record *r, size_t at, uint32_t count) {
+    memcpy(r->data + at, &count, sizeof(count));
+}
+
+static void snapshotTake(record *state, fdList *fds, conn **conns, size_t maxConns) {
+    snapshot s = { state, fds, conns, maxConns, 0, malloc(PETR_HEADER_SIZE + MAX_MSG_LEN) };
+    if (s.partial == NULL) {
+        printf("Out of memory writing handoff state\n");
+        exit(EXIT_FAILURE);
+    }
+
+    put32(state, HANDOFF_MAGIC);
+    put32(state, HANDOFF_VERSION);
+    put64(state, serverNextId());
+
+    int listenFds[2];
+    const char *unixPath = NULL;
+    int numListen = serverListeners(listenFds, &unixPath);
+    put32(state, numListen);
+    for (int i = 0; i < numListen; i++)
+        put32(state, addFd(fds, listenFds[i]));
+    putString(state, unixPath != NULL ? unixPath : "");
+
+    size_t at = putCountLater(state);
+    serverLocalUsers(snapshotUser, &s);
+    fillCount(state, at, s.count);
+
+    // connections that have not logged in yet, with what they sent so far;
+    // a user that logged out only waits for its client to hang up
+    at = putCountLater(state);
+    s.count = 0;
+    for (size_t fd = 0; fd < maxConns; fd++) {
+        if (conns[fd] != NULL && conns[fd]->client == NULL) {
+            putConn(&s, conns[fd]);
+            s.count++;
+        }
+    }
+    fillCount(state, at, s.count);
+
+    at = putCountLater(state);
+    s.count = 0;
+    serverRooms(snapshotRoom, &s);
+    fillCount(state, at, s.count);
+    free(s.partial);
+}
+
+static int sendState(int sock, record *state, fdList *fds) {
+    uint64_t len = state->len;
+    uint32_t numFds = fds->count;
+    struct iovec iov[3] = {
+        { &len, sizeof(len) },
+        { state->data, state->len },
+        { &numFds, sizeof(numFds) },
+    };
+    if (wr_iov(sock, iov, 3) < 0 || sendFds(sock, fds->fds, fds->count) < 0)
+        return -1;
+
+    char ack;
+    return readFull(sock, &ack, 1) < 0 || ack != 'K' ? -1 : 0;
+}
+
+void handoffRun(conn **conns, size_t maxConns) {
+    uint64_t wakes;
+    if (read(handoff.wakeFd, &wakes, sizeof(wakes)) < 0)
+        return;
+    pthread_mutex_lock(&handoff.lock);
+    int sock = handoff.successor;
+    pthread_mutex_unlock(&handoff.lock);
+    if (sock < 0)
+        return;
+
+    // nothing but this thread writes to a client from here on
+    printf("Handing over to a new server\n");
+    __atomic_store_n(&handoff.frozen, 1, __ATOMIC_RELEASE);
+    timersHold(1);
+    serverWaitIdle();
+    batchHold(1);
+
+    record state = { NULL, 0, 0 };
+    fdList fds = { NULL, 0, 0 };
+    snapshotTake(&state, &fds, conns, maxConns);
+    if (sendState(sock, &state, &fds) == 0) {
+        printf("Handed over %zu descriptors, exiting\n", fds.count);
+        exit(EXIT_SUCCESS);
+    }
+
+    printf("New server went away during handoff, serving on\n");
+    free(state.data);
+    free(fds.fds);
+    close(sock);
+    pthread_mutex_lock(&handoff.lock);
+    handoff.successor = -1;
+    pthread_mutex_unlock(&handoff.lock);
+    batchHold(0);
+    timersHold(0);
+    __atomic_store_n(&handoff.frozen, 0, __ATOMIC_RELEASE);
+}
+
+int handoffFrozen(void) {
+    return __atomic_load_n(&handoff.frozen, __ATOMIC_ACQUIRE);
+}
+
+int handoffWakeFd(void) {
+    return handoff.wakeFd;
+}
+
+static void adoptConn(int fd, user *client, const char *partial, size_t len) {
+    conn *c = malloc(sizeof(conn));
+    conn **adopted = realloc(handoff.adopted, (handoff.numAdopted + 1) * sizeof(conn *));
+    if (c == NULL || adopted == NULL) {
+        printf("Out of memory taking over connections\n");
+        exit(EXIT_FAILURE);
+    }
+    connInit(c, fd);
+    c->client = client;
+    // an unfinished frame, so this only buffers it
+    if (connFeed(c, partial, len) < 0) {
+        printf("Bad frame in handoff state\n");
+        exit(EXIT_FAILURE);
+    }
+    handoff.adopted = adopted;
+    handoff.adopted[handoff.numAdopted++] = c;
+}
+
+typedef struct {
+    int fd;
+    const char *partial;
+    uint32_t partialLen;
+    char *name;
+    unsigned long id;
+    unsigned int features;
+    shmRing *ring;
+} adoptedUser;
+
+typedef struct {
+    char *name;
+    user *members;
+    uint32_t count;
+} adoptedRoom;
+
+static void getConn(cursor *c, const int *fds, size_t numFds, int *fd, const char **partial, uint32_t *len) {
+    *fd = getFd(c, fds, numFds);
+    *len = get32(c);
+    *partial = c->p;
+    if (c->bad || *len > PETR_HEADER_SIZE + MAX_MSG_LEN || *len > c->left) {
+        c->bad = 1;
+        return;
+    }
+    c->p += *len;
+    c->left -= *len;
+}
+
+// Rebuild users, connections and rooms from the record. Lists are rebuilt
+// newest first, so items go in from the back to keep the old order.
+static int adopt(cursor *c, const int *fds, size_t numFds, int *listenFds, char **unixPath) {
+    if (get32(c) != HANDOFF_MAGIC || get32(c) != HANDOFF_VERSION)
+        return -1;
+    unsigned long nextId = get64(c);
+
+    uint32_t numListen = get32(c);
+    if (numListen < 1 || numListen > 2)
+        return -1;
+    for (uint32_t i = 0; i < numListen; i++)
+        listenFds[i] = getFd(c, fds, numFds);
+    *unixPath = getString(c);
+
+    uint32_t numUsers = get32(c);
+    if (c->bad || numUsers > numFds)
+        return -1;
+    adoptedUser *users = calloc(numUsers ? numUsers : 1, sizeof(adoptedUser));
+    for (uint32_t i = 0; i < numUsers && !c->bad; i++) {
+        adoptedUser *u = &users[i];
+        getConn(c, fds, numFds, &u->fd, &u->partial, &u->partialLen);
+        u->name = getString(c);
+        u->id = get64(c);
+        u->features = get32(c);
+        if (get32(c)) {
+            int memfd = getFd(c, fds, numFds);
+            int doorbell = getFd(c, fds, numFds);
+            uint64_t head = get64(c);
+            if (!c->bad && (u->ring = shmRingAdopt(memfd, doorbell, head)) == NULL)
+                c->bad = 1;
+        }
+    }
+    if (c->bad)
+        return -1;
+
+    serverAdoptNextId(nextId);
+    for (uint32_t i = numUsers; i-- > 0;) {
+        adoptedUser *u = &users[i];
+        adoptConn(u->fd, serverAdoptUser(u->name, u->id, u->fd, u->features, u->ring), u->partial, u->partialLen);
+    }
+    free(users);
+
+    uint32_t numPending = get32(c);
+    for (uint32_t i = 0; i < numPending && !c->bad; i++) {
+        int fd;
+        const char *partial;
+        uint32_t len;
+        getConn(c, fds, numFds, &fd, &partial, &len);
+        if (!c->bad) {
+            adoptConn(fd, NULL, partial, len);
+            timersAccepted(fd);
+        }
+    }
+
+    uint32_t numRooms = get32(c);
+    if (c->bad || numRooms > c->left)
+        return -1;
+    adoptedRoom *rooms = calloc(numRooms ? numRooms : 1, sizeof(adoptedRoom));
+    for (uint32_t i = 0; i < numRooms && !c->bad; i++) {
+        adoptedRoom *r = &rooms[i];
+        r->name = getString(c);
+        r->count = get32(c);
+        if (r->count == 0 || r->count > c->left) {
+            c->bad = 1;
+            break;
+        }
+        r->members = calloc(r->count, sizeof(user));
+        for (uint32_t m = 0; m < r->count; m++) {
+            r->members[m].id = get64(c);
+            r->members[m].node = get32(c);
+            if (r->members[m].node != clusterSelf() && !clusterPeer(r->members[m].node))
+                c->bad = 1;
+            r->members[m].features = get32(c);
+            r->members[m].fd = -1;
+            r->members[m].username = getString(c);
+        }
+    }
+    if (c->bad)
+        return -1;
+    for (uint32_t i = numRooms; i-- > 0;) {
+        serverAdoptRoom(rooms[i].name, rooms[i].members, rooms[i].count);
+        for (uint32_t m = 0; m < rooms[i].count; m++)
+            free(rooms[i].members[m].username);
+        free(rooms[i].members);
+    }
+    free(rooms);
+    return numListen;
+}
+
+int handoffTakeOver(const char *path, int *listenFds, char **unixPath) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Handoff socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (SA *)&addr, sizeof(addr)) < 0) {
+        if (sock >= 0)
+            close(sock);
+        return 0;
+    }
+    printf("Taking over from the server at %s\n", path);
+
+    uint64_t len;
+    uint32_t numFds;
+    char *data = NULL;
+    int *fds = NULL;
+    if (readFull(sock, &len, sizeof(len)) < 0 || (data = malloc(len ? len : 1)) == NULL ||
+        readFull(sock, data, len) < 0 || readFull(sock, &numFds, sizeof(numFds)) < 0 ||
+        (fds = malloc((numFds ? numFds : 1) * sizeof(int))) == NULL || recvFds(sock, fds, numFds) < 0) {
+        printf("Handoff from %s failed\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    // the old server serves on if this one dies before acknowledging
+    cursor c = { data, len, 0 };
+    int numListen = adopt(&c, fds, numFds, listenFds, unixPath);
+    if (numListen < 0) {
+        printf("Bad handoff state from %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (**unixPath == '\0') {
+        free(*unixPath);
+        *unixPath = NULL;
+    }
+
+    char ack = 'K';
+    if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+        printf("Handoff from %s failed\n", path);
+        exit(EXIT_FAILURE);
+    }
+    printf("Took over %zu connections\n", handoff.numAdopted);
+    close(sock);
+    free(data);
+    free(fds);
+    return numListen;
+}
+
+conn **handoffAdopted(size_t *count) {
+    conn **adopted = handoff.adopted;
+    *count = handoff.numAdopted;
+    handoff.adopted = NULL;
+    handoff.numAdopted = 0;
+    return adopted;
+}
+
+static void *process_handoff(void *arg) {
+    int listenFd = (int)(long)arg;
+    uint64_t one = 1;
+
+    while (1) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("handoff accept");
+            exit(EXIT_FAILURE);
+        }
+
+        // one successor at a time
+        pthread_mutex_lock(&handoff.lock);
+        if (handoff.successor >= 0) {
+            pthread_mutex_unlock(&handoff.lock);
+            close(fd);
+            continue;
+        }
+        handoff.successor = fd;
+        pthread_mutex_unlock(&handoff.lock);
+        if (write(handoff.wakeFd, &one, sizeof(one)) < 0)
+            perror("handoff wake");
+    }
+    return NULL;
+}
+
+void handoffListen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // whoever had it has handed over, or is gone
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (SA *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        printf("handoff socket bind failed\n");
+        exit(EXIT_FAILURE);
+    }
+    handoff.wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (handoff.wakeFd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, process_handoff, (void *)(long)fd);
+    printf("Waiting for a successor on %s\n", path);
+}
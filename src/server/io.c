@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include "io.h"
+#include "handoff.h"
+#include "timer.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define RECV_CHUNK 65536
+#define EPOLL_BATCH 256
+
+int ioParseBackend(const char *name, ioBackend *backend) {
+    if (strcmp(name, "threads") == 0)
+        *backend = IO_THREADS;
+    else if (strcmp(name, "epoll") == 0)
+        *backend = IO_EPOLL;
+    else if (strcmp(name, "uring") == 0)
+        *backend = IO_URING;
+    else
+        return -1;
+    return 0;
+}
+
+void connInit(conn *c, int fd) {
+    static unsigned int nextGen = 0;
+
+    c->fd = fd;
+    c->gen = ++nextGen;
+    c->client = NULL;
+    c->msg = NULL;
+    c->have = 0;
+    c->paused = 0;
+    c->armed = 0;
+    c->nextPaused = NULL;
+}
+
+// The first frame on a connection is its LOGIN, every later one is a job.
+static int dispatch(conn *c) {
+    char *msg = c->msg;
+    petr_header *header = (petr_header*)msg;
+
+    msg[sizeof(petr_header) + header->msg_len] = '\0';
+    c->msg = NULL;
+    c->have = 0;
+
+    if (c->client == NULL) {
+        c->client = serverLogin(c->fd, msg);
+        return c->client == NULL ? -1 : 0;
+    }
+    traceReceived(c->started);
+    serverEnqueue(c->client, msg);
+    return 0;
+}
+
+int connFeed(conn *c, const char *data, size_t len) {
+    while (1) {
+        if (c->have < PETR_HEADER_SIZE) {
+            if (len == 0)
+                return 0;
+
+            size_t n = PETR_HEADER_SIZE - c->have;
+            if (n > len)
+                n = len;
+            memcpy(c->wireHeader + c->have, data, n);
+            c->have += n;
+            data += n;
+            len -= n;
+            if (c->have < PETR_HEADER_SIZE)
+                return 0;
+
+            petr_header header;
+            petr_header_unpack(c->wireHeader, &header);
+            if (header.msg_len > MAX_MSG_LEN) {
+                printf("Message too large (%u bytes)\n", header.msg_len);
+                return -1;
+            }
+            c->msg = malloc(sizeof(petr_header) + header.msg_len + 1);
+            memcpy(c->msg, &header, sizeof(petr_header));
+            c->started = traceNow();
+        }
+
+        petr_header *header = (petr_header*)c->msg;
+        size_t bodyHave = c->have - PETR_HEADER_SIZE;
+        size_t n = header->msg_len - bodyHave;
+        if (n > len)
+            n = len;
+        memcpy(c->msg + sizeof(petr_header) + bodyHave, data, n);
+        c->have += n;
+        data += n;
+        len -= n;
+
+        if (c->have < PETR_HEADER_SIZE + header->msg_len)
+            return 0;
+        if (dispatch(c) < 0)
+            return -1;
+    }
+}
+
+size_t connPartial(const conn *c, char *out) {
+    size_t header = c->have < PETR_HEADER_SIZE ? c->have : PETR_HEADER_SIZE;
+    memcpy(out, c->wireHeader, header);
+    if (c->have > PETR_HEADER_SIZE)
+        memcpy(out + header, c->msg + sizeof(petr_header), c->have - PETR_HEADER_SIZE);
+    return c->have;
+}
+
+int connShouldPause(conn *c) {
+    return c->client != NULL && serverPauseReads(c->client);
+}
+
+void connClose(conn *c) {
+    free(c->msg);
+    c->msg = NULL;
+    if (c->client != NULL)
+        serverHangup(c->client);
+    else
+        serverDisconnect(c->fd);
+}
+
+size_t ioMaxConns(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+        return 65536;
+    return limit.rlim_cur;
+}
+
+// Single reactor thread: level-triggered epoll over every connection. The
+// sockets stay blocking for the job threads' writes, so reads use
+// MSG_DONTWAIT and take one chunk per wakeup. A connection with too much
+// queued is taken out of the set until its jobs drain.
+void runEpoll(const int *listenFds, int numListen) {
+    static char buf[RECV_CHUNK];
+    struct epoll_event events[EPOLL_BATCH];
+    size_t maxConns = ioMaxConns();
+    conn **conns = calloc(maxConns, sizeof(conn *));
+    conn *paused = NULL;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0 || conns == NULL) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    for (int l = 0; l < numListen; l++) {
+        fcntl(listenFds[l], F_SETFL, fcntl(listenFds[l], F_GETFL) | O_NONBLOCK);
+        ev.data.fd = listenFds[l];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listenFds[l], &ev);
+    }
+    int wakeFd = handoffWakeFd();
+    if (wakeFd >= 0) {
+        ev.data.fd = wakeFd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+
+    size_t numAdopted;
+    conn **adopted = handoffAdopted(&numAdopted);
+    for (size_t i = 0; i < numAdopted; i++) {
+        conn *c = adopted[i];
+        conns[c->fd] = c;
+        ev.data.fd = c->fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+    free(adopted);
+
+    printf("Serving clients with epoll\n");
+    while (1) {
+        int n = epoll_wait(epfd, events, EPOLL_BATCH, paused != NULL ? IO_RESUME_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (conn **p = &paused; *p != NULL;) {
+            conn *c = *p;
+            if (!serverCanResume(c->client)) {
+                p = &c->nextPaused;
+                continue;
+            }
+            *p = c->nextPaused;
+            c->paused = 0;
+            ev.events = EPOLLIN;
+            ev.data.fd = c->fd;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                // nothing is read while it runs, which is all it needs
+                handoffRun(conns, maxConns);
+                continue;
+            }
+            int listening = 0;
+            for (int l = 0; l < numListen; l++)
+                listening |= fd == listenFds[l];
+
+            if (listening) {
+                int client_fd;
+                while ((client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                    if ((size_t)client_fd >= maxConns) {
+                        close(client_fd);
+                        continue;
+                    }
+                    conn *c = malloc(sizeof(conn));
+                    connInit(c, client_fd);
+                    conns[client_fd] = c;
+                    timersAccepted(client_fd);
+
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client_fd;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev);
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("accept4");
+                continue;
+            }
+
+            conn *c = conns[fd];
+            if (c == NULL)
+                continue;
+
+            ssize_t received = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+
+            if (received <= 0 || connFeed(c, buf, received) < 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                conns[fd] = NULL;
+                connClose(c);
+                free(c);
+            } else if (connShouldPause(c)) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                c->paused = 1;
+                c->nextPaused = paused;
+                paused = c;
+            }
+        }
+    }
+}
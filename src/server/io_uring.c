@@ -0,0 +1,480 @@
+#include "io.h"
+#include "handoff.h"
+#include "timer.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 1024
+#define RECV_BUFS 1024          // provided receive buffers, a power of two
+#define RECV_BUF_SIZE 16384
+#define RECV_GROUP 0
+
+// user_data: operation in the top byte, connection generation in the next
+// 24 bits and the fd in the low 32, so completions for a closed (and maybe
+// reused) fd can be recognised and dropped.
+enum { OP_ACCEPT = 1, OP_RECV, OP_CANCEL, OP_TICK, OP_HANDOFF };
+
+#define USER_DATA(op, gen, fd) ((uint64_t)(op) << 56 | (uint64_t)((gen) & 0xffffff) << 32 | (uint32_t)(fd))
+#define USER_OP(data) ((data) >> 56)
+#define USER_GEN(data) (((data) >> 32) & 0xffffff)
+#define USER_FD(data) ((int)((data) & 0xffffffff))
+
+static struct {
+    int fd;
+    unsigned sqEntries;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;
+
+    struct io_uring_buf_ring *bufRing;
+    unsigned short bufTail;
+    char *bufs;
+
+    conn **conns;
+    size_t maxConns;
+
+    conn *paused;  // receive cancelled until their queued jobs drain
+    int ticking;
+
+    const int *listenFds;
+    int numListen;
+    // a handoff waits for every accept and receive to finish, as nothing
+    // may be read once it starts; these count what is still outstanding
+    int handingOff;
+    int accepting;
+    size_t receiving;
+} ring;
+
+static int uringSetup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // multishot recv can post many completions per submission
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 8;
+
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring.fd);
+        return -1;
+    }
+
+    size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+
+    char *ptr = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+
+    ring.sqEntries = p.sq_entries;
+    ring.sqHead = (unsigned *)(ptr + p.sq_off.head);
+    ring.sqTail = (unsigned *)(ptr + p.sq_off.tail);
+    ring.sqMask = (unsigned *)(ptr + p.sq_off.ring_mask);
+    ring.sqArray = (unsigned *)(ptr + p.sq_off.array);
+    ring.cqHead = (unsigned *)(ptr + p.cq_off.head);
+    ring.cqTail = (unsigned *)(ptr + p.cq_off.tail);
+    ring.cqMask = (unsigned *)(ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+    ring.toSubmit = 0;
+    return 0;
+}
+
+static void recycleBuffer(unsigned short bid) {
+    struct io_uring_buf *buf = &ring.bufRing->bufs[ring.bufTail & (RECV_BUFS - 1)];
+    buf->addr = (unsigned long)(ring.bufs + (size_t)bid * RECV_BUF_SIZE);
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bid;
+    ring.bufTail++;
+    __atomic_store_n(&ring.bufRing->tail, ring.bufTail, __ATOMIC_RELEASE);
+}
+
+// Receive buffers live in a provided-buffer ring registered with the
+// kernel, and every socket gets a slot in the fixed file table (slot = fd).
+static int uringRegister(void) {
+    ring.bufRing = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                        MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    ring.bufs = malloc((size_t)RECV_BUFS * RECV_BUF_SIZE);
+    if (ring.bufRing == MAP_FAILED || ring.bufs == NULL)
+        return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring.bufRing;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    ring.bufTail = 0;
+    for (unsigned i = 0; i < RECV_BUFS; i++)
+        recycleBuffer(i);
+
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = ring.maxConns;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0)
+        return -1;
+    return 0;
+}
+
+static int setFixedFile(int slot, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (unsigned long)&fd;
+    return syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
+
+static int submit(unsigned waitNr) {
+    while (1) {
+        int ret = syscall(__NR_io_uring_enter, ring.fd, ring.toSubmit, waitNr, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            ring.toSubmit -= ret;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+        if (errno != EINTR)
+            return 0;
+    }
+}
+
+static struct io_uring_sqe *getSqe(void) {
+    unsigned tail = *ring.sqTail;
+    if (tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.sqEntries) {
+        submit(0);
+        if (tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.sqEntries)
+            return NULL;
+    }
+
+    unsigned index = tail & *ring.sqMask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sqArray[index] = index;
+    return sqe;
+}
+
+static void pushSqe(void) {
+    __atomic_store_n(ring.sqTail, *ring.sqTail + 1, __ATOMIC_RELEASE);
+    ring.toSubmit++;
+}
+
+static void armAccept(int listen_fd) {
+    if (ring.handingOff)
+        return;
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == NULL) {
+        printf("io_uring submission queue full\n");
+        exit(EXIT_FAILURE);
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = USER_DATA(OP_ACCEPT, 0, listen_fd);
+    pushSqe();
+    ring.accepting++;
+}
+
+static void armRecv(conn *c) {
+    if (ring.handingOff)
+        return;
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == NULL) {
+        printf("io_uring submission queue full\n");
+        exit(EXIT_FAILURE);
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;  // index into the fixed file table
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = USER_DATA(OP_RECV, c->gen, c->fd);
+    pushSqe();
+    c->armed = 1;
+    ring.receiving++;
+}
+
+static void cancelRecv(conn *c) {
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = USER_DATA(OP_RECV, c->gen, c->fd);
+        sqe->user_data = USER_DATA(OP_CANCEL, c->gen, c->fd);
+        pushSqe();
+    }
+}
+
+static void armTick(void) {
+    static struct __kernel_timespec interval = { 0, IO_RESUME_MS * 1000000L };
+
+    if (ring.handingOff)
+        return;
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&interval;
+    sqe->len = 1;
+    sqe->user_data = USER_DATA(OP_TICK, 0, 0);
+    pushSqe();
+    ring.ticking = 1;
+}
+
+// Stop receiving on c until the scheduler has worked through its backlog.
+static void pauseConn(conn *c) {
+    c->paused = 1;
+    c->nextPaused = ring.paused;
+    ring.paused = c;
+    if (c->armed)
+        cancelRecv(c);
+    if (!ring.ticking)
+        armTick();
+}
+
+static void unlinkPaused(conn *c) {
+    for (conn **p = &ring.paused; *p != NULL; p = &(*p)->nextPaused) {
+        if (*p == c) {
+            *p = c->nextPaused;
+            break;
+        }
+    }
+    c->paused = 0;
+}
+
+// Re-arm paused connections whose cancelled receive has completed and
+// whose jobs have drained below their share.
+static void handleTick(void) {
+    ring.ticking = 0;
+    for (conn **p = &ring.paused; *p != NULL;) {
+        conn *c = *p;
+        if (c->armed || !serverCanResume(c->client)) {
+            p = &c->nextPaused;
+            continue;
+        }
+        *p = c->nextPaused;
+        c->paused = 0;
+        armRecv(c);
+    }
+    if (ring.paused != NULL)
+        armTick();
+}
+
+static void closeConn(conn *c) {
+    if (c->armed)
+        cancelRecv(c);
+    if (c->paused)
+        unlinkPaused(c);
+
+    setFixedFile(c->fd, -1);
+    ring.conns[c->fd] = NULL;
+    connClose(c);
+    free(c);
+}
+
+static void handleAccept(struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        ring.accepting--;
+        armAccept(USER_FD(cqe->user_data));
+    }
+
+    if (cqe->res == -ECANCELED && ring.handingOff)
+        return;
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("accept");
+        return;
+    }
+
+    int client_fd = cqe->res;
+    if ((size_t)client_fd >= ring.maxConns || setFixedFile(client_fd, client_fd) < 0) {
+        close(client_fd);
+        return;
+    }
+
+    conn *c = malloc(sizeof(conn));
+    connInit(c, client_fd);
+    ring.conns[client_fd] = c;
+    timersAccepted(client_fd);
+    armRecv(c);
+}
+
+static void handleRecv(struct io_uring_cqe *cqe) {
+    int fd = USER_FD(cqe->user_data);
+    conn *c = ring.conns[fd];
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int hasBuffer = cqe->flags & IORING_CQE_F_BUFFER;
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (!more)
+        ring.receiving--;
+
+    // completion for a connection that has since been closed
+    if (c == NULL || (c->gen & 0xffffff) != USER_GEN(cqe->user_data)) {
+        if (hasBuffer)
+            recycleBuffer(bid);
+        return;
+    }
+
+    if (!more)
+        c->armed = 0;
+
+    if (cqe->res == -ENOBUFS || (cqe->res == -ECANCELED && (c->paused || ring.handingOff))) {
+        if (!more && !c->paused)
+            armRecv(c);
+        return;
+    }
+
+    if (cqe->res <= 0) {
+        if (hasBuffer)
+            recycleBuffer(bid);
+        closeConn(c);
+        return;
+    }
+
+    int ret = connFeed(c, ring.bufs + (size_t)bid * RECV_BUF_SIZE, cqe->res);
+    recycleBuffer(bid);
+    if (ret < 0) {
+        closeConn(c);
+        return;
+    }
+    if (!c->paused && connShouldPause(c))
+        pauseConn(c);
+    else if (!more && !c->paused)
+        armRecv(c);
+}
+
+static void armHandoff(void) {
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == NULL) {
+        printf("io_uring submission queue full\n");
+        exit(EXIT_FAILURE);
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handoffWakeFd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = USER_DATA(OP_HANDOFF, 0, 0);
+    pushSqe();
+}
+
+// A successor is waiting: stop accepting and receiving. Data already on
+// its way still comes in and is fed; the handoff runs once none is left.
+static void startHandoff(void) {
+    ring.handingOff = 1;
+    for (int l = 0; l < ring.numListen; l++) {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == NULL)
+            break;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = USER_DATA(OP_ACCEPT, 0, ring.listenFds[l]);
+        sqe->user_data = USER_DATA(OP_CANCEL, 0, ring.listenFds[l]);
+        pushSqe();
+    }
+    for (size_t fd = 0; fd < ring.maxConns; fd++) {
+        if (ring.conns[fd] != NULL && ring.conns[fd]->armed)
+            cancelRecv(ring.conns[fd]);
+    }
+}
+
+// The successor went away: pick up where the loop left off.
+static void resumeAfterHandoff(void) {
+    ring.handingOff = 0;
+    for (int l = 0; l < ring.numListen; l++)
+        armAccept(ring.listenFds[l]);
+    for (size_t fd = 0; fd < ring.maxConns; fd++) {
+        conn *c = ring.conns[fd];
+        if (c != NULL && !c->armed && !c->paused)
+            armRecv(c);
+    }
+    if (ring.paused != NULL)
+        armTick();
+    armHandoff();
+}
+
+int runUring(const int *listenFds, int numListen) {
+    ring.maxConns = ioMaxConns();
+    if (uringSetup() < 0)
+        return -1;
+    if (uringRegister() < 0) {
+        close(ring.fd);
+        return -1;
+    }
+
+    ring.conns = calloc(ring.maxConns, sizeof(conn *));
+    ring.paused = NULL;
+    ring.ticking = 0;
+    ring.listenFds = listenFds;
+    ring.numListen = numListen;
+    if (ring.conns == NULL) {
+        close(ring.fd);
+        return -1;
+    }
+
+    printf("Serving clients with io_uring\n");
+    for (int l = 0; l < numListen; l++)
+        armAccept(listenFds[l]);
+    if (handoffWakeFd() >= 0)
+        armHandoff();
+
+    size_t numAdopted;
+    conn **adopted = handoffAdopted(&numAdopted);
+    for (size_t i = 0; i < numAdopted; i++) {
+        conn *c = adopted[i];
+        if ((size_t)c->fd >= ring.maxConns || setFixedFile(c->fd, c->fd) < 0) {
+            connClose(c);
+            free(c);
+            continue;
+        }
+        ring.conns[c->fd] = c;
+        armRecv(c);
+    }
+    free(adopted);
+
+    while (1) {
+        if (submit(1) < 0) {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cqMask];
+            switch (USER_OP(cqe->user_data)) {
+            case OP_ACCEPT:
+                handleAccept(cqe);
+                break;
+            case OP_RECV:
+                handleRecv(cqe);
+                break;
+            case OP_TICK:
+                handleTick();
+                break;
+            case OP_HANDOFF:
+                startHandoff();
+                break;
+            default:
+                break;
+            }
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+        if (ring.handingOff && ring.accepting == 0 && ring.receiving == 0 && !ring.ticking) {
+            handoffRun(ring.conns, ring.maxConns);
+            resumeAfterHandoff();
+        }
+    }
+    return 0;
+}
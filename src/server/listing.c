@@ -0,0 +1,502 @@
+#include "listing.h"
+#include "cluster.h"
+#include "epoch.h"
+#include "protocol.h"
+
+void listCacheInit(listCache *cache) {
+    cache->current = NULL;
+    // start dirty so the first request builds the frame
+    cache->version = 1;
+}
+
+void listCacheInvalidate(listCache *cache) {
+    __atomic_add_fetch(&cache->version, 1, __ATOMIC_RELEASE);
+}
+
+listFrame *listCacheFrame(listCache *cache) {
+    listFrame *frame = __atomic_load_n(&cache->current, __ATOMIC_ACQUIRE);
+    if (frame == NULL || frame->version != __atomic_load_n(&cache->version, __ATOMIC_ACQUIRE))
+        return NULL;
+    return frame;
+}
+
+// A frame being built, before it is published.
+typedef struct {
+    listFrame *frame;
+    size_t cap;
+} listBuild;
+
+static int reserve(listBuild *build, size_t needed) {
+    if (needed <= build->cap)
+        return 0;
+
+    size_t newCap = build->cap ? build->cap : BUFFER_SIZE;
+    while (newCap < needed)
+        newCap *= 2;
+
+    listFrame *newFrame = realloc(build->frame, sizeof(listFrame) + newCap);
+    if (newFrame == NULL)
+        return -1;
+
+    build->frame = newFrame;
+    build->cap = newCap;
+    return 0;
+}
+
+static int append(listBuild *build, const char *str, size_t len) {
+    if (reserve(build, build->frame->len + len) < 0)
+        return -1;
+    memcpy(build->frame->data + build->frame->len, str, len);
+    build->frame->len += len;
+    return 0;
+}
+
+static int buildStart(listBuild *build, listCache *cache) {
+    build->frame = NULL;
+    build->cap = 0;
+    if (reserve(build, PETR_HEADER_SIZE) < 0)
+        return -1;
+    build->frame->len = PETR_HEADER_SIZE;
+    build->frame->version = cache->version;
+    return 0;
+}
+
+static int buildFinish(listBuild *build, listCache *cache, uint8_t msg_type) {
+    listFrame *frame = build->frame;
+    if (frame->len > PETR_HEADER_SIZE && append(build, "", 1) < 0)
+        return -1;
+
+    petr_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = msg_type;
+    // an empty listing is sent as a bare header
+    header.msg_len = build->frame->len - PETR_HEADER_SIZE;
+    petr_header_pack(&header, (uint8_t *)build->frame->data);
+
+    listFrame *old = cache->current;
+    __atomic_store_n(&cache->current, build->frame, __ATOMIC_RELEASE);
+    if (old != NULL)
+        epochRetire(free, old);
+    return 0;
+}
+
+int listCacheRooms(listCache *cache, room *head, room *replicas) {
+    if (listCacheFrame(cache) != NULL)
+        return 0;
+
+    listBuild build;
+    if (buildStart(&build, cache) < 0)
+        return -1;
+
+    // "room: member,member\n" per room, newest room first
+    for (room *temp = head; temp != NULL; temp = temp->next) {
+        if (append(&build, temp->roomName, strlen(temp->roomName)) < 0 || append(&build, ": ", 2) < 0)
+            goto fail;
+        // newest member first, as joins append
+        const memberSet *members = &temp->members;
+        if (members->size == 0 && append(&build, "\n", 1) < 0)
+            goto fail;
+        for (size_t i = members->size; i-- > 0;) {
+            user *curUser = members->entries[i].member;
+            if (append(&build, curUser->username, strlen(curUser->username)) < 0)
+                goto fail;
+            if (append(&build, i == 0 ? "\n" : ",", 1) < 0)
+                goto fail;
+        }
+    }
+
+    // then the other nodes' rooms, as their owners listed them
+    for (room *temp = replicas; temp != NULL; temp = temp->next) {
+        if (append(&build, temp->roomName, strlen(temp->roomName)) < 0 || append(&build, ": ", 2) < 0 ||
+            append(&build, temp->memberNames, strlen(temp->memberNames)) < 0 || append(&build, "\n", 1) < 0)
+            goto fail;
+    }
+
+    if (buildFinish(&build, cache, RMLIST) < 0)
+        goto fail;
+    return 0;
+fail:
+    free(build.frame);
+    return -1;
+}
+
+char *listMemberNames(const room *r) {
+    const memberSet *members = &r->members;
+    size_t len = 0;
+    for (size_t i = 0; i < members->size; i++)
+        len += strlen(members->entries[i].member->username) + 1;
+
+    char *names = malloc(len + 1);
+    if (names == NULL)
+        return NULL;
+    len = 0;
+    for (size_t i = members->size; i-- > 0;) {
+        user *curUser = members->entries[i].member;
+        size_t nameLen = strlen(curUser->username);
+        memcpy(names + len, curUser->username, nameLen);
+        len += nameLen;
+        if (i > 0)
+            names[len++] = ',';
+    }
+    names[len] = '\0';
+    return names;
+}
+
+int listCacheUsers(listCache *cache, user *head) {
+    if (listCacheFrame(cache) != NULL)
+        return 0;
+
+    listBuild build;
+    if (buildStart(&build, cache) < 0)
+        return -1;
+
+    // offsets are read without the lock: the version is cleared while
+    // the offset changes, like a seqlock with a single writer
+    for (user *temp = head; temp != NULL; temp = temp->next) {
+        __atomic_store_n(&temp->listVersion, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&temp->listOffset, build.frame->len, __ATOMIC_RELAXED);
+        __atomic_store_n(&temp->listVersion, build.frame->version, __ATOMIC_RELEASE);
+        if (append(&build, temp->username, strlen(temp->username)) < 0 || append(&build, "\n", 1) < 0)
+            goto fail;
+    }
+
+    if (buildFinish(&build, cache, USRLIST) < 0)
+        goto fail;
+    return 0;
+fail:
+    free(build.frame);
+    return -1;
+}
+
+void listCacheSendRooms(user *to, listFrame *frame) {
+    struct iovec iov = { frame->data, frame->len };
+    userWriteFrame(to, &iov, 1);
+}
+
+// Where self's line starts in a frame its offset is not for, after a
+// rebuild raced with the send; 0 if it is not there.
+static size_t findSelf(listFrame *frame, const char *name, size_t nameLen) {
+    size_t pos = PETR_HEADER_SIZE;
+    while (pos + nameLen < frame->len) {
+        char *line = frame->data + pos;
+        char *end = memchr(line, '\n', frame->len - pos);
+        if (end == NULL)
+            break;
+        if ((size_t)(end - line) == nameLen && memcmp(line, name, nameLen) == 0)
+            return pos;
+        pos += end - line + 1;
+    }
+    return 0;
+}
+
+void listCacheSendUsers(user *self, listFrame *frame) {
+    size_t selfLen = strlen(self->username) + 1;
+    unsigned long version = __atomic_load_n(&self->listVersion, __ATOMIC_ACQUIRE);
+    size_t offset = __atomic_load_n(&self->listOffset, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (version != frame->version || __atomic_load_n(&self->listVersion, __ATOMIC_RELAXED) != version)
+        offset = findSelf(frame, self->username, selfLen - 1);
+    if (offset == 0) {
+        struct iovec iov = { frame->data, frame->len };
+        userWriteFrame(self, &iov, 1);
+        return;
+    }
+
+    size_t bodyLen = frame->len - PETR_HEADER_SIZE - selfLen;
+
+    petr_header header;
+    memset(&header, 0, sizeof(header));
+    header.msg_type = USRLIST;
+    // only the terminator would be left when self is the sole user
+    header.msg_len = bodyLen <= 1 ? 0 : bodyLen;
+
+    uint8_t wire[PETR_HEADER_SIZE];
+    petr_header_pack(&header, wire);
+    struct iovec iov[3] = {
+        { wire, sizeof(wire) },
+        { frame->data + PETR_HEADER_SIZE, offset - PETR_HEADER_SIZE },
+        { frame->data + offset + selfLen, frame->len - offset - selfLen },
+    };
+    userWriteFrame(self, iov, header.msg_len ? 3 : 1);
+}
+
+void nameIndexInit(nameIndex *index) {
+    index->table = NULL;
+}
+
+// A place in a table: an entry of a leaf, or leaf numLeaves past the end.
+typedef struct {
+    size_t leaf, at;
+} namePos;
+
+static size_t tableLeaves(const nameTable *table) {
+    return table == NULL ? 0 : table->numLeaves;
+}
+
+static int posValid(const nameTable *table, namePos pos) {
+    return pos.leaf < tableLeaves(table);
+}
+
+static int posBefore(namePos a, namePos b) {
+    return a.leaf < b.leaf || (a.leaf == b.leaf && a.at < b.at);
+}
+
+static const nameEntry *posEntry(const nameTable *table, namePos pos) {
+    return &table->leaves[pos.leaf]->entries[pos.at];
+}
+
+static void posNext(const nameTable *table, namePos *pos) {
+    if (++pos->at == table->leaves[pos->leaf]->size) {
+        pos->leaf++;
+        pos->at = 0;
+    }
+}
+
+// first entry of leaf whose name is >= name
+static size_t leafBound(const nameLeaf *leaf, const char *name) {
+    size_t lo = 0, hi = leaf->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(leaf->entries[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// first leaf whose last name is >= name, numLeaves if there is none
+static size_t leafFor(const nameTable *table, const char *name) {
+    size_t lo = 0, hi = tableLeaves(table);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const nameLeaf *leaf = table->leaves[mid];
+        if (strcmp(leaf->entries[leaf->size - 1].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// first position whose name is >= name
+static namePos lowerBound(const nameTable *table, const char *name) {
+    namePos pos = { leafFor(table, name), 0 };
+    if (posValid(table, pos))
+        pos.at = leafBound(table->leaves[pos.leaf], name);
+    return pos;
+}
+
+static int posIs(const nameTable *table, namePos pos, const char *name) {
+    return posValid(table, pos) && strcmp(posEntry(table, pos)->name, name) == 0;
+}
+
+static nameLeaf *leafNew(size_t size) {
+    nameLeaf *leaf = malloc(sizeof(nameLeaf) + size * sizeof(nameEntry));
+    if (leaf == NULL) {
+        printf("Out of memory indexing names\n");
+        exit(EXIT_FAILURE);
+    }
+    leaf->size = size;
+    return leaf;
+}
+
+// old with drop leaves from at replaced by count others, holding size
+// entries in all.
+static nameTable *tableReplace(const nameTable *old, size_t at, size_t drop, nameLeaf **with, size_t count,
+                               size_t size) {
+    size_t oldLeaves = tableLeaves(old);
+    size_t numLeaves = oldLeaves - drop + count;
+    nameTable *table = malloc(sizeof(nameTable) + numLeaves * sizeof(nameLeaf *));
+    if (table == NULL) {
+        printf("Out of memory indexing names\n");
+        exit(EXIT_FAILURE);
+    }
+    if (at > 0)
+        memcpy(table->leaves, old->leaves, at * sizeof(nameLeaf *));
+    memcpy(table->leaves + at, with, count * sizeof(nameLeaf *));
+    if (oldLeaves > at + drop)
+        memcpy(table->leaves + at + count, old->leaves + at + drop, (oldLeaves - at - drop) * sizeof(nameLeaf *));
+    table->size = size;
+    table->numLeaves = numLeaves;
+    return table;
+}
+
+// Readers may be searching the old table, so the change is made to copies
+// and swapped in whole; the leaves both share stay where they are.
+static void publish(nameIndex *index, nameTable *table, nameLeaf *replaced) {
+    nameTable *old = index->table;
+    __atomic_store_n(&index->table, table, __ATOMIC_RELEASE);
+    if (old != NULL)
+        epochRetire(free, old);
+    if (replaced != NULL)
+        epochRetire(free, replaced);
+}
+
+int nameIndexInsert(nameIndex *index, const char *name, void *item) {
+    nameTable *old = index->table;
+    if (tableLeaves(old) == 0) {
+        nameLeaf *leaf = leafNew(1);
+        leaf->entries[0] = (nameEntry){ name, item };
+        publish(index, tableReplace(old, 0, 0, &leaf, 1, 1), NULL);
+        return 0;
+    }
+
+    // past the last name it goes at the end of the last leaf
+    size_t at = leafFor(old, name);
+    if (at == old->numLeaves)
+        at--;
+    nameLeaf *src = old->leaves[at];
+    size_t pos = leafBound(src, name);
+
+    nameLeaf *leaf = leafNew(src->size + 1);
+    memcpy(leaf->entries, src->entries, pos * sizeof(nameEntry));
+    leaf->entries[pos] = (nameEntry){ name, item };
+    memcpy(&leaf->entries[pos + 1], &src->entries[pos], (src->size - pos) * sizeof(nameEntry));
+
+    nameLeaf *with[2] = { leaf, NULL };
+    size_t count = 1;
+    if (leaf->size > NAME_LEAF_MAX) {
+        size_t half = leaf->size / 2;
+        with[0] = leafNew(half);
+        with[1] = leafNew(leaf->size - half);
+        memcpy(with[0]->entries, leaf->entries, half * sizeof(nameEntry));
+        memcpy(with[1]->entries, leaf->entries + half, (leaf->size - half) * sizeof(nameEntry));
+        free(leaf);
+        count = 2;
+    }
+    publish(index, tableReplace(old, at, 1, with, count, old->size + 1), src);
+    return 0;
+}
+
+void nameIndexRemove(nameIndex *index, const char *name) {
+    nameTable *old = index->table;
+    namePos pos = lowerBound(old, name);
+    if (!posIs(old, pos, name))
+        return;
+
+    // an emptied leaf goes; the rest keep what they hold
+    nameLeaf *src = old->leaves[pos.leaf];
+    nameLeaf *leaf = NULL;
+    if (src->size > 1) {
+        leaf = leafNew(src->size - 1);
+        memcpy(leaf->entries, src->entries, pos.at * sizeof(nameEntry));
+        memcpy(&leaf->entries[pos.at], &src->entries[pos.at + 1], (src->size - pos.at - 1) * sizeof(nameEntry));
+    }
+    publish(index, tableReplace(old, pos.leaf, 1, &leaf, leaf != NULL, old->size - 1), src);
+}
+
+void *nameIndexFind(nameIndex *index, const char *name) {
+    const nameTable *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    namePos pos = lowerBound(table, name);
+    if (!posIs(table, pos, name))
+        return NULL;
+    return posEntry(table, pos)->item;
+}
+
+int listPageParse(char *body, listPageQuery *query) {
+    char *prefix = strstr(body, "\r\n");
+    if (prefix == NULL)
+        return -1;
+    *prefix = '\0';
+    prefix += 2;
+
+    char *limit = strstr(prefix, "\r\n");
+    if (limit == NULL)
+        return -1;
+    *limit = '\0';
+    limit += 2;
+
+    char *end;
+    long value = strtol(limit, &end, 10);
+    if (end == limit || value < 0)
+        return -1;
+
+    query->cursor = body;
+    query->prefix = prefix;
+    query->limit = (value == 0 || value > LIST_PAGE_MAX) ? LIST_PAGE_MAX : value;
+    return 0;
+}
+
+static namePos pageStart(const nameTable *table, listPageQuery *query) {
+    namePos start = lowerBound(table, query->prefix);
+    if (query->cursor[0] != '\0') {
+        namePos after = lowerBound(table, query->cursor);
+        if (posIs(table, after, query->cursor))
+            posNext(table, &after);
+        if (posBefore(start, after))
+            start = after;
+    }
+    return start;
+}
+
+// Walk at most limit matching entries from the cursor, skipping self.
+// Returns the position one past the last entry on the page.
+static namePos pageEnd(const nameTable *table, listPageQuery *query, namePos start, void *self, size_t *nameBytes,
+                       size_t *count) {
+    size_t prefixLen = strlen(query->prefix);
+    namePos pos = start;
+
+    *nameBytes = *count = 0;
+    for (; posValid(table, pos) && *count < query->limit; posNext(table, &pos)) {
+        const nameEntry *entry = posEntry(table, pos);
+        if (strncmp(entry->name, query->prefix, prefixLen) != 0)
+            break;
+        if (entry->item == self)
+            continue;
+        *nameBytes += strlen(entry->name);
+        (*count)++;
+    }
+    return pos;
+}
+
+char *listPageRooms(nameIndex *index, listPageQuery *query, size_t *len) {
+    const nameTable *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    size_t nameBytes, count;
+    namePos start = pageStart(table, query);
+    namePos end = pageEnd(table, query, start, NULL, &nameBytes, &count);
+
+    *len = 0;
+    if (count == 0)
+        return NULL;
+
+    // "name: " + up to 20 digits + "\n" per room, plus the terminator
+    char *body = malloc(nameBytes + count * 23 + 1);
+    if (body == NULL)
+        return NULL;
+
+    for (namePos pos = start; posBefore(pos, end); posNext(table, &pos)) {
+        room *r = posEntry(table, pos)->item;
+        *len += sprintf(body + *len, "%s: %zu\n", r->roomName, __atomic_load_n(&r->memberCount, __ATOMIC_RELAXED));
+    }
+    body[(*len)++] = '\0';
+    return body;
+}
+
+char *listPageUsers(nameIndex *index, listPageQuery *query, user *self, size_t *len) {
+    const nameTable *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    size_t nameBytes, count;
+    namePos start = pageStart(table, query);
+    namePos end = pageEnd(table, query, start, self, &nameBytes, &count);
+
+    *len = 0;
+    if (count == 0)
+        return NULL;
+
+    char *body = malloc(nameBytes + count + 1);
+    if (body == NULL)
+        return NULL;
+
+    for (namePos pos = start; posBefore(pos, end); posNext(table, &pos)) {
+        const nameEntry *entry = posEntry(table, pos);
+        if (entry->item == self)
+            continue;
+        size_t nameLen = strlen(entry->name);
+        memcpy(body + *len, entry->name, nameLen);
+        *len += nameLen;
+        body[(*len)++] = '\n';
+    }
+    body[(*len)++] = '\0';
+    return body;
+}
@@ -0,0 +1,356 @@
+#ifdef LOCK_PROFILE
+
+#define LOCKPROF_IMPL
+#include "lockprof.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    unsigned long acquired;
+    unsigned long contended;  // already held by another thread when asked for
+    uint64_t waitNs;
+    uint64_t waitMax;
+    unsigned long holds;  // acquired, plus once more for every cond wait it came back from
+    uint64_t holdNs;
+    uint64_t holdMax;
+    unsigned long wait[LOCK_PROF_BUCKETS];
+} lockCounters;
+
+// One per init site and one per call site, keyed by file and line; and
+// one per statically initialized mutex, keyed by its address with line 0.
+// A call site can lock different mutexes (one per peer, say), and an init
+// site sets up many.
+typedef struct {
+    const void *key;
+    int line;
+    const char *name;  // the expression the mutex was initialized or first locked with
+    lockCounters counters;
+    int used;
+} profEntry;
+
+// Which init site a live mutex came from. Slots are claimed with a CAS on
+// m; a destroyed mutex leaves its slot DEAD for the next one to take.
+typedef struct {
+    pthread_mutex_t *m;
+    profEntry *lock;
+} mutexSlot;
+
+#define SLOT_DEAD ((pthread_mutex_t *)1)
+
+// Held by this thread, innermost last, so hold time can be charged on
+// unlock to both the mutex and the site that took it.
+typedef struct {
+    pthread_mutex_t *m;
+    profEntry *lock;
+    profEntry *site;
+    uint64_t since;
+} heldLock;
+
+#define HELD_MAX 16
+
+static struct {
+    profEntry locks[LOCK_PROF_LOCKS];
+    profEntry sites[LOCK_PROF_SITES];
+    mutexSlot mutexes[LOCK_PROF_MUTEXES];
+    pthread_mutex_t insert;  // only taken to add an entry
+} prof = { .insert = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread heldLock held[HELD_MAX];
+static __thread int heldCount;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t hashOf(uintptr_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static profEntry *probe(profEntry *table, size_t size, const void *key, int line, int insert) {
+    size_t start = hashOf((uintptr_t)key * 31 + line) % size;
+    for (size_t i = 0; i < size; i++) {
+        profEntry *e = &table[(start + i) % size];
+        if (!__atomic_load_n(&e->used, __ATOMIC_ACQUIRE))
+            return insert ? e : NULL;
+        if (e->key == key && e->line == line)
+            return e;
+    }
+    return NULL;
+}
+
+// Entries are read without a lock once published: the key is written
+// before `used` is set with release order. Returns NULL if the table is full.
+static profEntry *find(profEntry *table, size_t size, const void *key, int line, const char *name) {
+    profEntry *e = probe(table, size, key, line, 0);
+    if (e != NULL)
+        return e;
+
+    pthread_mutex_lock(&prof.insert);
+    e = probe(table, size, key, line, 1);
+    if (e != NULL && !e->used) {
+        e->key = key;
+        e->line = line;
+        e->name = name;
+        __atomic_store_n(&e->used, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&prof.insert);
+    return e;
+}
+
+// The init site m was last set up at, or NULL if it was not (or the table
+// of live mutexes was full).
+static profEntry *mutexFind(pthread_mutex_t *m) {
+    size_t start = hashOf((uintptr_t)m) % LOCK_PROF_MUTEXES;
+    for (size_t i = 0; i < LOCK_PROF_MUTEXES; i++) {
+        mutexSlot *slot = &prof.mutexes[(start + i) % LOCK_PROF_MUTEXES];
+        pthread_mutex_t *at = __atomic_load_n(&slot->m, __ATOMIC_ACQUIRE);
+        if (at == m)
+            return __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+        if (at == NULL)
+            return NULL;
+    }
+    return NULL;
+}
+
+// A mutex initialized again at the same address, without a destroy in
+// between, keeps its slot and takes the new site.
+static void mutexTrack(pthread_mutex_t *m, profEntry *lock) {
+    size_t start = hashOf((uintptr_t)m) % LOCK_PROF_MUTEXES;
+    for (;;) {
+        mutexSlot *free = NULL;
+        size_t i;
+        for (i = 0; i < LOCK_PROF_MUTEXES; i++) {
+            mutexSlot *slot = &prof.mutexes[(start + i) % LOCK_PROF_MUTEXES];
+            pthread_mutex_t *at = __atomic_load_n(&slot->m, __ATOMIC_ACQUIRE);
+            if (at == m) {
+                __atomic_store_n(&slot->lock, lock, __ATOMIC_RELEASE);
+                return;
+            }
+            if (free == NULL && (at == NULL || at == SLOT_DEAD))
+                free = slot;
+            if (at == NULL)
+                break;
+        }
+        if (free == NULL)
+            return;
+        pthread_mutex_t *expected = free->m;
+        if ((expected == NULL || expected == SLOT_DEAD) &&
+            __atomic_compare_exchange_n(&free->m, &expected, m, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&free->lock, lock, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+static void mutexForget(pthread_mutex_t *m) {
+    size_t start = hashOf((uintptr_t)m) % LOCK_PROF_MUTEXES;
+    for (size_t i = 0; i < LOCK_PROF_MUTEXES; i++) {
+        mutexSlot *slot = &prof.mutexes[(start + i) % LOCK_PROF_MUTEXES];
+        pthread_mutex_t *at = __atomic_load_n(&slot->m, __ATOMIC_ACQUIRE);
+        if (at == m) {
+            __atomic_store_n(&slot->lock, NULL, __ATOMIC_RELEASE);
+            __atomic_store_n(&slot->m, SLOT_DEAD, __ATOMIC_RELEASE);
+            return;
+        }
+        if (at == NULL)
+            return;
+    }
+}
+
+static profEntry *lockOf(pthread_mutex_t *m, const char *name) {
+    profEntry *lock = mutexFind(m);
+    return lock != NULL ? lock : find(prof.locks, LOCK_PROF_LOCKS, m, 0, name);
+}
+
+int lockProfMutexInit(pthread_mutex_t *m, const pthread_mutexattr_t *attr, const char *name, const char *file,
+                      int line) {
+    profEntry *lock = find(prof.locks, LOCK_PROF_LOCKS, file, line, name);
+    if (lock != NULL)
+        mutexTrack(m, lock);
+    return pthread_mutex_init(m, attr);
+}
+
+int lockProfMutexDestroy(pthread_mutex_t *m) {
+    mutexForget(m);
+    return pthread_mutex_destroy(m);
+}
+
+static void countWait(lockCounters *c, uint64_t ns, int contended) {
+    int bucket = 0;
+    for (uint64_t v = ns; v > 1 && bucket < LOCK_PROF_BUCKETS - 1; v >>= 1)
+        bucket++;
+
+    __atomic_add_fetch(&c->acquired, 1, __ATOMIC_RELAXED);
+    if (!contended)
+        return;
+    __atomic_add_fetch(&c->contended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->waitNs, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->wait[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&c->waitMax, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&c->waitMax, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void countHold(lockCounters *c, uint64_t ns) {
+    __atomic_add_fetch(&c->holds, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->holdNs, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&c->holdMax, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&c->holdMax, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void pushHeld(pthread_mutex_t *m, profEntry *lock, profEntry *site) {
+    if (heldCount == HELD_MAX)
+        return;
+    held[heldCount].m = m;
+    held[heldCount].lock = lock;
+    held[heldCount].site = site;
+    held[heldCount].since = nowNs();
+    heldCount++;
+}
+
+static void popHeld(pthread_mutex_t *m) {
+    for (int i = heldCount - 1; i >= 0; i--) {
+        if (held[i].m != m)
+            continue;
+
+        uint64_t ns = nowNs() - held[i].since;
+        if (held[i].lock != NULL)
+            countHold(&held[i].lock->counters, ns);
+        if (held[i].site != NULL)
+            countHold(&held[i].site->counters, ns);
+        memmove(&held[i], &held[i + 1], (heldCount - i - 1) * sizeof(heldLock));
+        heldCount--;
+        return;
+    }
+}
+
+int lockProfLock(pthread_mutex_t *m, const char *name, const char *file, int line) {
+    profEntry *lock = lockOf(m, name);
+    profEntry *site = find(prof.sites, LOCK_PROF_SITES, file, line, name);
+
+    uint64_t start = 0;
+    int contended = 0;
+    int ret = pthread_mutex_trylock(m);
+    if (ret == EBUSY) {
+        contended = 1;
+        start = nowNs();
+        ret = pthread_mutex_lock(m);
+    }
+    if (ret != 0)
+        return ret;
+
+    uint64_t waited = contended ? nowNs() - start : 0;
+    if (lock != NULL)
+        countWait(&lock->counters, waited, contended);
+    if (site != NULL)
+        countWait(&site->counters, waited, contended);
+    pushHeld(m, lock, site);
+    return 0;
+}
+
+int lockProfUnlock(pthread_mutex_t *m) {
+    popHeld(m);
+    return pthread_mutex_unlock(m);
+}
+
+// The mutex is let go for the wait, so the hold ends there and a new one
+// starts on wakeup. Time asleep on the condition is not lock wait.
+static void releaseHeld(pthread_mutex_t *m, profEntry **lock, profEntry **site) {
+    *lock = *site = NULL;
+    for (int i = heldCount - 1; i >= 0; i--) {
+        if (held[i].m == m) {
+            *lock = held[i].lock;
+            *site = held[i].site;
+            break;
+        }
+    }
+    popHeld(m);
+}
+
+int lockProfCondWait(pthread_cond_t *c, pthread_mutex_t *m, const char *name, const char *file, int line) {
+    profEntry *lock, *site;
+    releaseHeld(m, &lock, &site);
+    int ret = pthread_cond_wait(c, m);
+    pushHeld(m, lock, site);
+    return ret;
+}
+
+int lockProfCondTimedWait(pthread_cond_t *c, pthread_mutex_t *m, const struct timespec *abstime) {
+    profEntry *lock, *site;
+    releaseHeld(m, &lock, &site);
+    int ret = pthread_cond_timedwait(c, m, abstime);
+    pushHeld(m, lock, site);
+    return ret;
+}
+
+static unsigned long percentile(const unsigned long *hist, unsigned long total, double q) {
+    unsigned long seen = 0;
+    for (int b = 0; b < LOCK_PROF_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > 0 && seen >= q * total)
+            return 2UL << b;
+    }
+    return 2UL << (LOCK_PROF_BUCKETS - 1);
+}
+
+static void dumpCounters(FILE *out, const lockCounters *c) {
+    fprintf(out, "taken %lu, contended %lu", c->acquired, c->contended);
+    if (c->contended > 0)
+        fprintf(out, ", wait total %luus p50 <%luns p99 <%luns max %luns", (unsigned long)(c->waitNs / 1000),
+                percentile(c->wait, c->contended, 0.5), percentile(c->wait, c->contended, 0.99),
+                (unsigned long)c->waitMax);
+    if (c->holds > 0)
+        fprintf(out, ", hold avg %luns max %luns", (unsigned long)(c->holdNs / c->holds),
+                (unsigned long)c->holdMax);
+    fprintf(out, "\n");
+}
+
+static int byWait(const void *a, const void *b) {
+    const profEntry *x = *(profEntry *const *)a, *y = *(profEntry *const *)b;
+    if (x->counters.waitNs != y->counters.waitNs)
+        return x->counters.waitNs < y->counters.waitNs ? 1 : -1;
+    return x->counters.acquired < y->counters.acquired ? 1 : -1;
+}
+
+// Counters are read while other threads may bump them, so a line can be
+// a few events out of step with itself.
+void lockProfDump(FILE *out) {
+    for (int i = 0; i < LOCK_PROF_LOCKS; i++) {
+        profEntry *e = &prof.locks[i];
+        if (!__atomic_load_n(&e->used, __ATOMIC_ACQUIRE))
+            continue;
+        if (e->line == 0)
+            fprintf(out, "lock %s (%p): ", e->name, e->key);
+        else
+            fprintf(out, "lock %s from %s:%d: ", e->name, (const char *)e->key, e->line);
+        dumpCounters(out, &e->counters);
+    }
+
+    profEntry *sites[LOCK_PROF_SITES];
+    int count = 0;
+    for (int i = 0; i < LOCK_PROF_SITES; i++)
+        if (__atomic_load_n(&prof.sites[i].used, __ATOMIC_ACQUIRE))
+            sites[count++] = &prof.sites[i];
+    qsort(sites, count, sizeof(profEntry *), byWait);
+
+    for (int i = 0; i < count && i < LOCK_PROF_TOP; i++) {
+        fprintf(out, "lock site %s:%d %s: ", (const char *)sites[i]->key, sites[i]->line, sites[i]->name);
+        dumpCounters(out, &sites[i]->counters);
+    }
+}
+
+void lockProfInit(void) {
+    statsRegister(lockProfDump);
+}
+
+#endif
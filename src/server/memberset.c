@@ -0,0 +1,171 @@
+#include "memberset.h"
+#include <stdlib.h>
+#include <string.h>
+
+static size_t slotFor(unsigned long id, size_t cap) {
+    // Fibonacci hashing; cap is always a power of two
+    return (id * 11400714819323198485ul) & (cap - 1);
+}
+
+void memberSetInit(memberSet *set) {
+    set->entries = set->small;
+    set->size = 0;
+    set->cap = MEMBER_INLINE;
+    set->slots = NULL;
+    set->slotCap = 0;
+}
+
+void memberSetFree(memberSet *set) {
+    if (set->slots != NULL) {
+        free(set->entries);
+        free(set->slots);
+    }
+    memberSetInit(set);
+}
+
+static void place(uint32_t *slots, size_t slotCap, unsigned long id, size_t pos) {
+    size_t slot = slotFor(id, slotCap);
+    while (slots[slot] != 0)
+        slot = (slot + 1) & (slotCap - 1);
+    slots[slot] = pos + 1;
+}
+
+// Move the entries to an array of cap, inline when they fit. A heap array
+// of cap (a power of two) gets 2 * cap slots, so probes stay short.
+static int resize(memberSet *set, size_t cap) {
+    memberEntry *entries = set->small;
+    uint32_t *slots = NULL;
+
+    if (cap <= MEMBER_INLINE) {
+        cap = MEMBER_INLINE;
+    } else {
+        entries = malloc(cap * sizeof(memberEntry));
+        slots = calloc(cap * 2, sizeof(uint32_t));
+        if (entries == NULL || slots == NULL) {
+            free(entries);
+            free(slots);
+            return -1;
+        }
+    }
+
+    memcpy(entries, set->entries, set->size * sizeof(memberEntry));
+    if (set->slots != NULL) {
+        free(set->entries);
+        free(set->slots);
+    }
+    set->entries = entries;
+    set->cap = cap;
+    set->slots = slots;
+    set->slotCap = slots == NULL ? 0 : cap * 2;
+
+    if (slots != NULL)
+        for (size_t pos = 0; pos < set->size; pos++)
+            place(slots, set->slotCap, entries[pos].id, pos);
+    return 0;
+}
+
+// The slot indexing id, or SIZE_MAX. Only for a set with an index.
+static size_t findSlot(const memberSet *set, unsigned long id) {
+    size_t mask = set->slotCap - 1;
+    for (size_t slot = slotFor(id, set->slotCap); set->slots[slot] != 0; slot = (slot + 1) & mask)
+        if (set->entries[set->slots[slot] - 1].id == id)
+            return slot;
+    return SIZE_MAX;
+}
+
+static size_t findPos(const memberSet *set, unsigned long id) {
+    if (set->slots == NULL) {
+        for (size_t pos = 0; pos < set->size; pos++)
+            if (set->entries[pos].id == id)
+                return pos;
+        return SIZE_MAX;
+    }
+    size_t slot = findSlot(set, id);
+    return slot == SIZE_MAX ? SIZE_MAX : set->slots[slot] - 1;
+}
+
+// Empty a slot, backward-shifting the rest of its cluster so lookups
+// never need tombstones.
+static void unindex(memberSet *set, size_t hole) {
+    size_t mask = set->slotCap - 1;
+    for (size_t next = (hole + 1) & mask; set->slots[next] != 0; next = (next + 1) & mask) {
+        size_t home = slotFor(set->entries[set->slots[next] - 1].id, set->slotCap);
+        // move the entry if its home slot is not between the hole and where it sits
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            set->slots[hole] = set->slots[next];
+            hole = next;
+        }
+    }
+    set->slots[hole] = 0;
+}
+
+int memberSetAdd(memberSet *set, unsigned long id, struct user *member) {
+    if (set->size == set->cap && resize(set, set->cap * 2) < 0)
+        return -1;
+
+    set->entries[set->size].id = id;
+    set->entries[set->size].member = member;
+    if (set->slots != NULL)
+        place(set->slots, set->slotCap, id, set->size);
+    set->size++;
+    return 0;
+}
+
+struct user *memberSetRemove(memberSet *set, unsigned long id) {
+    size_t pos;
+    if (set->slots == NULL) {
+        if ((pos = findPos(set, id)) == SIZE_MAX)
+            return NULL;
+    } else {
+        size_t slot = findSlot(set, id);
+        if (slot == SIZE_MAX)
+            return NULL;
+        pos = set->slots[slot] - 1;
+        unindex(set, slot);
+    }
+
+    struct user *member = set->entries[pos].member;
+    size_t last = set->size - 1;
+    if (pos != last) {
+        if (set->slots != NULL)
+            set->slots[findSlot(set, set->entries[last].id)] = pos + 1;
+        set->entries[pos] = set->entries[last];
+    }
+    set->size--;
+
+    // hand memory back once a big room has mostly emptied; if that fails
+    // the set just stays as big as it was
+    if (set->slots != NULL && set->size * 4 <= set->cap)
+        resize(set, set->cap / 2);
+    return member;
+}
+
+struct user *memberSetFind(const memberSet *set, unsigned long id) {
+    size_t pos = findPos(set, id);
+    return pos == SIZE_MAX ? NULL : set->entries[pos].member;
+}
+
+int memberSetContains(const memberSet *set, unsigned long id) {
+    return findPos(set, id) != SIZE_MAX;
+}
+
+int memberSetCopy(memberSet *dst, const memberSet *src) {
+    memberSetInit(dst);
+    if (src->slots != NULL) {
+        memberEntry *entries = malloc(src->cap * sizeof(memberEntry));
+        uint32_t *slots = malloc(src->slotCap * sizeof(uint32_t));
+        if (entries == NULL || slots == NULL) {
+            free(entries);
+            free(slots);
+            return -1;
+        }
+        memcpy(slots, src->slots, src->slotCap * sizeof(uint32_t));
+        dst->entries = entries;
+        dst->cap = src->cap;
+        dst->slots = slots;
+        dst->slotCap = src->slotCap;
+    }
+    memcpy(dst->entries, src->entries, src->size * sizeof(memberEntry));
+    dst->size = src->size;
+    return 0;
+}
@@ -0,0 +1,455 @@
+#include "presence.h"
+#include "cluster.h"
+#include <pthread.h>
+
+typedef struct {
+    char *name;
+    unsigned long id;
+    unsigned int features;
+    int online;
+    size_t seq;  // keeps one name's events in order through the sort
+} presenceEvent;
+
+typedef struct {
+    presenceEvent *events;
+    size_t size;
+    size_t cap;
+} eventList;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} encoder;
+
+typedef struct {
+    char **names;
+    size_t size;
+    size_t cap;
+} roomNames;
+
+static struct {
+    eventList pending;
+    roomNames rooms;  // changed since the last window, may repeat
+    size_t nextSeq;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+} bus;
+
+static int eventPush(eventList *list, const user *u, int online, size_t seq) {
+    if (list->size == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        presenceEvent *events = realloc(list->events, cap * sizeof(presenceEvent));
+        if (events == NULL)
+            return -1;
+        list->events = events;
+        list->cap = cap;
+    }
+
+    presenceEvent *e = &list->events[list->size++];
+    e->name = strdup(u->username);
+    e->id = u->id;
+    e->features = u->features;
+    e->online = online;
+    e->seq = seq;
+    return 0;
+}
+
+static void eventListFree(eventList *list) {
+    for (size_t i = 0; i < list->size; i++)
+        free(list->events[i].name);
+    free(list->events);
+    list->events = NULL;
+    list->size = list->cap = 0;
+}
+
+static int namePush(roomNames *list, const char *name) {
+    if (list->size == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        char **names = realloc(list->names, cap * sizeof(char *));
+        if (names == NULL)
+            return -1;
+        list->names = names;
+        list->cap = cap;
+    }
+    if ((list->names[list->size] = strdup(name)) == NULL)
+        return -1;
+    list->size++;
+    return 0;
+}
+
+static void roomNamesFree(roomNames *list) {
+    for (size_t i = 0; i < list->size; i++)
+        free(list->names[i]);
+    free(list->names);
+    list->names = NULL;
+    list->size = list->cap = 0;
+}
+
+static int reserve(encoder *enc, size_t more) {
+    if (enc->len + more <= enc->cap)
+        return 0;
+    size_t cap = enc->cap ? enc->cap : 256;
+    while (cap < enc->len + more)
+        cap *= 2;
+    uint8_t *buf = realloc(enc->buf, cap);
+    if (buf == NULL)
+        return -1;
+    enc->buf = buf;
+    enc->cap = cap;
+    return 0;
+}
+
+static int putVarint(encoder *enc, uint64_t v) {
+    if (reserve(enc, 10) < 0)
+        return -1;
+    while (v >= 0x80) {
+        enc->buf[enc->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    enc->buf[enc->len++] = v;
+    return 0;
+}
+
+static int getVarint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p == end)
+            return -1;
+        uint8_t b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static int compareEvents(const void *a, const void *b) {
+    const presenceEvent *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+    if (c != 0)
+        return c;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Sorting by name lets each name share its prefix with the one before it.
+static int encodeEvents(encoder *enc, eventList *list) {
+    qsort(list->events, list->size, sizeof(presenceEvent), compareEvents);
+
+    if (putVarint(enc, clusterSelf()) < 0 || putVarint(enc, list->size) < 0)
+        return -1;
+
+    const char *prevName = "";
+    unsigned long prevId = 0;
+    for (size_t i = 0; i < list->size; i++) {
+        presenceEvent *e = &list->events[i];
+        size_t shared = 0;
+        while (prevName[shared] != '\0' && prevName[shared] == e->name[shared])
+            shared++;
+        size_t rest = strlen(e->name) - shared;
+        int64_t delta = (int64_t)(e->id - prevId);
+
+        if (reserve(enc, 1) < 0)
+            return -1;
+        enc->buf[enc->len++] = e->online;
+        if (putVarint(enc, shared) < 0 || putVarint(enc, rest) < 0 || reserve(enc, rest) < 0)
+            return -1;
+        memcpy(enc->buf + enc->len, e->name + shared, rest);
+        enc->len += rest;
+        if (putVarint(enc, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)) < 0)
+            return -1;
+        if (e->online && putVarint(enc, e->features) < 0)
+            return -1;
+
+        prevName = e->name;
+        prevId = e->id;
+    }
+    return 0;
+}
+
+void presenceReceive(const char *body, size_t len) {
+    const uint8_t *p = (const uint8_t *)body;
+    const uint8_t *end = p + len;
+    uint64_t node, count;
+    char name[BUFFER_SIZE] = "";
+    unsigned long id = 0;
+
+    if (getVarint(&p, end, &node) < 0 || !clusterPeer(node) || getVarint(&p, end, &count) < 0)
+        return;
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t shared, rest, zigzag, features = 0;
+        if (p == end)
+            return;
+        int online = *p++;
+        if (getVarint(&p, end, &shared) < 0 || getVarint(&p, end, &rest) < 0)
+            return;
+        if (shared > strlen(name) || shared + rest >= sizeof(name) || rest > (uint64_t)(end - p))
+            return;
+        memcpy(name + shared, p, rest);
+        name[shared + rest] = '\0';
+        p += rest;
+
+        if (getVarint(&p, end, &zigzag) < 0)
+            return;
+        id += (unsigned long)((zigzag >> 1) ^ -(zigzag & 1));
+        if (online && getVarint(&p, end, &features) < 0)
+            return;
+
+        user *proxy = calloc(1, sizeof(user));
+        proxy->username = strdup(name);
+        proxy->id = id;
+        proxy->fd = -1;
+        proxy->node = node;
+        proxy->features = features;
+        serverPresenceApply(proxy, online);
+    }
+}
+
+// Room entries run to the end of the frame; the name of one that would
+// not fit with some of its listing is never sent.
+#define ROOM_ENTRY_MAX 32
+
+static int putBytes(encoder *enc, const char *bytes, size_t len) {
+    if (putVarint(enc, len) < 0 || reserve(enc, len) < 0)
+        return -1;
+    memcpy(enc->buf + enc->len, bytes, len);
+    enc->len += len;
+    return 0;
+}
+
+static void roomsFlush(int node, encoder *enc, size_t start) {
+    if (enc->len > start) {
+        struct iovec body = { enc->buf, enc->len };
+        if (node < 0)
+            clusterSendAll(PEER_ROOMS, &body, 1);
+        else
+            clusterSend(node, PEER_ROOMS, &body, 1);
+    }
+    enc->len = start;
+}
+
+// One room as it is now, over as many frames as its listing needs.
+static int encodeRoom(int node, encoder *enc, size_t start, const char *name) {
+    size_t nameLen = strlen(name), count = 0;
+    char *names = NULL;
+    int op = serverRoomSnapshot(name, &count, &names) == 0 ? ROOM_LISTED : ROOM_GONE;
+    if (start + nameLen + ROOM_ENTRY_MAX * 2 > ROOMS_FRAME_MAX) {
+        printf("Room (%s) name too long to replicate\n", name);
+        free(names);
+        return 0;
+    }
+
+    const char *rest = names;
+    size_t restLen = names != NULL ? strlen(names) : 0;
+    do {
+        if (enc->len + nameLen + ROOM_ENTRY_MAX * 2 > ROOMS_FRAME_MAX)
+            roomsFlush(node, enc, start);
+        size_t take = ROOMS_FRAME_MAX - enc->len - nameLen - ROOM_ENTRY_MAX;
+        if (take > restLen)
+            take = restLen;
+
+        if (reserve(enc, 1) < 0)
+            goto fail;
+        enc->buf[enc->len++] = op;
+        if (putBytes(enc, name, nameLen) < 0)
+            goto fail;
+        if (op == ROOM_LISTED && putVarint(enc, count) < 0)
+            goto fail;
+        if (op != ROOM_GONE && putBytes(enc, rest, take) < 0)
+            goto fail;
+        rest += take;
+        restLen -= take;
+        op = ROOM_MORE;
+    } while (restLen > 0);
+    free(names);
+    return 0;
+fail:
+    free(names);
+    return -1;
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Every room named, once each, to node or to all (-1).
+static void sendRooms(int node, roomNames *list) {
+    encoder enc = { NULL, 0, 0 };
+    qsort(list->names, list->size, sizeof(char *), compareNames);
+    if (putVarint(&enc, clusterSelf()) < 0)
+        goto fail;
+    size_t start = enc.len;
+    for (size_t i = 0; i < list->size; i++)
+        if ((i == 0 || strcmp(list->names[i], list->names[i - 1]) != 0) &&
+            encodeRoom(node, &enc, start, list->names[i]) < 0)
+            goto fail;
+    roomsFlush(node, &enc, start);
+    free(enc.buf);
+    return;
+fail:
+    printf("Out of memory encoding rooms\n");
+    free(enc.buf);
+}
+
+void presenceReceiveRooms(const char *body, size_t len) {
+    const uint8_t *p = (const uint8_t *)body;
+    const uint8_t *end = p + len;
+    uint64_t node;
+
+    if (getVarint(&p, end, &node) < 0 || !clusterPeer(node))
+        return;
+
+    while (p < end) {
+        uint64_t nameLen, count = 0, namesLen;
+        int op = *p++;
+        if (op > ROOM_MORE || getVarint(&p, end, &nameLen) < 0 || nameLen > (uint64_t)(end - p))
+            return;
+        char *name = strndup((const char *)p, nameLen);
+        p += nameLen;
+
+        char *names = NULL;
+        if (op != ROOM_GONE) {
+            if ((op == ROOM_LISTED && getVarint(&p, end, &count) < 0) || getVarint(&p, end, &namesLen) < 0 ||
+                namesLen > (uint64_t)(end - p)) {
+                free(name);
+                return;
+            }
+            names = strndup((const char *)p, namesLen);
+            p += namesLen;
+        }
+        // only a room's owner lists it
+        if (clusterOwner(name) != (int)node) {
+            free(name);
+            free(names);
+            continue;
+        }
+        serverRoomApply(node, name, count, names, op == ROOM_MORE);
+    }
+}
+
+static void sendEvents(int node, eventList *list) {
+    encoder enc = { NULL, 0, 0 };
+    if (encodeEvents(&enc, list) < 0) {
+        printf("Out of memory encoding presence\n");
+        free(enc.buf);
+        return;
+    }
+
+    struct iovec body = { enc.buf, enc.len };
+    if (node < 0)
+        clusterSendAll(PEER_PRESENCE, &body, 1);
+    else
+        clusterSend(node, PEER_PRESENCE, &body, 1);
+    free(enc.buf);
+}
+
+static void snapshotUser(const user *u, void *arg) {
+    if (eventPush(arg, u, 1, 0) < 0) {
+        printf("Out of memory taking presence snapshot\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void snapshotRoom(const room *r, void *arg) {
+    if (namePush(arg, r->roomName) < 0) {
+        printf("Out of memory taking room snapshot\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void presenceSync(int node) {
+    eventList snapshot = { NULL, 0, 0 };
+    roomNames rooms = { NULL, 0, 0 };
+
+    serverPresenceReset(node);
+    serverLocalUsers(snapshotUser, &snapshot);
+    sendEvents(node, &snapshot);
+    eventListFree(&snapshot);
+
+    serverRoomReset(node);
+    serverRooms(snapshotRoom, &rooms);
+    sendRooms(node, &rooms);
+    roomNamesFree(&rooms);
+}
+
+void presencePublish(const user *u, int online) {
+    if (!clusterEnabled())
+        return;
+
+    pthread_mutex_lock(&bus.lock);
+    if (eventPush(&bus.pending, u, online, bus.nextSeq++) < 0) {
+        printf("Out of memory queueing presence\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_cond_signal(&bus.notEmpty);
+    pthread_mutex_unlock(&bus.lock);
+}
+
+void presencePublishRoom(const char *name) {
+    if (!clusterEnabled())
+        return;
+
+    pthread_mutex_lock(&bus.lock);
+    if (namePush(&bus.rooms, name) < 0) {
+        printf("Out of memory queueing room\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_cond_signal(&bus.notEmpty);
+    pthread_mutex_unlock(&bus.lock);
+}
+
+static void *process_presence(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&bus.lock);
+        while (bus.pending.size == 0 && bus.rooms.size == 0)
+            pthread_cond_wait(&bus.notEmpty, &bus.lock);
+        pthread_mutex_unlock(&bus.lock);
+
+        // let a burst of logins pile up into one frame
+        usleep(PRESENCE_WINDOW_US);
+
+        pthread_mutex_lock(&bus.lock);
+        eventList batch = bus.pending;
+        roomNames changed = bus.rooms;
+        memset(&bus.pending, 0, sizeof(bus.pending));
+        memset(&bus.rooms, 0, sizeof(bus.rooms));
+        pthread_mutex_unlock(&bus.lock);
+
+        for (size_t i = 0; i < batch.size; i += PRESENCE_BATCH_MAX) {
+            eventList part = batch;
+            part.events += i;
+            part.size = batch.size - i < PRESENCE_BATCH_MAX ? batch.size - i : PRESENCE_BATCH_MAX;
+            sendEvents(-1, &part);
+        }
+        eventListFree(&batch);
+
+        // after the logins, so a room's members are known where it is listed
+        if (changed.size > 0)
+            sendRooms(-1, &changed);
+        roomNamesFree(&changed);
+    }
+    return NULL;
+}
+
+void presenceInit(void) {
+    pthread_t tid;
+    uint8_t self[4];
+
+    memset(&bus.pending, 0, sizeof(bus.pending));
+    memset(&bus.rooms, 0, sizeof(bus.rooms));
+    bus.nextSeq = 0;
+    pthread_mutex_init(&bus.lock, NULL);
+    pthread_cond_init(&bus.notEmpty, NULL);
+
+    if (!clusterEnabled())
+        return;
+    pthread_create(&tid, NULL, process_presence, NULL);
+
+    // nodes already up send back who is logged in there
+    self[0] = clusterSelf() & 0xff;
+    self[1] = (clusterSelf() >> 8) & 0xff;
+    self[2] = self[3] = 0;
+    struct iovec body = { self, sizeof(self) };
+    clusterSendAll(PEER_SYNC, &body, 1);
+}
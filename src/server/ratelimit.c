@@ -0,0 +1,135 @@
+#include "ratelimit.h"
+#include "protocol.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+
+typedef struct {
+    const char *name;
+    unsigned long rate;   // frames per second, 0 for no limit
+    unsigned long burst;
+    uint64_t interval;    // ns between tokens
+    uint64_t tolerance;   // how far ahead of now a bucket may run
+    unsigned long throttled;
+} rateLimit;
+
+static rateLimit limits[RATE_CLASSES] = {
+    [RATE_ALL]  = { "all", 2000, 4000 },
+    [RATE_SEND] = { "send", 500, 1000 },
+    [RATE_ROOM] = { "room", 100, 200 },
+    [RATE_LIST] = { "list", 50, 100 },
+};
+
+static int classOf(uint8_t msg_type) {
+    switch (msg_type) {
+    case RMSEND:
+    case USRSEND:
+        return RATE_SEND;
+    case RMCREATE:
+    case RMDELETE:
+    case RMJOIN:
+    case RMLEAVE:
+        return RATE_ROOM;
+    case RMLIST:
+    case RMLISTPAGE:
+    case USRLIST:
+    case USRLISTPAGE:
+        return RATE_LIST;
+    default:
+        return -1;
+    }
+}
+
+int rateLimitParse(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL)
+        return -1;
+
+    for (int i = 0; i < RATE_CLASSES; i++) {
+        if (strlen(limits[i].name) != (size_t)(eq - spec) || strncmp(spec, limits[i].name, eq - spec) != 0)
+            continue;
+
+        char *end;
+        unsigned long rate = strtoul(eq + 1, &end, 10);
+        unsigned long burst = rate;
+        if (*end == '/')
+            burst = strtoul(end + 1, &end, 10);
+        if (*end != '\0' || (rate > 0 && burst == 0))
+            return -1;
+        limits[i].rate = rate;
+        limits[i].burst = burst;
+        return 0;
+    }
+    return -1;
+}
+
+void rateLimitInit(void) {
+    for (int i = 0; i < RATE_CLASSES; i++) {
+        if (limits[i].rate == 0)
+            continue;
+        limits[i].interval = NSEC_PER_SEC / limits[i].rate;
+        limits[i].tolerance = limits[i].interval * limits[i].burst;
+    }
+    statsRegister(rateLimitDump);
+}
+
+void rateBucketsInit(rateBuckets *buckets) {
+    memset(buckets, 0, sizeof(*buckets));
+}
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// GCRA: a bucket is full while its arrival time is in the past, and each
+// token pushes it one interval further; more than tolerance ahead of now
+// means the burst is used up. Sets *next to the arrival time taking a
+// token leaves, or returns -1 without one.
+static int peek(const uint64_t *tat, rateLimit *limit, uint64_t now, uint64_t *next) {
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+    *next = (old > now ? old : now) + limit->interval;
+    return *next - now > limit->tolerance ? -1 : 0;
+}
+
+int rateAdmit(rateBuckets *buckets, uint8_t msg_type) {
+    // never keep a user from logging out
+    if (msg_type == LOGOUT)
+        return 0;
+
+    int classes[2] = { RATE_ALL, classOf(msg_type) };
+    uint64_t next[2];
+    uint64_t now = nowNs();
+
+    // a frame one bucket turns away takes nothing from the other
+    for (int i = 0; i < 2; i++) {
+        if (classes[i] < 0 || limits[classes[i]].rate == 0) {
+            classes[i] = -1;
+            continue;
+        }
+        rateLimit *limit = &limits[classes[i]];
+        if (peek(&buckets->tat[classes[i]], limit, now, &next[i]) < 0) {
+            __atomic_add_fetch(&limit->throttled, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&buckets->throttled, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    for (int i = 0; i < 2; i++)
+        if (classes[i] >= 0)
+            __atomic_store_n(&buckets->tat[classes[i]], next[i], __ATOMIC_RELAXED);
+    return 0;
+}
+
+void rateLimitDump(FILE *out) {
+    for (int i = 0; i < RATE_CLASSES; i++) {
+        if (limits[i].rate == 0)
+            fprintf(out, "ratelimit %s: unlimited\n", limits[i].name);
+        else
+            fprintf(out, "ratelimit %s: %lu/s burst %lu, throttled %lu\n", limits[i].name, limits[i].rate,
+                    limits[i].burst, __atomic_load_n(&limits[i].throttled, __ATOMIC_RELAXED));
+    }
+}
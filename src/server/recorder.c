@@ -0,0 +1,134 @@
+#include "recorder.h"
+#include "protocol.h"
+#include "stats.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct {
+    int fd;  // -1 when capture is off
+    char *buf;
+    size_t len;
+    uint64_t start;
+    unsigned long frames;
+    unsigned long closes;
+    unsigned long written;  // bytes that made it to the file
+    pthread_mutex_t lock;
+} rec = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Called with the lock held. A failed write ends the capture rather than
+// the server.
+static void flush(void) {
+    size_t done = 0;
+    while (rec.fd >= 0 && done < rec.len) {
+        ssize_t n = write(rec.fd, rec.buf + done, rec.len - done);
+        if (n < 0) {
+            perror("capture write");
+            close(rec.fd);
+            __atomic_store_n(&rec.fd, -1, __ATOMIC_RELAXED);
+            break;
+        }
+        done += n;
+    }
+    rec.written += done;
+    rec.len = 0;
+}
+
+static void reserve(size_t len) {
+    if (rec.len + len > RECORDER_BUFFER)
+        flush();
+}
+
+static void recorderDump(FILE *out) {
+    pthread_mutex_lock(&rec.lock);
+    flush();
+    fprintf(out, "capture: %lu frames, %lu closes, %lu bytes written%s\n", rec.frames, rec.closes, rec.written,
+            rec.fd < 0 ? ", stopped" : "");
+    pthread_mutex_unlock(&rec.lock);
+}
+
+static void recorderExit(void) {
+    pthread_mutex_lock(&rec.lock);
+    flush();
+    pthread_mutex_unlock(&rec.lock);
+}
+
+static void *process_recorder(void *arg) {
+    struct timespec wait = { RECORDER_FLUSH_MS / 1000, RECORDER_FLUSH_MS % 1000 * 1000000L };
+
+    while (__atomic_load_n(&rec.fd, __ATOMIC_RELAXED) >= 0) {
+        nanosleep(&wait, NULL);
+        recorderExit();
+    }
+    return NULL;
+}
+
+void recorderInit(const char *path) {
+    if (path == NULL)
+        return;
+
+    rec.buf = malloc(RECORDER_BUFFER);
+    rec.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec.buf == NULL || rec.fd < 0) {
+        printf("Cannot capture to %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    petr_capture_header_pack((uint8_t *)rec.buf);
+    rec.len = PETR_CAPTURE_HEADER_SIZE;
+    rec.start = now();
+    statsRegister(recorderDump);
+    atexit(recorderExit);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, process_recorder, NULL);
+    printf("Capturing client frames to %s\n", path);
+}
+
+// The clock is read under the lock, so times in the file never go back.
+static void record(int fd, const petr_header *header, const char *body) {
+    pthread_mutex_lock(&rec.lock);
+    if (rec.fd < 0) {
+        pthread_mutex_unlock(&rec.lock);
+        return;
+    }
+
+    petr_capture_record r = { now() - rec.start, fd, 0 };
+    if (header != NULL)
+        r.len = PETR_HEADER_SIZE + header->msg_len;
+    reserve(PETR_CAPTURE_RECORD_SIZE + r.len);
+    petr_capture_record_pack(&r, (uint8_t *)rec.buf + rec.len);
+    rec.len += PETR_CAPTURE_RECORD_SIZE;
+    if (header != NULL) {
+        petr_header_pack(header, (uint8_t *)rec.buf + rec.len);
+        memcpy(rec.buf + rec.len + PETR_HEADER_SIZE, body, header->msg_len);
+        rec.len += r.len;
+        rec.frames++;
+    } else {
+        rec.closes++;
+    }
+    pthread_mutex_unlock(&rec.lock);
+}
+
+void recorderFrame(int fd, const char *msg) {
+    // unlocked peek: capture is only ever turned off, and a late record
+    // is checked again under the lock
+    if (__atomic_load_n(&rec.fd, __ATOMIC_RELAXED) < 0)
+        return;
+    record(fd, (const petr_header *)msg, msg + sizeof(petr_header));
+}
+
+void recorderClosed(int fd) {
+    if (__atomic_load_n(&rec.fd, __ATOMIC_RELAXED) < 0)
+        return;
+    record(fd, NULL, NULL);
+}
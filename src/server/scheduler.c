@@ -0,0 +1,321 @@
+#include "scheduler.h"
+#include "cluster.h"
+#include "stats.h"
+#include <pthread.h>
+#include <time.h>
+
+static const char *classNames[JOB_CLASSES] = { "control", "query", "bulk" };
+static const int weights[JOB_CLASSES] = JOB_WEIGHTS;
+
+// Jobs from a peer arrive with a fresh proxy each, so they are kept in
+// order per sending node instead of per user.
+static jobOrder peerOrder[CLUSTER_MAX_NODES];
+
+static struct {
+    jobQueue *queue;
+    size_t budget;
+    unsigned long shed;
+    unsigned long pauses;
+    unsigned long latency[JOB_CLASSES][LATENCY_BUCKETS];
+    unsigned long starved[JOB_CLASSES];
+} sched;
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static jobClass classOf(uint8_t msg_type) {
+    switch (msg_type) {
+    case LOGOUT:
+    case RMCREATE:
+    case RMDELETE:
+    case RMJOIN:
+    case RMLEAVE:
+        return JOB_CONTROL;
+    case RMLIST:
+    case RMLISTPAGE:
+    case USRLIST:
+    case USRLISTPAGE:
+        return JOB_QUERY;
+    default:
+        return JOB_BULK;
+    }
+}
+
+void jobQueueInit(jobQueue *queue, size_t budget) {
+    memset(queue->lanes, 0, sizeof(queue->lanes));
+    for (int i = 0; i < JOB_CLASSES; i++)
+        queue->lanes[i].credits = weights[i];
+    queue->size = 0;
+    queue->bytes = 0;
+    queue->senders = 0;
+    queue->running = 0;
+    pthread_cond_init(&queue->drained, NULL);
+    sched.queue = queue;
+    sched.budget = budget;
+    statsRegister(jobQueueDump);
+}
+
+// order has a job waiting and none running: its next job can be taken.
+static void makeReady(jobQueue *queue, jobOrder *order) {
+    jobLane *lane = &queue->lanes[order->head->lane];
+    order->nextReady = NULL;
+    if (lane->tail == NULL)
+        lane->head = order;
+    else
+        lane->tail->nextReady = order;
+    lane->tail = order;
+}
+
+static void account(jobQueue *queue, job *j, int sign) {
+    if (sign > 0) {
+        if (j->order->bytes == 0)
+            queue->senders++;
+        j->order->bytes += j->bytes;
+        queue->bytes += j->bytes;
+        return;
+    }
+
+    j->order->bytes -= j->bytes;
+    if (j->order->bytes == 0)
+        queue->senders--;
+    queue->bytes -= j->bytes;
+    pthread_cond_broadcast(&queue->drained);
+}
+
+int jobQueuePush(jobQueue *queue, user *client, char *msg, unsigned int trace) {
+    petr_header *header = (petr_header*)msg;
+    job *j = malloc(sizeof(job));
+
+    j->msg = msg;
+    j->client = client;
+    j->order = client->node == clusterSelf() ? &client->order : &peerOrder[client->node];
+    j->class = classOf(header->msg_type);
+    j->enqueued = nowNs();
+    j->bytes = sizeof(job) + sizeof(petr_header) + header->msg_len + 1;
+    j->trace = trace;
+    j->next = NULL;
+
+    pthread_mutex_lock(&queue->jobQueueMutex);
+
+    if (j->order->closed) {
+        pthread_mutex_unlock(&queue->jobQueueMutex);
+        free(j);
+        return -2;
+    }
+
+    // a LOGOUT always gets in, it is what frees memory
+    if (header->msg_type != LOGOUT && queue->bytes + j->bytes > sched.budget) {
+        sched.shed++;
+        pthread_mutex_unlock(&queue->jobQueueMutex);
+        free(j);
+        return -1;
+    }
+
+    // never ahead of the client's own jobs waiting in a lower lane
+    jobOrder *order = j->order;
+    j->lane = j->class;
+    if (order->tail != NULL && order->tail->lane > j->lane)
+        j->lane = order->tail->lane;
+
+    int wasIdle = order->head == NULL;
+    if (order->tail == NULL)
+        order->head = j;
+    else
+        order->tail->next = j;
+    order->tail = j;
+    queue->lanes[j->lane].size++;
+    queue->size++;
+    account(queue, j, 1);
+
+    if (wasIdle && !order->running) {
+        makeReady(queue, order);
+        pthread_cond_signal(&queue->notEmpty);
+    }
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+    return 0;
+}
+
+static int pick(jobQueue *queue) {
+    uint64_t now = nowNs();
+
+    // a lane left waiting too long gets one turn, whatever its weight
+    for (int i = JOB_CLASSES - 1; i >= 0; i--) {
+        jobLane *lane = &queue->lanes[i];
+        if (lane->head != NULL && now - lane->head->head->enqueued >= JOB_STARVE_NS &&
+            now - lane->lastServed >= JOB_STARVE_NS) {
+            sched.starved[i]++;
+            lane->lastServed = now;
+            return i;
+        }
+    }
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < JOB_CLASSES; i++) {
+            if (queue->lanes[i].head != NULL && queue->lanes[i].credits > 0) {
+                queue->lanes[i].credits--;
+                queue->lanes[i].lastServed = now;
+                return i;
+            }
+        }
+        // every lane with work has used its share: start a new round
+        for (int i = 0; i < JOB_CLASSES; i++)
+            queue->lanes[i].credits = weights[i];
+    }
+    return -1;
+}
+
+job *jobQueuePop(jobQueue *queue) {
+    int laneIndex;
+
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    while ((laneIndex = pick(queue)) < 0)
+        pthread_cond_wait(&queue->notEmpty, &queue->jobQueueMutex);
+
+    jobLane *lane = &queue->lanes[laneIndex];
+    jobOrder *order = lane->head;
+    lane->head = order->nextReady;
+    if (lane->head == NULL)
+        lane->tail = NULL;
+    order->nextReady = NULL;
+
+    job *j = order->head;
+    order->head = j->next;
+    if (order->head == NULL)
+        order->tail = NULL;
+    lane->size--;
+    queue->size--;
+    account(queue, j, -1);
+
+    order->running = 1;
+    queue->running++;
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+    return j;
+}
+
+void jobQueueDone(jobQueue *queue, job *j) {
+    uint64_t us = (nowNs() - j->enqueued) / 1000;
+    int bucket = 0;
+    while (us > 1 && bucket < LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    sched.latency[j->class][bucket]++;
+    j->order->running = 0;
+    if (--queue->running == 0)
+        pthread_cond_broadcast(&queue->drained);
+    // the client's next job may be what another thread is waiting for
+    if (j->order->head != NULL) {
+        makeReady(queue, j->order);
+        pthread_cond_signal(&queue->notEmpty);
+    }
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+    free(j);
+}
+
+void jobQueueDrop(jobQueue *queue, user *client) {
+    jobOrder *order = &client->order;
+
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    if (order->head != NULL && !order->running) {
+        jobLane *lane = &queue->lanes[order->head->lane];
+        jobOrder **p = &lane->head;
+        jobOrder *prev = NULL;
+        while (*p != order) {
+            prev = *p;
+            p = &prev->nextReady;
+        }
+        *p = order->nextReady;
+        if (lane->tail == order)
+            lane->tail = prev;
+    }
+
+    job *j = order->head;
+    while (j != NULL) {
+        job *next = j->next;
+        queue->lanes[j->lane].size--;
+        queue->size--;
+        account(queue, j, -1);
+        free(j->msg);
+        free(j);
+        j = next;
+    }
+    order->head = order->tail = NULL;
+    order->nextReady = NULL;
+    order->closed = 1;
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+}
+
+static int overShare(jobQueue *queue, jobOrder *order) {
+    if (order->bytes == 0)
+        return 0;
+    if (order->bytes > sched.budget / JOB_CONN_SHARE)
+        return 1;
+    return queue->bytes > sched.budget / 4 * 3 && order->bytes * queue->senders > queue->bytes;
+}
+
+int jobQueueShouldPause(jobQueue *queue, user *client) {
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    int pause = overShare(queue, &client->order);
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+    return pause;
+}
+
+void jobQueueWaitShare(jobQueue *queue, user *client) {
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    if (overShare(queue, &client->order)) {
+        sched.pauses++;
+        while (overShare(queue, &client->order))
+            pthread_cond_wait(&queue->drained, &queue->jobQueueMutex);
+    }
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+}
+
+void jobQueueWaitIdle(jobQueue *queue) {
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    while (queue->size > 0 || queue->running > 0)
+        pthread_cond_wait(&queue->drained, &queue->jobQueueMutex);
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+}
+
+void jobQueueNotePause(jobQueue *queue) {
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    sched.pauses++;
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+}
+
+// Upper bound, in microseconds, of the bucket holding the given quantile.
+static unsigned long percentile(unsigned long *hist, unsigned long total, double q) {
+    unsigned long seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > 0 && seen >= q * total)
+            return 2UL << b;
+    }
+    return 2UL << (LATENCY_BUCKETS - 1);
+}
+
+void jobQueueDump(FILE *out) {
+    jobQueue *queue = sched.queue;
+
+    pthread_mutex_lock(&queue->jobQueueMutex);
+    fprintf(out, "jobs queue: %zu jobs, %zu of %zu bytes, %zu senders, shed %lu, reads paused %lu\n", queue->size,
+            queue->bytes, sched.budget, queue->senders, sched.shed, sched.pauses);
+    for (int i = 0; i < JOB_CLASSES; i++) {
+        unsigned long total = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            total += sched.latency[i][b];
+
+        fprintf(out, "jobs %s: queued %zu, done %lu, starved %lu", classNames[i], queue->lanes[i].size, total,
+                sched.starved[i]);
+        if (total > 0)
+            fprintf(out, ", p50 <%luus p99 <%luus", percentile(sched.latency[i], total, 0.5),
+                    percentile(sched.latency[i], total, 0.99));
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&queue->jobQueueMutex);
+}
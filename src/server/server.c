@@ -1,45 +1,65 @@
 #include "server.h"
+#include "audit.h"
+#include "batch.h"
+#include "cluster.h"
+#include "epoch.h"
+#include "fanout.h"
+#include "handoff.h"
+#include "io.h"
+#include "listing.h"
+#include "presence.h"
+#include "recorder.h"
+#include "scan.h"
+#include "scheduler.h"
+#include "shmring.h"
+#include "stats.h"
+#include "timecache.h"
+#include "timer.h"
+#include "trace.h"
 #include "protocol.h"
 #define __USE_GNU
 #include <pthread.h>
+#include <poll.h>
 #include <signal.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
 
 pthread_mutexattr_t attr;
 
+// ids are handed out from node << USER_ID_NODE_SHIFT up
+#define USER_ID_NODE_SHIFT 48
+
 struct {
     pthread_mutex_t usersMutex;
     struct user *userList;
+    listCache cache;
+    nameIndex index;
+    unsigned long nextId;
 } users;
 
 jobQueue jobs;
 roomList rooms;
-auditLog aLog;
 
-time_t t;
 
 const char exit_str[] = "exit";
 
-char buffer[BUFFER_SIZE];
-pthread_mutex_t buffer_lock;
-
 int total_num_msg = 0;
 int listen_fd;
+int unix_fd = -1;
+const char *unix_path;
 
 void sigint_handler(int sig) {
     printf("shutting down server\n");
     close(listen_fd);
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path);
+    }
     exit(0);
 }
 
-static void serverSendAudit(int msg_type, user *u) {
-     pthread_mutex_lock(&aLog.auditLogMutex);
-
-    FILE *file = fopen(aLog.fileName, "a");
-    time(&t);
-    fprintf(file, "Server sent: %x to %s [%d] at %s\n", msg_type, u->username, u->fd, ctime(&t));
-    fclose(file);
-
-    pthread_mutex_unlock(&aLog.auditLogMutex);
+void serverSendAudit(int msg_type, user *u) {
+    auditWrite("Server sent: %x to %s [%d] at %s\n", msg_type, u->username, u->fd, auditTime());
 }
 
 int server_init(int server_port) {
@@ -74,8 +94,9 @@ int server_init(int server_port) {
     } else
         printf("Socket successfully binded\n");
 
-    // Now server is ready to listen and verification
-    if ((listen(sockfd, 1)) != 0) {
+    // Now server is ready to listen and verification; a client running
+    // many sessions connects them all at once
+    if ((listen(sockfd, SOMAXCONN)) != 0) {
         printf("Listen failed\n");
         exit(EXIT_FAILURE);
     } else
@@ -84,24 +105,262 @@ int server_init(int server_port) {
     return sockfd;
 }
 
+// Listener for clients on this host, which may take their frames from a
+// shared-memory ring instead of the socket.
+int server_init_unix(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Unix socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        printf("unix socket creation failed...\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // a socket file left behind by an earlier run
+    unlink(path);
+    if (bind(sockfd, (SA *)&addr, sizeof(addr)) != 0) {
+        printf("unix socket bind failed\n");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(sockfd, SOMAXCONN) != 0) {
+        printf("Listen failed\n");
+        exit(EXIT_FAILURE);
+    } else
+        printf("Server listening on %s\n", path);
+
+    return sockfd;
+}
+
 static void getMsgAsStr(char *msg, char **str) {
     petr_header *header = (petr_header*)msg;
-    *str = malloc(header->msg_len);
-    memcpy(*str, (char*)header+sizeof(petr_header), header->msg_len);
+    // with the '\0' readJobMsg puts after the body, which may lack its own
+    *str = malloc(header->msg_len + 1);
+    memcpy(*str, (char*)header+sizeof(petr_header), header->msg_len + 1);
+}
+
+// Reply ESERV to a frame whose body is malformed.
+static void refuseMalformed(user *client) {
+    petr_header response;
+    memset(&response, 0, sizeof(response));
+    response.msg_type = ESERV;
+    response.msg_len = 0;
+    userWrite(client, &response, NULL);
+    serverSendAudit(response.msg_type, client);
+}
+
+// A local user is a member of its rooms itself: LOGOUT takes it out of
+// them before it leaves the user list. A remote user's proxy only lives
+// for one job, so rooms keep a copy of it with a name of its own.
+static user *roomMember(user *client) {
+    if (client->node == clusterSelf())
+        return client;
+    user *member = malloc(sizeof(user));
+    memcpy(member, client, sizeof(user));
+    member->username = strdup(client->username);
+    member->next = NULL;
+    return member;
+}
+
+static void freeMember(user *member) {
+    if (member->node == clusterSelf())
+        return;
+    free(member->username);
+    free(member);
+}
+
+static void retireMember(void *member) {
+    freeMember(member);
+}
+
+static void freeView(void *p) {
+    roomView *view = p;
+    memberSetFree(&view->members);
+    free(view);
+}
+
+// Publish who is in a room for RMSEND, which reads it without the room
+// list's mutex. Called with the mutex held.
+static void roomPublish(room *r) {
+    roomView *view = malloc(sizeof(roomView));
+    if (view == NULL || memberSetCopy(&view->members, &r->members) < 0) {
+        printf("Out of memory publishing room\n");
+        exit(EXIT_FAILURE);
+    }
+
+    roomView *old = r->view;
+    __atomic_store_n(&r->view, view, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->memberCount, r->members.size, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->viewStale, 0, __ATOMIC_RELEASE);
+    if (old != NULL)
+        epochRetire(freeView, old);
+}
+
+// Called with the mutex held after a join or leave. The view is taken
+// again when a send next needs it, see roomSendView.
+static void roomChanged(room *r) {
+    __atomic_store_n(&r->memberCount, r->members.size, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->viewStale, 1, __ATOMIC_RELEASE);
+    presencePublishRoom(r->roomName);
+}
+
+// The view RMSEND fans out to, from within an epoch section. The first
+// send after a change publishes it.
+static roomView *roomSendView(room *r) {
+    if (__atomic_load_n(&r->viewStale, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&rooms.roomListMutex);
+        // another send may have taken it while this one waited
+        if (r->viewStale)
+            roomPublish(r);
+        pthread_mutex_unlock(&rooms.roomListMutex);
+    }
+    return __atomic_load_n(&r->view, __ATOMIC_ACQUIRE);
+}
+
+// Take a user out of a room, once readers of the room are done with it.
+static void roomRemove(room *r, user *client) {
+    user *member = memberSetRemove(&r->members, client->id);
+    if (member == NULL)
+        return;
+    roomChanged(r);
+    if (member->node != clusterSelf())
+        epochRetire(retireMember, member);
+}
+
+// Free a room already unlinked from the list and the index. Its local
+// members may be gone by now, so only the id says which are copies.
+static void freeRoom(void *p) {
+    room *r = p;
+    for (size_t i = 0; i < r->members.size; i++)
+        if (r->members.entries[i].id >> USER_ID_NODE_SHIFT != (unsigned long)clusterSelf())
+            freeMember(r->members.entries[i].member);
+    freeView(r->view);
+    memberSetFree(&r->members);
+    free(r->roomName);
+    free(r);
+}
+
+// In cluster mode, ship a job to the node owning its room.
+// Returns 1 if it went elsewhere and is done here.
+static int routeJob(char *msg, user *client) {
+    petr_header *header = (petr_header*)msg;
+    char *body = msg + sizeof(petr_header);
+
+    if (!clusterEnabled() || client->node != clusterSelf())
+        return 0;
+
+    char *key;
+    switch (header->msg_type) {
+    case RMCREATE:
+    case RMDELETE:
+    case RMJOIN:
+    case RMLEAVE:
+    case RMSEND:
+        key = strndup(body, strcspn(body, "\r\n"));
+        break;
+    case LOGOUT:
+        // the user may be in rooms on every node
+        clusterBroadcastJob(client, msg);
+        return 0;
+    default:
+        return 0;
+    }
+
+    int owner = clusterOwner(key);
+    free(key);
+    if (owner == clusterSelf())
+        return 0;
+    clusterForwardJob(owner, client, msg);
+    return 1;
+}
+
+// Drop one of a local user's references; the last one closes its socket,
+// so the fd cannot be reused while a job might still write to it.
+static void userRelease(user *u) {
+    if (__atomic_sub_fetch(&u->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    serverDisconnect(u->fd);
+    if (u->ring != NULL)
+        shmRingFree(u->ring);
+    batchFree(u->batch);
+    free(u->username);
+    free(u);
+}
+
+static void retireUser(void *u) {
+    userRelease(u);
+}
+
+void serverUserHold(user *u) {
+    __atomic_add_fetch(&u->refs, 1, __ATOMIC_RELAXED);
+}
+
+void serverUserRelease(user *u) {
+    userRelease(u);
+}
+
+// Free a peer's proxy that has left the user index.
+static void freeProxy(void *p) {
+    user *proxy = p;
+    free(proxy->username);
+    free(proxy);
+}
+
+// The current list frames, rebuilt under the registry's mutex when stale.
+// Called inside an epoch section, which keeps the frame alive.
+static listFrame *roomsFrame(void) {
+    listFrame *frame = listCacheFrame(&rooms.cache);
+    if (frame != NULL)
+        return frame;
+
+    pthread_mutex_lock(&rooms.roomListMutex);
+    if (listCacheRooms(&rooms.cache, rooms.head, rooms.replicas) < 0) {
+        printf("Out of memory building room list\n");
+        exit(EXIT_FAILURE);
+    }
+    frame = rooms.cache.current;
+    pthread_mutex_unlock(&rooms.roomListMutex);
+    return frame;
+}
+
+static listFrame *usersFrame(void) {
+    listFrame *frame = listCacheFrame(&users.cache);
+    if (frame != NULL)
+        return frame;
+
+    pthread_mutex_lock(&users.usersMutex);
+    if (listCacheUsers(&users.cache, users.userList) < 0) {
+        printf("Out of memory building user list\n");
+        exit(EXIT_FAILURE);
+    }
+    frame = users.cache.current;
+    pthread_mutex_unlock(&users.usersMutex);
+    return frame;
 }
 
 void *process_job(void* arg) {
 
     while (1) {
-        //printf("Made b");
-        pthread_mutex_lock(&jobs.jobQueueMutex);
+        // the queue is not held while the job runs; the scheduler keeps
+        // each client's jobs from running concurrently or out of order
+        job *current = jobQueuePop(&jobs);
+        char *msg = current->msg;
+        petr_header *header = (petr_header*)msg;
+        user *client = current->client;
+        int remote = client->node != clusterSelf();
+        user *loggedOut = NULL;
 
-        while (jobs.size <= 0)
-            pthread_cond_wait(&jobs.notEmpty, &jobs.jobQueueMutex);
+        traceSpan(current->trace, SPAN_QUEUED, header->msg_type, current->enqueued, NULL);
+        traceEnter(current->trace, header->msg_type);
 
-        char *msg = jobs.tail->msg;
-        petr_header *header = (petr_header*)msg;
-        user *client = jobs.tail->client;
+        if (routeJob(msg, client))
+            goto finish;
 
         switch (header->msg_type)
         {
@@ -120,10 +379,7 @@ void *process_job(void* arg) {
                     if (strcmp(temp->roomName, roomname) == 0) {
                         response.msg_type = ERMEXISTS;
                         response.msg_len = 0;
-                        if (wr_msg(client->fd, &response, NULL) < 0) {
-                            printf("Write error\n");
-                            exit(EXIT_FAILURE);
-                        }
+                        userWrite(client, &response, NULL);
                         printf("Roomname already exists.\n");
 
                         serverSendAudit(response.msg_type, client);
@@ -137,21 +393,24 @@ void *process_job(void* arg) {
                 
                 response.msg_type = OK;
                 response.msg_len = 0;
-                if (wr_msg(client->fd, &response, NULL) < 0) {
-                    printf("Write error\n");
-                    exit(EXIT_FAILURE);
-                }
+                userWrite(client, &response, NULL);
 
                 serverSendAudit(response.msg_type, client);
 
 
                 room *newRoom = malloc(sizeof(room));
                 newRoom->roomName = roomname;
+                newRoom->node = clusterSelf();
+                newRoom->memberNames = NULL;
 
-                user *newClient = malloc(sizeof(user));
-                memcpy(newClient, client, sizeof(user));
-                newClient->next = NULL;
-                newRoom->creator = newRoom->userList = newClient;
+                newRoom->creator = roomMember(client);
+                memberSetInit(&newRoom->members);
+                if (memberSetAdd(&newRoom->members, client->id, newRoom->creator) < 0) {
+                    printf("Out of memory adding room member\n");
+                    exit(EXIT_FAILURE);
+                }
+                newRoom->view = NULL;
+                roomPublish(newRoom);
 
                 if (rooms.head == NULL) 
                     newRoom->next = NULL;
@@ -159,6 +418,12 @@ void *process_job(void* arg) {
                     newRoom->next = rooms.head;
                 
                 rooms.head = newRoom;
+                if (nameIndexInsert(&rooms.index, newRoom->roomName, newRoom) < 0) {
+                    printf("Out of memory indexing room\n");
+                    exit(EXIT_FAILURE);
+                }
+                listCacheInvalidate(&rooms.cache);
+                presencePublishRoom(newRoom->roomName);
 
                 pthread_mutex_unlock(&rooms.roomListMutex);
                 printf("Room (%s) created.\n", roomname);
@@ -183,38 +448,27 @@ void *process_job(void* arg) {
                             response.msg_type = RMCLOSED;
                             response.msg_len = strlen(roomname)+1;
 
-                            user *temp2 = temp->userList;
-                            while (temp2->next != NULL) {
-                                if (wr_msg(temp2->fd, &response, roomname) < 0) {
-                                    printf("Write error\n");
-                                    exit(EXIT_FAILURE);
-                                }
+                            // the creator joined first and never leaves, so it stays entries[0]
+                            for (size_t i = temp->members.size - 1; i > 0; i--) {
+                                user *temp2 = temp->members.entries[i].member;
+                                userWrite(temp2, &response, roomname);
                                 serverSendAudit(response.msg_type, temp2);
-                                temp2 = temp2->next;
                             }
                             
                             response.msg_type = OK;
                             response.msg_len = 0;
-                            if (wr_msg(client->fd, &response, NULL) < 0) {
-                                printf("Write error\n");
-                                exit(EXIT_FAILURE);
-                            }
+                            userWrite(client, &response, NULL);
                             serverSendAudit(response.msg_type, client);
 
-                            temp2 = temp->userList;
-                            while (temp2 != NULL) {
-                                user *temp3 = temp2;
-                                temp2 = temp2->next;
-                                free(temp3);
-                            }
-
                             if (prev == NULL)
                                 rooms.head = temp->next;
                             else
                                 prev->next = temp->next;
                             
-                            free(temp->roomName);
-                            free(temp);
+                            nameIndexRemove(&rooms.index, temp->roomName);
+                            listCacheInvalidate(&rooms.cache);
+                            presencePublishRoom(temp->roomName);
+                            epochRetire(freeRoom, temp);
 
                             printf("Room (%s) closed.\n", roomname);
                             pthread_mutex_unlock(&rooms.roomListMutex);
@@ -223,10 +477,7 @@ void *process_job(void* arg) {
                             // ERMDENIED
                             response.msg_type = ERMDENIED;
                             response.msg_len = 0;
-                            if (wr_msg(client->fd, &response, NULL) < 0) {
-                                printf("Write error\n");
-                                exit(EXIT_FAILURE);
-                            }
+                            userWrite(client, &response, NULL);
                             printf("User is not creator of room\n");
                             serverSendAudit(response.msg_type, client);
                             pthread_mutex_unlock(&rooms.roomListMutex);
@@ -240,10 +491,7 @@ void *process_job(void* arg) {
                 // ERMNOTFOUND
                 response.msg_type = ERMNOTFOUND;
                 response.msg_len = 0;
-                if (wr_msg(client->fd, &response, NULL) < 0) {
-                    printf("Write error\n");
-                    exit(EXIT_FAILURE);
-                }
+                userWrite(client, &response, NULL);
                 
                 printf("Roomname (%s) not found.\n", roomname);
                 serverSendAudit(response.msg_type, client);
@@ -253,48 +501,42 @@ void *process_job(void* arg) {
             break;
         case RMLIST:
             {
-                pthread_mutex_lock(&rooms.roomListMutex);
+                epochEnter();
+                listCacheSendRooms(client, roomsFrame());
+                epochExit();
+                serverSendAudit(RMLIST, client);
+            }
+            break;
+        case RMLISTPAGE:
+            {
+                epochEnter();
 
                 petr_header response;
                 memset(&response, 0, sizeof(response));
-                response.msg_type = RMLIST;
+                char *query;
+                listPageQuery page;
 
-                if (rooms.head == NULL) {
+                getMsgAsStr(msg, &query);
+                if (listPageParse(query, &page) < 0) {
+                    response.msg_type = ESERV;
                     response.msg_len = 0;
-                    if (wr_msg(client->fd, &response, NULL) < 0) {
-                        printf("Write error\n");
-                        exit(EXIT_FAILURE);
-                    }
+                    userWrite(client, &response, NULL);
                     serverSendAudit(response.msg_type, client);
-                    pthread_mutex_unlock(&rooms.roomListMutex);
+                    free(query);
+                    epochExit();
                     goto finish;
                 }
-                
-                pthread_mutex_lock(&buffer_lock);
-                bzero(buffer, BUFFER_SIZE);
 
-                room *temp = rooms.head;
-                int offset= 0;
-                while (temp != NULL){
-                    offset += snprintf(buffer+offset, strlen(temp->roomName)+3, "%s: ", temp->roomName);
-                    user* curUser = temp->userList;
-                    while(curUser != NULL) {
-                        offset += snprintf(buffer+offset, strlen(curUser->username)+2, "%s,", curUser->username);
-                        curUser = curUser->next;
-                    }
-                    buffer[offset-1] = '\n';
-                    temp = temp->next;
-                }    
-                buffer[offset] = '\0';
+                size_t len;
+                char *body = listPageRooms(&rooms.index, &page, &len);
 
-                response.msg_len = offset+1;
-                if (wr_msg(client->fd, &response, buffer) < 0) {
-                        printf("Write error\n");
-                        exit(EXIT_FAILURE);
-                }
+                response.msg_type = RMLISTPAGE;
+                response.msg_len = len;
+                userWrite(client, &response, body);
                 serverSendAudit(response.msg_type, client);
-                pthread_mutex_unlock(&buffer_lock);
-                pthread_mutex_unlock(&rooms.roomListMutex);
+                free(body);
+                free(query);
+                epochExit();
             }
             break;
         case RMJOIN:
@@ -310,17 +552,19 @@ void *process_job(void* arg) {
                 room *temp = rooms.head;
                 while (temp != NULL) {
                     if (strcmp(temp->roomName, roomname) == 0) {
-                        user *newClient = malloc(sizeof(user));
-                        memcpy(newClient, client, sizeof(user));
-                        newClient->next = temp->userList;
-                        temp->userList = newClient;
+                        // joining a room twice is a no-op rather than a duplicate member
+                        if (!memberSetContains(&temp->members, client->id)) {
+                            if (memberSetAdd(&temp->members, client->id, roomMember(client)) < 0) {
+                                printf("Out of memory adding room member\n");
+                                exit(EXIT_FAILURE);
+                            }
+                            roomChanged(temp);
+                            listCacheInvalidate(&rooms.cache);
+                        }
 
                         response.msg_type = OK;
                         response.msg_len = 0;
-                        if (wr_msg(client->fd, &response, NULL) < 0) {
-                            printf("Write error\n");
-                            exit(EXIT_FAILURE);
-                        }
+                        userWrite(client, &response, NULL);
 
                         printf("Room (%s) joined.\n", roomname);
                         serverSendAudit(response.msg_type, client);
@@ -333,10 +577,7 @@ void *process_job(void* arg) {
                 // ERMNOTFOUND
                 response.msg_type = ERMNOTFOUND;
                 response.msg_len = 0;
-                if (wr_msg(client->fd, &response, NULL) < 0) {
-                    printf("Write error\n");
-                    exit(EXIT_FAILURE);
-                }
+                userWrite(client, &response, NULL);
                 
                 printf("Roomname (%s) not found.\n", roomname);
                 serverSendAudit(response.msg_type, client);
@@ -356,49 +597,22 @@ void *process_job(void* arg) {
                 room *temp = rooms.head;
                 while (temp != NULL) {
                     if (strcmp(temp->roomName, roomname) == 0) {
-                        user *prev = NULL;
-                        user *temp2 = temp->userList;
-                        while (temp2 != NULL) {
-                            if (strcmp(temp2->username, client->username) == 0) {
-                                if (strcmp(client->username, temp->creator->username) == 0) {
-                                    response.msg_type = ERMDENIED;
-                                    response.msg_len = 0;
-                                    if (wr_msg(client->fd, &response, NULL) < 0) {
-                                        printf("Write error\n");
-                                        exit(EXIT_FAILURE);
-                                    }
-                                    serverSendAudit(response.msg_type, client);
-                                    pthread_mutex_unlock(&rooms.roomListMutex);
-                                    goto finish;
-                                } else {
-                                    if (prev == NULL)
-                                        temp->userList = temp2->next;
-                                    else
-                                        prev->next = temp2->next;
-
-                                    free(temp2);
-
-                                    response.msg_type = OK;
-                                    response.msg_len = 0;
-                                    if (wr_msg(client->fd, &response, NULL) < 0) {
-                                        printf("Write error\n");
-                                        exit(EXIT_FAILURE);
-                                    }
-                                    serverSendAudit(response.msg_type, client);
-                                    pthread_mutex_unlock(&rooms.roomListMutex);
-                                    goto finish;
-                                }
+                        if (memberSetContains(&temp->members, client->id)) {
+                            if (strcmp(client->username, temp->creator->username) == 0) {
+                                response.msg_type = ERMDENIED;
+                                response.msg_len = 0;
+                                userWrite(client, &response, NULL);
+                                serverSendAudit(response.msg_type, client);
+                                pthread_mutex_unlock(&rooms.roomListMutex);
+                                goto finish;
                             }
-                            prev = temp2;
-                            temp2 = temp2->next;
+                            roomRemove(temp, client);
+                            listCacheInvalidate(&rooms.cache);
                         }
                         
                         response.msg_type = OK;
                         response.msg_len = 0;
-                        if (wr_msg(client->fd, &response, NULL) < 0) {
-                            printf("Write error\n");
-                            exit(EXIT_FAILURE);
-                        }
+                        userWrite(client, &response, NULL);
                         serverSendAudit(response.msg_type, client);
 
                         pthread_mutex_unlock(&rooms.roomListMutex);
@@ -410,10 +624,7 @@ void *process_job(void* arg) {
                 // ERMNOTFOUND
                 response.msg_type = ERMNOTFOUND;
                 response.msg_len = 0;
-                if (wr_msg(client->fd, &response, NULL) < 0) {
-                    printf("Write error\n");
-                    exit(EXIT_FAILURE);
-                }
+                userWrite(client, &response, NULL);
                 
                 printf("Roomname (%s) not found.\n", roomname);
                 serverSendAudit(response.msg_type, client);
@@ -423,188 +634,156 @@ void *process_job(void* arg) {
             break;
         case RMSEND:
             {
-                pthread_mutex_lock(&rooms.roomListMutex);
+                epochEnter();
                 petr_header response;
                 memset(&response, 0, sizeof(response));
                 
-                char *msgToSend;
-                char *save_ptr;
-                getMsgAsStr(msg, &msgToSend);
-                char *roomname = strtok_r(msgToSend, "\r\n", &save_ptr);
-                msgToSend = save_ptr + 1;
-
-                room *temp = rooms.head;
-                while (temp != NULL) {
-                    if (strcmp(temp->roomName, roomname) == 0) {
-                        user *temp2 = temp->userList;
-                        while (temp2 != NULL) {
-                            if (strcmp(temp2->username, client->username) == 0) {
-                                user* temp3 = temp->userList;
-                                while (temp3 != NULL) {
-                                    if (temp3 != temp2) {
-                                        char *message = malloc(strlen(roomname)+strlen(client->username)+strlen(msgToSend)+4+1);
-                                        strcpy(message, roomname);
-                                        strcat(message, "\r\n");
-                                        strcat(message, client->username);
-                                        strcat(message, "\r\n");
-                                        strcat(message, msgToSend);
-
-                                        response.msg_type = RMRECV;
-                                        response.msg_len = strlen(message)+1;
-                                        
-                                        if (wr_msg(temp3->fd, &response, message) < 0) {
-                                            printf("Write error\n");
-                                            exit(EXIT_FAILURE);
-                                        }
-                                        serverSendAudit(response.msg_type, temp3);
-
-                                    }
-                                    temp3 = temp3->next;
-                                }
-
-                                response.msg_type = OK;
-                                response.msg_len = 0;
-
-                                if (wr_msg(client->fd, &response, NULL) < 0) {
-                                    printf("Write error\n");
-                                    exit(EXIT_FAILURE);
-                                }
-                                serverSendAudit(response.msg_type, client);
-
-                                pthread_mutex_unlock(&rooms.roomListMutex);
-                                goto finish;
-                            }
-                            temp2 = temp2->next;
-                        }
+                // "room\r\nmessage\0", split in place
+                petr_span fields[2];
+                if (petr_scan_fields(msg + sizeof(petr_header), header->msg_len, fields, 2) != 2) {
+                    refuseMalformed(client);
+                    epochExit();
+                    goto finish;
+                }
+                char *roomname = fields[0].ptr;
+                roomname[fields[0].len] = '\0';
+
+                // joins and leaves mark the view stale rather than waiting on sends
+                room *temp = nameIndexFind(&rooms.index, roomname);
+                if (temp != NULL) {
+                    roomView *view = roomSendView(temp);
+                    if (memberSetContains(&view->members, client->id)) {
+                        // "room\r\nsender\r\nmessage\0" gathered straight from the pieces
+                        struct iovec message[5] = {
+                            { roomname, fields[0].len },
+                            { "\r\n", 2 },
+                            { client->username, strlen(client->username) },
+                            { "\r\n", 2 },
+                            { fields[1].ptr, fields[1].len + 1 },
+                        };
+                        outMsg out;
+                        outMsgInit(&out, message, 5);
+
+                        fanoutSend(view->members.entries, view->members.size, client->id, RMRECV, RMRECVZ, &out);
+                        outMsgFree(&out);
 
-                        response.msg_type = ERMDENIED;
+                        response.msg_type = OK;
                         response.msg_len = 0;
-                        if (wr_msg(client->fd, &response, NULL) < 0) {
-                            printf("Write error\n");
-                            exit(EXIT_FAILURE);
-                        }
+
+                        userWrite(client, &response, NULL);
                         serverSendAudit(response.msg_type, client);
 
-                        pthread_mutex_unlock(&rooms.roomListMutex);
+                        epochExit();
                         goto finish;
                     }
-                    temp = temp->next;
+
+                    response.msg_type = ERMDENIED;
+                    response.msg_len = 0;
+                    userWrite(client, &response, NULL);
+                    serverSendAudit(response.msg_type, client);
+
+                    epochExit();
+                    goto finish;
                 }
 
                 // ERMNOTFOUND
                 response.msg_type = ERMNOTFOUND;
                 response.msg_len = 0;
-                if (wr_msg(client->fd, &response, NULL) < 0) {
-                    printf("Write error\n");
-                    exit(EXIT_FAILURE);
-                }
+                userWrite(client, &response, NULL);
                 serverSendAudit(response.msg_type, client);
                 
                 printf("Roomname (%s) not found.\n", roomname);
 
-                pthread_mutex_unlock(&rooms.roomListMutex);
+                epochExit();
             }
             break;
         case USRSEND:
             {
-                pthread_mutex_lock(&users.usersMutex);
+                epochEnter();
                 petr_header response;
                 memset(&response, 0, sizeof(response));
 
-                char *msgToSend;
-                char *save_ptr;
-                getMsgAsStr(msg, &msgToSend);
-                char *to_username = strtok_r(msgToSend, "\r\n", &save_ptr);
-                msgToSend = save_ptr + 1;
-
-                user* temp2 = users.userList;
-                while (temp2 != NULL){
-                    if (strcmp(temp2->username, to_username) == 0){
-                        char *message = malloc(strlen(client->username)+strlen(msgToSend)+2+1);
-                        strcpy(message, client->username);
-                        strcat(message, "\r\n");
-                        strcat(message, msgToSend);
-                      
-
-                        response.msg_type = USRRECV;
-                        response.msg_len = strlen(message)+1;
-                        
-                        if (wr_msg(temp2->fd, &response, message) < 0) {
-                            printf("Write error\n");
-                            exit(EXIT_FAILURE);
-                        }
-                        serverSendAudit(response.msg_type, temp2);
-
-                        response.msg_type = OK;
-                        response.msg_len = 0;
+                // "user\r\nmessage\0", split in place
+                petr_span fields[2];
+                if (petr_scan_fields(msg + sizeof(petr_header), header->msg_len, fields, 2) != 2) {
+                    refuseMalformed(client);
+                    epochExit();
+                    goto finish;
+                }
+                char *to_username = fields[0].ptr;
+                to_username[fields[0].len] = '\0';
+
+                // remote users are in the index too, replicated by presence
+                user *temp2 = nameIndexFind(&users.index, to_username);
+                if (temp2 != NULL) {
+                    struct iovec message[3] = {
+                        { client->username, strlen(client->username) },
+                        { "\r\n", 2 },
+                        { fields[1].ptr, fields[1].len + 1 },
+                    };
+                    outMsg out;
+                    outMsgInit(&out, message, 3);
+
+                    sendOutMsg(temp2, USRRECV, USRRECVZ, &out);
+                    outMsgFree(&out);
+
+                    response.msg_type = OK;
+                    response.msg_len = 0;
 
-                        if (wr_msg(client->fd, &response, NULL) < 0) {
-                            printf("Write error\n");
-                            exit(EXIT_FAILURE);
-                        }
-                        serverSendAudit(response.msg_type, client);
-                        
-                        pthread_mutex_unlock(&users.usersMutex);
-                        goto finish;
-                    }
-                    temp2 = temp2->next;
+                    userWrite(client, &response, NULL);
+                    serverSendAudit(response.msg_type, client);
+                    
+                    epochExit();
+                    goto finish;
                 }
                 
                 //EUSRNOTFOUND
                 response.msg_type = EUSRNOTFOUND;
                 response.msg_len = 0;
-                if (wr_msg(client->fd, &response, NULL) < 0) {
-                    printf("Write error\n");
-                    exit(EXIT_FAILURE);
-                }
+                userWrite(client, &response, NULL);
                 serverSendAudit(response.msg_type, client);
                 printf("User (%s) not found.\n", to_username);
-                pthread_mutex_unlock(&users.usersMutex);
+                epochExit();
             }
             break;
         case USRLIST:
             {
-                pthread_mutex_lock(&users.usersMutex);
+                epochEnter();
+                listCacheSendUsers(client, usersFrame());
+                epochExit();
+                serverSendAudit(USRLIST, client);
+            }
+            break;
+        case USRLISTPAGE:
+            {
+                epochEnter();
 
                 petr_header response;
                 memset(&response, 0, sizeof(response));
-                response.msg_type = USRLIST;
+                char *query;
+                listPageQuery page;
 
-                if (users.userList == NULL) {
+                getMsgAsStr(msg, &query);
+                if (listPageParse(query, &page) < 0) {
+                    response.msg_type = ESERV;
                     response.msg_len = 0;
-                    if (wr_msg(client->fd, &response, NULL) < 0) {
-                        printf("Write error\n");
-                        exit(EXIT_FAILURE);
-                    }
+                    userWrite(client, &response, NULL);
                     serverSendAudit(response.msg_type, client);
-                
-                    pthread_mutex_unlock(&users.usersMutex);
+                    free(query);
+                    epochExit();
                     goto finish;
                 }
-                
-                pthread_mutex_lock(&buffer_lock);
-                bzero(buffer, BUFFER_SIZE);
-
-                user *temp = users.userList;
-                int offset= 0;
-                while (temp != NULL){
-                    if (strcmp(temp->username, client->username) != 0) {
-                        offset += snprintf(buffer+offset, strlen(temp->username)+2, "%s\n", temp->username);
-                    }
-                    temp = temp->next;
-                }
 
-                buffer[offset] = '\0';
+                size_t len;
+                char *body = listPageUsers(&users.index, &page, client, &len);
 
-                response.msg_len = !offset ? 0 : offset+1;
-                if (wr_msg(client->fd, &response, buffer) < 0) {
-                        printf("Write error\n");
-                        exit(EXIT_FAILURE);
-                }
+                response.msg_type = USRLISTPAGE;
+                response.msg_len = len;
+                userWrite(client, &response, body);
                 serverSendAudit(response.msg_type, client);
-
-                pthread_mutex_unlock(&buffer_lock);
-                pthread_mutex_unlock(&users.usersMutex);
+                free(body);
+                free(query);
+                epochExit();
             }
             break;
         case LOGOUT:
@@ -621,14 +800,10 @@ void *process_job(void* arg) {
                         response.msg_type = RMCLOSED;
                         response.msg_len = strlen(temp->roomName)+1;
 
-                        user *temp2 = temp->userList;
-                        while (temp2->next != NULL) {
-                            if (wr_msg(temp2->fd, &response, temp->roomName) < 0) {
-                                printf("Write error\n");
-                                exit(EXIT_FAILURE);
-                            }
+                        for (size_t i = temp->members.size - 1; i > 0; i--) {
+                            user *temp2 = temp->members.entries[i].member;
+                            userWrite(temp2, &response, temp->roomName);
                             serverSendAudit(response.msg_type, temp2);
-                            temp2 = temp2->next;
                         }
                         //free out room
                         if (prev == NULL)
@@ -638,54 +813,44 @@ void *process_job(void* arg) {
 
                         room *temp3 = temp->next;
                             
-                        free(temp->roomName);
-                        free(temp);
+                        nameIndexRemove(&rooms.index, temp->roomName);
+                        presencePublishRoom(temp->roomName);
+                        epochRetire(freeRoom, temp);
 
                         temp = temp3;
                         continue;
                     } else {
-                        user *temp2 = temp->userList;
-                        user *prev2 = NULL;
-                        while (temp2 != NULL) {
-                            if (strcmp(temp2->username, client->username) == 0) {
-                                    if (prev2 == NULL)
-                                        temp->userList = temp2->next;
-                                    else
-                                        prev2->next = temp2->next;
-                                                                        
-                                    free(temp2);
-                                    break;
-                            }
-                        
-                            prev2 = temp2;
-                            temp2 = temp2->next;
-                        }
+                        roomRemove(temp, client);
                     }
 
                     prev = temp;
                     temp = temp->next;
                 }
+                listCacheInvalidate(&rooms.cache);
                 pthread_mutex_unlock(&rooms.roomListMutex);
+                // a peer's LOGOUT only clears the user out of rooms held here
+                if (remote)
+                    goto finish;
                 pthread_mutex_lock(&users.usersMutex);
 
                 user *curUser = users.userList;
                 user *prev3 = NULL;
                 while (curUser != NULL) {
-                    if (strcmp(curUser->username, client->username) == 0) {
+                    if (curUser == client) {
                         if (prev3 == NULL)
                             users.userList = curUser->next;
                         else
                             prev3->next = curUser->next;
+                        nameIndexRemove(&users.index, curUser->username);
+                        listCacheInvalidate(&users.cache);
+                        presencePublish(curUser, 0);
 
                         response.msg_type = OK;
                         response.msg_len = 0;
-                        if (wr_msg(client->fd, &response, NULL) < 0) {
-                            printf("Write error\n");
-                            exit(EXIT_FAILURE);
-                        }
+                        userWrite(client, &response, NULL);
                         serverSendAudit(response.msg_type, client);
-                        free(curUser->username);
-                        free(curUser);
+                        // freed once the scheduler is done with it
+                        loggedOut = curUser;
                         pthread_mutex_unlock(&users.usersMutex);
                         goto finish;
                     }
@@ -700,249 +865,706 @@ void *process_job(void* arg) {
         }
 
     finish:
-        if (jobs.tail->prev == NULL) {
-            free(jobs.tail);
-            jobs.head = jobs.tail = NULL;
-        } else {
-            jobs.tail->prev->next = NULL;
-            free(jobs.tail);
+        traceLeave(SPAN_HANDLER, client->username);
+        free(msg);
+        if (loggedOut != NULL)
+            jobQueueDrop(&jobs, loggedOut);
+        jobQueueDone(&jobs, current);
+        if (remote) {
+            free(client->username);
+            free(client);
+        } else if (loggedOut != NULL) {
+            // the registry's reference goes once lock-free readers are done
+            epochRetire(retireUser, loggedOut);
         }
 
-        jobs.size--;
+        auditWrite("Job thread [%ld] removed job at %s\n", (long)pthread_self(), auditTime());
+    }
+    return NULL;
+}
+
+// Pick up the options that follow the username in a LOGIN body.
+static unsigned int parseLoginOptions(char *body, uint32_t len) {
+    unsigned int features = 0;
+    size_t offset = strlen(body) + 1;
+
+    while (offset < len) {
+        char *option = body + offset;
+        if (strcmp(option, PETR_OPT_COMPRESS) == 0)
+            features |= USER_COMPRESS;
+        else if (strcmp(option, PETR_OPT_SHM) == 0)
+            features |= USER_SHM;
+        else if (strcmp(option, PETR_OPT_BATCH) == 0)
+            features |= USER_BATCH;
+        offset += strlen(option) + 1;
+    }
+    return features;
+}
+
+// Read one whole frame into a job buffer: the decoded header followed by
+// the body and an extra terminator so a malformed body is still a C string.
+static char *readJobMsg(petr_reader *reader) {
+    petr_header header;
+    if (rd_msgheader_buffered(reader, &header) < 0)
+        return NULL;
+    uint64_t start = traceNow();
+
+    if (header.msg_len > MAX_MSG_LEN) {
+        printf("Message too large (%u bytes)\n", header.msg_len);
+        return NULL;
+    }
 
-        pthread_mutex_lock(&aLog.auditLogMutex);
+    char *msg = malloc(sizeof(petr_header) + header.msg_len + 1);
+    memcpy(msg, &header, sizeof(petr_header));
+    if (rd_msgbody(reader, msg + sizeof(petr_header), header.msg_len) < 0) {
+        free(msg);
+        return NULL;
+    }
+    msg[sizeof(petr_header) + header.msg_len] = '\0';
+    traceReceived(start);
+    return msg;
+}
 
-        FILE *file = fopen(aLog.fileName, "a");
-        time(&t);
-        fprintf(file, "Job thread [%ld] removed job at %s\n", (long)pthread_self(), ctime(&t));
-        fclose(file);
+void serverEnqueue(user *client, char *msg) {
+    petr_header *header = (petr_header*)msg;
+    uint8_t msg_type = header->msg_type;
+    uint64_t enqueueStart = traceNow();
+    unsigned int frame = traceFrame(msg_type, client->username);
+    int pushed;
+
+    // from a peer while the state is on its way to a successor
+    if (handoffFrozen()) {
+        free(msg);
+        if (client->node != clusterSelf()) {
+            free(client->username);
+            free(client);
+        }
+        return;
+    }
 
-        pthread_mutex_unlock(&aLog.auditLogMutex);
+    if (client->node == clusterSelf()) {
+        recorderFrame(client->fd, msg);
+        timersActivity(client->fd);
+    }
+
+    // jobs from peers were admitted by the user's own node
+    if (client->node == clusterSelf() && rateAdmit(&client->rate, header->msg_type) < 0) {
+        petr_header response;
+        memset(&response, 0, sizeof(response));
+        response.msg_type = ETHROTTLED;
+        response.msg_len = 0;
+        // on the reactor: a client too far behind to take it goes without
+        userTryWrite(client, &response, NULL);
+
+        auditWrite("Client throttled: %x from %s, %lu dropped, at %s\n", header->msg_type, client->username,
+                client->rate.throttled, auditTime());
 
-        pthread_mutex_unlock(&jobs.jobQueueMutex);
+        free(msg);
+        return;
     }
-    return NULL;
+
+    auditWrite("Client sent: %x, %d %s at %s\n", header->msg_type, header->msg_len, msg+sizeof(petr_header), auditTime());
+    // frames that trail the user's LOGOUT are dropped
+    if ((pushed = jobQueuePush(&jobs, client, msg, frame)) == -2) {
+        free(msg);
+        return;
+    }
+    if (pushed < 0) {
+        petr_header response;
+        memset(&response, 0, sizeof(response));
+        response.msg_type = ESERVBUSY;
+        response.msg_len = 0;
+        if (client->node == clusterSelf())
+            userTryWrite(client, &response, NULL);
+        else
+            userWrite(client, &response, NULL);
+
+        auditWrite("Job shed: %x from %s, queue full, at %s\n", header->msg_type, client->username, auditTime());
+
+        free(msg);
+        if (client->node != clusterSelf()) {
+            free(client->username);
+            free(client);
+        }
+        return;
+    }
+
+    auditWrite("Job thread [%ld] inserted job at %s\n", (long)pthread_self(), auditTime());
+    // the job may already have run, so nothing of it is touched here
+    traceSpan(frame, SPAN_ENQUEUE, msg_type, enqueueStart, NULL);
 }
 
-//Function running in thread
-void *process_client(void *user_ptr) {
-    user *client = (user *)user_ptr;
-    int client_fd = client->fd;
-    int received_size;
-    fd_set read_fds;
+void serverDisconnect(int client_fd) {
+    printf("Close current client connection\n");
+    recorderClosed(client_fd);
+    timersClosed(client_fd);
+    close(client_fd);
 
-    int retval;
-    while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(client_fd, &read_fds);
-        retval = select(client_fd + 1, &read_fds, NULL, NULL, NULL);
-        if (retval != 1 && !FD_ISSET(client_fd, &read_fds)) {
-            printf("Error with select() function\n");
+    auditWrite("Client connection [%d] closed at %s\n", client_fd, auditTime());
+}
+
+void serverHangup(user *client) {
+    auditWrite("Client hung up: %s [%d] at %s\n", client->username, client->fd, auditTime());
+
+    // writes to it fail from now on and are dropped by userWrite
+    recorderClosed(client->fd);
+    shutdown(client->fd, SHUT_RDWR);
+    if (client->ring != NULL)
+        shmRingClose(client->ring);
+
+    // log it out as if it had asked to; if it already did, the queue
+    // refuses the job
+    char *logout = calloc(1, sizeof(petr_header) + 1);
+    ((petr_header *)logout)->msg_type = LOGOUT;
+    if (jobQueuePush(&jobs, client, logout, 0) < 0)
+        free(logout);
+    userRelease(client);
+}
+
+int serverPauseReads(user *client) {
+    if (!jobQueueShouldPause(&jobs, client))
+        return 0;
+    jobQueueNotePause(&jobs);
+    return 1;
+}
+
+int serverCanResume(user *client) {
+    return !jobQueueShouldPause(&jobs, client);
+}
+
+void serverDeliver(const char *name, struct iovec *frame, int iovcnt) {
+    if (handoffFrozen())
+        return;
+    epochEnter();
+    user *to = nameIndexFind(&users.index, name);
+    if (to != NULL && to->node == clusterSelf())
+        userWriteFrame(to, frame, iovcnt);
+    epochExit();
+}
+
+static void removeUser(user *u) {
+    user *prev = NULL;
+    for (user *temp = users.userList; temp != NULL; prev = temp, temp = temp->next) {
+        if (temp == u) {
+            if (prev == NULL)
+                users.userList = u->next;
+            else
+                prev->next = u->next;
             break;
         }
+    }
+    nameIndexRemove(&users.index, u->username);
+    listCacheInvalidate(&users.cache);
+}
 
-        pthread_mutex_lock(&buffer_lock);
+void serverPresenceApply(user *proxy, int online) {
+    pthread_mutex_lock(&users.usersMutex);
+    user *known = nameIndexFind(&users.index, proxy->username);
 
-        bzero(buffer, BUFFER_SIZE);
-        received_size = read(client_fd, buffer, sizeof(buffer));
-        if (received_size < 0) {
-            printf("Receiving failed\n");
-            break;
-        } else if (received_size == 0) {
-            pthread_mutex_unlock(&buffer_lock);
-            break;
-            //continue;
+    if (online) {
+        // two nodes let the same name in at once: the local login stands
+        if (known != NULL && known->node == clusterSelf()) {
+            printf("User (%s) also logged in on node %d\n", proxy->username, proxy->node);
+            goto drop;
+        }
+        if (known != NULL) {
+            removeUser(known);
+            epochRetire(freeProxy, known);
+        }
+        proxy->next = users.userList;
+        users.userList = proxy;
+        if (nameIndexInsert(&users.index, proxy->username, proxy) < 0) {
+            printf("Out of memory indexing user\n");
+            exit(EXIT_FAILURE);
         }
+        listCacheInvalidate(&users.cache);
+        pthread_mutex_unlock(&users.usersMutex);
+        return;
+    }
 
+    if (known != NULL && known->node == proxy->node && known->id == proxy->id) {
+        removeUser(known);
+        epochRetire(freeProxy, known);
+    }
+drop:
+    pthread_mutex_unlock(&users.usersMutex);
+    free(proxy->username);
+    free(proxy);
+}
+
+void serverPresenceReset(int node) {
+    pthread_mutex_lock(&users.usersMutex);
+    user *temp = users.userList;
+    while (temp != NULL) {
+        user *next = temp->next;
+        if (temp->node == node) {
+            removeUser(temp);
+            epochRetire(freeProxy, temp);
+        }
+        temp = next;
+    }
+    pthread_mutex_unlock(&users.usersMutex);
+}
 
-        petr_header *header = (petr_header*)buffer;
-        pthread_mutex_lock(&aLog.auditLogMutex);
+int serverRoomSnapshot(const char *name, size_t *memberCount, char **memberNames) {
+    pthread_mutex_lock(&rooms.roomListMutex);
+    room *r = nameIndexFind(&rooms.index, name);
+    if (r == NULL || r->node != clusterSelf()) {
+        pthread_mutex_unlock(&rooms.roomListMutex);
+        return -1;
+    }
+    *memberCount = r->members.size;
+    *memberNames = listMemberNames(r);
+    pthread_mutex_unlock(&rooms.roomListMutex);
+    if (*memberNames == NULL) {
+        printf("Out of memory listing room\n");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
 
-        FILE *file = fopen(aLog.fileName, "a");
-        time(&t);
-        fprintf(file, "Client sent: %x, %d %s at %s\n", header->msg_type, header->msg_len, ((char*)header+sizeof(petr_header)), ctime(&t));
-        fclose(file);
+static void freeReplica(void *p) {
+    room *r = p;
+    free(r->roomName);
+    free(r->memberNames);
+    free(r);
+}
 
-        pthread_mutex_unlock(&aLog.auditLogMutex);
-        pthread_mutex_lock(&jobs.jobQueueMutex);
+static void removeReplica(room *r) {
+    room **link = &rooms.replicas;
+    while (*link != r)
+        link = &(*link)->next;
+    *link = r->next;
+    nameIndexRemove(&rooms.index, r->roomName);
+    listCacheInvalidate(&rooms.cache);
+    epochRetire(freeReplica, r);
+}
 
-        job* newJob = malloc(sizeof(job));
-        newJob->msg = malloc(received_size);
-        newJob->client = client;
-        memcpy(newJob->msg, buffer, received_size);
+void serverRoomApply(int node, char *name, size_t memberCount, char *memberNames, int more) {
+    pthread_mutex_lock(&rooms.roomListMutex);
+    room *known = nameIndexFind(&rooms.index, name);
+    if (known != NULL && known->node != node)
+        goto drop;
 
-        newJob->prev = NULL;
-        if (jobs.head == NULL) {
-            newJob->next = NULL;
-            jobs.head = jobs.tail = newJob;
-        } else {
-            newJob->next = jobs.head;
-            jobs.head->prev = newJob;
-            jobs.head = newJob;
+    if (memberNames == NULL) {
+        if (known != NULL)
+            removeReplica(known);
+        goto drop;
+    }
+    if (more) {
+        // the rest of a listing too long for one frame
+        if (known == NULL)
+            goto drop;
+        size_t len = strlen(known->memberNames);
+        char *names = realloc(known->memberNames, len + strlen(memberNames) + 1);
+        if (names == NULL) {
+            printf("Out of memory replicating room\n");
+            exit(EXIT_FAILURE);
         }
+        strcpy(names + len, memberNames);
+        known->memberNames = names;
+        listCacheInvalidate(&rooms.cache);
+        goto drop;
+    }
 
-        jobs.size++;
+    // only listings read memberNames, and they build under the mutex
+    if (known != NULL) {
+        free(known->memberNames);
+        known->memberNames = memberNames;
+        __atomic_store_n(&known->memberCount, memberCount, __ATOMIC_RELAXED);
+        listCacheInvalidate(&rooms.cache);
+        pthread_mutex_unlock(&rooms.roomListMutex);
+        free(name);
+        return;
+    }
 
-        pthread_mutex_lock(&aLog.auditLogMutex);
+    room *replica = calloc(1, sizeof(room));
+    replica->roomName = name;
+    replica->node = node;
+    replica->memberNames = memberNames;
+    replica->memberCount = memberCount;
+    replica->next = rooms.replicas;
+    rooms.replicas = replica;
+    if (nameIndexInsert(&rooms.index, replica->roomName, replica) < 0) {
+        printf("Out of memory indexing room\n");
+        exit(EXIT_FAILURE);
+    }
+    listCacheInvalidate(&rooms.cache);
+    pthread_mutex_unlock(&rooms.roomListMutex);
+    return;
+drop:
+    pthread_mutex_unlock(&rooms.roomListMutex);
+    free(name);
+    free(memberNames);
+}
 
-        file = fopen(aLog.fileName, "a");
-        time(&t);
-        fprintf(file, "Job thread [%ld] inserted job at %s\n", (long)pthread_self(), ctime(&t));
-        fclose(file);
+void serverRoomReset(int node) {
+    pthread_mutex_lock(&rooms.roomListMutex);
+    room *temp = rooms.replicas;
+    while (temp != NULL) {
+        room *next = temp->next;
+        if (temp->node == node)
+            removeReplica(temp);
+        temp = next;
+    }
+    pthread_mutex_unlock(&rooms.roomListMutex);
+}
 
-        pthread_mutex_unlock(&aLog.auditLogMutex);
-     
-        pthread_cond_signal(&jobs.notEmpty);
-        pthread_mutex_unlock(&jobs.jobQueueMutex);
+static int unixConnection(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(fd, (SA *)&addr, &len) == 0 && addr.ss_family == AF_UNIX;
+}
 
-        pthread_mutex_unlock(&buffer_lock);
+void serverLocalUsers(void (*fn)(const user *u, void *arg), void *arg) {
+    pthread_mutex_lock(&users.usersMutex);
+    for (user *temp = users.userList; temp != NULL; temp = temp->next)
+        if (temp->node == clusterSelf())
+            fn(temp, arg);
+    pthread_mutex_unlock(&users.usersMutex);
+}
+
+int serverListeners(int *fds, const char **path) {
+    fds[0] = listen_fd;
+    *path = unix_fd >= 0 ? unix_path : NULL;
+    if (unix_fd < 0)
+        return 1;
+    fds[1] = unix_fd;
+    return 2;
+}
 
+void serverWaitIdle(void) {
+    jobQueueWaitIdle(&jobs);
+}
+
+unsigned long serverNextId(void) {
+    pthread_mutex_lock(&users.usersMutex);
+    unsigned long nextId = users.nextId;
+    pthread_mutex_unlock(&users.usersMutex);
+    return nextId;
+}
+
+void serverAdoptNextId(unsigned long nextId) {
+    pthread_mutex_lock(&users.usersMutex);
+    users.nextId = nextId;
+    pthread_mutex_unlock(&users.usersMutex);
+}
+
+void serverRooms(void (*fn)(const room *r, void *arg), void *arg) {
+    pthread_mutex_lock(&rooms.roomListMutex);
+    for (room *temp = rooms.head; temp != NULL; temp = temp->next)
+        fn(temp, arg);
+    pthread_mutex_unlock(&rooms.roomListMutex);
+}
+
+// As serverLogin lets a user in, less the LOGIN: it is already connected.
+user *serverAdoptUser(char *name, unsigned long id, int fd, unsigned int features, shmRing *ring) {
+    user *u = malloc(sizeof(user));
+    u->username = name;
+    u->id = id;
+    u->fd = fd;
+    u->node = clusterSelf();
+    u->reader = NULL;
+    u->ring = ring;
+    u->batch = features & USER_BATCH ? batchNew() : NULL;
+    u->refs = 2;
+    u->features = features;
+    rateBucketsInit(&u->rate);
+    memset(&u->order, 0, sizeof(u->order));
+    u->listVersion = 0;
+
+    pthread_mutex_lock(&users.usersMutex);
+    u->next = users.userList;
+    users.userList = u;
+    if (nameIndexInsert(&users.index, name, u) < 0) {
+        printf("Out of memory indexing user\n");
+        exit(EXIT_FAILURE);
     }
-    // Close the socket at the end
-    printf("Close current client connection\n");
-    close(client_fd);
+    listCacheInvalidate(&users.cache);
+    presencePublish(u, 1);
+    pthread_mutex_unlock(&users.usersMutex);
+
+    auditWrite("User taken over: %s, %d at %s\n", name, fd, auditTime());
+
+    timersLoggedIn(fd);
+    return u;
+}
 
-    pthread_mutex_lock(&aLog.auditLogMutex);
+// As RMCREATE and RMJOIN build a room; members[0] is its creator. Local
+// members are the users adopted before it, remote ones are copied.
+void serverAdoptRoom(char *name, user *members, size_t count) {
+    room *newRoom = malloc(sizeof(room));
+    newRoom->roomName = name;
+    newRoom->node = clusterSelf();
+    newRoom->memberNames = NULL;
+    memberSetInit(&newRoom->members);
+    for (size_t i = 0; i < count; i++) {
+        user *member = members[i].node == clusterSelf() ? nameIndexFind(&users.index, members[i].username)
+                                                         : roomMember(&members[i]);
+        if (member == NULL) {
+            printf("Room (%s) member %s was not taken over\n", name, members[i].username);
+            exit(EXIT_FAILURE);
+        }
+        if (i == 0)
+            newRoom->creator = member;
+        if (memberSetAdd(&newRoom->members, members[i].id, member) < 0) {
+            printf("Out of memory adding room member\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_lock(&rooms.roomListMutex);
+    newRoom->view = NULL;
+    roomPublish(newRoom);
+    newRoom->next = rooms.head;
+    rooms.head = newRoom;
+    if (nameIndexInsert(&rooms.index, newRoom->roomName, newRoom) < 0) {
+        printf("Out of memory indexing room\n");
+        exit(EXIT_FAILURE);
+    }
+    listCacheInvalidate(&rooms.cache);
+    presencePublishRoom(newRoom->roomName);
+    pthread_mutex_unlock(&rooms.roomListMutex);
+}
 
-    FILE *file = fopen(aLog.fileName, "a");
-    time(&t);
-    fprintf(file, "Client thread [%ld] terminated at %s\n", (long) pthread_self(), ctime(&t));
-    fclose(file);
+user *serverLogin(int client_fd, char *loginMsg) {
+    petr_header *header = (petr_header*)loginMsg;
+    recorderFrame(client_fd, loginMsg);
+    if (header->msg_type != LOGIN || header->msg_len <= 0) {
+        petr_header eservHeader;
+        memset(&eservHeader, 0, sizeof(eservHeader));
+        eservHeader.msg_type = ESERV;
+        eservHeader.msg_len = 0;
+        if (wr_msg_try(client_fd, &eservHeader, NULL) < 0) {
+            printf("Write error\n");
+        }
 
-    pthread_mutex_unlock(&aLog.auditLogMutex);
+        free(loginMsg);
+        return NULL;
+    }
+    char *username;
+    getMsgAsStr(loginMsg, &username);
+    unsigned int features = parseLoginOptions(loginMsg + sizeof(petr_header), header->msg_len);
+    free(loginMsg);
+
+    // a ring only makes sense for a client sharing our memory; anyone else
+    // gets a plain OK and keeps reading its socket
+    shmRing *ring = NULL;
+    if ((features & USER_SHM) && unixConnection(client_fd))
+        ring = shmRingNew();
+    if (ring == NULL)
+        features &= ~USER_SHM;
+
+    // every frame goes out in one write of its own; with Nagle on, one
+    // written while the last is still unacknowledged waits out the
+    // client's delayed ACK, some 40ms
+    int one = 1;
+    if (!unixConnection(client_fd))
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_mutex_lock(&users.usersMutex); 
+
+    if (nameIndexFind(&users.index, username) != NULL) {
+        petr_header newHeader;
+        memset(&newHeader, 0, sizeof(newHeader));
+        newHeader.msg_type = EUSREXISTS;
+        newHeader.msg_len = 0;
+        if (wr_msg_try(client_fd, &newHeader, NULL) < 0) {
+            printf("Write error\n");
+        }
+        printf("Username already exists. Connection refused.\n");
+        
+        auditWrite("User denied: %s, %d at %s\n", username, client_fd, auditTime());
+
+        pthread_mutex_unlock(&users.usersMutex);
+        if (ring != NULL)
+            shmRingFree(ring);
+        free(username);
+        return NULL;
+    }
+
+    // the reactor logs users in, so no reply here waits on the client: a
+    // fresh connection has room for it, and one without is refused
+    petr_header newHeader;
+    memset(&newHeader, 0, sizeof(newHeader));
+    newHeader.msg_type = OK;
+    newHeader.msg_len = 0;
+    if ((ring != NULL ? shmRingGrant(ring, client_fd) : wr_msg_try(client_fd, &newHeader, NULL)) < 0) {
+        printf("Write error\n");
+        pthread_mutex_unlock(&users.usersMutex);
+        if (ring != NULL)
+            shmRingFree(ring);
+        free(username);
+        return NULL;
+    }
+    struct user *newUser = malloc(sizeof(struct user));
+    newUser->username = username;
+    newUser->id = ++users.nextId;
+    newUser->fd = client_fd;
+    newUser->node = clusterSelf();
+    newUser->reader = NULL;
+    newUser->ring = ring;
+    newUser->batch = features & USER_BATCH ? batchNew() : NULL;
+    newUser->refs = 2;
+    newUser->features = features;
+    rateBucketsInit(&newUser->rate);
+    memset(&newUser->order, 0, sizeof(newUser->order));
+    newUser->listVersion = 0;
+    
+    if (users.userList == NULL)
+        newUser->next = NULL;
+    else
+        newUser->next = users.userList;
+    
+    users.userList = newUser;
+    if (nameIndexInsert(&users.index, username, newUser) < 0) {
+        printf("Out of memory indexing user\n");
+        exit(EXIT_FAILURE);
+    }
+    listCacheInvalidate(&users.cache);
+    presencePublish(newUser, 1);
+
+    printf("Client (%s) connection accepted\n", username);
+    auditWrite("User accepted: %s, %d at %s\n", username, client_fd, auditTime());
+    pthread_mutex_unlock(&users.usersMutex);
+
+    timersLoggedIn(client_fd);
+    return newUser;
+}
+
+//Function running in thread
+void *process_client(void *user_ptr) {
+    user *client = (user *)user_ptr;
+    petr_reader *reader = client->reader;
+
+    while (1) {
+        // hold off reading while this client has more than its share queued
+        jobQueueWaitShare(&jobs, client);
+        char *msg = readJobMsg(reader);
+        if (msg == NULL)
+            break;
+        serverEnqueue(client, msg);
+    }
+    client->reader = NULL;
+    free(reader);
+    serverHangup(client);
+
+    auditWrite("Client thread [%ld] terminated at %s\n", (long) pthread_self(), auditTime());
 
 
     return NULL;
 }
 
-void run_server(int server_port) {
-    listen_fd = server_init(server_port); // Initiate server and start listening on specified port
-    int client_fd;
-    struct sockaddr_in client_addr;
+// Thread-per-client backend: this thread accepts and logs users in, and
+// each logged-in user gets a thread blocked reading its frames.
+static void runThreads(const int *listenFds, int numListen) {
+    struct sockaddr_storage client_addr;
     int client_addr_len = sizeof(client_addr);
-    int received_size;
+    struct pollfd listening[2];
 
     pthread_t tid;
 
+    for (int l = 0; l < numListen; l++) {
+        listening[l].fd = listenFds[l];
+        listening[l].events = POLLIN;
+    }
+
     while (1) {
-        begin:
         // Wait and Accept the connection from client
         printf("Wait for new client connection\n");
-        int *client_fd = malloc(sizeof(int));
-        *client_fd = accept(listen_fd, (SA *)&client_addr, (socklen_t*)&client_addr_len);
-        if (*client_fd < 0) {
+        if (poll(listening, numListen, -1) < 0)
+            continue;
+        int ready = 0;
+        while (ready < numListen - 1 && !(listening[ready].revents & POLLIN))
+            ready++;
+        client_addr_len = sizeof(client_addr);
+        int client_fd = accept(listenFds[ready], (SA *)&client_addr, (socklen_t*)&client_addr_len);
+        if (client_fd < 0) {
             printf("server acccept failed\n");
             exit(EXIT_FAILURE);
-        } else {
-            // TODO: Verify User name (reject and close on failed)
-            //      -> add to user list -> spawn client thread
-            
-            pthread_mutex_lock(&buffer_lock);
-
-            bzero(buffer, BUFFER_SIZE);
-            received_size = read(*client_fd, buffer, sizeof(buffer));
-            
-            if (received_size < 0) {
-                printf("Receiving failed\n");
-                break;                
-            } else if (received_size == 0) {
-                printf("Nothing sent\n");
-                continue;
-            }
-            
-            petr_header *header = (petr_header*)buffer;
-            if (header->msg_type != LOGIN || header->msg_len <= 0) {
-                // TODO: send ESERV
-                petr_header eservHeader;
-                memset(&eservHeader, 0, sizeof(eservHeader));
-                eservHeader.msg_type = ESERV;
-                eservHeader.msg_len = 0;
-                if (wr_msg(*client_fd, &eservHeader, NULL) < 0) {
-                    printf("Write error\n");
-                    exit(EXIT_FAILURE);
-                }
-
-                pthread_mutex_unlock(&buffer_lock);
-                continue;
-            }
-            // char *username = malloc(header->msg_len+1);
-            // memcpy(username, (char*)header + sizeof(petr_header), header->msg_len);
-            // username[header->msg_len] = '\0';
-            char *username;
-            getMsgAsStr(buffer, &username);
-            pthread_mutex_lock(&users.usersMutex); 
-            struct user *temp = users.userList;
-            bzero(buffer, BUFFER_SIZE);
-            int ret;
-            
-            while (temp != NULL) {
-                if (strcmp(username, temp->username) == 0) {
-                    petr_header newHeader;
-                    memset(&newHeader, 0, sizeof(newHeader));
-                    newHeader.msg_type = EUSREXISTS;
-                    newHeader.msg_len = 0;
-                    if (wr_msg(*client_fd, &newHeader, NULL) < 0) {
-                        printf("Write error\n");
-                        exit(EXIT_FAILURE);
-                    }
-                    printf("Username already exists. Connection refused.\n");
-                    
-                    pthread_mutex_lock(&aLog.auditLogMutex);
+        }
 
-                    FILE *file = fopen(aLog.fileName, "a");
+        petr_reader *reader = malloc(sizeof(petr_reader));
+        petr_reader_init(reader, client_fd);
+
+        // a client that never logs in is shut down by its LOGIN deadline
+        timersAccepted(client_fd);
+        char *loginMsg = readJobMsg(reader);
+        if (loginMsg == NULL) {
+            printf("Nothing sent\n");
+            free(reader);
+            timersClosed(client_fd);
+            close(client_fd);
+            continue;
+        }
 
-                    time(&t);
-                    fprintf(file, "User denied: %s, %d at %s\n", username, *client_fd, ctime(&t));
-                    fclose(file);
+        user *newUser = serverLogin(client_fd, loginMsg);
+        if (newUser == NULL) {
+            free(reader);
+            recorderClosed(client_fd);
+            timersClosed(client_fd);
+            close(client_fd);
+            continue;
+        }
+        newUser->reader = reader;
 
-                    pthread_mutex_unlock(&aLog.auditLogMutex);
+        pthread_create(&tid, NULL, process_client, (void *)newUser);
 
+        auditWrite("Client thread [%ld] created for %s at %s\n", (long)tid, newUser->username, auditTime());
+    }
+}
 
-                    pthread_mutex_unlock(&users.usersMutex);
-                    pthread_mutex_unlock(&buffer_lock);
-                    goto begin;
-                }
-                temp = temp->next;
-            }
-            petr_header newHeader;
-            memset(&newHeader, 0, sizeof(newHeader));
-            newHeader.msg_type = OK;
-            newHeader.msg_len = 0;
-            if (wr_msg(*client_fd, &newHeader, NULL) < 0) {
-                printf("Write error\n");
-                exit(EXIT_FAILURE);
+void run_server(int server_port, const char *path, const char *handoffPath, ioBackend backend) {
+    int listenFds[2];
+    int numListen = 0;
+    if (handoffPath != NULL) {
+        if (backend == IO_THREADS) {
+            printf("Handoff needs an event-loop backend (-i epoll|uring)\n");
+            exit(EXIT_FAILURE);
+        }
+        char *handedPath = NULL;
+        // the old server's listeners, whatever this one was asked for
+        numListen = handoffTakeOver(handoffPath, listenFds, &handedPath);
+        if (numListen > 0) {
+            listen_fd = listenFds[0];
+            if (numListen > 1) {
+                unix_fd = listenFds[1];
+                unix_path = handedPath;
             }
-            struct user *newUser = malloc(sizeof(struct user));
-            newUser->username = username;
-            newUser->fd = *client_fd;
-            
-            if (users.userList == NULL)
-                newUser->next = NULL;
-            else
-                newUser->next = users.userList;
-            
-            users.userList = newUser;
-
-            
-            printf("Client (%s) connection accepted\n", username);
-            pthread_mutex_lock(&aLog.auditLogMutex);
-
-            FILE* file = fopen(aLog.fileName, "a");
-            time(&t);
-            fprintf(file, "User accepted: %s, %d at %s\n", username, *client_fd, ctime(&t));
-            pthread_create(&tid, NULL, process_client, (void *)newUser);
-            time(&t);
-            fprintf(file, "Client thread [%ld] created for %s at %s\n", (long)tid, username, ctime(&t));
-            fclose(file);
-            pthread_mutex_unlock(&aLog.auditLogMutex);
-            pthread_mutex_unlock(&users.usersMutex);
-            pthread_mutex_unlock(&buffer_lock);
+        }
+        handoffListen(handoffPath);
+    }
 
+    if (numListen == 0) {
+        listen_fd = server_init(server_port); // Initiate server and start listening on specified port
+        listenFds[numListen++] = listen_fd;
+        if (path != NULL) {
+            unix_path = path;
+            unix_fd = server_init_unix(path);
+            listenFds[numListen++] = unix_fd;
         }
     }
+
+    switch (backend) {
+    case IO_URING:
+        if (runUring(listenFds, numListen) == 0)
+            break;
+        printf("io_uring unavailable, falling back to epoll\n");
+        // fall through
+    case IO_EPOLL:
+        runEpoll(listenFds, numListen);
+        break;
+    case IO_THREADS:
+    default:
+        runThreads(listenFds, numListen);
+        break;
+    }
     
-    bzero(buffer, BUFFER_SIZE);
     close(listen_fd);
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path);
+    }
     
     return;
 }
@@ -950,18 +1572,79 @@ void run_server(int server_port) {
 int main(int argc, char *argv[]) {
     int opt;
     int numJobs = 2;
+    int numFanout = 2;
+    ioBackend backend = IO_THREADS;
+    int node = 0;
+    size_t queueBudget = JOB_BUDGET_DEFAULT;
+    unsigned int traceEvery = 0;
+    char *peers = NULL;
+    char *unixPath = NULL;
+    char *handoffPath = NULL;
+    char *capturePath = NULL;
     pthread_t tid;
     char *logFileName;
 
     unsigned int port = 0;
-    while ((opt = getopt(argc, argv, "hj:")) != -1) {
+    while ((opt = getopt(argc, argv, "hj:f:i:n:P:r:q:t:k:w:u:H:c:")) != -1) {
         switch (opt) {
         case 'j':
             numJobs = atoi(optarg);
             break;
+        case 'f':
+            numFanout = atoi(optarg);
+            break;
+        case 'i':
+            if (ioParseBackend(optarg, &backend) < 0) {
+                fprintf(stderr, "ERROR: Unknown I/O backend %s (threads, epoll, uring)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            node = atoi(optarg);
+            break;
+        case 'P':
+            peers = optarg;
+            break;
+        case 'r':
+            if (rateLimitParse(optarg) < 0) {
+                fprintf(stderr, "ERROR: Bad rate limit %s (all|send|room|list=RATE[/BURST])\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            queueBudget = strtoul(optarg, NULL, 10);
+            if (queueBudget == 0) {
+                fprintf(stderr, "ERROR: Job queue budget must be a positive number of bytes\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            traceEvery = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            if (timersParse(optarg) < 0) {
+                fprintf(stderr, "ERROR: Timeout must be login|idle|heartbeat=SECONDS, got %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            if (batchParse(optarg) < 0) {
+                fprintf(stderr, "ERROR: Batch window must be MS[/COUNT], got %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            unixPath = optarg;
+            break;
+        case 'H':
+            handoffPath = optarg;
+            break;
+        case 'c':
+            capturePath = optarg;
+            break;
         case 'h':
         default: /* '?' */
-            fprintf(stderr, "Server Application Usage: %s [-h][-j N] PORT_NUMBER AUDIT_FILENAME\n",
+            fprintf(stderr, "Server Application Usage: %s [-h][-j N][-f N][-i threads|epoll|uring][-n NODE -P PEER_SOCKETS][-r CLASS=RATE/BURST][-q BYTES][-t N][-k login|idle|heartbeat=SECONDS][-w MS[/COUNT]][-u SOCKET_PATH][-H HANDOFF_PATH][-c CAPTURE_FILE] PORT_NUMBER AUDIT_FILENAME\n",
                     argv[0]);
             exit(EXIT_FAILURE);
         }
@@ -972,32 +1655,56 @@ int main(int argc, char *argv[]) {
     
     if (port == 0) {
         fprintf(stderr, "ERROR: Port number for server to listen is not given\n");
-        fprintf(stderr, "Server Application Usage: %s [-h][-j N] PORT_NUMBER AUDIT_FILENAME\n",
+        fprintf(stderr, "Server Application Usage: %s [-h][-j N][-f N][-i threads|epoll|uring][-n NODE -P PEER_SOCKETS][-r CLASS=RATE/BURST][-q BYTES][-t N][-k login|idle|heartbeat=SECONDS][-w MS[/COUNT]][-u SOCKET_PATH][-H HANDOFF_PATH][-c CAPTURE_FILE] PORT_NUMBER AUDIT_FILENAME\n",
                 argv[0]);
         exit(EXIT_FAILURE);
     }
 
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK_NP);
 
-    pthread_mutex_init(&buffer_lock, &attr);
     pthread_mutex_init(&users.usersMutex, &attr);
     pthread_mutex_init(&rooms.roomListMutex, &attr);
     pthread_mutex_init(&jobs.jobQueueMutex, &attr);
     pthread_cond_init(&jobs.notEmpty, NULL);
 
-    pthread_mutex_init(&aLog.auditLogMutex, &attr);
-
     users.userList = NULL;
 
-    jobs.head = jobs.tail = NULL;
-    jobs.size = 0;
 
     rooms.head = NULL;
+    rooms.replicas = NULL;
+
+    listCacheInit(&users.cache);
+    listCacheInit(&rooms.cache);
+    nameIndexInit(&users.index);
+    nameIndexInit(&rooms.index);
+
+    // before any other thread starts, so they all inherit the signal mask
+    statsInit();
+    auditInit(logFileName);
+#ifdef LOCK_PROFILE
+    lockProfInit();
+#endif
+    rateLimitInit();
+    epochInit();
+    shmRingInit();
+    recorderInit(capturePath);
+    traceInit(traceEvery, logFileName);
+    timersInit();
+    batchInit();
+    jobQueueInit(&jobs, queueBudget);
+
+    if (clusterInit(node, peers) < 0) {
+        fprintf(stderr, "ERROR: Node %d needs its socket in -P PATH,PATH,...\n", node);
+        exit(EXIT_FAILURE);
+    }
+    presenceInit();
+    // ids stay unique across the cluster so room member sets can hold proxies
+    users.nextId = (unsigned long)clusterSelf() << USER_ID_NODE_SHIFT;
 
-    aLog.fileName = logFileName;
+    fanoutInit(numFanout);
 
     for (int i = 0; i < numJobs; i++)
         pthread_create(&tid, NULL, process_job, NULL);
 
-    run_server(port);
+    run_server(port, unixPath, handoffPath, backend);
 }
\ No newline at end of file
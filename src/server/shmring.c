@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct shmRing {
+    petr_ring_end end;
+    size_t mapLen;
+    int memfd;     // kept after the grant, for a successor to map
+    int doorbell;  // eventfd the client waits on
+    int closed;
+    pthread_mutex_t lock;
+};
+
+static struct {
+    unsigned long granted;
+    unsigned long frames;
+    unsigned long bytes;
+    unsigned long fullWaits;
+    unsigned long doorbells;
+} shm;
+
+static void count(unsigned long *counter, unsigned long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void shmRingDump(FILE *out) {
+    fprintf(out, "shm: %lu rings granted, %lu frames, %lu bytes, %lu full waits, %lu doorbells\n",
+            __atomic_load_n(&shm.granted, __ATOMIC_RELAXED), __atomic_load_n(&shm.frames, __ATOMIC_RELAXED),
+            __atomic_load_n(&shm.bytes, __ATOMIC_RELAXED), __atomic_load_n(&shm.fullWaits, __ATOMIC_RELAXED),
+            __atomic_load_n(&shm.doorbells, __ATOMIC_RELAXED));
+}
+
+void shmRingInit(void) {
+    statsRegister(shmRingDump);
+}
+
+shmRing *shmRingNew(void) {
+    shmRing *ring = calloc(1, sizeof(shmRing));
+    if (ring == NULL)
+        return NULL;
+    ring->mapLen = PETR_RING_DATA + SHM_RING_SIZE;
+    ring->memfd = memfd_create("petr-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    ring->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    void *map = MAP_FAILED;
+    // sealed at its size, so the client cannot shrink it under our writes
+    if (ring->memfd >= 0 && ring->doorbell >= 0 && ftruncate(ring->memfd, ring->mapLen) == 0 &&
+        fcntl(ring->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+        map = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (map == MAP_FAILED) {
+        if (ring->memfd >= 0)
+            close(ring->memfd);
+        if (ring->doorbell >= 0)
+            close(ring->doorbell);
+        free(ring);
+        return NULL;
+    }
+
+    petr_ring_init(map, SHM_RING_SIZE);
+    petr_ring_attach(&ring->end, map, ring->mapLen);
+    pthread_mutex_init(&ring->lock, NULL);
+    return ring;
+}
+
+int shmRingGrant(shmRing *ring, int fd) {
+    petr_header ok = { 0, OK };
+    uint8_t wire[PETR_HEADER_SIZE];
+    petr_header_pack(&ok, wire);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { wire, sizeof(wire) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { ring->memfd, ring->doorbell };
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // called from the reactor, which waits on no one: a fresh connection
+    // takes the eight bytes at once, and one that doesn't is refused
+    ssize_t sent;
+    do
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (sent < 0 && errno == EINTR);
+    if (sent < (ssize_t)sizeof(wire))
+        return -1;
+
+    count(&shm.granted, 1);
+    return 0;
+}
+
+// Called with the ring's lock held, after a frame went in.
+static int sent(shmRing *ring, struct iovec *frame, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += frame[i].iov_len;
+    count(&shm.frames, 1);
+    count(&shm.bytes, len);
+
+    if (petr_ring_wake(&ring->end)) {
+        uint64_t one = 1;
+        count(&shm.doorbells, 1);
+        // a full counter still leaves the doorbell readable
+        if (write(ring->doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            return -1;
+    }
+    return 0;
+}
+
+int shmRingSend(shmRing *ring, struct iovec *frame, int iovcnt) {
+    struct timespec wait = { 0, SHM_RING_WAIT_US * 1000L };
+    int ret;
+
+    // held while waiting for room too, so frames stay whole and in order
+    pthread_mutex_lock(&ring->lock);
+    while ((ret = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) ? -1 : petr_ring_write(&ring->end, frame, iovcnt)) ==
+           1) {
+        count(&shm.fullWaits, 1);
+        nanosleep(&wait, NULL);
+    }
+    if (ret == 0)
+        ret = sent(ring, frame, iovcnt);
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+int shmRingTrySend(shmRing *ring, struct iovec *frame, int iovcnt) {
+    if (pthread_mutex_trylock(&ring->lock) != 0)
+        return 1;
+    int ret = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) ? -1 : petr_ring_write(&ring->end, frame, iovcnt);
+    if (ret == 0)
+        ret = sent(ring, frame, iovcnt);
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+void shmRingClose(shmRing *ring) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+void shmRingFree(shmRing *ring) {
+    munmap(ring->end.shared, ring->mapLen);
+    close(ring->memfd);
+    close(ring->doorbell);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+void shmRingState(shmRing *ring, int *memfd, int *doorbell, uint64_t *head) {
+    *memfd = ring->memfd;
+    *doorbell = ring->doorbell;
+    *head = ring->end.pos;
+}
+
+shmRing *shmRingAdopt(int memfd, int doorbell, uint64_t head) {
+    shmRing *ring = calloc(1, sizeof(shmRing));
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (ring != NULL && fstat(memfd, &st) == 0)
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED || petr_ring_attach(&ring->end, map, st.st_size) < 0) {
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        free(ring);
+        close(memfd);
+        close(doorbell);
+        return NULL;
+    }
+
+    ring->end.pos = head;
+    ring->mapLen = st.st_size;
+    ring->memfd = memfd;
+    ring->doorbell = doorbell;
+    pthread_mutex_init(&ring->lock, NULL);
+    return ring;
+}
@@ -0,0 +1,52 @@
+#include "stats.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+static struct {
+    statsDumpFn sources[STATS_MAX_SOURCES];
+    int count;
+    sigset_t mask;
+    pthread_mutex_t lock;
+} stats;
+
+static void *process_stats(void *arg) {
+    int sig;
+
+    while (1) {
+        if (sigwait(&stats.mask, &sig) != 0)
+            continue;
+        if (sig != SIGUSR1) {
+            printf("shutting down server\n");
+            exit(EXIT_SUCCESS);
+        }
+
+        pthread_mutex_lock(&stats.lock);
+        printf("--- stats ---\n");
+        for (int i = 0; i < stats.count; i++)
+            stats.sources[i](stdout);
+        fflush(stdout);
+        pthread_mutex_unlock(&stats.lock);
+    }
+    return NULL;
+}
+
+void statsInit(void) {
+    pthread_t tid;
+
+    stats.count = 0;
+    pthread_mutex_init(&stats.lock, NULL);
+    sigemptyset(&stats.mask);
+    sigaddset(&stats.mask, SIGUSR1);
+    sigaddset(&stats.mask, SIGINT);
+    sigaddset(&stats.mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stats.mask, NULL);
+    pthread_create(&tid, NULL, process_stats, NULL);
+}
+
+void statsRegister(statsDumpFn dump) {
+    pthread_mutex_lock(&stats.lock);
+    if (stats.count < STATS_MAX_SOURCES)
+        stats.sources[stats.count++] = dump;
+    pthread_mutex_unlock(&stats.lock);
+}
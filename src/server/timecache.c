@@ -0,0 +1,17 @@
+#include "timecache.h"
+#include <time.h>
+
+#define TIME_TEXT_LEN 32  // ctime_r needs 26
+
+static __thread time_t cachedSecond = -1;
+static __thread char cachedText[TIME_TEXT_LEN];
+
+const char *auditTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != cachedSecond) {
+        cachedSecond = ts.tv_sec;
+        ctime_r(&cachedSecond, cachedText);
+    }
+    return cachedText;
+}
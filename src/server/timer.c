@@ -0,0 +1,315 @@
+#include "timer.h"
+#include "io.h"
+#include "stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define ROOT_SLOTS (1 << TIMER_ROOT_BITS)
+#define LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)
+#define MAX_DELAY ((1ULL << (TIMER_ROOT_BITS + (TIMER_LEVELS - 1) * TIMER_LEVEL_BITS)) - 1)
+#define TICKS(sec) ((uint64_t)(sec) * 1000 / TIMER_TICK_MS)
+
+typedef enum { TIMER_OFF, TIMER_LOGIN, TIMER_IDLE } timerState;
+
+typedef struct timerEntry timerEntry;
+
+struct timerEntry {
+    timerEntry *prev, *next;  // in a wheel slot, prev NULL when not armed
+    uint64_t expires;         // tick
+    uint64_t lastActive;      // tick of the last frame in
+    uint64_t lastBeat;        // tick of the last heartbeat out
+    timerState state;
+};
+
+typedef struct {
+    const char *name;
+    unsigned long seconds;
+    unsigned long fired;
+} timerLimit;
+
+enum { LIMIT_LOGIN, LIMIT_IDLE, LIMIT_HEARTBEAT, LIMITS };
+
+static timerLimit limits[LIMITS] = {
+    [LIMIT_LOGIN] = { "login", 10 },
+    [LIMIT_IDLE] = { "idle", 0 },
+    [LIMIT_HEARTBEAT] = { "heartbeat", 0 },
+};
+
+// Each slot is a circular list headed by a dummy entry.
+static struct {
+    timerEntry root[ROOT_SLOTS];
+    timerEntry levels[TIMER_LEVELS - 1][LEVEL_SLOTS];
+    timerEntry *entries;  // by fd
+    size_t maxConns;
+    uint64_t now;
+    int running;
+    int held;  // no deadline fires, while connections are handed over
+    pthread_mutex_t lock;
+} wheel;
+
+int timersParse(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL)
+        return -1;
+
+    for (int i = 0; i < LIMITS; i++) {
+        if (strlen(limits[i].name) != (size_t)(eq - spec) || strncmp(spec, limits[i].name, eq - spec) != 0)
+            continue;
+
+        char *end;
+        unsigned long seconds = strtoul(eq + 1, &end, 10);
+        if (*end != '\0' || eq[1] == '\0')
+            return -1;
+        limits[i].seconds = seconds;
+        return 0;
+    }
+    return -1;
+}
+
+static void slotRemove(timerEntry *e) {
+    if (e->prev == NULL)
+        return;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void slotInsert(timerEntry *e) {
+    // the current slot has been looked at already
+    if (e->expires <= wheel.now)
+        e->expires = wheel.now + 1;
+    uint64_t delay = e->expires - wheel.now;
+    if (delay > MAX_DELAY) {
+        delay = MAX_DELAY;
+        e->expires = wheel.now + delay;
+    }
+
+    timerEntry *head;
+    if (delay < ROOT_SLOTS) {
+        head = &wheel.root[e->expires & (ROOT_SLOTS - 1)];
+    } else {
+        int level = 0;
+        while (delay >= 1ULL << (TIMER_ROOT_BITS + (level + 1) * TIMER_LEVEL_BITS))
+            level++;
+        int shift = TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS;
+        head = &wheel.levels[level][(e->expires >> shift) & (LEVEL_SLOTS - 1)];
+    }
+
+    e->prev = head->prev;
+    e->next = head;
+    head->prev->next = e;
+    head->prev = e;
+}
+
+static void arm(timerEntry *e, uint64_t expires) {
+    slotRemove(e);
+    e->expires = expires;
+    slotInsert(e);
+}
+
+static timerEntry *entryOf(int fd) {
+    if (!wheel.running || fd < 0 || (size_t)fd >= wheel.maxConns)
+        return NULL;
+    return &wheel.entries[fd];
+}
+
+void timersAccepted(int fd) {
+    timerEntry *e = entryOf(fd);
+    if (e == NULL)
+        return;
+
+    pthread_mutex_lock(&wheel.lock);
+    e->lastActive = e->lastBeat = wheel.now;
+    e->state = limits[LIMIT_LOGIN].seconds > 0 ? TIMER_LOGIN : TIMER_OFF;
+    if (e->state == TIMER_LOGIN)
+        arm(e, wheel.now + TICKS(limits[LIMIT_LOGIN].seconds));
+    else
+        slotRemove(e);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+// Next time the entry needs looking at: its idle deadline or its next
+// heartbeat, whichever comes first.
+static uint64_t nextDeadline(timerEntry *e) {
+    uint64_t next = UINT64_MAX;
+    if (limits[LIMIT_IDLE].seconds > 0)
+        next = e->lastActive + TICKS(limits[LIMIT_IDLE].seconds);
+    if (limits[LIMIT_HEARTBEAT].seconds > 0) {
+        uint64_t quiet = e->lastActive > e->lastBeat ? e->lastActive : e->lastBeat;
+        uint64_t beat = quiet + TICKS(limits[LIMIT_HEARTBEAT].seconds);
+        if (beat < next)
+            next = beat;
+    }
+    return next;
+}
+
+void timersLoggedIn(int fd) {
+    timerEntry *e = entryOf(fd);
+    if (e == NULL)
+        return;
+
+    pthread_mutex_lock(&wheel.lock);
+    e->lastActive = wheel.now;
+    e->state = TIMER_IDLE;
+    uint64_t next = nextDeadline(e);
+    if (next == UINT64_MAX) {
+        e->state = TIMER_OFF;
+        slotRemove(e);
+    } else {
+        arm(e, next);
+    }
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+void timersActivity(int fd) {
+    timerEntry *e = entryOf(fd);
+    if (e != NULL)
+        __atomic_store_n(&e->lastActive, __atomic_load_n(&wheel.now, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+void timersClosed(int fd) {
+    timerEntry *e = entryOf(fd);
+    if (e == NULL)
+        return;
+
+    pthread_mutex_lock(&wheel.lock);
+    e->state = TIMER_OFF;
+    slotRemove(e);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+static void sendHeartbeat(int fd) {
+    petr_header header = { 0, HEARTBEAT };
+    uint8_t wire[PETR_HEADER_SIZE];
+    petr_header_pack(&header, wire);
+    // never block the wheel on a full socket; a peer that is not reading
+    // is left to the idle timeout
+    if (send(fd, wire, sizeof(wire), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        shutdown(fd, SHUT_RDWR);
+}
+
+static void expire(timerEntry *e) {
+    int fd = e - wheel.entries;
+
+    if (e->state == TIMER_LOGIN) {
+        limits[LIMIT_LOGIN].fired++;
+        e->state = TIMER_OFF;
+        shutdown(fd, SHUT_RDWR);
+        return;
+    }
+    if (e->state != TIMER_IDLE)
+        return;
+
+    uint64_t active = __atomic_load_n(&e->lastActive, __ATOMIC_RELAXED);
+    if (limits[LIMIT_IDLE].seconds > 0 && wheel.now >= active + TICKS(limits[LIMIT_IDLE].seconds)) {
+        limits[LIMIT_IDLE].fired++;
+        e->state = TIMER_OFF;
+        shutdown(fd, SHUT_RDWR);
+        return;
+    }
+
+    uint64_t quiet = active > e->lastBeat ? active : e->lastBeat;
+    if (limits[LIMIT_HEARTBEAT].seconds > 0 && wheel.now >= quiet + TICKS(limits[LIMIT_HEARTBEAT].seconds)) {
+        limits[LIMIT_HEARTBEAT].fired++;
+        e->lastBeat = wheel.now;
+        sendHeartbeat(fd);
+    }
+    arm(e, nextDeadline(e));
+}
+
+// Move every entry of a higher level slot down to where it now belongs.
+static void cascade(int level) {
+    int shift = TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS;
+    timerEntry *head = &wheel.levels[level][(wheel.now >> shift) & (LEVEL_SLOTS - 1)];
+
+    while (head->next != head) {
+        timerEntry *e = head->next;
+        slotRemove(e);
+        slotInsert(e);
+    }
+}
+
+static void tick(void) {
+    __atomic_store_n(&wheel.now, wheel.now + 1, __ATOMIC_RELAXED);
+    // each time a level wraps, the next level's current slot comes due
+    for (int level = 0; level < TIMER_LEVELS - 1; level++) {
+        if ((wheel.now & ((1ULL << (TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS)) - 1)) != 0)
+            break;
+        cascade(level);
+    }
+
+    timerEntry *head = &wheel.root[wheel.now & (ROOT_SLOTS - 1)];
+    while (head->next != head) {
+        timerEntry *e = head->next;
+        slotRemove(e);
+        if (e->expires > wheel.now)
+            slotInsert(e);  // clamped to MAX_DELAY and not due yet
+        else
+            expire(e);
+    }
+}
+
+static void *process_timers(void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (1) {
+        next.tv_nsec += TIMER_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+
+        pthread_mutex_lock(&wheel.lock);
+        if (!wheel.held)
+            tick();
+        pthread_mutex_unlock(&wheel.lock);
+    }
+    return NULL;
+}
+
+void timersHold(int held) {
+    // under the lock, so a tick already firing is over when this returns
+    pthread_mutex_lock(&wheel.lock);
+    wheel.held = held;
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+static void timersDump(FILE *out) {
+    for (int i = 0; i < LIMITS; i++) {
+        if (limits[i].seconds == 0)
+            fprintf(out, "timer %s: off\n", limits[i].name);
+        else
+            fprintf(out, "timer %s: %lus, fired %lu\n", limits[i].name, limits[i].seconds,
+                    __atomic_load_n(&limits[i].fired, __ATOMIC_RELAXED));
+    }
+}
+
+void timersInit(void) {
+    pthread_t tid;
+
+    if (limits[LIMIT_LOGIN].seconds == 0 && limits[LIMIT_IDLE].seconds == 0 && limits[LIMIT_HEARTBEAT].seconds == 0)
+        return;
+
+    wheel.maxConns = ioMaxConns();
+    wheel.entries = calloc(wheel.maxConns, sizeof(timerEntry));
+    if (wheel.entries == NULL) {
+        printf("Timer wheel allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ROOT_SLOTS; i++)
+        wheel.root[i].prev = wheel.root[i].next = &wheel.root[i];
+    for (int level = 0; level < TIMER_LEVELS - 1; level++)
+        for (int i = 0; i < LEVEL_SLOTS; i++)
+            wheel.levels[level][i].prev = wheel.levels[level][i].next = &wheel.levels[level][i];
+    wheel.now = 0;
+    pthread_mutex_init(&wheel.lock, NULL);
+    wheel.running = 1;
+
+    statsRegister(timersDump);
+    pthread_create(&tid, NULL, process_timers, NULL);
+}
@@ -0,0 +1,202 @@
+#include "trace.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    uint64_t seq;  // slot index + 1 once written, 0 while being written
+    uint64_t start;
+    uint64_t dur;
+    unsigned int frame;
+    int tid;
+    uint8_t kind;
+    uint8_t msg_type;
+    char detail[TRACE_DETAIL];
+} span;
+
+static const char *kindNames[SPAN_KINDS] = { "receive", "enqueue", "queued", "handler", "send", "fanout" };
+
+static struct {
+    unsigned int every;  // 0 when tracing is off
+    char *path;
+    span *ring;
+    uint64_t head;
+    unsigned long seen;
+    unsigned int frames;
+} trace;
+
+static __thread uint64_t receiveStart;
+static __thread unsigned int current;
+static __thread uint8_t currentType;
+static __thread uint64_t currentStart;
+static __thread int threadId;
+
+void traceInit(unsigned int every, const char *auditFile) {
+    if (every == 0)
+        return;
+
+    trace.ring = calloc(TRACE_RING, sizeof(span));
+    trace.path = malloc(strlen(auditFile) + sizeof(".trace.json"));
+    if (trace.ring == NULL || trace.path == NULL) {
+        printf("Trace ring allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(trace.path, "%s.trace.json", auditFile);
+    trace.every = every;
+    statsRegister(traceDump);
+}
+
+uint64_t traceNow(void) {
+    if (trace.every == 0)
+        return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Slots are claimed with one fetch-and-add; a reader takes a slot only if
+// its seq reads the same before and after copying it.
+void traceSpan(unsigned int frame, spanKind kind, uint8_t msg_type, uint64_t start, const char *detail) {
+    if (frame == 0 || start == 0)
+        return;
+
+    uint64_t end = traceNow();
+    if (threadId == 0)
+        threadId = syscall(SYS_gettid);
+
+    uint64_t index = __atomic_fetch_add(&trace.head, 1, __ATOMIC_RELAXED);
+    span *s = &trace.ring[index % TRACE_RING];
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->start = start;
+    s->dur = end - start;
+    s->frame = frame;
+    s->tid = threadId;
+    s->kind = kind;
+    s->msg_type = msg_type;
+    strncpy(s->detail, detail != NULL ? detail : "", TRACE_DETAIL - 1);
+    s->detail[TRACE_DETAIL - 1] = '\0';
+    __atomic_store_n(&s->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+void traceReceived(uint64_t start) {
+    receiveStart = start;
+}
+
+unsigned int traceFrame(uint8_t msg_type, const char *from) {
+    if (trace.every == 0)
+        return 0;
+
+    uint64_t start = receiveStart;
+    receiveStart = 0;
+    if (__atomic_add_fetch(&trace.seen, 1, __ATOMIC_RELAXED) % trace.every != 0)
+        return 0;
+
+    unsigned int frame = __atomic_add_fetch(&trace.frames, 1, __ATOMIC_RELAXED);
+    traceSpan(frame, SPAN_RECEIVE, msg_type, start, from);
+    return frame;
+}
+
+void traceEnter(unsigned int frame, uint8_t msg_type) {
+    current = frame;
+    currentType = msg_type;
+    currentStart = frame != 0 ? traceNow() : 0;
+}
+
+void traceLeave(spanKind kind, const char *detail) {
+    traceSpan(current, kind, currentType, currentStart, detail);
+    current = 0;
+}
+
+unsigned int traceCurrent(void) {
+    return current;
+}
+
+uint64_t traceSendBegin(void) {
+    return current != 0 ? traceNow() : 0;
+}
+
+void traceSendEnd(uint64_t start, uint8_t msg_type, const char *to) {
+    traceSpan(current, SPAN_SEND, msg_type, start, to);
+}
+
+static int byFrame(const void *a, const void *b) {
+    const span *x = a, *y = b;
+    if (x->frame != y->frame)
+        return x->frame < y->frame ? -1 : 1;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return 0;
+}
+
+static void writeEvent(FILE *file, const span *s, int *first) {
+    fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"0x%02x\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+            "\"tid\":%d,\"args\":{\"frame\":%u,\"detail\":\"", *first ? "" : ",", kindNames[s->kind],
+            s->msg_type, s->start / 1000.0, s->dur / 1000.0, s->tid, s->frame);
+    // names are client supplied and cut at TRACE_DETAIL wherever that
+    // falls, maybe inside a UTF-8 sequence: anything but printable ASCII
+    // is escaped a byte at a time, so the JSON stays valid
+    for (const unsigned char *c = (const unsigned char *)s->detail; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else if (*c < 0x20 || *c >= 0x7f)
+            fprintf(file, "\\u%04x", *c);
+        else
+            fputc(*c, file);
+    }
+    fprintf(file, "\"}}");
+    *first = 0;
+}
+
+// A flow arrow per frame, through each of its spans in time order, so the
+// viewer draws the critical path across threads.
+static void writeFlow(FILE *file, const span *s, const char *phase) {
+    fprintf(file, ",\n{\"name\":\"frame\",\"cat\":\"flow\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":%u,\"ts\":%.3f,"
+            "\"pid\":1,\"tid\":%d}", phase, s->frame, s->start / 1000.0, s->tid);
+}
+
+void traceDump(FILE *out) {
+    span *copy = malloc(TRACE_RING * sizeof(span));
+    if (copy == NULL)
+        return;
+
+    size_t count = 0;
+    for (size_t i = 0; i < TRACE_RING; i++) {
+        span *s = &trace.ring[i];
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq == 0)
+            continue;
+        copy[count] = *s;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+            count++;
+    }
+    qsort(copy, count, sizeof(span), byFrame);
+
+    FILE *file = fopen(trace.path, "w");
+    if (file == NULL) {
+        fprintf(out, "trace: cannot write %s\n", trace.path);
+        free(copy);
+        return;
+    }
+
+    int first = 1;
+    fprintf(file, "{\"traceEvents\":[");
+    for (size_t i = 0; i < count; i++) {
+        writeEvent(file, &copy[i], &first);
+        int firstOfFrame = i == 0 || copy[i - 1].frame != copy[i].frame;
+        int lastOfFrame = i == count - 1 || copy[i + 1].frame != copy[i].frame;
+        if (!(firstOfFrame && lastOfFrame))
+            writeFlow(file, &copy[i], firstOfFrame ? "s" : lastOfFrame ? "f" : "t");
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    fprintf(out, "trace: 1 in %u frames, %u sampled, %zu spans written to %s\n", trace.every,
+            __atomic_load_n(&trace.frames, __ATOMIC_RELAXED), count, trace.path);
+    free(copy);
+}
@@ -0,0 +1,268 @@
+// Round trips through src/protocol/protocol.c: header packing, the
+// buffered reader on frames that arrive in pieces, and wr_iov over a
+// sendmsg that only takes a few bytes at a time. Built with
+// -Wl,--wrap=sendmsg, see `make test`.
+//
+// usage: test_protocol
+#include "protocol.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+// sendmsg as the test wants it: at most sendCap bytes per call (0 for no
+// cap), and EINTR before every sendInterrupt-th call.
+static size_t sendCap;
+static int sendInterrupt;
+static int sendCalls;
+
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+    sendCalls++;
+    if (sendInterrupt && sendCalls % sendInterrupt == 0) {
+        errno = EINTR;
+        return -1;
+    }
+    if (sendCap == 0)
+        return __real_sendmsg(fd, msg, flags);
+
+    struct iovec iov[64];
+    struct msghdr capped = *msg;
+    size_t left = sendCap;
+    int n = 0;
+    for (size_t i = 0; i < msg->msg_iovlen && left > 0 && n < 64; i++) {
+        iov[n] = msg->msg_iov[i];
+        if (iov[n].iov_len > left)
+            iov[n].iov_len = left;
+        left -= iov[n++].iov_len;
+    }
+    capped.msg_iov = iov;
+    capped.msg_iovlen = n;
+    return __real_sendmsg(fd, &capped, flags);
+}
+
+static void pair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void testHeader(void) {
+    petr_header h = { 0x01020304, RMSEND }, back;
+    uint8_t wire[PETR_HEADER_SIZE];
+    memset(wire, 0xaa, sizeof(wire));
+
+    petr_header_pack(&h, wire);
+    uint8_t expect[PETR_HEADER_SIZE] = { 0x04, 0x03, 0x02, 0x01, RMSEND, 0, 0, 0 };
+    CHECK(memcmp(wire, expect, sizeof(wire)) == 0);
+
+    petr_header_unpack(wire, &back);
+    CHECK(back.msg_len == h.msg_len);
+    CHECK(back.msg_type == h.msg_type);
+
+    h.msg_len = 0xffffffff;
+    h.msg_type = ESERV;
+    petr_header_pack(&h, wire);
+    petr_header_unpack(wire, &back);
+    CHECK(back.msg_len == 0xffffffff && back.msg_type == ESERV);
+}
+
+// Frames for the reader test: small ones, an empty one, and one bigger
+// than the reader's buffer, so bodies are read both ways.
+#define FRAMES 200
+
+static size_t frameLen(int i) {
+    if (i % 50 == 49)
+        return 3 * PETR_READER_SIZE + 17;
+    if (i % 10 == 0)
+        return 0;
+    return i * 7 % 300 + 1;
+}
+
+static char frameByte(int i, size_t at) {
+    return (char)(i * 31 + at);
+}
+
+typedef struct {
+    int fd;
+    size_t chunk;
+} splitWriter;
+
+// Write every frame as one stream, in chunks of chunk bytes so headers
+// and bodies are split across reads.
+static void *writeSplit(void *arg) {
+    splitWriter *w = arg;
+    size_t total = 0;
+    for (int i = 0; i < FRAMES; i++)
+        total += PETR_HEADER_SIZE + frameLen(i);
+
+    char *stream = malloc(total), *p = stream;
+    for (int i = 0; i < FRAMES; i++) {
+        petr_header h = { frameLen(i), RMRECV };
+        petr_header_pack(&h, (uint8_t *)p);
+        p += PETR_HEADER_SIZE;
+        for (size_t at = 0; at < h.msg_len; at++)
+            *p++ = frameByte(i, at);
+    }
+    for (size_t done = 0; done < total; done += w->chunk) {
+        size_t n = total - done < w->chunk ? total - done : w->chunk;
+        if (write(w->fd, stream + done, n) != (ssize_t)n)
+            break;
+        // let the reader catch up, so it sees the pieces one at a time
+        if (done / w->chunk % 16 == 0)
+            usleep(50);
+    }
+    free(stream);
+    close(w->fd);
+    return NULL;
+}
+
+static void testReaderSplit(size_t chunk) {
+    int fds[2];
+    pair(fds);
+    splitWriter w = { fds[1], chunk };
+    pthread_t tid;
+    pthread_create(&tid, NULL, writeSplit, &w);
+
+    petr_reader *r = malloc(sizeof(petr_reader));
+    petr_reader_init(r, fds[0]);
+    char *body = malloc(4 * PETR_READER_SIZE);
+    int bad = 0;
+    for (int i = 0; i < FRAMES; i++) {
+        petr_header h;
+        if (rd_msgheader_buffered(r, &h) < 0 || h.msg_type != RMRECV || h.msg_len != frameLen(i) ||
+            rd_msgbody(r, body, h.msg_len) < 0) {
+            printf("frame %d lost with %zu-byte chunks\n", i, chunk);
+            bad = 1;
+            break;
+        }
+        for (size_t at = 0; at < h.msg_len; at++)
+            if (body[at] != frameByte(i, at)) {
+                printf("frame %d byte %zu wrong with %zu-byte chunks\n", i, at, chunk);
+                bad = 1;
+                break;
+            }
+        if (bad)
+            break;
+    }
+    CHECK(!bad);
+    // and the stream ends where the frames do
+    petr_header h;
+    CHECK(bad || rd_msgheader_buffered(r, &h) < 0);
+
+    pthread_join(tid, NULL);
+    close(fds[0]);
+    free(body);
+    free(r);
+}
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+} drain;
+
+static void *readAll(void *arg) {
+    drain *d = arg;
+    ssize_t n;
+    while ((n = read(d->fd, d->buf + d->len, 65536)) > 0)
+        d->len += n;
+    return NULL;
+}
+
+// Frames through wr_msgbatch and wr_msgv arrive whole and in order however
+// little each sendmsg takes.
+static void testPartialWrites(size_t cap, int interrupt) {
+    int fds[2];
+    pair(fds);
+    drain d = { fds[0], malloc(1 << 20), 0 };
+    pthread_t tid;
+    pthread_create(&tid, NULL, readAll, &d);
+
+    enum { COUNT = 40 };
+    petr_header hs[COUNT];
+    char *bodies[COUNT];
+    size_t expect = 0;
+    for (int i = 0; i < COUNT; i++) {
+        hs[i].msg_len = frameLen(i);
+        hs[i].msg_type = RMRECV;
+        bodies[i] = NULL;
+        if (hs[i].msg_len > 0) {
+            bodies[i] = malloc(hs[i].msg_len);
+            for (size_t at = 0; at < hs[i].msg_len; at++)
+                bodies[i][at] = frameByte(i, at);
+        }
+        expect += PETR_HEADER_SIZE + hs[i].msg_len;
+    }
+
+    sendCap = cap;
+    sendInterrupt = interrupt;
+    sendCalls = 0;
+    CHECK(wr_msgbatch(fds[1], hs, bodies, COUNT) == 0);
+    // a body in pieces, more of them than wr_msgv keeps on its stack
+    struct iovec pieces[12];
+    for (int i = 0; i < 12; i++)
+        pieces[i] = (struct iovec){ "piece", 5 };
+    petr_header h = { 60, RMSEND };
+    CHECK(wr_msgv(fds[1], &h, pieces, 12) == 0);
+    int calls = sendCalls;
+    sendCap = 0;
+    sendInterrupt = 0;
+    close(fds[1]);
+    pthread_join(tid, NULL);
+
+    CHECK(cap == 0 || calls >= (int)((expect + PETR_HEADER_SIZE + 60) / cap));
+    CHECK(d.len == expect + PETR_HEADER_SIZE + 60);
+    char *p = d.buf;
+    for (int i = 0; i < COUNT && p < d.buf + d.len; i++) {
+        petr_header got;
+        petr_header_unpack((uint8_t *)p, &got);
+        CHECK(got.msg_len == hs[i].msg_len && got.msg_type == RMRECV);
+        p += PETR_HEADER_SIZE;
+        CHECK(hs[i].msg_len == 0 || memcmp(p, bodies[i], hs[i].msg_len) == 0);
+        p += hs[i].msg_len;
+        free(bodies[i]);
+    }
+    petr_header got;
+    petr_header_unpack((uint8_t *)p, &got);
+    CHECK(got.msg_len == 60 && got.msg_type == RMSEND);
+    for (int i = 0; i < 12; i++)
+        CHECK(memcmp(p + PETR_HEADER_SIZE + i * 5, "piece", 5) == 0);
+
+    close(fds[0]);
+    free(d.buf);
+}
+
+int main(void) {
+    testHeader();
+    testReaderSplit(1);
+    testReaderSplit(5);
+    testReaderSplit(PETR_HEADER_SIZE + 3);
+    testReaderSplit(PETR_READER_SIZE + 1);
+    testPartialWrites(0, 0);
+    testPartialWrites(1, 0);
+    testPartialWrites(13, 3);
+    testPartialWrites(4096, 2);
+
+    if (failures) {
+        printf("protocol: %d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("protocol: ok\n");
+    return 0;
+}
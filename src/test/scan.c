@@ -0,0 +1,200 @@
+// The three paths through src/protocol/scan.c, AVX2 (petr_scan_fields
+// where the CPU has it), SSE2 and scalar, must agree on every body: the
+// same result and the same fields. Multibyte sequences, good and bad, are
+// put across each 16, 32 and 64 byte block boundary and cut off by the
+// terminator; '\0' and "\r\n" are put at every offset; then random bodies
+// mix all of it. The scalar result is also checked against what each
+// placed case should give, so the paths can't agree on a wrong answer.
+//
+// usage: test_scan
+#include "scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FIELDS 4
+#define BODY_MAX 512
+
+static int failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+typedef struct {
+    const char *bytes;
+    int valid;
+} sequence;
+
+static const sequence sequences[] = {
+    { "\xc3\xa9", 1 },          // é
+    { "\xe2\x82\xac", 1 },      // €
+    { "\xf0\x9f\x98\x80", 1 },  // U+1F600
+    { "\xe0\xa0\x80", 1 },      // the first three byte form
+    { "\xed\x9f\xbf", 1 },      // the last before the surrogates
+    { "\xf4\x8f\xbf\xbf", 1 },  // U+10FFFF
+    { "\xc0\xaf", 0 },          // overlong
+    { "\xe0\x80\xaf", 0 },      // overlong
+    { "\xf0\x80\x80\xaf", 0 },  // overlong
+    { "\xed\xa0\x80", 0 },      // surrogate
+    { "\xf4\x90\x80\x80", 0 },  // past U+10FFFF
+    { "\xf5\x80\x80\x80", 0 },
+    { "\x80", 0 },              // a lone continuation
+    { "\xc3\xa9\xa9", 0 },      // one continuation too many
+    { "\xc3", 0 },              // cut short
+    { "\xe2\x82", 0 },
+    { "\xf0\x9f\x98", 0 },
+};
+
+#define NUM_SEQUENCES (sizeof(sequences) / sizeof(sequences[0]))
+
+static const char *why;  // the case being checked, for the failure message
+static int whyAt;
+
+// Scan body with each path and compare; returns the scalar result.
+static int agree(char *body, uint32_t len, int max) {
+    petr_span scalar[MAX_FIELDS], sse2[MAX_FIELDS], avx2[MAX_FIELDS];
+    int n = petr_scan_fields_scalar(body, len, scalar, max);
+    int nSse2 = petr_scan_fields_sse2(body, len, sse2, max);
+    int nAvx2 = petr_scan_fields(body, len, avx2, max);
+
+    int same = n == nSse2 && n == nAvx2;
+    for (int i = 0; same && i < n; i++)
+        same = scalar[i].ptr == sse2[i].ptr && scalar[i].len == sse2[i].len && scalar[i].ptr == avx2[i].ptr &&
+               scalar[i].len == avx2[i].len;
+    if (!same) {
+        printf("%s at %d, %u bytes: scalar %d, sse2 %d, avx2 %d\n", why, whyAt, len, n, nSse2, nAvx2);
+        failures++;
+    }
+    return n;
+}
+
+// Each sequence across each boundary, inside ASCII and inside é's: at
+// every split, just before and just after.
+static void testBoundaries(void) {
+    static const int boundaries[] = { 16, 32, 48, 64, 96, 128 };
+    char body[BODY_MAX];
+    why = "sequence across a boundary";
+    for (size_t b = 0; b < sizeof(boundaries) / sizeof(boundaries[0]); b++)
+        for (size_t s = 0; s < NUM_SEQUENCES; s++) {
+            int n = strlen(sequences[s].bytes);
+            for (int fill = 0; fill < 2; fill++)
+                for (int k = 0; k <= n; k++) {
+                    uint32_t len = boundaries[b] + 71;
+                    for (uint32_t i = 0; i + 1 < len; i++)
+                        body[i] = fill ? "\xc3\xa9"[i % 2] : 'a';
+                    // the sequence at an even offset, so é's stay whole
+                    int at = (boundaries[b] - k) & ~1;
+                    memcpy(body + at, sequences[s].bytes, n);
+                    if (fill && n % 2 == 1)
+                        body[at + n] = 'a';
+                    body[len - 1] = '\0';
+                    whyAt = at;
+                    CHECK(agree(body, len, 2) == (sequences[s].valid ? 1 : -1));
+                }
+        }
+}
+
+// Each sequence last before the terminator, for every body length up to
+// past two 64 byte blocks.
+static void testAtEnd(void) {
+    char body[BODY_MAX];
+    why = "sequence before the terminator";
+    for (size_t s = 0; s < NUM_SEQUENCES; s++) {
+        int n = strlen(sequences[s].bytes);
+        for (uint32_t len = n + 1; len <= 140; len++) {
+            memset(body, 'a', len);
+            memcpy(body + len - 1 - n, sequences[s].bytes, n);
+            body[len - 1] = '\0';
+            whyAt = len - 1 - n;
+            CHECK(agree(body, len, 2) == (sequences[s].valid ? 1 : -1));
+        }
+    }
+}
+
+// A '\0' and a '\r' alone at every offset, and "\r\n" at every offset,
+// which splits unless it is the terminator that follows the '\r'.
+static void testSpecials(void) {
+    static const uint32_t lens[] = { 17, 33, 65, 130 };
+    char body[BODY_MAX];
+    petr_span fields[MAX_FIELDS];
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        uint32_t len = lens[l];
+        for (uint32_t at = 0; at + 1 < len; at++) {
+            whyAt = at;
+            why = "'\\0'";
+            memset(body, 'a', len);
+            body[at] = '\0';
+            body[len - 1] = '\0';
+            CHECK(agree(body, len, 2) == -1);
+
+            why = "'\\r'";
+            body[at] = '\r';
+            CHECK(agree(body, len, 2) == 1);
+
+            why = "\"\\r\\n\"";
+            if (at + 2 < len)
+                body[at + 1] = '\n';
+            int split = at + 2 < len;
+            CHECK(agree(body, len, 2) == 1 + split);
+            if (split && petr_scan_fields_scalar(body, len, fields, 2) == 2)
+                CHECK(fields[0].len == at && fields[1].ptr == body + at + 2);
+            CHECK(agree(body, len, 1) == 1);
+        }
+    }
+}
+
+// Bodies of random pieces, the terminator last, with up to MAX_FIELDS
+// fields.
+static void testRandom(int count) {
+    static const char *ascii[] = { "a", "hello", "\r\n", "\r", "\n", "\r\r\n", "0123456789abcdef", "\x7f" };
+    char body[BODY_MAX];
+    unsigned int seed = 1;
+    why = "random body";
+    for (int c = 0; c < count; c++) {
+        uint32_t len = 0, target = rand_r(&seed) % 300;
+        while (len < target) {
+            const char *piece;
+            int r = rand_r(&seed) % 100;
+            if (r < 60)
+                piece = ascii[rand_r(&seed) % (sizeof(ascii) / sizeof(ascii[0]))];
+            else if (r < 98)
+                piece = sequences[rand_r(&seed) % 6].bytes;  // a good one
+            else
+                piece = sequences[rand_r(&seed) % NUM_SEQUENCES].bytes;
+            size_t n = strlen(piece);
+            if (len + n + 2 > BODY_MAX)
+                break;
+            memcpy(body + len, piece, n);
+            len += n;
+        }
+        if (rand_r(&seed) % 100 == 0)
+            body[rand_r(&seed) % (len + 1)] = '\0';
+        body[len++] = '\0';
+        whyAt = c;
+        agree(body, len, 1 + rand_r(&seed) % MAX_FIELDS);
+    }
+}
+
+int main(void) {
+    char noTerminator[] = { 'a', 'b' };
+    petr_span fields[MAX_FIELDS];
+    CHECK(petr_scan_fields(noTerminator, 2, fields, 2) == -1);
+    CHECK(petr_scan_fields(noTerminator, 0, fields, 2) == -1);
+
+    testBoundaries();
+    testAtEnd();
+    testSpecials();
+    testRandom(200000);
+
+    if (failures) {
+        printf("scan: %d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("scan: ok%s\n", __builtin_cpu_supports("avx2") ? "" : " (no AVX2 here, petr_scan_fields ran SSE2)");
+    return 0;
+}